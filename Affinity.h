@@ -0,0 +1,80 @@
+#ifndef AFFINITY_H_
+#define AFFINITY_H_
+
+#include <thread>
+#include <vector>
+#include <string>
+#include <fstream>
+#include <cstdlib>
+
+#ifdef __linux__
+#  include <pthread.h>
+#  include <sched.h>
+#endif
+
+// Restricts thread to the specified CPUs. Returns false if that failed (say, because
+// none of them is available to this process) or isn't supported: only Linux is, so far.
+inline bool setThreadAffinity(std::thread& thread, const std::vector<int>& cpus)
+{
+#ifdef __linux__
+    cpu_set_t set;
+    CPU_ZERO(&set);
+    for (std::size_t i = 0; i != cpus.size(); ++i)
+        if (cpus[i] >= 0 && cpus[i] < CPU_SETSIZE)
+            CPU_SET(cpus[i], &set);
+    return pthread_setaffinity_np(thread.native_handle(), sizeof(set), &set) == 0;
+#else
+    (void) thread;
+    (void) cpus;
+    return false;
+#endif
+}
+
+// Parses a list of CPUs in the format Linux uses in sysfs, e.g. "0-3,8,10-11"
+inline std::vector<int> parseCpuList(const std::string& list)
+{
+    std::vector<int> cpus;
+    const char* p = list.c_str();
+    while (*p)
+    {
+        char* end;
+        long first = std::strtol(p, &end, 10);
+        if (end == p)
+            break;
+        long last = first;
+        if (*end == '-')
+        {
+            p = end + 1;
+            last = std::strtol(p, &end, 10);
+            if (end == p)
+                break;
+        }
+        for (long cpu = first; cpu <= last; ++cpu)
+            cpus.push_back(static_cast<int>(cpu));
+
+        p = end;
+        if (*p == ',')
+            ++p;
+    }
+    return cpus;
+}
+
+// The CPUs of each NUMA node (in the format of ThreadPoolOptions::numaNodes), as reported
+// by Linux. Empty if that information isn't available.
+inline std::vector<std::vector<int>> numaTopology()
+{
+    std::vector<std::vector<int>> nodes;
+#ifdef __linux__
+    for (int node = 0; ; ++node)
+    {
+        std::ifstream file("/sys/devices/system/node/node" + std::to_string(node) + "/cpulist");
+        std::string list;
+        if (!std::getline(file, list))
+            break;
+        nodes.push_back(parseCpuList(list));
+    }
+#endif
+    return nodes;
+}
+
+#endif /* AFFINITY_H_ */
@@ -0,0 +1,223 @@
+#ifndef ALGORITHMS_H_
+#define ALGORITHMS_H_
+
+#include <atomic>
+#include <memory>
+#include <algorithm>
+#include <iterator>
+#include <functional>
+#include <vector>
+#include <cstddef>
+
+#include "ParallelFor.h"
+
+// Parallel counterparts of std::sort, std::transform, std::inclusive_scan and
+// std::find_if, over random access iterators. Like parallelFor(), they run on pool's
+// threads and the calling thread, and can be called from inside the pool's own tasks.
+// The functions passed to them are called concurrently, and an exception thrown by one
+// of them is rethrown (with the range left partly processed).
+
+// How many elements of T are processed together: about 32 KiB worth (an L1 data cache),
+// so whole blocks share no cache line (if sizeof(T) divides 64 and the range is aligned)
+template <class T>
+struct CacheBlock
+{
+    static const std::size_t BYTES = 32 * 1024;
+
+    static std::size_t elements() { return std::max<std::size_t>(1, BYTES / sizeof(T)); }
+};
+
+// Calls blockBody(b, first, last) for every block b of [0, n), [first, last) being
+// [b * block, (b + 1) * block) clipped to n, in parallel (see parallelForChunks()): chunks
+// of the range then always start and end at block boundaries
+template <class Pool, class Index, class BlockBody>
+void parallelForBlocks(Pool& pool, Index n, Index block, BlockBody blockBody)
+{
+    parallelForChunks(pool, Index(0), (n + block - 1) / block, [&](Index firstBlock, Index lastBlock) {
+        for (Index b = firstBlock; b != lastBlock; ++b)
+            blockBody(b, b * block, std::min(n, (b + 1) * block));
+    });
+}
+
+// Writes op(x) to out + i for each element x at first + i, and returns out + (last - first).
+// out may be first.
+template <class Pool, class InputIt, class OutputIt, class UnaryOp>
+OutputIt parallelTransform(Pool& pool, InputIt first, InputIt last, OutputIt out, UnaryOp op)
+{
+    typedef typename std::iterator_traits<InputIt>::difference_type Index;
+    typedef typename std::iterator_traits<InputIt>::value_type T;
+
+    const Index n = last - first;
+    parallelForBlocks(pool, n, Index(CacheBlock<T>::elements()), [&](Index, Index begin, Index end) {
+        std::transform(first + begin, first + end, out + begin, op);
+    });
+    return out + n;
+}
+
+// Writes op(...op(op(x0, x1), x2)..., xi) to out + i for each element xi at first + i,
+// and returns out + (last - first). out may be first. Each block is reduced on its own,
+// the blocks' totals are scanned (on the calling thread, there being only one per block),
+// then each block is scanned from the total of the blocks before it: so op must be
+// associative, and is called about twice per element.
+template <class Pool, class InputIt, class OutputIt, class BinaryOp>
+OutputIt parallelInclusiveScan(Pool& pool, InputIt first, InputIt last, OutputIt out, BinaryOp op)
+{
+    typedef typename std::iterator_traits<InputIt>::difference_type Index;
+    typedef typename std::iterator_traits<InputIt>::value_type T;
+
+    const Index n = last - first;
+    if (n == 0)
+        return out;
+
+    // The last block's total isn't needed. (Copies of *first, so that T needn't be default
+    // constructible.)
+    const Index block = Index(CacheBlock<T>::elements());
+    const Index blocks = (n + block - 1) / block;
+    std::vector<T> totals(blocks, *first);
+    parallelForBlocks(pool, (blocks - 1) * block, block, [&](Index b, Index begin, Index end) {
+        T total = first[begin];
+        for (Index i = begin + 1; i != end; ++i)
+            total = op(std::move(total), first[i]);
+        totals[b] = std::move(total);
+    });
+    for (Index b = 1; b < blocks - 1; ++b)
+        totals[b] = op(totals[b - 1], totals[b]);
+
+    parallelForBlocks(pool, n, block, [&](Index b, Index begin, Index end) {
+        T sum = b == 0 ? T(first[begin]) : op(totals[b - 1], first[begin]);
+        out[begin] = sum;
+        for (Index i = begin + 1; i != end; ++i)
+        {
+            sum = op(std::move(sum), first[i]);
+            out[i] = sum;
+        }
+    });
+    return out + n;
+}
+
+// parallelInclusiveScan() with std::plus
+template <class Pool, class InputIt, class OutputIt>
+OutputIt parallelInclusiveScan(Pool& pool, InputIt first, InputIt last, OutputIt out)
+{
+    typedef typename std::iterator_traits<InputIt>::value_type T;
+    return parallelInclusiveScan(pool, first, last, out, std::plus<T>());
+}
+
+// Returns the first iterator in [first, last) whose element satisfies pred (last if
+// none does), as std::find_if. Blocks past the first match found so far are skipped
+// without calling pred, so a search stops soon after it succeeds.
+template <class Pool, class InputIt, class Predicate>
+InputIt parallelFindIf(Pool& pool, InputIt first, InputIt last, Predicate pred)
+{
+    typedef typename std::iterator_traits<InputIt>::difference_type Index;
+    typedef typename std::iterator_traits<InputIt>::value_type T;
+
+    const Index n = last - first;
+    std::atomic<Index> found(n);                // The lowest match's index so far
+    parallelForBlocks(pool, n, Index(CacheBlock<T>::elements()), [&](Index, Index begin, Index end) {
+        if (begin >= found.load(std::memory_order_relaxed))
+            return;
+        const Index index = std::find_if(first + begin, first + end, pred) - first;
+        Index lowest = found.load(std::memory_order_relaxed);
+        while (index != end && index < lowest && !found.compare_exchange_weak(lowest, index, std::memory_order_relaxed))
+            ;
+    });
+    return first + found.load(std::memory_order_relaxed);
+}
+
+// How many elements of [a, a + na) are among the first k that a stable merge of it with
+// [b, b + nb) outputs (the merge path's crossing of diagonal k), in O(log k) comparisons
+template <class It, class Index, class Compare>
+Index mergeSplit(It a, Index na, It b, Index nb, Index k, Compare& comp)
+{
+    Index low = std::max(Index(0), k - nb), high = std::min(k, na);
+    while (low < high)
+    {
+        const Index middle = low + (high - low) / 2;
+        if (comp(b[k - middle - 1], a[middle]))
+            high = middle;
+        else
+            low = middle + 1;
+    }
+    return low;
+}
+
+// Merges each pair of consecutive sorted runs of width elements of [src, src + n) (the
+// last run may be shorter, or alone) into the same place in dst, by moving them. Every
+// block of the output is merged on its own, from where the merge path crosses its ends,
+// so each round of a merge sort is as parallel as the first. The crossings are all found
+// first, since finding one compares elements that a neighbouring block's merge moves
+// from. width must be a multiple of block, so that no block spans two pairs.
+template <class Pool, class SrcIt, class DstIt, class Index, class Compare>
+void parallelMergeRuns(Pool& pool, SrcIt src, DstIt dst, Index n, Index width, Index block, Compare& comp)
+{
+    // Elements taken from the pair's first run before each block
+    std::vector<Index> firstRun((n + block - 1) / block);
+    parallelForBlocks(pool, n, block, [&](Index b, Index begin, Index) {
+        const Index pair = begin / (2 * width) * (2 * width);
+        const Index middle = std::min(n, pair + width), pairEnd = std::min(n, pair + 2 * width);
+        firstRun[b] = mergeSplit(src + pair, middle - pair, src + middle, pairEnd - middle, begin - pair, comp);
+    });
+
+    parallelForBlocks(pool, n, block, [&](Index b, Index begin, Index end) {
+        const Index pair = begin / (2 * width) * (2 * width);
+        const Index middle = std::min(n, pair + width), pairEnd = std::min(n, pair + 2 * width);
+        const Index firstA = firstRun[b], lastA = end == pairEnd ? middle - pair : firstRun[b + 1];
+        std::merge(std::make_move_iterator(src + pair + firstA), std::make_move_iterator(src + pair + lastA),
+                   std::make_move_iterator(src + middle + (begin - pair - firstA)),
+                   std::make_move_iterator(src + middle + (end - pair - lastA)), dst + begin, comp);
+    });
+}
+
+// Sorts [first, last) by comp, as std::sort (not stably): a run per participating thread
+// is sorted with std::sort, then pairs of runs are merged, through a buffer of as many
+// elements (T must be default constructible), until one is left. Ranges of a run or less
+// (a few blocks) are sorted by the calling thread alone.
+template <class Pool, class RandomIt, class Compare>
+void parallelSort(Pool& pool, RandomIt first, RandomIt last, Compare comp)
+{
+    typedef typename std::iterator_traits<RandomIt>::difference_type Index;
+    typedef typename std::iterator_traits<RandomIt>::value_type T;
+
+    const Index n = last - first;
+    const Index block = Index(CacheBlock<T>::elements());
+    const Index participants = pool.threadCount() + 1;
+    Index run = std::max(4 * block, (n + participants - 1) / participants);
+    run = (run + block - 1) / block * block;
+    if (run >= n)
+    {
+        std::sort(first, last, comp);
+        return;
+    }
+
+    parallelFor(pool, Index(0), (n + run - 1) / run, [&](Index r) {
+        std::sort(first + r * run, first + std::min(n, (r + 1) * run), comp);
+    });
+
+    // new T[] leaves trivial types uninitialized: the merges' threads touch the buffer first
+    std::unique_ptr<T[]> buffer(new T[n]);
+    bool inBuffer = false;
+    for (Index width = run; width < n; width *= 2)
+    {
+        if (inBuffer)
+            parallelMergeRuns(pool, buffer.get(), first, n, width, block, comp);
+        else
+            parallelMergeRuns(pool, first, buffer.get(), n, width, block, comp);
+        inBuffer = !inBuffer;
+    }
+
+    if (inBuffer)
+        parallelForBlocks(pool, n, block, [&](Index, Index begin, Index end) {
+            std::move(buffer.get() + begin, buffer.get() + end, first + begin);
+        });
+}
+
+// parallelSort() with std::less
+template <class Pool, class RandomIt>
+void parallelSort(Pool& pool, RandomIt first, RandomIt last)
+{
+    typedef typename std::iterator_traits<RandomIt>::value_type T;
+    parallelSort(pool, first, last, std::less<T>());
+}
+
+#endif /* ALGORITHMS_H_ */
@@ -0,0 +1,64 @@
+#ifndef CACHE_ALIGNED_H_
+#define CACHE_ALIGNED_H_
+
+#include <new>
+#include <cstddef>
+#include <cstdint>
+
+// A fixed-size array of default-constructed Ts, each starting a cache line of its own
+// and padded to whole lines, so that threads writing their own element never write to the
+// same line. (new[] doesn't align to cache lines in C++11, so the storage is aligned by hand.)
+template <class T>
+class CacheAlignedArray
+{
+private:
+    static const std::size_t CACHE_LINE_SIZE = 64;
+    static const std::size_t STRIDE = (sizeof(T) + CACHE_LINE_SIZE - 1) / CACHE_LINE_SIZE * CACHE_LINE_SIZE;
+
+    std::size_t size_;
+    char* storage_;
+    char* first_;
+public:
+    explicit CacheAlignedArray(std::size_t size);
+    ~CacheAlignedArray();
+
+    CacheAlignedArray(const CacheAlignedArray& other) = delete;
+    CacheAlignedArray& operator=(const CacheAlignedArray& other) = delete;
+
+    T& operator[](std::size_t i) { return *reinterpret_cast<T*>(first_ + i * STRIDE); }
+    const T& operator[](std::size_t i) const { return *reinterpret_cast<const T*>(first_ + i * STRIDE); }
+    std::size_t size() const { return size_; }
+};
+
+template <class T>
+CacheAlignedArray<T>::CacheAlignedArray(std::size_t size)
+    : size_(size)
+    , storage_(static_cast<char*>(::operator new(size * STRIDE + CACHE_LINE_SIZE - 1)))
+{
+    std::uintptr_t address = reinterpret_cast<std::uintptr_t>(storage_);
+    first_ = storage_ + (CACHE_LINE_SIZE - address % CACHE_LINE_SIZE) % CACHE_LINE_SIZE;
+
+    std::size_t constructed = 0;
+    try
+    {
+        for (; constructed != size_; ++constructed)
+            new (first_ + constructed * STRIDE) T();
+    }
+    catch (...)
+    {
+        while (constructed != 0)
+            (*this)[--constructed].~T();
+        ::operator delete(storage_);
+        throw;
+    }
+}
+
+template <class T>
+CacheAlignedArray<T>::~CacheAlignedArray()
+{
+    for (std::size_t i = 0; i != size_; ++i)
+        (*this)[i].~T();
+    ::operator delete(storage_);
+}
+
+#endif /* CACHE_ALIGNED_H_ */
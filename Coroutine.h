@@ -0,0 +1,249 @@
+#ifndef COROUTINE_H_
+#define COROUTINE_H_
+
+// Coroutine support needs C++20; with older standards, this header is empty
+#if __cplusplus >= 202002L && defined(__cpp_impl_coroutine)
+
+#include <coroutine>
+#include <exception>
+#include <future>
+#include <type_traits>
+#include <utility>
+#include <variant>
+
+#include "GenericThreadPool.h"
+
+// What co_await schedule(pool) waits on: the coroutine is suspended, and resumed by one
+// of the pool's threads. Resuming it is an ordinary execute() of a lambda holding the
+// handle, which fits inline in the task, so no promise is created and nothing is
+// allocated once the pool has warmed up.
+class ScheduleAwaitable
+{
+private:
+    GenericThreadPool& pool_;
+    bool rejected_;
+public:
+    explicit ScheduleAwaitable(GenericThreadPool& pool) : pool_(pool), rejected_(false) {}
+
+    bool await_ready() const noexcept { return false; }
+
+    // A pool that's been shut down won't resume the coroutine, so it carries on right away
+    // (and await_resume() throws)
+    bool await_suspend(std::coroutine_handle<> handle)
+    {
+        if (pool_.isShutdown())
+        {
+            rejected_ = true;
+            return false;
+        }
+        pool_.execute([handle]() { handle.resume(); });
+        return true;
+    }
+
+    void await_resume() const
+    {
+        if (rejected_)
+            throw std::future_error(std::future_errc::broken_promise);
+    }
+};
+
+// Moves the awaiting coroutine onto one of the pool's threads. As with execute(), a
+// coroutine whose resumption is dropped (by a concurrent shutdown, or a bounded queue
+// rejecting it) is never resumed.
+inline ScheduleAwaitable schedule(GenericThreadPool& pool)
+{
+    return ScheduleAwaitable(pool);
+}
+
+template <class T>
+class CoTask;
+
+// What CoTask<T>'s promise needs regardless of T: the coroutine awaiting it, which is
+// resumed (on the thread that finished the task) through symmetric transfer
+class CoTaskPromiseBase
+{
+private:
+    struct FinalAwaiter
+    {
+        bool await_ready() const noexcept { return false; }
+
+        template <class Promise>
+        std::coroutine_handle<> await_suspend(std::coroutine_handle<Promise> handle) noexcept
+        {
+            std::coroutine_handle<> continuation = handle.promise().continuation_;
+            return continuation ? continuation : std::noop_coroutine();
+        }
+
+        void await_resume() const noexcept {}
+    };
+
+    std::coroutine_handle<> continuation_;
+public:
+    std::suspend_always initial_suspend() const noexcept { return std::suspend_always(); }
+    FinalAwaiter final_suspend() const noexcept { return FinalAwaiter(); }
+
+    void setContinuation(std::coroutine_handle<> continuation) { continuation_ = continuation; }
+};
+
+template <class T>
+class CoTaskPromise : public CoTaskPromiseBase
+{
+private:
+    std::variant<std::monostate, T, std::exception_ptr> result_;
+public:
+    CoTask<T> get_return_object();
+
+    template <class U>
+    void return_value(U&& value) { result_.template emplace<1>(std::forward<U>(value)); }
+    void unhandled_exception() { result_.template emplace<2>(std::current_exception()); }
+
+    T result()
+    {
+        if (result_.index() == 2)
+            std::rethrow_exception(std::get<2>(result_));
+        return std::move(std::get<1>(result_));
+    }
+};
+
+template <>
+class CoTaskPromise<void> : public CoTaskPromiseBase
+{
+private:
+    std::exception_ptr exception_;
+public:
+    CoTask<void> get_return_object();
+
+    void return_void() {}
+    void unhandled_exception() { exception_ = std::current_exception(); }
+
+    void result()
+    {
+        if (exception_)
+            std::rethrow_exception(exception_);
+    }
+};
+
+// A coroutine that returns a T (or throws), started lazily: it only runs once awaited,
+// on the awaiting thread, and resumes its awaiter as soon as it completes, on whichever
+// thread completed it. Nothing blocks a thread in between; a CoTask that starts with
+// co_await schedule(pool) runs on the pool. Movable, not copyable, and awaited once.
+template <class T>
+class CoTask
+{
+public:
+    typedef CoTaskPromise<T> promise_type;
+private:
+    std::coroutine_handle<promise_type> handle_;
+
+    class Awaiter
+    {
+    private:
+        std::coroutine_handle<promise_type> handle_;
+    public:
+        explicit Awaiter(std::coroutine_handle<promise_type> handle) : handle_(handle) {}
+
+        bool await_ready() const noexcept { return false; }
+
+        std::coroutine_handle<> await_suspend(std::coroutine_handle<> awaiting) noexcept
+        {
+            handle_.promise().setContinuation(awaiting);
+            return handle_;
+        }
+
+        T await_resume() { return handle_.promise().result(); }
+    };
+public:
+    explicit CoTask(std::coroutine_handle<promise_type> handle) : handle_(handle) {}
+    CoTask(CoTask&& other) noexcept : handle_(std::exchange(other.handle_, nullptr)) {}
+    ~CoTask() { if (handle_) handle_.destroy(); }
+
+    CoTask(const CoTask& other) = delete;
+    CoTask& operator=(const CoTask& other) = delete;
+
+    Awaiter operator co_await() && { return Awaiter(handle_); }
+};
+
+template <class T>
+inline
+CoTask<T> CoTaskPromise<T>::get_return_object()
+{
+    return CoTask<T>(std::coroutine_handle<CoTaskPromise<T>>::from_promise(*this));
+}
+
+inline
+CoTask<void> CoTaskPromise<void>::get_return_object()
+{
+    return CoTask<void>(std::coroutine_handle<CoTaskPromise<void>>::from_promise(*this));
+}
+
+// A coroutine nobody awaits: it starts right away, and its frame is freed when it ends.
+// An exception escaping it terminates the program.
+struct DetachedCoroutine
+{
+    struct promise_type
+    {
+        DetachedCoroutine get_return_object() const noexcept { return DetachedCoroutine(); }
+        std::suspend_never initial_suspend() const noexcept { return std::suspend_never(); }
+        std::suspend_never final_suspend() const noexcept { return std::suspend_never(); }
+        void return_void() const noexcept {}
+        void unhandled_exception() const noexcept { std::terminate(); }
+    };
+};
+
+// The coroutines behind spawn() and syncWait(). A task spawned on a pool that's been
+// shut down is destroyed without running.
+inline DetachedCoroutine runOnPool(GenericThreadPool& pool, CoTask<void> task)
+{
+    try
+    {
+        co_await schedule(pool);
+    }
+    catch (const std::future_error&)
+    {
+        co_return;
+    }
+    co_await std::move(task);
+}
+
+// The promise lives in the coroutine's frame, so it's never destroyed while setting it
+template <class T>
+DetachedCoroutine runIntoPromise(CoTask<T> task, std::promise<T> result)
+{
+    try
+    {
+        if constexpr (std::is_void<T>::value)
+        {
+            co_await std::move(task);
+            result.set_value();
+        }
+        else
+            result.set_value(co_await std::move(task));
+    }
+    catch (...)
+    {
+        result.set_exception(std::current_exception());
+    }
+}
+
+// Starts the task on one of the pool's threads, without waiting for it: the way to have
+// many requests in flight at once. By the time the task starts, the caller may be gone,
+// so the task must not refer to the caller's locals.
+inline void spawn(GenericThreadPool& pool, CoTask<void> task)
+{
+    runOnPool(pool, std::move(task));
+}
+
+// Runs the task (starting on the calling thread) and blocks until it completes; returns
+// its result, or rethrows its exception. For use outside coroutines, e.g. in main().
+template <class T>
+T syncWait(CoTask<T> task)
+{
+    std::promise<T> result;
+    std::future<T> done = result.get_future();
+    runIntoPromise(std::move(task), std::move(result));
+    return done.get();
+}
+
+#endif
+
+#endif /* COROUTINE_H_ */
@@ -0,0 +1,276 @@
+#ifndef EXECUTOR_GROUP_H_
+#define EXECUTOR_GROUP_H_
+
+#include <string>
+#include <vector>
+#include <memory>
+#include <mutex>
+#include <condition_variable>
+#include <thread>
+#include <chrono>
+#include <stdexcept>
+#include <algorithm>
+
+#include "GenericThreadPool.h"
+
+// What a class that needs its reserved threads back does about the ones it lent
+enum class ReclaimPolicy
+{
+    Revoke,                     // Borrowers shrink right away (the threads retire after their current task)
+    Wait                        // Borrowers keep the threads they have work for, until the work runs out
+};
+
+struct ExecutorGroupOptions
+{
+    ReclaimPolicy reclaim;
+    std::chrono::milliseconds interval;     // Between balancing steps (0: only when rebalance() is called)
+    std::chrono::milliseconds lendAfter;    // How long a class must idle before its threads are lent
+
+    ExecutorGroupOptions() : reclaim(ReclaimPolicy::Revoke), interval(2), lendAfter(100) {}
+};
+
+// Where a class stands, along with its pool's metrics
+struct ExecutorClassStats
+{
+    std::string name;
+    int reservedThreads, maxThreads;
+    int threads;                            // Right now, reserved or borrowed
+    int activeThreads, pendingTasks;
+    ThreadPoolStats pool;                   // See BasicThreadPool::stats()
+};
+
+// Pools for different classes of work (CPU-bound, blocking I/O, latency-critical...)
+// sharing one budget of cores, so that together they don't run more threads than that.
+// Each class has a pool of its own, so its tasks queue apart from the others', and a
+// reserve of threads it gets whenever it has work. Classes lend the threads they don't
+// use (once idle for lendAfter) back to the budget, and a class with more work than
+// threads borrows from the budget, up to its maximum; a class that needs its reserve
+// back reclaims it from the borrowers, according to the ReclaimPolicy. The threads are
+// balanced every interval, by resize()ing the pools from a thread of the group's own,
+// so running a task costs no more than in a standalone pool.
+class ExecutorGroup
+{
+private:
+    struct ExecutorClass
+    {
+        std::string name;
+        int reserved, max;
+        bool lendable;                      // Whether its reserve is lent while idle
+        std::unique_ptr<GenericThreadPool> pool;
+        std::chrono::steady_clock::time_point lastBusy;
+    };
+
+    const int coreBudget_;
+    const ExecutorGroupOptions options_;
+    std::vector<std::unique_ptr<ExecutorClass>> classes_;
+    int reservedThreads_;                   // Of every class
+    mutable std::mutex lock_;
+    std::condition_variable stopping_;
+    bool stopped_;
+    std::thread balancer_;
+
+    ExecutorClass& find(const std::string& name) const;
+    void balance();
+public:
+    explicit ExecutorGroup(int coreBudget, const ExecutorGroupOptions& options = ExecutorGroupOptions());
+    ~ExecutorGroup();
+
+    ExecutorGroup(const ExecutorGroup& other) = delete;
+    ExecutorGroup& operator=(const ExecutorGroup& other) = delete;
+
+    GenericThreadPool& addClass(const std::string& name, int reservedThreads, int maxThreads,
+                                bool lendable = true, ThreadPoolOptions options = ThreadPoolOptions());
+    GenericThreadPool& pool(const std::string& name);
+
+    void rebalance();
+
+    std::vector<ExecutorClassStats> stats() const;
+    int coreBudget() const;
+};
+
+inline
+ExecutorGroup::ExecutorGroup(int coreBudget, const ExecutorGroupOptions& options)
+    : coreBudget_(coreBudget)
+    , options_(options)
+    , reservedThreads_(0)
+    , stopped_(false)
+{
+    if (options_.interval.count() > 0)
+        balancer_ = std::thread([this]() {
+            std::unique_lock<std::mutex> ul(lock_);
+            while (!stopped_)
+            {
+                stopping_.wait_for(ul, options_.interval);
+                if (!stopped_)
+                    balance();
+            }
+        });
+}
+
+// The pools are destroyed along with the group (so, by default, they wait for their tasks)
+inline
+ExecutorGroup::~ExecutorGroup()
+{
+    {
+        std::lock_guard<std::mutex> lg(lock_);
+        stopped_ = true;
+    }
+    stopping_.notify_all();
+    if (balancer_.joinable())
+        balancer_.join();
+}
+
+// Adds a class, whose pool can have up to maxThreads threads (options.maxThreads and
+// options.elastic are overridden: the group decides). A class that isn't lendable keeps
+// its reserve even while idle, so its tasks never wait for a thread to start. Throws
+// std::invalid_argument if the name is taken, or if the reserves would exceed the budget.
+inline
+GenericThreadPool& ExecutorGroup::addClass(const std::string& name, int reservedThreads, int maxThreads,
+                                           bool lendable, ThreadPoolOptions options)
+{
+    std::lock_guard<std::mutex> lg(lock_);
+    for (std::size_t i = 0; i != classes_.size(); ++i)
+        if (classes_[i]->name == name)
+            throw std::invalid_argument("ExecutorGroup already has a class named " + name);
+    if (reservedThreads < 0 || maxThreads < std::max(reservedThreads, 1) ||
+        reservedThreads_ + reservedThreads > coreBudget_)
+        throw std::invalid_argument("ExecutorGroup can't reserve the threads of " + name);
+
+    options.maxThreads = std::min(maxThreads, coreBudget_);
+    options.elastic = false;
+
+    std::unique_ptr<ExecutorClass> added(new ExecutorClass());
+    added->name = name;
+    added->reserved = reservedThreads;
+    added->max = options.maxThreads;
+    added->lendable = lendable;
+    added->pool.reset(new GenericThreadPool(lendable ? 0 : reservedThreads, options));
+    classes_.push_back(std::move(added));
+    reservedThreads_ += reservedThreads;
+
+    balance();
+    return *classes_.back()->pool;
+}
+
+// Throws std::out_of_range if there's no such class
+inline
+GenericThreadPool& ExecutorGroup::pool(const std::string& name)
+{
+    std::lock_guard<std::mutex> lg(lock_);
+    return *find(name).pool;
+}
+
+// Balances the threads right away, rather than at the next interval
+inline
+void ExecutorGroup::rebalance()
+{
+    std::lock_guard<std::mutex> lg(lock_);
+    balance();
+}
+
+inline
+int ExecutorGroup::coreBudget() const { return coreBudget_; }
+
+// One per class, in the order they were added
+inline
+std::vector<ExecutorClassStats> ExecutorGroup::stats() const
+{
+    std::lock_guard<std::mutex> lg(lock_);
+    std::vector<ExecutorClassStats> stats(classes_.size());
+    for (std::size_t i = 0; i != classes_.size(); ++i)
+    {
+        const ExecutorClass& c = *classes_[i];
+        stats[i].name = c.name;
+        stats[i].reservedThreads = c.reserved;
+        stats[i].maxThreads = c.max;
+        stats[i].threads = c.pool->threadCount();
+        stats[i].activeThreads = c.pool->activeThreads();
+        stats[i].pendingTasks = c.pool->pendingTasks();
+        stats[i].pool = c.pool->stats();
+    }
+    return stats;
+}
+
+// Must be called with lock_ held
+inline
+ExecutorGroup::ExecutorClass& ExecutorGroup::find(const std::string& name) const
+{
+    for (std::size_t i = 0; i != classes_.size(); ++i)
+        if (classes_[i]->name == name)
+            return *classes_[i];
+    throw std::out_of_range("ExecutorGroup has no class named " + name);
+}
+
+// Must be called with lock_ held. Each class wants a thread per pending task (or, if it
+// was busy lately, the threads it has, so that it keeps them between bursts), within its
+// maximum. The budget goes to the reserves that are never lent first, then (with
+// ReclaimPolicy::Wait) to the borrowers' threads that still have work, then to the other
+// reserves, and whatever is left to the classes that want more, a thread at a time.
+inline
+void ExecutorGroup::balance()
+{
+    const std::chrono::steady_clock::time_point now = std::chrono::steady_clock::now();
+    const std::size_t n = classes_.size();
+    std::vector<int> threads(n), wanted(n), given(n, 0);
+    int left = coreBudget_;
+
+    for (std::size_t i = 0; i != n; ++i)
+    {
+        ExecutorClass& c = *classes_[i];
+        int pending = c.pool->pendingTasks();
+        threads[i] = c.pool->threadCount();
+        if (pending > 0)
+            c.lastBusy = now;
+
+        wanted[i] = pending;
+        if (now - c.lastBusy < options_.lendAfter)
+            wanted[i] = std::max(wanted[i], threads[i]);
+        if (!c.lendable)
+        {
+            wanted[i] = std::max(wanted[i], c.reserved);
+            given[i] = c.reserved;
+            left -= c.reserved;
+        }
+        wanted[i] = std::min(wanted[i], c.max);
+    }
+
+    if (options_.reclaim == ReclaimPolicy::Wait)
+        for (std::size_t i = 0; i != n; ++i)
+        {
+            int keep = std::min(std::min(threads[i], classes_[i]->pool->pendingTasks()), wanted[i]);
+            if (threads[i] > classes_[i]->reserved && keep > given[i])
+            {
+                keep = std::min(keep - given[i], left);
+                given[i] += keep;
+                left -= keep;
+            }
+        }
+
+    for (std::size_t i = 0; i != n; ++i)
+    {
+        int reserve = std::min(std::min(wanted[i], classes_[i]->reserved) - given[i], left);
+        if (reserve > 0)
+        {
+            given[i] += reserve;
+            left -= reserve;
+        }
+    }
+
+    for (bool more = true; left > 0 && more; )
+    {
+        more = false;
+        for (std::size_t i = 0; i != n && left > 0; ++i)
+            if (given[i] < wanted[i])
+            {
+                ++given[i];
+                --left;
+                more = true;
+            }
+    }
+
+    for (std::size_t i = 0; i != n; ++i)
+        if (given[i] != threads[i])
+            classes_[i]->pool->resize(given[i]);
+}
+
+#endif /* EXECUTOR_GROUP_H_ */
@@ -0,0 +1,187 @@
+#ifndef FUNCTION_H_
+#define FUNCTION_H_
+
+#include <cstddef>
+#include <new>
+#include <utility>
+#include <type_traits>
+
+template <class Signature>
+class UniqueFunction;
+
+// A move-only replacement for std::function. Callables of up to INLINE_SIZE bytes
+// (that can be moved without throwing) are stored inside the object itself, so
+// wrapping a small lambda never allocates; larger ones are stored on the heap.
+template <class R, class... Args>
+class UniqueFunction<R(Args...)>
+{
+public:
+    static const std::size_t INLINE_SIZE = 7 * sizeof(void*);   // So that sizeof(UniqueFunction) == 8 pointers
+private:
+    typedef typename std::aligned_storage<INLINE_SIZE, alignof(void*)>::type Storage;
+
+    struct Operations
+    {
+        R (*invoke)(Storage& storage, Args&&... args);
+        void (*move)(Storage& to, Storage& from);       // Also destroys from
+        void (*destroy)(Storage& storage);
+        bool isInline;
+    };
+
+    template <class Fn>
+    struct InlineOperations
+    {
+        static R invoke(Storage& storage, Args&&... args) { return (*reinterpret_cast<Fn*>(&storage))(std::forward<Args>(args)...); }
+        static void move(Storage& to, Storage& from)
+        {
+            Fn* fn = reinterpret_cast<Fn*>(&from);
+            new (&to) Fn(std::move(*fn));
+            fn->~Fn();
+        }
+        static void destroy(Storage& storage) { reinterpret_cast<Fn*>(&storage)->~Fn(); }
+        static const Operations table;
+    };
+
+    template <class Fn>
+    struct HeapOperations
+    {
+        static Fn*& pointer(Storage& storage) { return *reinterpret_cast<Fn**>(&storage); }
+        static R invoke(Storage& storage, Args&&... args) { return (*pointer(storage))(std::forward<Args>(args)...); }
+        static void move(Storage& to, Storage& from) { new (&to) Fn*(pointer(from)); }
+        static void destroy(Storage& storage) { delete pointer(storage); }
+        static const Operations table;
+    };
+
+    template <class Fn>
+    struct FitsInline
+    {
+        static const bool value = sizeof(Fn) <= INLINE_SIZE
+            && alignof(Storage) % alignof(Fn) == 0
+            && std::is_nothrow_move_constructible<Fn>::value;
+    };
+
+    Storage storage_;
+    const Operations* operations_;
+
+    template <class Fn>
+    void construct(Fn&& fn, std::true_type);
+    template <class Fn>
+    void construct(Fn&& fn, std::false_type);
+public:
+    UniqueFunction();
+
+    template <class Fn, class = typename std::enable_if<
+        !std::is_same<typename std::decay<Fn>::type, UniqueFunction>::value>::type>
+    UniqueFunction(Fn&& fn);
+
+    UniqueFunction(const UniqueFunction& other) = delete;
+    UniqueFunction& operator=(const UniqueFunction& other) = delete;
+
+    UniqueFunction(UniqueFunction&& other);
+    UniqueFunction& operator=(UniqueFunction&& other);
+
+    ~UniqueFunction();
+
+    R operator()(Args... args);
+
+    explicit operator bool() const;
+    bool isInline() const;
+};
+
+template <class R, class... Args>
+template <class Fn>
+const typename UniqueFunction<R(Args...)>::Operations UniqueFunction<R(Args...)>::InlineOperations<Fn>::table = {
+    &InlineOperations<Fn>::invoke, &InlineOperations<Fn>::move, &InlineOperations<Fn>::destroy, true
+};
+
+template <class R, class... Args>
+template <class Fn>
+const typename UniqueFunction<R(Args...)>::Operations UniqueFunction<R(Args...)>::HeapOperations<Fn>::table = {
+    &HeapOperations<Fn>::invoke, &HeapOperations<Fn>::move, &HeapOperations<Fn>::destroy, false
+};
+
+template <class R, class... Args>
+UniqueFunction<R(Args...)>::UniqueFunction()
+    : operations_(nullptr)
+{}
+
+template <class R, class... Args>
+template <class Fn, class>
+UniqueFunction<R(Args...)>::UniqueFunction(Fn&& fn)
+{
+    typedef typename std::decay<Fn>::type Decayed;
+    construct(std::forward<Fn>(fn), std::integral_constant<bool, FitsInline<Decayed>::value>());
+}
+
+template <class R, class... Args>
+UniqueFunction<R(Args...)>::UniqueFunction(UniqueFunction&& other)
+    : operations_(other.operations_)
+{
+    if (operations_)
+        operations_->move(storage_, other.storage_);
+    other.operations_ = nullptr;
+}
+
+template <class R, class... Args>
+UniqueFunction<R(Args...)>& UniqueFunction<R(Args...)>::operator=(UniqueFunction&& other)
+{
+    if (this == &other)
+        return *this;
+
+    if (operations_)
+        operations_->destroy(storage_);
+    operations_ = other.operations_;
+    if (operations_)
+        operations_->move(storage_, other.storage_);
+    other.operations_ = nullptr;
+    return *this;
+}
+
+template <class R, class... Args>
+UniqueFunction<R(Args...)>::~UniqueFunction()
+{
+    if (operations_)
+        operations_->destroy(storage_);
+}
+
+// Calling an empty UniqueFunction is undefined. A plain pointer to a function of exactly
+// this type is called directly, rather than through invoke() (which would take a second
+// indirect call to reach the function).
+template <class R, class... Args>
+inline
+R UniqueFunction<R(Args...)>::operator()(Args... args)
+{
+    typedef R (*Pointer)(Args...);
+    if (operations_ == &InlineOperations<Pointer>::table)
+        return (*reinterpret_cast<Pointer*>(&storage_))(std::forward<Args>(args)...);
+    return operations_->invoke(storage_, std::forward<Args>(args)...);
+}
+
+template <class R, class... Args>
+inline
+UniqueFunction<R(Args...)>::operator bool() const { return operations_ != nullptr; }
+
+// Whether the callable is stored in the object itself (i.e. wasn't heap allocated)
+template <class R, class... Args>
+inline
+bool UniqueFunction<R(Args...)>::isInline() const { return operations_ == nullptr || operations_->isInline; }
+
+template <class R, class... Args>
+template <class Fn>
+void UniqueFunction<R(Args...)>::construct(Fn&& fn, std::true_type)
+{
+    typedef typename std::decay<Fn>::type Decayed;
+    new (&storage_) Decayed(std::forward<Fn>(fn));
+    operations_ = &InlineOperations<Decayed>::table;
+}
+
+template <class R, class... Args>
+template <class Fn>
+void UniqueFunction<R(Args...)>::construct(Fn&& fn, std::false_type)
+{
+    typedef typename std::decay<Fn>::type Decayed;
+    new (&storage_) Decayed*(new Decayed(std::forward<Fn>(fn)));
+    operations_ = &HeapOperations<Decayed>::table;
+}
+
+#endif /* FUNCTION_H_ */
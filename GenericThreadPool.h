@@ -0,0 +1,507 @@
+#ifndef GENERIC_THREAD_POOL_H_
+#define GENERIC_THREAD_POOL_H_
+
+#include <future>
+#include <memory>
+#include <tuple>
+#include <exception>
+#include <vector>
+#include <iterator>
+#include <utility>
+#include <type_traits>
+#include <chrono>
+#include <cstdint>
+
+#include "seq.h"
+#include "Function.h"
+#include "ThreadPool.h"
+
+// A function bound to its (decayed) arguments, like the callable std::thread and
+// std::async create. Each argument is passed as an rvalue, since the call happens once.
+template <class Fn, class... Args>
+class BoundCall
+{
+private:
+    Fn fn_;
+    std::tuple<Args...> args_;
+
+    template <int... Nums>
+    typename std::result_of<Fn(Args...)>::type callActually(Sequence<Nums...>);
+public:
+    // (Not for copying: a BoundCall lvalue goes to the copy constructor)
+    template <class DeducedFn, class... DeducedArgs, class = typename std::enable_if<
+        !std::is_same<typename std::decay<DeducedFn>::type, BoundCall>::value>::type>
+    explicit BoundCall(DeducedFn&& fn, DeducedArgs&&... args);
+
+    typename std::result_of<Fn(Args...)>::type operator()();
+};
+
+template <class Fn, class... Args>
+template <class DeducedFn, class... DeducedArgs, class>
+BoundCall<Fn, Args...>::BoundCall(DeducedFn&& fn, DeducedArgs&&... args)
+    : fn_(std::forward<DeducedFn>(fn))
+    , args_(std::forward<DeducedArgs>(args)...)
+{}
+
+template <class Fn, class... Args>
+inline
+typename std::result_of<Fn(Args...)>::type BoundCall<Fn, Args...>::operator()()
+{
+    return callActually(typename IndexSequence<sizeof...(Args)>::seq());
+}
+
+template <class Fn, class... Args>
+template <int... Nums>
+inline
+typename std::result_of<Fn(Args...)>::type BoundCall<Fn, Args...>::callActually(Sequence<Nums...>)
+{
+    return fn_(std::move(std::get<Nums>(args_))...);
+}
+
+// A call that stores its result (or exception) in a promise
+template <class R, class Call>
+class PromisedCall
+{
+private:
+    std::promise<R> promise_;
+    Call call_;
+public:
+    // The promise's shared state is allocated with alloc
+    template <class Alloc>
+    PromisedCall(std::allocator_arg_t, const Alloc& alloc, Call&& call)
+        : promise_(std::allocator_arg, alloc)
+        , call_(std::move(call))
+    {}
+
+    std::future<R> getFuture() { return promise_.get_future(); }
+
+    void operator()()
+    {
+        try
+        {
+            fulfillPromise(promise_, call_);
+        }
+        catch (...)
+        {
+            promise_.set_exception(std::current_exception());
+        }
+    }
+};
+
+template <class T>
+class PoolFuture;
+
+// A task of any type (the callable is type-erased by UniqueFunction)
+class GenericTask
+{
+private:
+    UniqueFunction<void()> fn_;
+public:
+    GenericTask() {}
+
+    template <class Fn>
+    explicit GenericTask(Fn&& fn) : fn_(std::forward<Fn>(fn)) {}
+
+    void execute() { fn_(); }
+
+    bool isInline() const { return fn_.isInline(); }
+};
+
+// A ThreadPool that isn't tied to a single function type: any callable can be
+// submitted, with any arguments, so one set of threads can serve every kind of task.
+// Policy (a PoolPolicy) makes the pool's compile-time choices; GenericThreadPool is the
+// one with the default policies.
+template <class Policy>
+class PolicyGenericThreadPool : public BasicThreadPool<GenericTask, Policy>
+{
+protected:
+    typedef typename BasicThreadPool<GenericTask, Policy>::TaskNode TaskNode;
+    typedef typename BasicThreadPool<GenericTask, Policy>::TaskBatch TaskBatch;
+public:
+    typedef typename BasicThreadPool<GenericTask, Policy>::ProducerToken ProducerToken;
+
+    explicit PolicyGenericThreadPool(int numThreads, bool waitOnDestroy = true);
+    PolicyGenericThreadPool(int numThreads, const ThreadPoolOptions& options);
+
+    template <class Fn, class... Args>
+    void execute(Fn&& fn, Args&&... args);
+
+    template <class Fn, class... Args>
+    std::future<typename std::result_of<typename std::decay<Fn>::type(typename std::decay<Args>::type...)>::type>
+    submit(Fn&& fn, Args&&... args);
+
+    template <class Fn, class... Args>
+    std::future<typename std::result_of<typename std::decay<Fn>::type(typename std::decay<Args>::type...)>::type>
+    trySubmit(Fn&& fn, Args&&... args);
+
+    template <class Fn, class... Args>
+    std::future<typename std::result_of<typename std::decay<Fn>::type(typename std::decay<Args>::type...)>::type>
+    submitWithPriority(Priority priority, Fn&& fn, Args&&... args);
+
+    template <class Fn, class... Args>
+    std::future<typename std::result_of<typename std::decay<Fn>::type(typename std::decay<Args>::type...)>::type>
+    submitOnNode(int numaNode, Fn&& fn, Args&&... args);
+
+    template <class Fn, class... Args>
+    void executeCancellable(const CancellationToken& token, Fn&& fn, Args&&... args);
+
+    template <class Fn, class... Args>
+    std::future<typename std::result_of<typename std::decay<Fn>::type(typename std::decay<Args>::type...)>::type>
+    submitCancellable(const CancellationToken& token, Fn&& fn, Args&&... args);
+
+    template <class Fn, class... Args>
+    void executeFrom(ProducerToken& token, Fn&& fn, Args&&... args);
+
+    template <class Fn, class... Args>
+    std::future<typename std::result_of<typename std::decay<Fn>::type(typename std::decay<Args>::type...)>::type>
+    submitFrom(ProducerToken& token, Fn&& fn, Args&&... args);
+
+    template <class Rep, class Period, class Fn, class... Args>
+    TimerHandle executeAfter(const std::chrono::duration<Rep, Period>& delay, Fn&& fn, Args&&... args);
+
+    template <class Clock, class Duration, class Fn, class... Args>
+    TimerHandle executeAt(const std::chrono::time_point<Clock, Duration>& time, Fn&& fn, Args&&... args);
+
+    template <class Rep, class Period, class Fn, class... Args>
+    std::future<typename std::result_of<typename std::decay<Fn>::type(typename std::decay<Args>::type...)>::type>
+    submitAfter(const std::chrono::duration<Rep, Period>& delay, Fn&& fn, Args&&... args);
+
+    template <class Clock, class Duration, class Fn, class... Args>
+    std::future<typename std::result_of<typename std::decay<Fn>::type(typename std::decay<Args>::type...)>::type>
+    submitAt(const std::chrono::time_point<Clock, Duration>& time, Fn&& fn, Args&&... args);
+
+    template <class Rep, class Period, class Fn, class... Args>
+    TimerHandle scheduleEvery(const std::chrono::duration<Rep, Period>& period, Fn&& fn, Args&&... args);
+
+    template <class InputIt, class Fn>
+    void executeBatch(InputIt first, InputIt last, Fn fn);
+
+    template <class InputIt, class Fn>
+    std::vector<std::future<typename std::result_of<Fn(typename std::iterator_traits<InputIt>::value_type)>::type>>
+    submitBatch(InputIt first, InputIt last, Fn fn);
+private:
+    template <class Fn, class... Args>
+    std::future<typename std::result_of<typename std::decay<Fn>::type(typename std::decay<Args>::type...)>::type>
+    submitActually(Backpressure backpressure, Priority priority, int numaNode, ProducerToken* token,
+                   const CancellationToken* cancellation, Fn&& fn, Args&&... args);
+
+    template <class Fn, class... Args>
+    std::future<typename std::result_of<typename std::decay<Fn>::type(typename std::decay<Args>::type...)>::type>
+    submitAtTick(std::uint64_t due, Fn&& fn, Args&&... args);
+};
+
+// What PoolFuture, coroutines and ExecutorGroup work with. Only this one has async(),
+// since a PoolFuture holds on to a GenericThreadPool.
+class GenericThreadPool : public PolicyGenericThreadPool<PoolPolicy<>>
+{
+public:
+    explicit GenericThreadPool(int numThreads, bool waitOnDestroy = true);
+    GenericThreadPool(int numThreads, const ThreadPoolOptions& options);
+
+    template <class Fn, class... Args>
+    PoolFuture<typename std::result_of<typename std::decay<Fn>::type(typename std::decay<Args>::type...)>::type>
+    async(Fn&& fn, Args&&... args);
+};
+
+template <class Policy>
+PolicyGenericThreadPool<Policy>::PolicyGenericThreadPool(int numThreads, bool waitOnDestroy)
+    : BasicThreadPool<GenericTask, Policy>(numThreads, ThreadPoolOptions(waitOnDestroy))
+{}
+
+template <class Policy>
+PolicyGenericThreadPool<Policy>::PolicyGenericThreadPool(int numThreads, const ThreadPoolOptions& options)
+    : BasicThreadPool<GenericTask, Policy>(numThreads, options)
+{}
+
+inline
+GenericThreadPool::GenericThreadPool(int numThreads, bool waitOnDestroy)
+    : PolicyGenericThreadPool<PoolPolicy<>>(numThreads, waitOnDestroy)
+{}
+
+inline
+GenericThreadPool::GenericThreadPool(int numThreads, const ThreadPoolOptions& options)
+    : PolicyGenericThreadPool<PoolPolicy<>>(numThreads, options)
+{}
+
+// Unlike submit(), no promise is created, so the return value (if any) is discarded
+// and an exception thrown by fn goes to the pool's error handler (see
+// ThreadPoolOptions::errorHandler and taskErrors()); the thread carries on.
+template <class Policy>
+template <class Fn, class... Args>
+void PolicyGenericThreadPool<Policy>::execute(Fn&& fn, Args&&... args)
+{
+    typedef BoundCall<typename std::decay<Fn>::type, typename std::decay<Args>::type...> Call;
+
+    if (this->isShutdown())
+        return;
+
+    this->enqueue(this->newTask(Call(std::forward<Fn>(fn), std::forward<Args>(args)...)));
+}
+
+// As with std::async, fn and args are copied (or moved) into the task, and an exception
+// thrown by fn is stored in the returned future. Returns an invalid future if the pool
+// has been shut down (or if the task was rejected by a full bounded queue).
+template <class Policy>
+template <class Fn, class... Args>
+inline
+std::future<typename std::result_of<typename std::decay<Fn>::type(typename std::decay<Args>::type...)>::type>
+PolicyGenericThreadPool<Policy>::submit(Fn&& fn, Args&&... args)
+{
+    return submitActually(this->backpressure(), Priority::Normal, this->ANY_NODE, nullptr, nullptr,
+                          std::forward<Fn>(fn), std::forward<Args>(args)...);
+}
+
+// Same as submit(), but never waits for room in a bounded queue: if the queue is full,
+// returns an invalid future (regardless of the pool's backpressure policy).
+template <class Policy>
+template <class Fn, class... Args>
+inline
+std::future<typename std::result_of<typename std::decay<Fn>::type(typename std::decay<Args>::type...)>::type>
+PolicyGenericThreadPool<Policy>::trySubmit(Fn&& fn, Args&&... args)
+{
+    return submitActually(Backpressure::Reject, Priority::Normal, this->ANY_NODE, nullptr, nullptr,
+                          std::forward<Fn>(fn), std::forward<Args>(args)...);
+}
+
+// Same as submit(), but the task runs before every queued task of lower priority
+// (see ThreadPool::submitWithPriority())
+template <class Policy>
+template <class Fn, class... Args>
+inline
+std::future<typename std::result_of<typename std::decay<Fn>::type(typename std::decay<Args>::type...)>::type>
+PolicyGenericThreadPool<Policy>::submitWithPriority(Priority priority, Fn&& fn, Args&&... args)
+{
+    return submitActually(this->backpressure(), priority, this->ANY_NODE, nullptr, nullptr,
+                          std::forward<Fn>(fn), std::forward<Args>(args)...);
+}
+
+// Same as submit(), but queued on the specified NUMA node (see ThreadPool::submitOnNode())
+template <class Policy>
+template <class Fn, class... Args>
+inline
+std::future<typename std::result_of<typename std::decay<Fn>::type(typename std::decay<Args>::type...)>::type>
+PolicyGenericThreadPool<Policy>::submitOnNode(int numaNode, Fn&& fn, Args&&... args)
+{
+    return submitActually(this->backpressure(), Priority::Normal, numaNode, nullptr, nullptr,
+                          std::forward<Fn>(fn), std::forward<Args>(args)...);
+}
+
+// Same as execute(), but skipped if the token is cancelled before the task starts
+template <class Policy>
+template <class Fn, class... Args>
+void PolicyGenericThreadPool<Policy>::executeCancellable(const CancellationToken& token, Fn&& fn, Args&&... args)
+{
+    typedef BoundCall<typename std::decay<Fn>::type, typename std::decay<Args>::type...> Call;
+
+    if (this->isShutdown())
+        return;
+
+    TaskNode* node = this->newTask(Call(std::forward<Fn>(fn), std::forward<Args>(args)...));
+    this->makeCancellable(node, token);
+    this->enqueue(node);
+}
+
+// Same as submit(), but skipped if the token is cancelled before the task starts (see
+// ThreadPool::submitCancellable())
+template <class Policy>
+template <class Fn, class... Args>
+inline
+std::future<typename std::result_of<typename std::decay<Fn>::type(typename std::decay<Args>::type...)>::type>
+PolicyGenericThreadPool<Policy>::submitCancellable(const CancellationToken& token, Fn&& fn, Args&&... args)
+{
+    return submitActually(this->backpressure(), Priority::Normal, this->ANY_NODE, nullptr, &token,
+                          std::forward<Fn>(fn), std::forward<Args>(args)...);
+}
+
+// Same as execute(), but through the token's lane (see ThreadPool::submitFrom())
+template <class Policy>
+template <class Fn, class... Args>
+void PolicyGenericThreadPool<Policy>::executeFrom(ProducerToken& token, Fn&& fn, Args&&... args)
+{
+    typedef BoundCall<typename std::decay<Fn>::type, typename std::decay<Args>::type...> Call;
+
+    if (this->isShutdown())
+        return;
+
+    this->enqueue(this->newTask(Call(std::forward<Fn>(fn), std::forward<Args>(args)...)), this->backpressure(),
+                  Priority::Normal, this->ANY_NODE, &token);
+}
+
+// Same as submit(), but through the token's lane (see ThreadPool::submitFrom())
+template <class Policy>
+template <class Fn, class... Args>
+inline
+std::future<typename std::result_of<typename std::decay<Fn>::type(typename std::decay<Args>::type...)>::type>
+PolicyGenericThreadPool<Policy>::submitFrom(ProducerToken& token, Fn&& fn, Args&&... args)
+{
+    return submitActually(this->backpressure(), Priority::Normal, this->ANY_NODE, &token, nullptr,
+                          std::forward<Fn>(fn), std::forward<Args>(args)...);
+}
+
+template <class Policy>
+template <class Fn, class... Args>
+std::future<typename std::result_of<typename std::decay<Fn>::type(typename std::decay<Args>::type...)>::type>
+PolicyGenericThreadPool<Policy>::submitActually(Backpressure backpressure, Priority priority, int numaNode,
+                                                ProducerToken* token, const CancellationToken* cancellation,
+                                                Fn&& fn, Args&&... args)
+{
+    typedef BoundCall<typename std::decay<Fn>::type, typename std::decay<Args>::type...> Call;
+    typedef typename std::result_of<typename std::decay<Fn>::type(typename std::decay<Args>::type...)>::type retType;
+
+    if (this->isShutdown())
+        return std::future<retType>();
+
+    PromisedCall<retType, Call> call(std::allocator_arg, this->stateAllocator(),
+                                     Call(std::forward<Fn>(fn), std::forward<Args>(args)...));
+    std::future<retType> fut = call.getFuture();
+    TaskNode* node = this->newTask(std::move(call));
+    if (cancellation)
+        this->makeCancellable(node, *cancellation);
+    if (!this->enqueue(node, backpressure, priority, numaNode, token))
+        return std::future<retType>();
+
+    return fut;
+}
+
+// Same as execute(), but the task is only enqueued once the delay has passed (see
+// submitAfter()). Returns a handle to cancel it with until then, or an invalid handle if
+// the pool has been shut down.
+template <class Policy>
+template <class Rep, class Period, class Fn, class... Args>
+TimerHandle PolicyGenericThreadPool<Policy>::executeAfter(const std::chrono::duration<Rep, Period>& delay,
+                                                          Fn&& fn, Args&&... args)
+{
+    typedef BoundCall<typename std::decay<Fn>::type, typename std::decay<Args>::type...> Call;
+
+    if (this->isShutdown())
+        return TimerHandle();
+
+    return this->addTimer(this->newTask(Call(std::forward<Fn>(fn), std::forward<Args>(args)...)),
+                          this->tickAfter(delay));
+}
+
+// Same as executeAfter(), but the task is enqueued once the specified time has come
+template <class Policy>
+template <class Clock, class Duration, class Fn, class... Args>
+inline
+TimerHandle PolicyGenericThreadPool<Policy>::executeAt(const std::chrono::time_point<Clock, Duration>& time,
+                                                       Fn&& fn, Args&&... args)
+{
+    return executeAfter(time - Clock::now(), std::forward<Fn>(fn), std::forward<Args>(args)...);
+}
+
+// Same as submit(), but the task is only enqueued once the delay has passed (rounded up
+// to a whole millisecond). Until then, it waits in the pool's timer wheel, which costs
+// no thread however many tasks wait, and isn't waited for by wait(). Returns an invalid
+// future if the pool has been shut down; a task still waiting when the pool is destroyed
+// (or shutdownNow() is called) breaks its promise.
+template <class Policy>
+template <class Rep, class Period, class Fn, class... Args>
+inline
+std::future<typename std::result_of<typename std::decay<Fn>::type(typename std::decay<Args>::type...)>::type>
+PolicyGenericThreadPool<Policy>::submitAfter(const std::chrono::duration<Rep, Period>& delay, Fn&& fn, Args&&... args)
+{
+    return submitAtTick(this->tickAfter(delay), std::forward<Fn>(fn), std::forward<Args>(args)...);
+}
+
+// Same as submitAfter(), but the task is enqueued once the specified time has come
+template <class Policy>
+template <class Clock, class Duration, class Fn, class... Args>
+inline
+std::future<typename std::result_of<typename std::decay<Fn>::type(typename std::decay<Args>::type...)>::type>
+PolicyGenericThreadPool<Policy>::submitAt(const std::chrono::time_point<Clock, Duration>& time, Fn&& fn, Args&&... args)
+{
+    return submitAtTick(this->tickAt(time), std::forward<Fn>(fn), std::forward<Args>(args)...);
+}
+
+// Enqueues the task every period (the first time, a period from now) until the timer is
+// cancelled with cancelTimer(), or the pool shut down. Each run gets its own copies of
+// fn and args, and runs as with execute(). Runs may overlap if one takes longer than the
+// period. Returns an invalid handle if the pool has been shut down.
+template <class Policy>
+template <class Rep, class Period, class Fn, class... Args>
+TimerHandle PolicyGenericThreadPool<Policy>::scheduleEvery(const std::chrono::duration<Rep, Period>& period,
+                                                           Fn&& fn, Args&&... args)
+{
+    typedef BoundCall<typename std::decay<Fn>::type, typename std::decay<Args>::type...> Call;
+
+    if (this->isShutdown())
+        return TimerHandle();
+
+    Call call(std::forward<Fn>(fn), std::forward<Args>(args)...);
+    std::uint64_t ticks = this->toTicks(period);
+    return this->addTimer([this, call]() { return this->newTask(call); }, this->tickAfter(period),
+                          ticks != 0 ? ticks : 1);
+}
+
+template <class Policy>
+template <class Fn, class... Args>
+std::future<typename std::result_of<typename std::decay<Fn>::type(typename std::decay<Args>::type...)>::type>
+PolicyGenericThreadPool<Policy>::submitAtTick(std::uint64_t due, Fn&& fn, Args&&... args)
+{
+    typedef BoundCall<typename std::decay<Fn>::type, typename std::decay<Args>::type...> Call;
+    typedef typename std::result_of<typename std::decay<Fn>::type(typename std::decay<Args>::type...)>::type retType;
+
+    if (this->isShutdown())
+        return std::future<retType>();
+
+    PromisedCall<retType, Call> call(std::allocator_arg, this->stateAllocator(),
+                                     Call(std::forward<Fn>(fn), std::forward<Args>(args)...));
+    std::future<retType> fut = call.getFuture();
+    if (!this->addTimer(this->newTask(std::move(call)), due).valid())
+        return std::future<retType>();
+
+    return fut;
+}
+
+// Same as submitBatch(), without promises (so, as with execute(), an exception thrown
+// by fn goes to the pool's error handler)
+template <class Policy>
+template <class InputIt, class Fn>
+void PolicyGenericThreadPool<Policy>::executeBatch(InputIt first, InputIt last, Fn fn)
+{
+    typedef typename std::iterator_traits<InputIt>::value_type Element;
+    typedef BoundCall<Fn, Element> Call;
+
+    if (this->isShutdown())
+        return;
+
+    TaskBatch batch(*this);
+    for (; first != last; ++first)
+        batch.push(this->newTask(Call(fn, *first)));
+    this->enqueue(batch);
+}
+
+// Submits fn(element) for each element in [first, last), all at once: the tasks are
+// queued while taking the pool's lock only once, and no more threads are woken up than
+// there are tasks. fn and the elements are copied into the tasks. Returns the futures
+// in the same order, or no futures at all if the pool has been shut down.
+template <class Policy>
+template <class InputIt, class Fn>
+std::vector<std::future<typename std::result_of<Fn(typename std::iterator_traits<InputIt>::value_type)>::type>>
+PolicyGenericThreadPool<Policy>::submitBatch(InputIt first, InputIt last, Fn fn)
+{
+    typedef typename std::iterator_traits<InputIt>::value_type Element;
+    typedef BoundCall<Fn, Element> Call;
+    typedef typename std::result_of<Fn(Element)>::type retType;
+
+    std::vector<std::future<retType>> futures;
+    if (this->isShutdown())
+        return futures;
+
+    TaskBatch batch(*this);
+    for (; first != last; ++first)
+    {
+        PromisedCall<retType, Call> call(std::allocator_arg, this->stateAllocator(), Call(fn, *first));
+        futures.push_back(call.getFuture());
+        batch.push(this->newTask(std::move(call)));
+    }
+    this->enqueue(batch);
+
+    return futures;
+}
+
+// PoolFuture (and async()) need the complete GenericThreadPool
+#include "PoolFuture.h"
+
+#endif /* GENERIC_THREAD_POOL_H_ */
@@ -0,0 +1,140 @@
+#ifndef MPMC_QUEUE_H_
+#define MPMC_QUEUE_H_
+
+#include <atomic>
+#include <cstddef>
+#include <type_traits>
+
+// A bounded lock-free multi-producer multi-consumer FIFO (Dmitry Vyukov's design):
+// every slot carries a sequence number that tells producers and consumers whose turn
+// it is to use the slot, so a push or pop is a single CAS on enqueuePos_/dequeuePos_.
+// Slots and both positions are padded to a cache line each, so that producers and
+// consumers don't invalidate each other's lines. T must be trivially copyable (in
+// practice, a pointer).
+template <class T>
+class MPMCQueue
+{
+private:
+    static const std::size_t CACHE_LINE_SIZE = 64;
+
+    struct Cell
+    {
+        std::atomic<std::size_t> sequence;
+        T data;
+        char pad[CACHE_LINE_SIZE - sizeof(std::atomic<std::size_t>) - sizeof(T)];
+    };
+
+    struct Position
+    {
+        std::atomic<std::size_t> value;
+        char pad[CACHE_LINE_SIZE - sizeof(std::atomic<std::size_t>)];
+    };
+
+    char pad0_[CACHE_LINE_SIZE];
+    Cell* const cells_;
+    const std::size_t capacity_;
+    char pad1_[CACHE_LINE_SIZE - sizeof(Cell*) - sizeof(std::size_t)];
+    Position enqueuePos_;
+    Position dequeuePos_;
+public:
+    explicit MPMCQueue(std::size_t capacity);
+    ~MPMCQueue();
+
+    MPMCQueue(const MPMCQueue& other) = delete;
+    MPMCQueue& operator=(const MPMCQueue& other) = delete;
+
+    bool tryPush(T item);
+    bool tryPop(T& item);
+
+    std::size_t capacity() const;
+    std::size_t size() const;
+};
+
+// Capacity must be positive
+template <class T>
+MPMCQueue<T>::MPMCQueue(std::size_t capacity)
+    : cells_(new Cell[capacity])
+    , capacity_(capacity)
+{
+    static_assert(std::is_trivially_copyable<T>::value, "MPMCQueue elements must be trivially copyable");
+
+    for (std::size_t i = 0; i != capacity_; ++i)
+        cells_[i].sequence.store(i, std::memory_order_relaxed);
+    enqueuePos_.value.store(0, std::memory_order_relaxed);
+    dequeuePos_.value.store(0, std::memory_order_relaxed);
+}
+
+template <class T>
+MPMCQueue<T>::~MPMCQueue()
+{
+    delete[] cells_;
+}
+
+// Returns false (without blocking) if the queue is full
+template <class T>
+bool MPMCQueue<T>::tryPush(T item)
+{
+    std::size_t pos = enqueuePos_.value.load(std::memory_order_relaxed);
+    for (;;)
+    {
+        Cell& cell = cells_[pos % capacity_];
+        std::size_t seq = cell.sequence.load(std::memory_order_acquire);
+        std::ptrdiff_t diff = static_cast<std::ptrdiff_t>(seq) - static_cast<std::ptrdiff_t>(pos);
+
+        if (diff == 0)
+        {
+            if (enqueuePos_.value.compare_exchange_weak(pos, pos + 1, std::memory_order_relaxed))
+            {
+                cell.data = item;
+                cell.sequence.store(pos + 1, std::memory_order_release);
+                return true;
+            }
+        }
+        else if (diff < 0)
+            return false;       // The slot still holds the item pushed one lap ago
+        else
+            pos = enqueuePos_.value.load(std::memory_order_relaxed);
+    }
+}
+
+// Returns false (without blocking) if the queue is empty
+template <class T>
+bool MPMCQueue<T>::tryPop(T& item)
+{
+    std::size_t pos = dequeuePos_.value.load(std::memory_order_relaxed);
+    for (;;)
+    {
+        Cell& cell = cells_[pos % capacity_];
+        std::size_t seq = cell.sequence.load(std::memory_order_acquire);
+        std::ptrdiff_t diff = static_cast<std::ptrdiff_t>(seq) - static_cast<std::ptrdiff_t>(pos + 1);
+
+        if (diff == 0)
+        {
+            if (dequeuePos_.value.compare_exchange_weak(pos, pos + 1, std::memory_order_relaxed))
+            {
+                item = cell.data;
+                cell.sequence.store(pos + capacity_, std::memory_order_release);
+                return true;
+            }
+        }
+        else if (diff < 0)
+            return false;       // No item has been pushed into the slot yet
+        else
+            pos = dequeuePos_.value.load(std::memory_order_relaxed);
+    }
+}
+
+template <class T>
+inline
+std::size_t MPMCQueue<T>::capacity() const { return capacity_; }
+
+// Only a snapshot, since other threads may be pushing and popping concurrently
+template <class T>
+std::size_t MPMCQueue<T>::size() const
+{
+    std::size_t enqueued = enqueuePos_.value.load(std::memory_order_relaxed);
+    std::size_t dequeued = dequeuePos_.value.load(std::memory_order_relaxed);
+    return enqueued > dequeued ? enqueued - dequeued : 0;
+}
+
+#endif /* MPMC_QUEUE_H_ */
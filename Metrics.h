@@ -0,0 +1,292 @@
+#ifndef METRICS_H_
+#define METRICS_H_
+
+#include <atomic>
+#include <vector>
+#include <memory>
+#include <chrono>
+#include <cstddef>
+#include <cstdint>
+
+#include "CacheAligned.h"
+
+// The counts of a LatencyHistogram, taken at some point in time
+struct HistogramSnapshot
+{
+    std::vector<std::uint64_t> counts;      // Per bucket (see LatencyHistogram::bucketOf())
+    std::uint64_t total;
+    std::chrono::nanoseconds sum, max;
+
+    HistogramSnapshot() : total(0), sum(0), max(0) {}
+
+    std::chrono::nanoseconds mean() const;
+    std::chrono::nanoseconds percentile(double p) const;
+};
+
+// Recorded durations, bucketed HDR-style: exactly below 32ns, then 16 buckets per power
+// of two (so within 1/16 of the actual value), up to about a day. Recording is a couple
+// of relaxed atomic operations, so any number of threads can record concurrently.
+class LatencyHistogram
+{
+public:
+    static const int MAX_MSB = 46;          // 2^47ns is about 39 hours
+    static const int NUM_BUCKETS = ((MAX_MSB - 4) << 4) + 32;
+private:
+    std::atomic<std::uint64_t> counts_[NUM_BUCKETS];
+    std::atomic<std::uint64_t> total_, sum_, max_;
+public:
+    LatencyHistogram();
+
+    LatencyHistogram(const LatencyHistogram& other) = delete;
+    LatencyHistogram& operator=(const LatencyHistogram& other) = delete;
+
+    void record(std::chrono::nanoseconds duration);
+    HistogramSnapshot snapshot() const;
+
+    static int bucketOf(std::uint64_t nanos);
+    static std::uint64_t bucketUpperBound(int bucket);
+};
+
+// What one thread of a pool did, in total
+struct WorkerStats
+{
+    std::uint64_t executed;                 // Tasks run
+    std::uint64_t stolen;                   // Of which were stolen from other threads' deques
+    std::chrono::nanoseconds idleTime;      // Spent spinning or blocked, waiting for tasks
+
+    WorkerStats() : executed(0), stolen(0), idleTime(0) {}
+};
+
+// A snapshot of a pool's metrics (see BasicThreadPool::stats()). Only enabled if the pool
+// is compiled with THREADPOOL_METRICS defined; otherwise, every metric stays zero.
+struct ThreadPoolStats
+{
+    bool enabled;
+    HistogramSnapshot queueLatency;         // From submission to the start of the task
+    HistogramSnapshot runTime;
+    std::vector<WorkerStats> workers;       // Per thread slot (see ThreadPoolOptions::maxThreads)
+    std::size_t maxQueueDepth;              // The most tasks waiting at once
+
+    ThreadPoolStats() : enabled(false), maxQueueDepth(0) {}
+};
+
+inline
+std::chrono::nanoseconds HistogramSnapshot::mean() const
+{
+    if (total == 0)
+        return std::chrono::nanoseconds(0);
+    return std::chrono::nanoseconds(sum.count() / static_cast<std::int64_t>(total));
+}
+
+// The smallest duration that at least a fraction p (in [0, 1]) of the recorded ones don't
+// exceed, as precise as its bucket (the maximum, for p = 1)
+inline
+std::chrono::nanoseconds HistogramSnapshot::percentile(double p) const
+{
+    if (total == 0)
+        return std::chrono::nanoseconds(0);
+
+    std::uint64_t rank = static_cast<std::uint64_t>(p * total + 0.5);
+    if (rank == 0)
+        rank = 1;
+    std::uint64_t seen = 0;
+    for (std::size_t i = 0; i != counts.size(); ++i)
+        if ((seen += counts[i]) >= rank)
+        {
+            std::chrono::nanoseconds bound(LatencyHistogram::bucketUpperBound(static_cast<int>(i)));
+            return bound < max ? bound : max;
+        }
+    return max;
+}
+
+inline
+LatencyHistogram::LatencyHistogram()
+    : total_(0)
+    , sum_(0)
+    , max_(0)
+{
+    for (int i = 0; i != NUM_BUCKETS; ++i)
+        counts_[i].store(0, std::memory_order_relaxed);
+}
+
+inline
+void LatencyHistogram::record(std::chrono::nanoseconds duration)
+{
+    std::uint64_t nanos = duration.count() > 0 ? static_cast<std::uint64_t>(duration.count()) : 0;
+    counts_[bucketOf(nanos)].fetch_add(1, std::memory_order_relaxed);
+    total_.fetch_add(1, std::memory_order_relaxed);
+    sum_.fetch_add(nanos, std::memory_order_relaxed);
+
+    std::uint64_t max = max_.load(std::memory_order_relaxed);
+    while (nanos > max && !max_.compare_exchange_weak(max, nanos, std::memory_order_relaxed))
+        ;
+}
+
+// Not atomic as a whole: counts recorded meanwhile may or may not be included
+inline
+HistogramSnapshot LatencyHistogram::snapshot() const
+{
+    HistogramSnapshot snapshot;
+    snapshot.counts.resize(NUM_BUCKETS);
+    for (int i = 0; i != NUM_BUCKETS; ++i)
+    {
+        snapshot.counts[i] = counts_[i].load(std::memory_order_relaxed);
+        snapshot.total += snapshot.counts[i];
+    }
+    snapshot.sum = std::chrono::nanoseconds(sum_.load(std::memory_order_relaxed));
+    snapshot.max = std::chrono::nanoseconds(max_.load(std::memory_order_relaxed));
+    return snapshot;
+}
+
+// The bucket is the value's top 5 bits (whose first is always 1), offset by 16 times the
+// amount of lower bits
+inline
+int LatencyHistogram::bucketOf(std::uint64_t nanos)
+{
+    if (nanos < 32)
+        return static_cast<int>(nanos);
+
+    int msb = 63;
+#if defined(__GNUC__) || defined(__clang__)
+    msb -= __builtin_clzll(nanos);
+#else
+    while (!(nanos >> msb))
+        --msb;
+#endif
+    if (msb > MAX_MSB)
+        return NUM_BUCKETS - 1;
+    const int shift = msb - 4;
+    return (shift << 4) + static_cast<int>(nanos >> shift);
+}
+
+inline
+std::uint64_t LatencyHistogram::bucketUpperBound(int bucket)
+{
+    if (bucket < 32)
+        return bucket;
+    const int shift = (bucket >> 4) - 1;
+    const std::uint64_t mantissa = (bucket & 15) + 16;
+    return ((mantissa + 1) << shift) - 1;
+}
+
+// The metrics a pool records, by default when THREADPOOL_METRICS is defined (or with
+// PoolPolicy<Queue, RecordingMetrics>). Per-thread counters are only written by their
+// own thread, and padded to a cache line each.
+class RecordingMetrics
+{
+public:
+    typedef std::chrono::steady_clock Clock;
+
+    // Every task carries one (see BasicThreadPool::TaskNode)
+    struct TaskStamp
+    {
+        Clock::time_point queuedAt;
+    };
+
+    class Timer
+    {
+    private:
+        Clock::time_point start_;
+    public:
+        Timer() : start_(Clock::now()) {}
+        std::chrono::nanoseconds elapsed() const { return Clock::now() - start_; }
+        Clock::time_point start() const { return start_; }
+    };
+private:
+    struct Worker
+    {
+        std::atomic<std::uint64_t> executed, stolen, idleNanos;
+        Worker() : executed(0), stolen(0), idleNanos(0) {}
+    };
+
+    LatencyHistogram queueLatency_, runTime_;
+    CacheAlignedArray<Worker> workers_;         // Each thread's counters on lines of their own
+    const int numWorkers_;
+    std::atomic<int> maxQueueDepth_;
+public:
+    explicit RecordingMetrics(int numWorkers)
+        : workers_(numWorkers)
+        , numWorkers_(numWorkers)
+        , maxQueueDepth_(0)
+    {}
+
+    void stampQueued(TaskStamp& stamp) { stamp.queuedAt = Clock::now(); }
+
+    // activeThreads() is only called here, since counting the active threads isn't free
+    template <class ActiveThreads>
+    void queueDepth(const std::atomic<int>& pendingTasks, const ActiveThreads& activeThreads)
+    {
+        int depth = pendingTasks.load(std::memory_order_relaxed) - activeThreads();
+        int max = maxQueueDepth_.load(std::memory_order_relaxed);
+        while (depth > max && !maxQueueDepth_.compare_exchange_weak(max, depth, std::memory_order_relaxed))
+            ;
+    }
+
+    Timer taskStarted(const TaskStamp& stamp)
+    {
+        Timer timer;
+        queueLatency_.record(timer.start() - stamp.queuedAt);
+        return timer;
+    }
+
+    void taskFinished(int worker, const Timer& timer)
+    {
+        runTime_.record(timer.elapsed());
+        workers_[worker].executed.fetch_add(1, std::memory_order_relaxed);
+    }
+
+    void taskStolen(int worker) { workers_[worker].stolen.fetch_add(1, std::memory_order_relaxed); }
+
+    Timer idleStarted() { return Timer(); }
+
+    void idleFinished(int worker, const Timer& timer)
+    {
+        workers_[worker].idleNanos.fetch_add(timer.elapsed().count(), std::memory_order_relaxed);
+    }
+
+    void snapshot(ThreadPoolStats& stats) const
+    {
+        stats.enabled = true;
+        stats.queueLatency = queueLatency_.snapshot();
+        stats.runTime = runTime_.snapshot();
+        stats.maxQueueDepth = maxQueueDepth_.load(std::memory_order_relaxed);
+        stats.workers.resize(numWorkers_);
+        for (int i = 0; i != numWorkers_; ++i)
+        {
+            stats.workers[i].executed = workers_[i].executed.load(std::memory_order_relaxed);
+            stats.workers[i].stolen = workers_[i].stolen.load(std::memory_order_relaxed);
+            stats.workers[i].idleTime = std::chrono::nanoseconds(workers_[i].idleNanos.load(std::memory_order_relaxed));
+        }
+    }
+};
+
+// Without THREADPOOL_METRICS (or with PoolPolicy<Queue, NoMetrics>), nothing is recorded,
+// and the calls compile to nothing (TaskStamp is an empty base of each task's node, so it
+// takes no room either)
+class NoMetrics
+{
+public:
+    struct TaskStamp {};
+    struct Timer {};
+
+    explicit NoMetrics(int) {}
+
+    void stampQueued(TaskStamp&) {}
+    template <class ActiveThreads>
+    void queueDepth(const std::atomic<int>&, const ActiveThreads&) {}
+    Timer taskStarted(const TaskStamp&) { return Timer(); }
+    void taskFinished(int, const Timer&) {}
+    void taskStolen(int) {}
+    Timer idleStarted() { return Timer(); }
+    void idleFinished(int, const Timer&) {}
+    void snapshot(ThreadPoolStats&) const {}
+};
+
+// The metrics pools record unless their PoolPolicy says otherwise
+#ifdef THREADPOOL_METRICS
+typedef RecordingMetrics PoolMetrics;
+#else
+typedef NoMetrics PoolMetrics;
+#endif
+
+#endif /* METRICS_H_ */
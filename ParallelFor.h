@@ -0,0 +1,181 @@
+#ifndef PARALLEL_FOR_H_
+#define PARALLEL_FOR_H_
+
+#include <atomic>
+#include <mutex>
+#include <condition_variable>
+#include <memory>
+#include <exception>
+#include <algorithm>
+#include <utility>
+
+// The state shared by the threads working on one parallelFor() range. Participants
+// repeatedly claim chunks of [next, end) - large ones at first, then ever smaller ones
+// (guided scheduling), so that threads finish at about the same time without claiming
+// a chunk per index. Helper tasks hold a shared_ptr to it, since they may only start
+// running after the range is done and the caller has returned.
+template <class Index>
+class ParallelRange
+{
+private:
+    std::atomic<Index> next_;
+    const Index end_, grain_;
+    const int participants_;
+    std::atomic<int> busy_;                 // Participants that may be running a chunk
+    std::exception_ptr exception_;          // The first exception thrown by a chunk
+    std::mutex lock_;
+    std::condition_variable idle_;
+
+    bool claim(Index& first, Index& last);
+public:
+    ParallelRange(Index begin, Index end, Index grain, int participants);
+
+    template <class Fn>
+    void run(Fn& chunkFn);
+    void wait();
+};
+
+template <class Index>
+ParallelRange<Index>::ParallelRange(Index begin, Index end, Index grain, int participants)
+    : next_(begin)
+    , end_(end)
+    , grain_(grain)
+    , participants_(participants)
+    , busy_(0)
+{}
+
+// Claims the next chunk: a share of the remaining indices, but at least grain_ of them
+template <class Index>
+bool ParallelRange<Index>::claim(Index& first, Index& last)
+{
+    first = next_.load();
+    do
+    {
+        if (first >= end_)
+            return false;
+        Index remaining = end_ - first;
+        last = first + std::min(remaining, std::max(grain_, Index(remaining / (2 * participants_))));
+    } while (!next_.compare_exchange_weak(first, last));
+    return true;
+}
+
+// Calls chunkFn(first, last) for chunks until none is left. An exception thrown by
+// chunkFn stops every participant from claiming more chunks, and is rethrown by wait().
+// (busy_ is incremented before claiming: once wait() sees that run() returned and
+// busy_ == 0, no participant can still be in chunkFn, nor enter it again.)
+template <class Index>
+template <class Fn>
+void ParallelRange<Index>::run(Fn& chunkFn)
+{
+    ++busy_;
+
+    Index first, last;
+    while (claim(first, last))
+    {
+        try
+        {
+            chunkFn(first, last);
+        }
+        catch (...)
+        {
+            std::lock_guard<std::mutex> lg(lock_);
+            if (!exception_)
+                exception_ = std::current_exception();
+            next_ = end_;
+        }
+    }
+
+    if (--busy_ == 0)
+    {
+        { std::lock_guard<std::mutex> lg(lock_); }
+        idle_.notify_all();
+    }
+}
+
+// Only called by the thread that started the range, after its own run() returned
+template <class Index>
+void ParallelRange<Index>::wait()
+{
+    std::unique_lock<std::mutex> ul(lock_);
+    while (busy_ != 0)
+        idle_.wait(ul);
+
+    // Taken out of the range, since a helper may be the last one to release it
+    std::exception_ptr exception = exception_;
+    exception_ = nullptr;
+    if (exception)
+        std::rethrow_exception(exception);
+}
+
+// Calls chunkBody(first, last) for consecutive chunks [first, last) covering [begin, end),
+// on pool's threads and the calling thread, and returns once every call has returned.
+// If a call throws, the remaining chunks are skipped and the exception is rethrown.
+// Chunks are never smaller than grain indices (except perhaps the last one).
+// Pool can be any pool that runs callables taking no arguments, e.g. a GenericThreadPool
+// or a ThreadPool<void()>. Only as many helper tasks are submitted as there are threads,
+// and since the calling thread takes part (without waiting for helpers that haven't
+// started yet), this can be called from inside a task running on the same pool.
+template <class Pool, class Index, class ChunkBody>
+void parallelForChunks(Pool& pool, Index begin, Index end, ChunkBody chunkBody, Index grain = 1)
+{
+    if (begin >= end)
+        return;
+    grain = std::max(grain, Index(1));
+
+    typedef ParallelRange<Index> Range;
+    const int participants = pool.threadCount() + 1;
+    std::shared_ptr<Range> range = std::make_shared<Range>(begin, end, grain, participants);
+
+    // Helpers only touch chunkBody after claiming a chunk, which can't happen anymore
+    // once range->wait() has returned
+    struct Helper
+    {
+        std::shared_ptr<Range> range;
+        ChunkBody* chunkBody;
+        void operator()() { range->run(*chunkBody); }
+    };
+
+    const Index chunks = (end - begin - 1) / grain + 1;
+    const Index helpers = std::min(Index(participants - 1), Index(chunks - 1));
+    for (Index i = 0; i < helpers; ++i)
+        pool.execute(Helper{ range, &chunkBody });
+
+    range->run(chunkBody);
+    range->wait();
+}
+
+// Calls body(i) for every i in [begin, end) in parallel (see parallelForChunks()),
+// without submitting a task, or creating a future, per index
+template <class Pool, class Index, class Body>
+void parallelFor(Pool& pool, Index begin, Index end, Body body, Index grain = 1)
+{
+    parallelForChunks(pool, begin, end, [&body](Index first, Index last) {
+        for (Index i = first; i != last; ++i)
+            body(i);
+    }, grain);
+}
+
+// Computes combine(...combine(combine(identity, body(begin)), body(begin + 1))..., body(end - 1))
+// in parallel (see parallelForChunks()): each chunk is reduced on its own, starting from
+// identity, then the chunks' results are combined as they finish. Since that changes the
+// grouping and order of the calls, combine must be associative and commutative, and
+// identity must be its identity element.
+template <class Pool, class Index, class T, class Body, class Combine>
+T parallelReduce(Pool& pool, Index begin, Index end, T identity, Body body, Combine combine, Index grain = 1)
+{
+    T result = identity;
+    std::mutex resultLock;
+
+    parallelForChunks(pool, begin, end, [&](Index first, Index last) {
+        T partial = identity;
+        for (Index i = first; i != last; ++i)
+            partial = combine(std::move(partial), body(i));
+
+        std::lock_guard<std::mutex> lg(resultLock);
+        result = combine(std::move(result), std::move(partial));
+    }, grain);
+
+    return result;
+}
+
+#endif /* PARALLEL_FOR_H_ */
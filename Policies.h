@@ -0,0 +1,62 @@
+#ifndef POLICIES_H_
+#define POLICIES_H_
+
+#include <cstddef>
+
+#include "Metrics.h"
+#include "Tracing.h"
+
+// Queue policies: which queues a pool's threads take tasks from. With a policy other
+// than AnyQueue, the choice is made at compile time, so the queues the pool doesn't use
+// cost it no branch at all (submitting and finding a task never test for them), and the
+// matching ThreadPoolOptions are ignored. Each policy maps what the options ask for to
+// what the pool does.
+
+// Whatever ThreadPoolOptions say (workStealing, lifoSlot and queueCapacity)
+struct AnyQueue
+{
+    static bool workStealing(bool requested) { return requested; }
+    static bool lifoSlot(bool requested) { return requested; }
+    static bool bounded(bool requested) { return requested; }
+};
+
+// The shared queue only, one FIFO per priority under the pool's lock
+struct SharedQueue
+{
+    static bool workStealing(bool) { return false; }
+    static bool lifoSlot(bool) { return false; }
+    static bool bounded(bool) { return false; }
+};
+
+// The lock-free bounded ring (MPMCQueue) for Normal tasks, of queueCapacity tasks
+// (DEFAULT_CAPACITY if that's 0)
+struct BoundedQueue
+{
+    static const std::size_t DEFAULT_CAPACITY = 1024;
+
+    static bool workStealing(bool) { return false; }
+    static bool lifoSlot(bool) { return false; }
+    static bool bounded(bool) { return true; }
+};
+
+// A work-stealing deque per thread (and LIFO slots, if lifoSlot is set)
+struct StealingQueue
+{
+    static bool workStealing(bool) { return true; }
+    static bool lifoSlot(bool requested) { return requested; }
+    static bool bounded(bool) { return false; }
+};
+
+// The compile-time choices of a pool (see PolicyThreadPool and PolicyGenericThreadPool):
+// Queue is one of the queue policies above, Metrics either RecordingMetrics or NoMetrics
+// (by default, PoolMetrics: whichever THREADPOOL_METRICS selects), and Tracer either
+// RingTracer or NoTracer (by default, PoolTracer: whichever THREADPOOL_TRACING selects).
+template <class Queue = AnyQueue, class Metrics = PoolMetrics, class Tracer = PoolTracer>
+struct PoolPolicy
+{
+    typedef Queue QueuePolicy;
+    typedef Metrics MetricsPolicy;
+    typedef Tracer TracerPolicy;
+};
+
+#endif /* POLICIES_H_ */
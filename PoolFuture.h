@@ -0,0 +1,536 @@
+#ifndef POOL_FUTURE_H_
+#define POOL_FUTURE_H_
+
+#include <future>
+#include <memory>
+#include <mutex>
+#include <condition_variable>
+#include <chrono>
+#include <vector>
+#include <atomic>
+#include <exception>
+#include <utility>
+#include <type_traits>
+
+#include "Function.h"
+#include "GenericThreadPool.h"
+
+// The state shared by a PoolFuture and whatever completes it: the result (a value or an
+// exception), plus the callbacks to run once it's ready. FutureState<T> adds the value.
+class FutureStateBase
+{
+private:
+    mutable std::mutex lock_;
+    mutable std::condition_variable readyCondition_;
+    bool ready_;
+    std::exception_ptr exception_;
+    std::vector<UniqueFunction<void()>> callbacks_;
+    GenericThreadPool* pool_;
+protected:
+    // Runs the callbacks (outside lock_). setResult should store the result.
+    template <class SetResult>
+    void complete(SetResult setResult);
+
+    void rethrowIfFailed() const;
+public:
+    explicit FutureStateBase(GenericThreadPool* pool) : ready_(false), pool_(pool) {}
+
+    FutureStateBase(const FutureStateBase& other) = delete;
+    FutureStateBase& operator=(const FutureStateBase& other) = delete;
+
+    GenericThreadPool* pool() const { return pool_; }
+
+    void setException(std::exception_ptr exception);
+    bool hasException() const;
+    bool isReady() const;
+    void wait() const;
+
+    template <class Clock, class Duration>
+    bool waitUntil(const std::chrono::time_point<Clock, Duration>& deadline) const;
+
+    void onReady(UniqueFunction<void()> callback);
+};
+
+template <class SetResult>
+void FutureStateBase::complete(SetResult setResult)
+{
+    std::vector<UniqueFunction<void()>> callbacks;
+    {
+        std::lock_guard<std::mutex> lg(lock_);
+        if (ready_)
+            return;
+        setResult();
+        ready_ = true;
+        callbacks.swap(callbacks_);
+    }
+    readyCondition_.notify_all();
+
+    for (std::size_t i = 0; i != callbacks.size(); ++i)
+        callbacks[i]();
+}
+
+// Must only be called once the state is ready
+inline
+void FutureStateBase::rethrowIfFailed() const
+{
+    if (exception_)
+        std::rethrow_exception(exception_);
+}
+
+// Ignored if the state is already ready
+inline
+void FutureStateBase::setException(std::exception_ptr exception)
+{
+    complete([this, &exception]() { exception_ = exception; });
+}
+
+inline
+bool FutureStateBase::hasException() const
+{
+    std::lock_guard<std::mutex> lg(lock_);
+    return exception_ != nullptr;
+}
+
+inline
+bool FutureStateBase::isReady() const
+{
+    std::lock_guard<std::mutex> lg(lock_);
+    return ready_;
+}
+
+inline
+void FutureStateBase::wait() const
+{
+    std::unique_lock<std::mutex> ul(lock_);
+    while (!ready_)
+        readyCondition_.wait(ul);
+}
+
+template <class Clock, class Duration>
+bool FutureStateBase::waitUntil(const std::chrono::time_point<Clock, Duration>& deadline) const
+{
+    std::unique_lock<std::mutex> ul(lock_);
+    while (!ready_)
+        if (readyCondition_.wait_until(ul, deadline) == std::cv_status::timeout)
+            return ready_;
+    return true;
+}
+
+// Runs callback once the state is ready, on the thread that makes it ready (or right
+// away, on the calling thread, if it already is). Callbacks should be quick.
+inline
+void FutureStateBase::onReady(UniqueFunction<void()> callback)
+{
+    {
+        std::lock_guard<std::mutex> lg(lock_);
+        if (!ready_)
+        {
+            callbacks_.push_back(std::move(callback));
+            return;
+        }
+    }
+    callback();
+}
+
+template <class T>
+class FutureState : public FutureStateBase
+{
+private:
+    typename std::aligned_storage<sizeof(T), alignof(T)>::type value_;
+    bool hasValue_;
+public:
+    explicit FutureState(GenericThreadPool* pool) : FutureStateBase(pool), hasValue_(false) {}
+    ~FutureState() { if (hasValue_) reinterpret_cast<T*>(&value_)->~T(); }
+
+    template <class U>
+    void setValue(U&& value);
+
+    T takeValue();
+};
+
+// Ignored if the state is already ready
+template <class T>
+template <class U>
+void FutureState<T>::setValue(U&& value)
+{
+    complete([this, &value]() {
+        new (&value_) T(std::forward<U>(value));
+        hasValue_ = true;
+    });
+}
+
+// Must only be called (once) after the state is ready. Rethrows the stored exception, if any.
+template <class T>
+T FutureState<T>::takeValue()
+{
+    rethrowIfFailed();
+    return std::move(*reinterpret_cast<T*>(&value_));
+}
+
+template <>
+class FutureState<void> : public FutureStateBase
+{
+public:
+    explicit FutureState(GenericThreadPool* pool) : FutureStateBase(pool) {}
+
+    void setValue() { complete([]() {}); }
+    void takeValue() { rethrowIfFailed(); }
+};
+
+// Stores the result of fn(args...) in state (void results need their own overload)
+template <class R, class Fn, class... CallArgs>
+void fulfillState(FutureState<R>& state, Fn& fn, CallArgs&&... args)
+{
+    state.setValue(fn(std::forward<CallArgs>(args)...));
+}
+
+template <class Fn, class... CallArgs>
+void fulfillState(FutureState<void>& state, Fn& fn, CallArgs&&... args)
+{
+    fn(std::forward<CallArgs>(args)...);
+    state.setValue();
+}
+
+// The result of a continuation taking a T (or nothing, if T is void)
+template <class Fn, class T>
+struct ContinuationResult
+{
+    typedef typename std::result_of<Fn(T)>::type type;
+};
+
+template <class Fn>
+struct ContinuationResult<Fn, void>
+{
+    typedef typename std::result_of<Fn()>::type type;
+};
+
+// A task that completes a FutureState with the result of a call. If the task is destroyed
+// without having run (say, because the pool was shut down), the state gets a
+// std::future_error (broken_promise) instead, so that nobody waits for it forever.
+template <class R, class Call>
+class StateTask
+{
+private:
+    std::shared_ptr<FutureState<R>> state_;
+    Call call_;
+public:
+    StateTask(const std::shared_ptr<FutureState<R>>& state, Call&& call) : state_(state), call_(std::move(call)) {}
+    StateTask(StateTask&& other) = default;
+    ~StateTask();
+
+    void operator()();
+};
+
+template <class R, class Call>
+StateTask<R, Call>::~StateTask()
+{
+    if (state_)
+        state_->setException(std::make_exception_ptr(std::future_error(std::future_errc::broken_promise)));
+}
+
+template <class R, class Call>
+void StateTask<R, Call>::operator()()
+{
+    std::shared_ptr<FutureState<R>> state = std::move(state_);
+    try
+    {
+        call_(*state);
+    }
+    catch (...)
+    {
+        state->setException(std::current_exception());
+    }
+}
+
+// Calls fn with the (ready) value of a future, and stores the result in the next state.
+// An exception stored in the future skips fn and is passed on instead.
+template <class T, class Fn>
+class ContinuationCall
+{
+private:
+    std::shared_ptr<FutureState<T>> from_;
+    Fn fn_;
+
+    template <class R, class U>
+    static void run(FutureState<R>& to, Fn& fn, FutureState<U>& from) { fulfillState(to, fn, from.takeValue()); }
+
+    template <class R>
+    static void run(FutureState<R>& to, Fn& fn, FutureState<void>& from) { from.takeValue(); fulfillState(to, fn); }
+public:
+    template <class DeducedFn>
+    ContinuationCall(const std::shared_ptr<FutureState<T>>& from, DeducedFn&& fn) : from_(from), fn_(std::forward<DeducedFn>(fn)) {}
+
+    template <class R>
+    void operator()(FutureState<R>& to) { run(to, fn_, *from_); }
+};
+
+// Calls fn(args...) (see GenericThreadPool::async())
+template <class Call>
+class AsyncCall
+{
+private:
+    Call call_;
+public:
+    explicit AsyncCall(Call&& call) : call_(std::move(call)) {}
+
+    template <class R>
+    void operator()(FutureState<R>& to) { fulfillState(to, call_); }
+};
+
+// Passes a task to a pool (or, without a pool, runs it right away) once a future is ready
+template <class Task>
+class Scheduler
+{
+private:
+    GenericThreadPool* pool_;
+    Task task_;
+public:
+    Scheduler(GenericThreadPool* pool, Task&& task) : pool_(pool), task_(std::move(task)) {}
+
+    void operator()()
+    {
+        if (pool_)
+            pool_->execute(std::move(task_));
+        else
+            task_();
+    }
+};
+
+// Like std::future, but tied to a GenericThreadPool: then() schedules a continuation to
+// run on the pool once the result is ready, instead of blocking a thread in get().
+// Continuations (and the results of whenAll()/whenAny()) without a pool run on whichever
+// thread completes the future. PoolFutures are move-only, and get() and then() can be
+// called only once (after which valid() is false).
+template <class T>
+class PoolFuture
+{
+private:
+    template <class U>
+    friend class PoolFuture;
+
+    std::shared_ptr<FutureState<T>> state_;
+public:
+    PoolFuture() {}
+    explicit PoolFuture(std::shared_ptr<FutureState<T>> state) : state_(std::move(state)) {}
+
+    PoolFuture(const PoolFuture& other) = delete;
+    PoolFuture& operator=(const PoolFuture& other) = delete;
+
+    PoolFuture(PoolFuture&& other) : state_(std::move(other.state_)) {}
+    PoolFuture& operator=(PoolFuture&& other) { state_ = std::move(other.state_); return *this; }
+
+    bool valid() const { return state_ != nullptr; }
+    bool isReady() const { return state_->isReady(); }
+    void wait() const { state_->wait(); }
+
+    template <class Rep, class Period>
+    bool waitFor(const std::chrono::duration<Rep, Period>& timeout) const;
+
+    T get();
+
+    template <class Fn>
+    PoolFuture<typename ContinuationResult<typename std::decay<Fn>::type, T>::type> then(Fn&& fn);
+
+    // For whenAll()/whenAny()
+    const std::shared_ptr<FutureState<T>>& state() const { return state_; }
+};
+
+// Returns true if the result is ready, false if timed out
+template <class T>
+template <class Rep, class Period>
+inline
+bool PoolFuture<T>::waitFor(const std::chrono::duration<Rep, Period>& timeout) const
+{
+    return state_->waitUntil(std::chrono::steady_clock::now() + timeout);
+}
+
+// Blocks until the result is ready, then returns it (or throws the stored exception)
+template <class T>
+T PoolFuture<T>::get()
+{
+    std::shared_ptr<FutureState<T>> state = std::move(state_);
+    state->wait();
+    return state->takeValue();
+}
+
+// Returns a future for fn(value) (or fn(), for a PoolFuture<void>), which is run on the
+// pool once this future is ready. If this future holds an exception, fn isn't called and
+// the returned future holds the exception instead.
+template <class T>
+template <class Fn>
+PoolFuture<typename ContinuationResult<typename std::decay<Fn>::type, T>::type> PoolFuture<T>::then(Fn&& fn)
+{
+    typedef typename ContinuationResult<typename std::decay<Fn>::type, T>::type R;
+    typedef StateTask<R, ContinuationCall<T, typename std::decay<Fn>::type>> Task;
+
+    std::shared_ptr<FutureState<T>> from = std::move(state_);
+    GenericThreadPool* pool = from->pool();
+    std::shared_ptr<FutureState<R>> next = std::make_shared<FutureState<R>>(pool);
+
+    Task task(next, ContinuationCall<T, typename std::decay<Fn>::type>(from, std::forward<Fn>(fn)));
+    from->onReady(Scheduler<Task>(pool, std::move(task)));
+
+    return PoolFuture<R>(next);
+}
+
+// Collects the values of whenAll()'s futures once the last of them is ready. remaining_
+// starts with an extra count for whenAll() itself, so that the result isn't set before
+// all callbacks have been registered (or right away, if there are no futures).
+template <class T>
+class AllState
+{
+private:
+    std::vector<PoolFuture<T>> futures_;
+    std::atomic<std::size_t> remaining_;
+    std::shared_ptr<FutureState<std::vector<T>>> result_;
+public:
+    AllState(std::vector<PoolFuture<T>>&& futures, const std::shared_ptr<FutureState<std::vector<T>>>& result)
+        : futures_(std::move(futures)), remaining_(futures_.size() + 1), result_(result) {}
+
+    const std::vector<PoolFuture<T>>& futures() const { return futures_; }
+
+    void finishOne()
+    {
+        if (--remaining_ != 0)
+            return;
+
+        std::vector<T> values;
+        values.reserve(futures_.size());
+        try
+        {
+            for (std::size_t i = 0; i != futures_.size(); ++i)
+                values.push_back(futures_[i].get());
+        }
+        catch (...)
+        {
+            result_->setException(std::current_exception());
+            return;
+        }
+        result_->setValue(std::move(values));
+    }
+};
+
+template <>
+class AllState<void>
+{
+private:
+    std::vector<PoolFuture<void>> futures_;
+    std::atomic<std::size_t> remaining_;
+    std::shared_ptr<FutureState<void>> result_;
+public:
+    AllState(std::vector<PoolFuture<void>>&& futures, const std::shared_ptr<FutureState<void>>& result)
+        : futures_(std::move(futures)), remaining_(futures_.size() + 1), result_(result) {}
+
+    const std::vector<PoolFuture<void>>& futures() const { return futures_; }
+
+    void finishOne()
+    {
+        if (--remaining_ != 0)
+            return;
+
+        try
+        {
+            for (std::size_t i = 0; i != futures_.size(); ++i)
+                futures_[i].get();
+        }
+        catch (...)
+        {
+            result_->setException(std::current_exception());
+            return;
+        }
+        result_->setValue();
+    }
+};
+
+// The result type of whenAll(): all the values, in order (or nothing, for void futures)
+template <class T>
+struct WhenAllResult
+{
+    typedef std::vector<T> type;
+};
+
+template <>
+struct WhenAllResult<void>
+{
+    typedef void type;
+};
+
+// Returns a future that becomes ready once all of the futures are. Its value is the vector
+// of their values, in the same order (or, if one of them holds an exception, the first
+// such exception). It is tied to the same pool as the first future.
+template <class T>
+PoolFuture<typename WhenAllResult<T>::type> whenAll(std::vector<PoolFuture<T>> futures)
+{
+    typedef typename WhenAllResult<T>::type R;
+
+    GenericThreadPool* pool = futures.empty() ? nullptr : futures[0].state()->pool();
+    std::shared_ptr<FutureState<R>> result = std::make_shared<FutureState<R>>(pool);
+    std::shared_ptr<AllState<T>> all = std::make_shared<AllState<T>>(std::move(futures), result);
+
+    const std::vector<PoolFuture<T>>& inputs = all->futures();
+    for (std::size_t i = 0; i != inputs.size(); ++i)
+        inputs[i].state()->onReady([all]() { all->finishOne(); });
+    all->finishOne();
+
+    return PoolFuture<R>(result);
+}
+
+// The value of whenAny()'s future: the index of the (first) future that became ready,
+// and all the futures passed to whenAny(), to get the value from
+template <class T>
+struct WhenAnyResult
+{
+    std::size_t index;
+    std::vector<PoolFuture<T>> futures;
+};
+
+// Returns a future that becomes ready as soon as one of the futures is (holding a value or
+// an exception). futures must not be empty.
+template <class T>
+PoolFuture<WhenAnyResult<T>> whenAny(std::vector<PoolFuture<T>> futures)
+{
+    struct AnyState
+    {
+        std::atomic<bool> done;
+        WhenAnyResult<T> value;
+        std::shared_ptr<FutureState<WhenAnyResult<T>>> result;
+    };
+
+    GenericThreadPool* pool = futures[0].state()->pool();
+    std::shared_ptr<AnyState> any = std::make_shared<AnyState>();
+    any->done = false;
+    any->result = std::make_shared<FutureState<WhenAnyResult<T>>>(pool);
+    any->value.futures = std::move(futures);
+    std::shared_ptr<FutureState<WhenAnyResult<T>>> result = any->result;
+
+    // Copied first, since the first callback may hand the futures over right away
+    std::vector<std::shared_ptr<FutureState<T>>> states;
+    for (std::size_t i = 0; i != any->value.futures.size(); ++i)
+        states.push_back(any->value.futures[i].state());
+
+    for (std::size_t i = 0; i != states.size(); ++i)
+        states[i]->onReady([any, i]() {
+            if (any->done.exchange(true))
+                return;
+            any->value.index = i;
+            any->result->setValue(std::move(any->value));
+        });
+
+    return PoolFuture<WhenAnyResult<T>>(result);
+}
+
+// Same as submit(), but returns a PoolFuture (so that continuations can be attached)
+template <class Fn, class... Args>
+PoolFuture<typename std::result_of<typename std::decay<Fn>::type(typename std::decay<Args>::type...)>::type>
+GenericThreadPool::async(Fn&& fn, Args&&... args)
+{
+    typedef BoundCall<typename std::decay<Fn>::type, typename std::decay<Args>::type...> Call;
+    typedef typename std::result_of<typename std::decay<Fn>::type(typename std::decay<Args>::type...)>::type retType;
+
+    std::shared_ptr<FutureState<retType>> state = std::make_shared<FutureState<retType>>(this);
+    execute(StateTask<retType, AsyncCall<Call>>(state, AsyncCall<Call>(Call(std::forward<Fn>(fn), std::forward<Args>(args)...))));
+
+    return PoolFuture<retType>(state);
+}
+
+#endif /* POOL_FUTURE_H_ */
@@ -0,0 +1,239 @@
+#ifndef SLAB_H_
+#define SLAB_H_
+
+#include <atomic>
+#include <memory>
+#include <mutex>
+#include <new>
+#include <cstddef>
+#include <cstdint>
+
+// A thread-safe pool of fixed-size memory blocks. Blocks are carved out of chunks
+// allocated on demand (or up front with reserve()) and are recycled through a
+// lock-free free list, so once the slab has grown to its working size, allocate()
+// and deallocate() never touch the heap. heapAllocations() counts the times it did.
+class Slab
+{
+private:
+    static const std::size_t HEADER_SIZE = 16;          // Keeps blocks aligned for any scalar type
+    static const std::uint32_t MAX_CHUNKS = 4096;
+    static const std::uint32_t NOT_IN_SLAB = 0xffffffff;
+
+    // Precedes each block. next links the free list (as index + 1, so 0 is the end).
+    struct Header
+    {
+        std::uint32_t index;
+        std::atomic<std::uint32_t> next;
+    };
+
+    static const std::size_t CACHE_LINE_SIZE = 64;
+
+    // Every allocation and free CASes freeList_, so it gets a line of its own, away
+    // from the (read-mostly) fields around it
+    const std::size_t blockSize_, stride_, blocksPerChunk_;
+    char pad0_[CACHE_LINE_SIZE];
+    std::atomic<std::uint64_t> freeList_;               // (ABA tag << 32) | (index of first free block + 1)
+    char pad1_[CACHE_LINE_SIZE];
+    std::atomic<char*> chunks_[MAX_CHUNKS];
+    std::atomic<std::uint32_t> numChunks_;
+    std::atomic<std::size_t> heapAllocations_;
+    std::mutex growLock_;
+
+    Header* header(std::uint32_t index) const;
+    bool grow(bool onlyIfEmpty);
+public:
+    explicit Slab(std::size_t blockSize, std::size_t blocksPerChunk = 256);
+    ~Slab();
+
+    Slab(const Slab& other) = delete;
+    Slab& operator=(const Slab& other) = delete;
+
+    void* allocate();
+    void deallocate(void* block);
+    void reserve(std::size_t blocks);
+
+    std::size_t blockSize() const;
+    std::size_t capacity() const;
+    std::size_t heapAllocations() const;
+    void countHeapAllocation();
+};
+
+inline
+Slab::Slab(std::size_t blockSize, std::size_t blocksPerChunk)
+    : blockSize_(blockSize)
+    , stride_(HEADER_SIZE + (blockSize + HEADER_SIZE - 1) / HEADER_SIZE * HEADER_SIZE)
+    , blocksPerChunk_(blocksPerChunk)
+    , freeList_(0)
+    , numChunks_(0)
+    , heapAllocations_(0)
+{
+    for (std::uint32_t i = 0; i != MAX_CHUNKS; ++i)
+        chunks_[i].store(nullptr, std::memory_order_relaxed);
+}
+
+// Every block must have been deallocated already
+inline
+Slab::~Slab()
+{
+    for (std::uint32_t i = 0; i != numChunks_.load(); ++i)
+        ::operator delete(chunks_[i].load());
+}
+
+inline
+Slab::Header* Slab::header(std::uint32_t index) const
+{
+    char* chunk = chunks_[index / blocksPerChunk_].load(std::memory_order_acquire);
+    return reinterpret_cast<Header*>(chunk + (index % blocksPerChunk_) * stride_);
+}
+
+// Falls back to the heap (and counts it) if the slab reached MAX_CHUNKS
+inline
+void* Slab::allocate()
+{
+    for (;;)
+    {
+        std::uint64_t head = freeList_.load(std::memory_order_acquire);
+        while (head & 0xffffffff)
+        {
+            Header* h = header(static_cast<std::uint32_t>(head & 0xffffffff) - 1);
+            std::uint64_t next = ((head >> 32) + 1) << 32 | h->next.load(std::memory_order_relaxed);
+            if (freeList_.compare_exchange_weak(head, next, std::memory_order_acquire, std::memory_order_acquire))
+                return reinterpret_cast<char*>(h) + HEADER_SIZE;
+        }
+
+        if (!grow(true))
+        {
+            countHeapAllocation();
+            Header* h = static_cast<Header*>(::operator new(HEADER_SIZE + blockSize_));
+            h->index = NOT_IN_SLAB;
+            return reinterpret_cast<char*>(h) + HEADER_SIZE;
+        }
+    }
+}
+
+inline
+void Slab::deallocate(void* block)
+{
+    Header* h = reinterpret_cast<Header*>(static_cast<char*>(block) - HEADER_SIZE);
+    if (h->index == NOT_IN_SLAB)
+    {
+        ::operator delete(h);
+        return;
+    }
+
+    std::uint64_t head = freeList_.load(std::memory_order_relaxed);
+    std::uint64_t pushed;
+    do
+    {
+        h->next.store(static_cast<std::uint32_t>(head & 0xffffffff), std::memory_order_relaxed);
+        pushed = ((head >> 32) + 1) << 32 | (h->index + 1);
+    } while (!freeList_.compare_exchange_weak(head, pushed, std::memory_order_release, std::memory_order_relaxed));
+}
+
+// Grows the slab until it holds at least the specified amount of blocks
+inline
+void Slab::reserve(std::size_t blocks)
+{
+    while (capacity() < blocks && grow(false))
+        ;
+}
+
+// Adds one chunk of blocks to the free list. Returns false if there is no room for one.
+// If onlyIfEmpty is set, does nothing when the free list isn't empty (say, because
+// another thread grew the slab while this one waited for growLock_).
+inline
+bool Slab::grow(bool onlyIfEmpty)
+{
+    std::lock_guard<std::mutex> lg(growLock_);
+
+    if (onlyIfEmpty && (freeList_.load(std::memory_order_acquire) & 0xffffffff))
+        return true;
+
+    std::uint32_t chunkIndex = numChunks_.load(std::memory_order_relaxed);
+    if (chunkIndex == MAX_CHUNKS)
+        return false;
+
+    char* chunk = static_cast<char*>(::operator new(stride_ * blocksPerChunk_));
+    countHeapAllocation();
+
+    std::uint32_t first = chunkIndex * blocksPerChunk_;
+    for (std::uint32_t i = 0; i != blocksPerChunk_; ++i)
+    {
+        Header* h = reinterpret_cast<Header*>(chunk + i * stride_);
+        h->index = first + i;
+        h->next.store(i + 1 == blocksPerChunk_ ? 0 : first + i + 2, std::memory_order_relaxed);
+    }
+    chunks_[chunkIndex].store(chunk, std::memory_order_release);
+    numChunks_.store(chunkIndex + 1, std::memory_order_release);
+
+    // Splice the whole chunk onto the front of the free list
+    Header* last = reinterpret_cast<Header*>(chunk + (blocksPerChunk_ - 1) * stride_);
+    std::uint64_t head = freeList_.load(std::memory_order_relaxed);
+    std::uint64_t pushed;
+    do
+    {
+        last->next.store(static_cast<std::uint32_t>(head & 0xffffffff), std::memory_order_relaxed);
+        pushed = ((head >> 32) + 1) << 32 | (first + 1);
+    } while (!freeList_.compare_exchange_weak(head, pushed, std::memory_order_release, std::memory_order_relaxed));
+
+    return true;
+}
+
+inline
+std::size_t Slab::blockSize() const { return blockSize_; }
+
+inline
+std::size_t Slab::capacity() const { return numChunks_.load() * blocksPerChunk_; }
+
+inline
+std::size_t Slab::heapAllocations() const { return heapAllocations_.load(std::memory_order_relaxed); }
+
+inline
+void Slab::countHeapAllocation() { heapAllocations_.fetch_add(1, std::memory_order_relaxed); }
+
+// A standard allocator drawing single objects that fit in a block from a shared Slab,
+// e.g. for std::promise's shared state. The slab is reference counted, so memory can
+// be handed back after the ThreadPool owning it is gone (say, by a surviving future).
+// Bigger requests go to the heap, and are counted as such.
+template <class T>
+class SlabAllocator
+{
+private:
+    template <class U>
+    friend class SlabAllocator;
+
+    std::shared_ptr<Slab> slab_;
+
+    bool fits(std::size_t n) const { return n * sizeof(T) <= slab_->blockSize() && alignof(T) <= 16; }
+public:
+    typedef T value_type;
+
+    explicit SlabAllocator(const std::shared_ptr<Slab>& slab) : slab_(slab) {}
+
+    template <class U>
+    SlabAllocator(const SlabAllocator<U>& other) : slab_(other.slab_) {}
+
+    T* allocate(std::size_t n)
+    {
+        if (fits(n))
+            return static_cast<T*>(slab_->allocate());
+        slab_->countHeapAllocation();
+        return static_cast<T*>(::operator new(n * sizeof(T)));
+    }
+
+    void deallocate(T* p, std::size_t n)
+    {
+        if (fits(n))
+            slab_->deallocate(p);
+        else
+            ::operator delete(p);
+    }
+
+    template <class U>
+    bool operator==(const SlabAllocator<U>& other) const { return slab_ == other.slab_; }
+
+    template <class U>
+    bool operator!=(const SlabAllocator<U>& other) const { return slab_ != other.slab_; }
+};
+
+#endif /* SLAB_H_ */
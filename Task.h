@@ -2,27 +2,71 @@
 #define TASK_H_
 
 #include <future>
+#include <memory>
+#include <tuple>
+#include <exception>
 #include <algorithm>
 #include <utility>
 #include <type_traits>
+#include <new>
 
 #include "seq.h"
+#include "Function.h"
+
+// Stores the result of fn(args...) in promise (void results need their own overload)
+template <class R, class Fn, class... CallArgs>
+void fulfillPromise(std::promise<R>& promise, Fn& fn, CallArgs&&... args)
+{
+    promise.set_value(fn(std::forward<CallArgs>(args)...));
+}
+
+template <class Fn, class... CallArgs>
+void fulfillPromise(std::promise<void>& promise, Fn& fn, CallArgs&&... args)
+{
+    fn(std::forward<CallArgs>(args)...);
+    promise.set_value();
+}
+
+// Tag for Task's constructor: the task gets no promise, so creating it allocates no
+// shared state; its result is discarded, and an exception escapes execute()
+struct DiscardResult {};
 
 template <class FunctionType, class... Args>
 class Task
 {
+public:
+    typedef typename std::result_of<typename std::decay<FunctionType>::type(Args...)>::type ResultType;
 private:
-    std::packaged_task<FunctionType> task_;
+    typedef std::promise<ResultType> Promise;
+
+    UniqueFunction<FunctionType> fn_;
+    typename std::aligned_storage<sizeof(Promise), alignof(Promise)>::type promise_;
+    bool hasPromise_;
     std::tuple<Args...> args_;
 
+    Promise& promise() { return *reinterpret_cast<Promise*>(&promise_); }
+
     template<int... Nums>
     void executeActually(Sequence<Nums...>);
 public:
+    // Empty, without a promise: getFuture() must not be called
     Task();
 
-    template <class Fn, class... DeducedArgs>
+    template <class Fn, class... DeducedArgs, class = typename std::enable_if<
+        !std::is_same<typename std::decay<Fn>::type, std::allocator_arg_t>::value &&
+        !std::is_same<typename std::decay<Fn>::type, DiscardResult>::value>::type>
     Task(Fn&& fn, DeducedArgs&&... args);
 
+    // The promise's shared state is allocated with alloc
+    template <class Alloc, class Fn, class... DeducedArgs>
+    Task(std::allocator_arg_t, const Alloc& alloc, Fn&& fn, DeducedArgs&&... args);
+
+    // No promise: getFuture() must not be called
+    template <class Fn, class... DeducedArgs>
+    Task(DiscardResult, Fn&& fn, DeducedArgs&&... args);
+
+    ~Task();
+
     Task(const Task& other) = delete;
     Task& operator=(Task& other) = delete;
 
@@ -30,33 +74,82 @@ public:
     Task& operator=(Task&& other);
 
     void execute();
-    
-    // Need to figure out a way to typedef this
-    std::future<typename std::result_of<typename std::decay<FunctionType>::type(Args...)>::type>
-    getFuture();
+
+    std::future<ResultType> getFuture();
+
+    bool isInline() const;
 };
 
+// Without a promise (as with DiscardResult), so that placeholder tasks never allocate
 template <class FunctionType, class... Args>
 Task<FunctionType, Args...>::Task()
+    : hasPromise_(false)
 {}
 
 template <class FunctionType, class... Args>
-template <class Fn, class... DeducedArgs>
+template <class Fn, class... DeducedArgs, class>
 Task<FunctionType, Args...>::Task(Fn&& fn, DeducedArgs&&... args)
-    : task_(std::forward<Fn>(fn))
+    : fn_(std::forward<Fn>(fn))
+    , hasPromise_(false)
+    , args_(std::forward<Args>(args)...)
+{
+    new (&promise_) Promise();
+    hasPromise_ = true;
+}
+
+template <class FunctionType, class... Args>
+template <class Alloc, class Fn, class... DeducedArgs>
+Task<FunctionType, Args...>::Task(std::allocator_arg_t, const Alloc& alloc, Fn&& fn, DeducedArgs&&... args)
+    : fn_(std::forward<Fn>(fn))
+    , hasPromise_(false)
+    , args_(std::forward<Args>(args)...)
+{
+    new (&promise_) Promise(std::allocator_arg, alloc);
+    hasPromise_ = true;
+}
+
+template <class FunctionType, class... Args>
+template <class Fn, class... DeducedArgs>
+Task<FunctionType, Args...>::Task(DiscardResult, Fn&& fn, DeducedArgs&&... args)
+    : fn_(std::forward<Fn>(fn))
+    , hasPromise_(false)
     , args_(std::forward<Args>(args)...)
 {}
 
+// A promise destroyed before the task ran breaks it
+template <class FunctionType, class... Args>
+Task<FunctionType, Args...>::~Task()
+{
+    if (hasPromise_)
+        promise().~Promise();
+}
+
 template <class FunctionType, class... Args>
 Task<FunctionType, Args...>::Task(Task&& other)
-    : task_(std::move(other.task_))
+    : fn_(std::move(other.fn_))
+    , hasPromise_(other.hasPromise_)
     , args_(std::move(other.args_))
-{}
+{
+    if (hasPromise_)
+        new (&promise_) Promise(std::move(other.promise()));
+}
 
 template <class FunctionType, class... Args>
 Task<FunctionType, Args...>& Task<FunctionType, Args...>::operator=(Task&& other)
 {
-    task_ = std::move(other.task_);
+    fn_ = std::move(other.fn_);
+    if (hasPromise_ && other.hasPromise_)
+        promise() = std::move(other.promise());
+    else if (hasPromise_)
+    {
+        promise().~Promise();
+        hasPromise_ = false;
+    }
+    else if (other.hasPromise_)
+    {
+        new (&promise_) Promise(std::move(other.promise()));
+        hasPromise_ = true;
+    }
     args_ = std::move(other.args_);
     return *this;
 }
@@ -68,10 +161,18 @@ void Task<FunctionType, Args...>::execute()
 }
 
 template <class FunctionType, class... Args>
-std::future<typename std::result_of<typename std::decay<FunctionType>::type(Args...)>::type>
+std::future<typename Task<FunctionType, Args...>::ResultType>
 Task<FunctionType, Args...>::getFuture()
 {
-    return std::move(task_.get_future());
+    return promise().get_future();
+}
+
+// Whether the function was small enough to be stored without a heap allocation
+template <class FunctionType, class... Args>
+inline
+bool Task<FunctionType, Args...>::isInline() const
+{
+    return fn_.isInline();
 }
 
 // Not actually using the Sequence - we just want (to expand) the template arguments
@@ -79,7 +180,20 @@ template <class FunctionType, class... Args>
 template <int... Nums>
 void Task<FunctionType, Args...>::executeActually(Sequence<Nums...>)
 {
-    task_(std::get<Nums>(args_)...);
+    if (!hasPromise_)
+    {
+        fn_(std::get<Nums>(args_)...);
+        return;
+    }
+
+    try
+    {
+        fulfillPromise(promise(), fn_, std::get<Nums>(args_)...);
+    }
+    catch (...)
+    {
+        promise().set_exception(std::current_exception());
+    }
 }
 
 #endif /* TASK_H_ */
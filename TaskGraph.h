@@ -0,0 +1,291 @@
+#ifndef TASK_GRAPH_H_
+#define TASK_GRAPH_H_
+
+#include <vector>
+#include <memory>
+#include <atomic>
+#include <mutex>
+#include <condition_variable>
+#include <exception>
+#include <stdexcept>
+#include <future>
+#include <utility>
+#include <cstddef>
+
+#include "Function.h"
+
+// A set of tasks with dependencies between them, run on a pool's threads. Each node keeps
+// an atomic count of its unfinished predecessors; the thread finishing a node decrements
+// its successors' counts and starts the ones that become ready - one of them on the same
+// thread, right away, and the others by submitting them to the pool (so, in a
+// work-stealing pool, onto that thread's own deque). The graph isn't consumed by run(),
+// so the same graph can be run again and again without rebuilding it.
+class TaskGraph
+{
+public:
+    typedef std::size_t Node;
+private:
+    static const Node NO_NODE = static_cast<Node>(-1);
+
+    struct NodeData
+    {
+        UniqueFunction<void()> fn;
+        std::vector<Node> successors;
+        int predecessors;
+        std::atomic<int> remaining;         // Predecessors yet to finish in the current run
+
+        template <class Fn>
+        explicit NodeData(Fn&& f) : fn(std::forward<Fn>(f)), predecessors(0), remaining(0) {}
+    };
+
+    // Runs its node, or if the pool drops it unrun (rejected by a full bounded queue, or
+    // discarded by a shutdown), fails the run from there, so that run() still returns
+    template <class Pool>
+    class NodeRunner
+    {
+    private:
+        TaskGraph* graph_;
+        Pool* pool_;
+        Node node_;
+    public:
+        NodeRunner(TaskGraph* graph, Pool* pool, Node node) : graph_(graph), pool_(pool), node_(node) {}
+
+        NodeRunner(NodeRunner&& other) noexcept
+            : graph_(other.graph_)
+            , pool_(other.pool_)
+            , node_(other.node_)
+        {
+            other.graph_ = nullptr;
+        }
+
+        NodeRunner(const NodeRunner& other) = delete;
+        NodeRunner& operator=(const NodeRunner& other) = delete;
+
+        ~NodeRunner()
+        {
+            if (graph_)
+                graph_->dropFrom(node_);
+        }
+
+        void operator()()
+        {
+            TaskGraph* graph = graph_;
+            graph_ = nullptr;
+            graph->runFrom(*pool_, node_);
+        }
+    };
+
+    std::vector<std::unique_ptr<NodeData>> nodes_;
+    bool checked_;                          // Whether the graph is known to be acyclic
+
+    // Per run
+    std::atomic<std::size_t> unfinished_;
+    std::atomic<bool> failed_;
+    std::exception_ptr exception_;
+    bool finished_;                         // Set (with lock_ held) by the thread finishing the last node
+    std::mutex lock_;
+    std::condition_variable done_;
+
+    void checkAcyclic();
+
+    template <class Pool>
+    void runFrom(Pool& pool, Node node);
+    void dropFrom(Node node);
+    void finishNode();
+public:
+    TaskGraph();
+
+    TaskGraph(const TaskGraph& other) = delete;
+    TaskGraph& operator=(const TaskGraph& other) = delete;
+
+    template <class Fn>
+    Node add(Fn&& fn);
+    void precede(Node before, Node after);
+
+    template <class Pool>
+    void run(Pool& pool);
+
+    std::size_t size() const;
+};
+
+inline
+TaskGraph::TaskGraph()
+    : checked_(true)
+    , unfinished_(0)
+    , failed_(false)
+    , finished_(false)
+{}
+
+// Adds a node running fn(), and returns its handle
+template <class Fn>
+TaskGraph::Node TaskGraph::add(Fn&& fn)
+{
+    nodes_.emplace_back(new NodeData(std::forward<Fn>(fn)));
+    return nodes_.size() - 1;
+}
+
+// Makes after wait for before to finish
+inline
+void TaskGraph::precede(Node before, Node after)
+{
+    nodes_[before]->successors.push_back(after);
+    ++nodes_[after]->predecessors;
+    checked_ = false;
+}
+
+inline
+std::size_t TaskGraph::size() const { return nodes_.size(); }
+
+// Throws std::logic_error if the edges form a cycle (whose nodes could never run)
+inline
+void TaskGraph::checkAcyclic()
+{
+    std::vector<int> remaining(nodes_.size());
+    std::vector<Node> ready;
+    for (Node i = 0; i != nodes_.size(); ++i)
+        if ((remaining[i] = nodes_[i]->predecessors) == 0)
+            ready.push_back(i);
+
+    std::size_t visited = 0;
+    while (!ready.empty())
+    {
+        Node node = ready.back();
+        ready.pop_back();
+        ++visited;
+
+        const std::vector<Node>& successors = nodes_[node]->successors;
+        for (std::size_t i = 0; i != successors.size(); ++i)
+            if (--remaining[successors[i]] == 0)
+                ready.push_back(successors[i]);
+    }
+
+    if (visited != nodes_.size())
+        throw std::logic_error("TaskGraph has a cycle");
+    checked_ = true;
+}
+
+// Runs every node (after its predecessors) on pool's threads and the calling thread, and
+// blocks until all of them finished. If a node throws, the nodes that haven't started
+// yet are skipped, and the (first) exception is rethrown. Pool can be any pool that runs
+// callables taking no arguments, e.g. a GenericThreadPool or a ThreadPool<void()>. If the
+// pool drops one of the run's tasks (a bounded queue with Backpressure::Reject being full,
+// or the pool being shut down), the nodes it would have run are skipped, and
+// std::future_error(broken_promise) is thrown. The graph must not be modified or run
+// concurrently.
+template <class Pool>
+void TaskGraph::run(Pool& pool)
+{
+    if (!checked_)
+        checkAcyclic();
+    if (nodes_.empty())
+        return;
+
+    failed_ = false;
+    exception_ = nullptr;
+    finished_ = false;
+    unfinished_ = nodes_.size();
+
+    std::vector<Node> roots;
+    for (Node i = 0; i != nodes_.size(); ++i)
+    {
+        nodes_[i]->remaining.store(nodes_[i]->predecessors, std::memory_order_relaxed);
+        if (nodes_[i]->predecessors == 0)
+            roots.push_back(i);
+    }
+
+    // The calling thread runs the first root itself
+    for (std::size_t i = 1; i < roots.size(); ++i)
+        pool.execute(NodeRunner<Pool>(this, &pool, roots[i]));
+    runFrom(pool, roots[0]);
+
+    std::unique_lock<std::mutex> ul(lock_);
+    while (!finished_)
+        done_.wait(ul);
+
+    if (exception_)
+    {
+        std::exception_ptr exception = exception_;
+        exception_ = nullptr;
+        std::rethrow_exception(exception);
+    }
+}
+
+// Runs node, then keeps going with one of the successors it made ready (if any)
+template <class Pool>
+void TaskGraph::runFrom(Pool& pool, Node node)
+{
+    while (node != NO_NODE)
+    {
+        NodeData& data = *nodes_[node];
+        if (!failed_)
+        {
+            try
+            {
+                data.fn();
+            }
+            catch (...)
+            {
+                std::lock_guard<std::mutex> lg(lock_);
+                if (!exception_)
+                    exception_ = std::current_exception();
+                failed_ = true;
+            }
+        }
+
+        Node next = NO_NODE;
+        for (std::size_t i = 0; i != data.successors.size(); ++i)
+        {
+            Node successor = data.successors[i];
+            if (--nodes_[successor]->remaining != 0)
+                continue;
+            if (next == NO_NODE)
+                next = successor;
+            else
+                pool.execute(NodeRunner<Pool>(this, &pool, successor));
+        }
+
+        finishNode();
+        node = next;
+    }
+}
+
+// Fails the run, then skips node and every successor it makes ready, on the calling
+// thread: it's called as the pool drops a task, so nothing is submitted to the pool
+inline
+void TaskGraph::dropFrom(Node node)
+{
+    {
+        std::lock_guard<std::mutex> lg(lock_);
+        if (!exception_)
+            exception_ = std::make_exception_ptr(std::future_error(std::future_errc::broken_promise));
+        failed_ = true;
+    }
+
+    std::vector<Node> skipped(1, node);
+    while (!skipped.empty())
+    {
+        node = skipped.back();
+        skipped.pop_back();
+
+        const std::vector<Node>& successors = nodes_[node]->successors;
+        for (std::size_t i = 0; i != successors.size(); ++i)
+            if (--nodes_[successors[i]]->remaining == 0)
+                skipped.push_back(successors[i]);
+        finishNode();
+    }
+}
+
+// Counts a node as finished. Once finished_ is set, run() may return as soon as lock_ is
+// released, so the caller mustn't touch the graph afterwards.
+inline
+void TaskGraph::finishNode()
+{
+    if (--unfinished_ == 0)
+    {
+        std::lock_guard<std::mutex> lg(lock_);
+        finished_ = true;
+        done_.notify_all();
+    }
+}
+
+#endif /* TASK_GRAPH_H_ */
@@ -0,0 +1,169 @@
+#ifndef TASK_GROUP_H_
+#define TASK_GROUP_H_
+
+#include <atomic>
+#include <mutex>
+#include <condition_variable>
+#include <exception>
+#include <future>
+#include <type_traits>
+#include <utility>
+#include <cstddef>
+
+// Tasks run on a pool and waited for together: instead of a future (and a promise's
+// shared state) per task, the group counts its unfinished tasks with one atomic, and
+// keeps the first exception any of them threw, for wait() to rethrow. Once a task has
+// thrown, the group's tasks that haven't started yet are skipped. A group can be reused
+// once wait() returned, but must not be waited for by two threads at once.
+class TaskGroup
+{
+private:
+    // What's actually submitted: runs fn and tells the group. A task dropped without
+    // running (by a pool that's been shut down, or a full bounded queue) tells the group
+    // too, as a broken promise.
+    template <class Fn>
+    class GroupTask
+    {
+    private:
+        TaskGroup* group_;
+        Fn fn_;
+    public:
+        template <class DeducedFn>
+        GroupTask(TaskGroup* group, DeducedFn&& fn) : group_(group), fn_(std::forward<DeducedFn>(fn)) {}
+
+        GroupTask(GroupTask&& other) noexcept(std::is_nothrow_move_constructible<Fn>::value)
+            : group_(other.group_)
+            , fn_(std::move(other.fn_))
+        {
+            other.group_ = nullptr;
+        }
+
+        GroupTask(const GroupTask& other) = delete;
+        GroupTask& operator=(const GroupTask& other) = delete;
+
+        ~GroupTask()
+        {
+            if (group_)
+                group_->finish(std::make_exception_ptr(std::future_error(std::future_errc::broken_promise)));
+        }
+
+        void operator()();
+    };
+
+    std::atomic<std::size_t> pending_;
+    std::atomic<bool> failed_;
+    std::exception_ptr exception_;          // Set by the task that set failed_
+    std::mutex lock_;
+    std::condition_variable done_;
+
+    void finish(std::exception_ptr exception);
+    void waitActually();
+public:
+    TaskGroup();
+    ~TaskGroup();
+
+    TaskGroup(const TaskGroup& other) = delete;
+    TaskGroup& operator=(const TaskGroup& other) = delete;
+
+    template <class Pool, class Fn>
+    void run(Pool& pool, Fn&& fn);
+
+    void wait();
+
+    bool hasFailed() const;
+};
+
+inline
+TaskGroup::TaskGroup()
+    : pending_(0)
+    , failed_(false)
+{}
+
+// Waits for the group's tasks, but discards their exception (wait() first to get it)
+inline
+TaskGroup::~TaskGroup()
+{
+    waitActually();
+}
+
+// Submits fn() to the pool as one of the group's tasks (through pool.execute(), so no
+// promise is created). Pool can be any pool that runs callables taking no arguments, e.g.
+// a GenericThreadPool or a ThreadPool<void()>. fn's result is discarded.
+template <class Pool, class Fn>
+void TaskGroup::run(Pool& pool, Fn&& fn)
+{
+    ++pending_;
+    pool.execute(GroupTask<typename std::decay<Fn>::type>(this, std::forward<Fn>(fn)));
+}
+
+// Blocks until every task run so far finished (or was dropped). Then, if one threw,
+// rethrows its exception, which also resets the group for reuse.
+inline
+void TaskGroup::wait()
+{
+    waitActually();
+
+    if (failed_)
+    {
+        std::exception_ptr exception = exception_;
+        exception_ = nullptr;
+        failed_ = false;
+        std::rethrow_exception(exception);
+    }
+}
+
+// Whether a task has thrown (since the last wait() rethrew)
+inline
+bool TaskGroup::hasFailed() const
+{
+    return failed_;
+}
+
+inline
+void TaskGroup::waitActually()
+{
+    std::unique_lock<std::mutex> ul(lock_);
+    while (pending_ != 0)
+        done_.wait(ul);
+}
+
+// The last task to finish takes lock_ before decrementing pending_ to 0, so wait() can't
+// see it done (and the group be destroyed) until that task is done touching the group
+inline
+void TaskGroup::finish(std::exception_ptr exception)
+{
+    if (exception && !failed_.exchange(true))
+        exception_ = exception;
+
+    std::size_t pending = pending_.load();
+    while (pending > 1)
+        if (pending_.compare_exchange_weak(pending, pending - 1))
+            return;
+
+    std::lock_guard<std::mutex> lg(lock_);
+    if (--pending_ == 0)
+        done_.notify_all();
+}
+
+template <class Fn>
+void TaskGroup::GroupTask<Fn>::operator()()
+{
+    TaskGroup* group = group_;
+    group_ = nullptr;
+
+    std::exception_ptr exception;
+    if (!group->failed_)
+    {
+        try
+        {
+            fn_();
+        }
+        catch (...)
+        {
+            exception = std::current_exception();
+        }
+    }
+    group->finish(exception);
+}
+
+#endif /* TASK_GROUP_H_ */
@@ -2,15 +2,31 @@
 #define THREAD_POOL_H_
 
 #include <vector>
-#include <queue>
 #include <future>
 #include <mutex>
 #include <condition_variable>
 #include <algorithm>
 #include <utility>
 #include <type_traits>
+#include <atomic>
+#include <memory>
+#include <thread>
+#include <chrono>
+#include <deque>
+#include <functional>
+#include <exception>
+#include <cstdint>
 
 #include "Task.h"
+#include "Function.h"
+#include "Slab.h"
+#include "MPMCQueue.h"
+#include "WorkStealingDeque.h"
+#include "TimerWheel.h"
+#include "Affinity.h"
+#include "CacheAligned.h"
+#include "Metrics.h"
+#include "Policies.h"
 
 /**
  * Copyright (c) 2015 by Michael Wang
@@ -33,31 +49,542 @@
  * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
  * THE SOFTWARE.
  */
-template <class FunctionType, class... Args>
-class ThreadPool
+
+// What submit() does when a bounded queue (see ThreadPoolOptions::queueCapacity) is full
+enum class Backpressure
+{
+    Block,          // Wait until a thread takes a task off the queue
+    SpinThenBlock,  // Retry for a while (yielding in between) before waiting
+    Reject          // Don't enqueue the task; submit() returns an invalid future
+};
+
+// Scheduling bands for submitWithPriority(). A queued task only waits behind the tasks
+// queued before it in its own band and the tasks in higher bands.
+enum class Priority
+{
+    High,           // E.g. latency-critical requests
+    Normal,         // What submit() uses
+    Low             // E.g. background maintenance
+};
+
+// What a thread with nothing to do does before it blocks (until a task is submitted).
+// Spinning saves the submitter a wake-up call, and the thread the time to wake up,
+// at the cost of burning a core: best left to pools on dedicated cores.
+enum class IdlePolicy
+{
+    Block,          // Block right away
+    Spin,           // Poll for tasks idleSpins times (pausing in between) first
+    SpinThenYield   // Same, then poll idleSpins more times, yielding the CPU in between
+};
+
+template <class TaskType, class Policy = PoolPolicy<>>
+class BasicThreadPool;
+
+// Lets queued tasks be skipped (see submitCancellable()): once cancel() is called, the
+// tasks submitted with this token (or a copy of it) that haven't started yet are
+// destroyed instead of run, breaking their promises. Tasks already running aren't
+// interrupted, but can poll isCancelled(). Copies share the same state.
+class CancellationToken
+{
+private:
+    template <class TaskType, class Policy>
+    friend class BasicThreadPool;
+
+    std::shared_ptr<std::atomic<bool>> cancelled_;
+public:
+    CancellationToken() : cancelled_(std::make_shared<std::atomic<bool>>(false)) {}
+
+    void cancel() { cancelled_->store(true, std::memory_order_release); }
+    bool isCancelled() const { return cancelled_->load(std::memory_order_acquire); }
+};
+
+// Identifies a timer (see executeAfter() and scheduleEvery()), to cancel it with
+// cancelTimer(). Default constructed, or once its timer has fired (or been cancelled),
+// it identifies none: slots are reused, but a handle only matches its own timer.
+class TimerHandle
+{
+private:
+    template <class TaskType, class Policy>
+    friend class BasicThreadPool;
+
+    std::uint32_t index_;                   // The timer's slot + 1 (0 if none)
+    std::uint32_t generation_;
+public:
+    TimerHandle() : index_(0), generation_(0) {}
+
+    bool valid() const { return index_ != 0; }
+};
+
+// Construction-time settings for a ThreadPool. The defaults match ThreadPool(numThreads).
+struct ThreadPoolOptions
+{
+    bool waitOnDestroy;             // Call wait() on destruction
+    bool workStealing;              // Give each thread its own deque of tasks (see submit())
+    std::size_t preallocatedTasks;  // Task slots (and promise states) to allocate up front
+    std::size_t queueCapacity;      // If nonzero, use a lock-free queue of (at most) this many tasks
+    Backpressure backpressure;      // What to do when that queue is full
+    std::vector<int> cpuAffinity;   // If not empty, pin thread i to CPU cpuAffinity[i % size]
+    std::vector<std::vector<int>> numaNodes;    // If not empty, the CPUs of each node (see submitOnNode())
+    IdlePolicy idlePolicy;          // What idle threads do before blocking
+    unsigned idleSpins;             // How long they do it, in polls
+    int maxThreads;                 // The most threads resize() can start (0: the initial amount)
+    bool elastic;                   // Add threads under load, and retire idle ones (see resize())
+    int minThreads;                 // The fewest threads an elastic pool retires down to
+    std::chrono::milliseconds idleTimeout;  // How long a thread of an elastic pool idles before retiring
+    bool lifoSlot;                  // Run a task submitted by a task next, on the same thread (implies workStealing)
+    std::function<void(std::exception_ptr)> errorHandler;  // Given each exception a task lets escape (see taskErrors())
+    int blockingThreads;            // Extra threads that stand in for those blocked in a BlockingSection
+
+    explicit ThreadPoolOptions(bool wait = true)
+        : waitOnDestroy(wait)
+        , workStealing(false)
+        , preallocatedTasks(0)
+        , queueCapacity(0)
+        , backpressure(Backpressure::Block)
+        , idlePolicy(IdlePolicy::Block)
+        , idleSpins(2000)
+        , maxThreads(0)
+        , elastic(false)
+        , minThreads(1)
+        , idleTimeout(1000)
+        , lifoSlot(false)
+        , blockingThreads(0)
+    {}
+};
+
+// What a BlockingSection tells the pool whose thread it's on, whatever the pool's type
+class BlockingAware
+{
+private:
+    friend class BlockingSection;
+
+    virtual bool blockingStarted() = 0;
+    virtual void blockingFinished() = 0;
+protected:
+    ~BlockingAware() {}
+
+    // The pool of the current thread (outside a BlockingSection), if any
+    static BlockingAware*& current()
+    {
+        static thread_local BlockingAware* pool = nullptr;
+        return pool;
+    }
+};
+
+// Marks the rest of a task's scope as blocking (on I/O, a lock, another pool's future...):
+// meanwhile, the pool runs a compensating thread in the task's place, so that blocking
+// doesn't leave a core idle while tasks wait. The thread retires once the section ends
+// (after its current task). A pool compensates for up to ThreadPoolOptions::blockingThreads
+// threads at once; past that, or outside a pool's threads, or inside another section, a
+// section does nothing. Meant for waits that last well beyond starting a thread.
+class BlockingSection
+{
+private:
+    BlockingAware* pool_;                   // Null unless the pool compensates
+public:
+    BlockingSection()
+        : pool_(BlockingAware::current())
+    {
+        if (pool_)
+        {
+            BlockingAware::current() = nullptr;
+            if (!pool_->blockingStarted())
+            {
+                BlockingAware::current() = pool_;
+                pool_ = nullptr;
+            }
+        }
+    }
+
+    ~BlockingSection()
+    {
+        if (pool_)
+        {
+            pool_->blockingFinished();
+            BlockingAware::current() = pool_;
+        }
+    }
+
+    BlockingSection(const BlockingSection& other) = delete;
+    BlockingSection& operator=(const BlockingSection& other) = delete;
+};
+
+// The threads, queues and bookkeeping shared by ThreadPool and GenericThreadPool.
+// TaskType must be default constructible, movable, and have an execute() member.
+template <class TaskType, class Policy>
+class BasicThreadPool : private BlockingAware
 {
+protected:
+    typedef typename Policy::QueuePolicy Queue;
+    typedef typename Policy::MetricsPolicy Metrics;
+    typedef typename Policy::TracerPolicy Tracer;
+
+    // Tasks are constructed in place in nodes drawn from taskSlab_ (the stamps are empty
+    // unless THREADPOOL_METRICS and THREADPOOL_TRACING are defined). The task is skipped if
+    // cancelled is set.
+    struct TaskNode : Metrics::TaskStamp, Tracer::TaskStamp
+    {
+        TaskType task;
+        TaskNode* next;
+        std::shared_ptr<std::atomic<bool>> cancelled;
+
+        template <class... CtorArgs>
+        explicit TaskNode(CtorArgs&&... args) : task(std::forward<CtorArgs>(args)...), next(nullptr) {}
+    };
+private:
+    // A FIFO of TaskNodes linked through their next pointers, so that queueing
+    // never allocates
+    class TaskQueue
+    {
+    private:
+        TaskNode* head_;
+        TaskNode* tail_;
+    public:
+        TaskQueue() : head_(nullptr), tail_(nullptr) {}
+
+        bool empty() const { return head_ == nullptr; }
+
+        void push(TaskNode* node)
+        {
+            node->next = nullptr;
+            if (tail_)
+                tail_->next = node;
+            else
+                head_ = node;
+            tail_ = node;
+        }
+
+        TaskNode* pop()
+        {
+            TaskNode* node = head_;
+            head_ = node->next;
+            if (!head_)
+                tail_ = nullptr;
+            return node;
+        }
+
+        // Moves all of other's nodes to the back of this queue
+        void splice(TaskQueue& other)
+        {
+            if (other.empty())
+                return;
+            if (tail_)
+                tail_->next = other.head_;
+            else
+                head_ = other.head_;
+            tail_ = other.tail_;
+            other.head_ = other.tail_ = nullptr;
+        }
+    };
+protected:
+    // Tasks to be enqueued all at once (see enqueue(TaskBatch&)). Tasks that are
+    // still in the batch when it's destroyed are destroyed along with it.
+    class TaskBatch
+    {
+    private:
+        friend class BasicThreadPool;
+
+        BasicThreadPool& pool_;
+        TaskQueue tasks_;
+        std::size_t size_;
+    public:
+        explicit TaskBatch(BasicThreadPool& pool) : pool_(pool), size_(0) {}
+        ~TaskBatch() { while (!tasks_.empty()) pool_.destroyTask(tasks_.pop()); }
+
+        TaskBatch(const TaskBatch& other) = delete;
+        TaskBatch& operator=(const TaskBatch& other) = delete;
+
+        void push(TaskNode* node)
+        {
+            pool_.metrics_.stampQueued(*node);
+            pool_.tracer_.taskQueued(*node, pool_.traceThread());
+            tasks_.push(node);
+            ++size_;
+        }
+        std::size_t size() const { return size_; }
+    };
+private:
+    // The queue of one producer (see ProducerToken). Only the token's owner pushes, so the
+    // lane's lock is contended by the threads draining it at most, never by other producers.
+    // Lanes are only freed along with the pool; a released lane goes to the next token.
+    struct ProducerLane
+    {
+        std::mutex lock;
+        TaskQueue tasks;
+        std::atomic<int> size;          // Readable without lock
+        std::atomic<bool> inUse;        // Owned by a token
+        ProducerLane* next;             // Set before the lane is published, then never changes
+
+        ProducerLane() : size(0), inUse(true), next(nullptr) {}
+    };
+public:
+    // A producer's own lane into the pool (see producerToken()), for submitFrom() and
+    // executeFrom(). Movable, not copyable; must not outlive the pool, and must only be
+    // used by one thread at a time.
+    class ProducerToken
+    {
+    private:
+        friend class BasicThreadPool;
+
+        ProducerLane* lane_;
+
+        explicit ProducerToken(ProducerLane* lane) : lane_(lane) {}
+    public:
+        ProducerToken(ProducerToken&& other) : lane_(other.lane_) { other.lane_ = nullptr; }
+        ~ProducerToken() { if (lane_) lane_->inUse = false; }
+
+        ProducerToken(const ProducerToken& other) = delete;
+        ProducerToken& operator=(const ProducerToken& other) = delete;
+
+        bool valid() const { return lane_ != nullptr; }
+    };
 private:
-    static const int MAX_WAIT_TIME;         // Maximum time (in milliseconds) to sleep for in wait()
 
-    std::vector<std::thread> threads_;
-    std::queue<Task<FunctionType, Args...>> tasks_;
+    static const std::size_t STATE_BLOCK_SIZE = 80;     // Fits std::promise's state and result (for small result types)
+    static const int SPIN_COUNT = 64;                   // Attempts to push before blocking, for Backpressure::SpinThenBlock
+    static const int NUM_PRIORITIES = 3;
+    static const int MAX_LIFO_STREAK = 3;               // Tasks run in a row from a LIFO slot, before looking elsewhere
+    static const std::size_t CACHE_LINE_SIZE = 64;
+
+    static thread_local BasicThreadPool* currentPool_;  // The pool owning the calling thread, if any
+    static thread_local int currentId_;
+    static thread_local unsigned stealSeed_;
+
+    // What each thread (slot) writes often: one cache line each, so that threads don't
+    // invalidate each other's lines. activeThreads() adds up the active flags on demand.
+    struct Worker
+    {
+        std::atomic<bool> active;           // Running a task
+        std::atomic<TaskNode*> next;        // The LIFO slot (see ThreadPoolOptions::lifoSlot)
+        int lifoStreak;                     // Tasks run in a row from it
+        ProducerLane* laneCursor;           // The producer lane it last took a task from
+
+        Worker() : active(false), next(nullptr), lifoStreak(0), laneCursor(nullptr) {}
+    };
+
+    // Timers count time in ticks of TimerTick since timerEpoch_
+    typedef std::chrono::milliseconds TimerTick;
+
+    // A timer (see addTimer()). A one-shot timer holds its task, built when the timer was
+    // added; a periodic one builds each run's task with makeTask.
+    struct TimerSlot : TimerEntry
+    {
+        TaskNode* node;
+        UniqueFunction<TaskNode*()> makeTask;
+        std::uint64_t period;               // In ticks (0 if one-shot)
+        const std::uint32_t index;          // In timerSlots_
+        std::uint32_t generation;           // Bumped whenever the slot is freed
+        std::uint32_t nextFree;             // The next free slot's index + 1, while free
+
+        explicit TimerSlot(std::uint32_t i) : node(nullptr), period(0), index(i), generation(0), nextFree(0) {}
+    };
+
+    // The members are grouped by who writes them, with a cache line of padding in between:
+    // configuration (read-mostly), the lock and what it guards, the counters idle threads
+    // poll, the pending task count (written by every submission and task), the slab, and
+    // the timers.
+
+    std::vector<std::thread> threads_;     // One per slot, up to maxThreads (see resize())
+    std::vector<std::vector<int>> threadCpus_;  // The CPUs each slot's thread is pinned to, if any
+    std::atomic<int> targetThreads_;        // Threads of slots past this one retire
+    const int blockingSlots_;               // The last slots, past maxThreads(), for compensating threads
+    std::atomic<int> compensating_;         // How many of those should run (under resizeLock_ and lock_)
+    const bool elastic_;
+    const int minThreads_;
+    const std::chrono::milliseconds idleTimeout_;
+    std::shared_ptr<Slab> stateSlab_;       // Shared with the future of every submitted task
+    std::atomic<bool> isShutdown_;          // Only set under lock_, but read anywhere
+    bool waitOnDestroy_;
+    const IdlePolicy idlePolicy_;
+    const unsigned idleSpins_;
+    const std::function<void(std::exception_ptr)> errorHandler_;
+    CacheAlignedArray<Worker> workers_;     // workers_[id - 1] belongs to thread id
+
+    // Work stealing: each thread owns localTasks_[id - 1], and tasks_ only receives
+    // tasks submitted from outside the pool (or with a priority other than Normal).
+    // With LIFO slots, the task a thread's task submitted last waits in its slot instead,
+    // and runs next on that thread; a task it displaces goes to the deque. Other threads
+    // only take it when they find nothing else.
+    bool workStealing_;
+    const bool lifoSlot_;
+    std::vector<std::unique_ptr<WorkStealingDeque<TaskNode*>>> localTasks_;
+
+    // Bounded queue: if set, boundedTasks_ replaces tasks_[Normal], and submitters that
+    // find it full wait on spaceAvailable_ (according to backpressure_)
+    std::unique_ptr<MPMCQueue<TaskNode*>> boundedTasks_;
+    Backpressure backpressure_;
+
+    // NUMA nodes: the threads are split into contiguous groups, one per node, each pinned
+    // to its node's CPUs; nodeTasks_[n] holds the tasks submitted to node n (under lock_)
+    std::vector<int> threadNodes_;          // The node of thread id is threadNodes_[id - 1]
+    std::vector<TaskQueue> nodeTasks_;
+
+    char pad0_[CACHE_LINE_SIZE];
     std::mutex lock_;
+    TaskQueue tasks_[NUM_PRIORITIES];       // One FIFO per Priority, highest first
+    std::vector<char> threadRunning_;       // Whether a slot's thread runs (or will), under lock_
     std::condition_variable taskAvailable_;
-    int activeThreads_;
-    bool isShutdown_, isForced_, waitOnDestroy_;
-    
+    std::condition_variable tasksDone_;     // Notified when the pool may have become idle (see wait())
+    std::condition_variable spaceAvailable_;
+    std::mutex resizeLock_;                 // Serializes starting, joining and detaching threads
+
+    char pad1_[CACHE_LINE_SIZE];
+    std::atomic<int> queuedTasks_[NUM_PRIORITIES];  // The sizes of tasks_, readable without lock_
+    std::atomic<int> localTaskCount_;       // Including the tasks in LIFO slots
+    std::atomic<int> boundedTaskCount_;
+    std::atomic<int> nodeTaskCount_;
+    std::atomic<int> blockedSubmitters_;    // Waiting for room in the bounded queue
+
+    // Threads blocked on taskAvailable_ (incremented with lock_ held): if there are none,
+    // submitting a task doesn't notify it. Spinning threads aren't counted.
+    std::atomic<int> idleThreads_;
+
+    // Producer lanes: a list that only grows at its head, drained round-robin, each thread
+    // starting after the lane it last took a task from (its Worker's laneCursor)
+    std::atomic<ProducerLane*> lanes_;
+    std::atomic<int> laneTaskCount_;
+
+    char pad2_[CACHE_LINE_SIZE];
+    std::atomic<int> pendingTasks_;         // Tasks submitted but not yet completed
+
+    char pad3_[CACHE_LINE_SIZE];
+    Slab taskSlab_;
+    Metrics metrics_;
+    Tracer tracer_;
+    std::atomic<std::uint64_t> taskErrors_;
+
+    // Timers: every slot, scheduled or free, is in timerSlots_ (whose elements never
+    // move), and the scheduled ones are in timerWheel_, all under timerLock_. nextTimer_
+    // is when the wheel next needs advancing: idle threads take turns sleeping until then
+    // (one at a time, the timekeeper), and busy ones check it between tasks.
+    char pad4_[CACHE_LINE_SIZE];
+    mutable std::mutex timerLock_;
+    TimerWheel timerWheel_;
+    std::deque<TimerSlot> timerSlots_;
+    std::uint32_t freeTimers_;              // The first free slot's index + 1 (0 if none)
+    std::size_t firingTimers_;              // Taken out of the wheel by fireTimers(), not enqueued yet
+    const std::chrono::steady_clock::time_point timerEpoch_;   // Tick 0
+    std::atomic<std::uint64_t> nextTimer_;  // timerWheel_.nextExpiry(), readable without timerLock_
+    bool timekeeper_;                       // Whether an idle thread sleeps until nextTimer_ (under lock_)
+
+    bool usesStealing() const;
+    bool usesLifoSlot() const;
+    bool usesBoundedQueue() const;
+    int traceThread() const;
     void doWork(int id);
+    bool pushTask(TaskNode* node, Backpressure backpressure, Priority priority, int numaNode,
+                  ProducerToken* token);
+    void pushBatch(TaskBatch& batch);
+    void startThread(int slot);
+    void resizeActually(int numThreads);
+    void growIfBusy();
+    bool retire(int id);
+    bool isRetiring(int id) const;
+    bool blockingStarted() override;
+    void blockingFinished() override;
+    void waitIdle(std::unique_lock<std::mutex>& ul, int id);
+    bool findTask(int id, TaskNode*& node);
+    bool popSharedTask(Priority lowest, TaskNode*& node);
+    bool popLocalTask(WorkStealingDeque<TaskNode*>& deque, bool steal, TaskNode*& node);
+    bool popNextTask(int slot, bool steal, TaskNode*& node);
+    bool popBoundedTask(TaskNode*& node);
+    bool popNodeTask(int home, bool remote, TaskNode*& node);
+    bool popLaneTask(int id, TaskNode*& node);
+    bool pushBoundedTask(TaskNode* node, Backpressure backpressure);
+    bool hasQueuedTask() const;
+    TaskNode* popQueuedTask(Priority lowest);
+    void notifyTaskAvailable(std::size_t count);
+    void wakeThreads(std::size_t count);
+    void waitForTask(int id);
+    bool spinForTask() const;
+    bool mightHaveTask() const;
+    static void cpuRelax();
+    void runTask(TaskNode* node);
+    void taskFailed(std::exception_ptr exception) noexcept;
+    void destroyTask(TaskNode* node);
+    void finishTask();
+    void setActive(bool active);
+    bool isIdle() const;
+    void takeQueuedTasks(TaskQueue& taken);
+    TimerHandle addTimerActually(TaskNode* node, UniqueFunction<TaskNode*()>&& makeTask,
+                                 std::uint64_t due, std::uint64_t period);
+    void freeTimer(TimerSlot& timer);
+    void fireTimers();
+    void clearTimers();
+    std::uint64_t currentTick() const;
+protected:
+    static const int ANY_NODE = -1;         // For enqueue(): not bound to a NUMA node
+
+    BasicThreadPool(int numThreads, const ThreadPoolOptions& options);
+    ~BasicThreadPool();
+
+    BasicThreadPool(const BasicThreadPool& other) = delete;
+    BasicThreadPool& operator=(const BasicThreadPool& other) = delete;
+
+    template <class... CtorArgs>
+    TaskNode* newTask(CtorArgs&&... args);
+    bool enqueue(TaskNode* node);
+    bool enqueue(TaskNode* node, Backpressure backpressure, Priority priority = Priority::Normal,
+                 int numaNode = ANY_NODE, ProducerToken* token = nullptr);
+    void enqueue(TaskBatch& batch);
+    void makeCancellable(TaskNode* node, const CancellationToken& token);
+
+    template <class Rep, class Period>
+    static std::uint64_t toTicks(const std::chrono::duration<Rep, Period>& d);
+    template <class Rep, class Period>
+    std::uint64_t tickAfter(const std::chrono::duration<Rep, Period>& delay) const;
+    template <class Clock, class Duration>
+    std::uint64_t tickAt(const std::chrono::time_point<Clock, Duration>& time) const;
+    TimerHandle addTimer(TaskNode* node, std::uint64_t due);
+    TimerHandle addTimer(UniqueFunction<TaskNode*()>&& makeTask, std::uint64_t due, std::uint64_t period);
+
+    SlabAllocator<char> stateAllocator() const;
 public:
-    ThreadPool(int numThreads, bool waitOnDestroy = true);
-    ~ThreadPool();
-    
     int activeThreads() const;
     int threadCount() const;
+    int pendingTasks() const;
+    int maxThreads() const;
+    int nodeCount() const;
+    std::size_t queueCapacity() const;
+    Backpressure backpressure() const;
     bool isShutdown() const;
     bool isTerminated() const;
+    std::size_t heapAllocations() const;
+    std::uint64_t taskErrors() const;
+    ThreadPoolStats stats() const;
+    void startTracing(std::size_t eventsPerThread = 65536);
+    void stopTracing();
+    void writeTrace(std::ostream& out) const;
+
+    ProducerToken producerToken();
+    bool cancelTimer(const TimerHandle& handle);
+    std::size_t timerCount() const;
     
+    void resize(int numThreads);
     void shutdown(bool force = false);
+    std::size_t shutdownNow();
     void wait();
+
+    template <class Rep, class Period>
+    bool waitFor(const std::chrono::duration<Rep, Period>& timeout);
+
+    template <class Clock, class Duration>
+    bool waitUntil(const std::chrono::time_point<Clock, Duration>& deadline);
+};
+
+// A pool of tasks of one function type, with the compile-time choices of Policy (a
+// PoolPolicy); ThreadPool is the one with the default policies
+template <class Policy, class FunctionType, class... Args>
+class PolicyThreadPool : public BasicThreadPool<Task<FunctionType, Args...>, Policy>
+{
+private:
+    typedef Task<FunctionType, Args...> TaskType;
+    typedef typename BasicThreadPool<TaskType, Policy>::TaskNode TaskNode;
+public:
+    typedef typename BasicThreadPool<TaskType, Policy>::ProducerToken ProducerToken;
+
+    PolicyThreadPool(int numThreads, bool waitOnDestroy = true);
+    PolicyThreadPool(int numThreads, const ThreadPoolOptions& options);
     
     template <class Fn, class... DeducedArgs>
     void execute(Fn&& fn, DeducedArgs&&... args);
@@ -65,146 +592,1957 @@ public:
     template <class Fn, class... DeducedArgs>
     std::future<typename std::result_of<Fn(Args...)>::type>
     submit(Fn&& fn, DeducedArgs&&... args);
+
+    template <class Fn, class... DeducedArgs>
+    std::future<typename std::result_of<Fn(Args...)>::type>
+    trySubmit(Fn&& fn, DeducedArgs&&... args);
+
+    template <class Fn, class... DeducedArgs>
+    std::future<typename std::result_of<Fn(Args...)>::type>
+    submitWithPriority(Priority priority, Fn&& fn, DeducedArgs&&... args);
+
+    template <class Fn, class... DeducedArgs>
+    std::future<typename std::result_of<Fn(Args...)>::type>
+    submitOnNode(int numaNode, Fn&& fn, DeducedArgs&&... args);
+
+    template <class Fn, class... DeducedArgs>
+    void executeCancellable(const CancellationToken& token, Fn&& fn, DeducedArgs&&... args);
+
+    template <class Fn, class... DeducedArgs>
+    std::future<typename std::result_of<Fn(Args...)>::type>
+    submitCancellable(const CancellationToken& token, Fn&& fn, DeducedArgs&&... args);
+
+    template <class Fn, class... DeducedArgs>
+    void executeFrom(ProducerToken& token, Fn&& fn, DeducedArgs&&... args);
+
+    template <class Fn, class... DeducedArgs>
+    std::future<typename std::result_of<Fn(Args...)>::type>
+    submitFrom(ProducerToken& token, Fn&& fn, DeducedArgs&&... args);
+
+    template <class Rep, class Period, class Fn, class... DeducedArgs>
+    TimerHandle executeAfter(const std::chrono::duration<Rep, Period>& delay, Fn&& fn, DeducedArgs&&... args);
+
+    template <class Clock, class Duration, class Fn, class... DeducedArgs>
+    TimerHandle executeAt(const std::chrono::time_point<Clock, Duration>& time, Fn&& fn, DeducedArgs&&... args);
+
+    template <class Rep, class Period, class Fn, class... DeducedArgs>
+    std::future<typename std::result_of<Fn(Args...)>::type>
+    submitAfter(const std::chrono::duration<Rep, Period>& delay, Fn&& fn, DeducedArgs&&... args);
+
+    template <class Clock, class Duration, class Fn, class... DeducedArgs>
+    std::future<typename std::result_of<Fn(Args...)>::type>
+    submitAt(const std::chrono::time_point<Clock, Duration>& time, Fn&& fn, DeducedArgs&&... args);
+
+    template <class Rep, class Period, class Fn, class... DeducedArgs>
+    TimerHandle scheduleEvery(const std::chrono::duration<Rep, Period>& period, Fn&& fn, DeducedArgs&&... args);
+
+    template <class InputIt, class Fn>
+    void executeBatch(InputIt first, InputIt last, Fn fn);
+
+    template <class InputIt, class Fn>
+    std::vector<std::future<typename std::result_of<Fn(Args...)>::type>>
+    submitBatch(InputIt first, InputIt last, Fn fn);
+private:
+    typedef typename BasicThreadPool<TaskType, Policy>::TaskBatch TaskBatch;
+
+    // Builds each run's task for scheduleEvery(), from its own copies of fn and args
+    template <class Fn>
+    struct RepeatingTask
+    {
+        PolicyThreadPool* pool;
+        Fn fn;
+        std::tuple<Args...> args;
+
+        TaskNode* operator()() { return pool->newDiscardingTask(fn, args, typename IndexSequence<sizeof...(Args)>::seq()); }
+    };
+
+    template <class Fn, class... DeducedArgs>
+    TimerHandle executeAtTick(std::uint64_t due, Fn&& fn, DeducedArgs&&... args);
+
+    template <class Fn, class... DeducedArgs>
+    std::future<typename std::result_of<Fn(Args...)>::type>
+    submitAtTick(std::uint64_t due, Fn&& fn, DeducedArgs&&... args);
+
+    template <class Fn, class... DeducedArgs>
+    void executeActually(Backpressure backpressure, ProducerToken* token, const CancellationToken* cancellation,
+                         Fn&& fn, DeducedArgs&&... args);
+
+    template <class Fn, class... DeducedArgs>
+    std::future<typename std::result_of<Fn(Args...)>::type>
+    submitActually(Backpressure backpressure, Priority priority, int numaNode, ProducerToken* token,
+                   const CancellationToken* cancellation, Fn&& fn, DeducedArgs&&... args);
+
+    template <class Fn, int... Nums>
+    TaskNode* newBatchTask(Fn& fn, std::tuple<Args...>& args, Sequence<Nums...>);
+
+    template <class Fn, int... Nums>
+    TaskNode* newDiscardingTask(Fn& fn, std::tuple<Args...>& args, Sequence<Nums...>);
 };
 
 template <class FunctionType, class... Args>
-const int ThreadPool<FunctionType, Args...>::MAX_WAIT_TIME = 50;
+class ThreadPool : public PolicyThreadPool<PoolPolicy<>, FunctionType, Args...>
+{
+public:
+    ThreadPool(int numThreads, bool waitOnDestroy = true)
+        : PolicyThreadPool<PoolPolicy<>, FunctionType, Args...>(numThreads, waitOnDestroy)
+    {}
 
-// Constructs a ThreadPool with the specified amount of threads (must be nonnegative).
-// If waitOnDestroy is true, the ThreadPool will call wait() on destruction; otherwise, it will not.
-template <class FunctionType, class... Args>
-ThreadPool<FunctionType, Args...>::ThreadPool(int numThreads, bool waitOnDestroy)
-    : threads_(numThreads)
-    , activeThreads_(0)
+    ThreadPool(int numThreads, const ThreadPoolOptions& options)
+        : PolicyThreadPool<PoolPolicy<>, FunctionType, Args...>(numThreads, options)
+    {}
+};
+
+template <class TaskType, class Policy>
+thread_local BasicThreadPool<TaskType, Policy>* BasicThreadPool<TaskType, Policy>::currentPool_ = nullptr;
+
+template <class TaskType, class Policy>
+thread_local int BasicThreadPool<TaskType, Policy>::currentId_ = 0;
+
+template <class TaskType, class Policy>
+thread_local unsigned BasicThreadPool<TaskType, Policy>::stealSeed_ = 0;
+
+template <class TaskType, class Policy>
+BasicThreadPool<TaskType, Policy>::BasicThreadPool(int numThreads, const ThreadPoolOptions& options)
+    : threads_(std::max(numThreads, options.maxThreads) + options.blockingThreads)
+    , threadCpus_(threads_.size())
+    , targetThreads_(numThreads)
+    , blockingSlots_(options.blockingThreads)
+    , compensating_(0)
+    , elastic_(options.elastic)
+    , minThreads_(options.minThreads)
+    , idleTimeout_(options.idleTimeout)
+    , stateSlab_(new Slab(STATE_BLOCK_SIZE))
     , isShutdown_(false)
-    , isForced_(false)
-    , waitOnDestroy_(waitOnDestroy)
+    , waitOnDestroy_(options.waitOnDestroy)
+    , idlePolicy_(options.idlePolicy)
+    , idleSpins_(options.idleSpins)
+    , errorHandler_(options.errorHandler)
+    , workers_(threads_.size())
+    , workStealing_(Queue::workStealing(options.workStealing || options.lifoSlot))
+    , lifoSlot_(Queue::lifoSlot(options.lifoSlot))
+    , backpressure_(options.backpressure)
+    , threadRunning_(threads_.size(), 0)
+    , localTaskCount_(0)
+    , boundedTaskCount_(0)
+    , nodeTaskCount_(0)
+    , blockedSubmitters_(0)
+    , idleThreads_(0)
+    , lanes_(nullptr)
+    , laneTaskCount_(0)
+    , pendingTasks_(0)
+    , taskSlab_(sizeof(TaskNode))
+    , metrics_(threads_.size())
+    , tracer_(threads_.size())
+    , taskErrors_(0)
+    , freeTimers_(0)
+    , firingTimers_(0)
+    , timerEpoch_(std::chrono::steady_clock::now())
+    , nextTimer_(TimerWheel::NEVER)
+    , timekeeper_(false)
+{
+    // Each task needs one block for its promise's shared state, and one for the result
+    taskSlab_.reserve(options.preallocatedTasks);
+    stateSlab_->reserve(2 * options.preallocatedTasks);
+
+    for (int i = 0; i != NUM_PRIORITIES; ++i)
+        queuedTasks_[i].store(0, std::memory_order_relaxed);
+
+    if (usesStealing())
+        for (std::size_t i = 0; i != threads_.size(); ++i)
+            localTasks_.emplace_back(new WorkStealingDeque<TaskNode*>());
+    if (Queue::bounded(options.queueCapacity != 0))
+    {
+        std::size_t capacity = options.queueCapacity;
+        if (capacity == 0)
+            capacity = BoundedQueue::DEFAULT_CAPACITY;
+        boundedTasks_.reset(new MPMCQueue<TaskNode*>(capacity));
+    }
+    if (!options.numaNodes.empty())
+    {
+        nodeTasks_.resize(options.numaNodes.size());
+        for (std::size_t i = 0; i != threads_.size(); ++i)
+            threadNodes_.push_back(static_cast<int>(i * nodeTasks_.size() / threads_.size()));
+    }
+
+    for (std::size_t i = 0; i != threads_.size(); ++i)
+        if (!threadNodes_.empty())
+            threadCpus_[i] = options.numaNodes[threadNodes_[i]];
+        else if (!options.cpuAffinity.empty())
+            threadCpus_[i].push_back(options.cpuAffinity[i % options.cpuAffinity.size()]);
+
+    for (int i = 0; i != numThreads; ++i)
+    {
+        threadRunning_[i] = 1;
+        startThread(i);
+    }
+}
+
+// Pinning is only a hint: if it fails, the thread runs wherever the OS puts it
+template <class TaskType, class Policy>
+void BasicThreadPool<TaskType, Policy>::startThread(int slot)
 {
-    for (int i = 0; i != threads_.size(); ++i)
-        threads_[i] = std::move(std::thread(&ThreadPool::doWork, this, i + 1));
+    threads_[slot] = std::thread(&BasicThreadPool::doWork, this, slot + 1);
+    if (!threadCpus_[slot].empty())
+        setThreadAffinity(threads_[slot], threadCpus_[slot]);
 }
 
 // Join all uncompleted threads if this ThreadPool hasn't been forcefully shut down
-template <class FunctionType, class... Args>
-ThreadPool<FunctionType, Args...>::~ThreadPool()
+template <class TaskType, class Policy>
+BasicThreadPool<TaskType, Policy>::~BasicThreadPool()
 {
     if (waitOnDestroy_)
         wait();
     if (!isShutdown_)
         shutdown(false);
 
-    if (!isForced_)
-        for (int i = 0; i != threads_.size(); ++i)
+    // Once a compensating thread that was starting has started, no other will
+    {
+        std::lock_guard<std::mutex> rg(resizeLock_);
+    }
+
+    // (Detached threads aren't joinable)
+    for (std::size_t i = 0; i != threads_.size(); ++i)
+        if (threads_[i].joinable())
             threads_[i].join();
+
+    clearTimers();
+
+    // Tasks that never ran get destroyed (breaking their promises)
+    for (int i = 0; i != NUM_PRIORITIES; ++i)
+        while (!tasks_[i].empty())
+            destroyTask(tasks_[i].pop());
+    for (std::size_t i = 0; i != nodeTasks_.size(); ++i)
+        while (!nodeTasks_[i].empty())
+            destroyTask(nodeTasks_[i].pop());
+
+    TaskNode* node;
+    for (std::size_t i = 0; i != localTasks_.size(); ++i)
+        while (localTasks_[i]->pop(node))
+            destroyTask(node);
+    if (usesLifoSlot())
+        for (std::size_t i = 0; i != workers_.size(); ++i)
+            if ((node = workers_[i].next.exchange(nullptr)))
+                destroyTask(node);
+    if (usesBoundedQueue())
+        while (boundedTasks_->tryPop(node))
+            destroyTask(node);
+
+    for (ProducerLane* lane = lanes_; lane; )
+    {
+        while (!lane->tasks.empty())
+            destroyTask(lane->tasks.pop());
+        ProducerLane* next = lane->next;
+        delete lane;
+        lane = next;
+    }
 }
 
-template <class FunctionType, class... Args>
+template <class TaskType, class Policy>
 inline
-int ThreadPool<FunctionType, Args...>::activeThreads() const { return activeThreads_; }
+int BasicThreadPool<TaskType, Policy>::activeThreads() const
+{
+    int active = 0;
+    for (std::size_t i = 0; i != workers_.size(); ++i)
+        active += workers_[i].active ? 1 : 0;
+    return active;
+}
 
-template <class FunctionType, class... Args>
+template <class TaskType, class Policy>
 inline
-int ThreadPool<FunctionType, Args...>::threadCount() const { return threads_.size(); }
+int BasicThreadPool<TaskType, Policy>::threadCount() const { return targetThreads_; }
 
-template <class FunctionType, class... Args>
+// Tasks submitted but not finished yet, queued or running (timers only count once due)
+template <class TaskType, class Policy>
 inline
-bool ThreadPool<FunctionType, Args...>::isShutdown() const { return isShutdown_; }
+int BasicThreadPool<TaskType, Policy>::pendingTasks() const { return pendingTasks_; }
 
-template <class FunctionType, class... Args>
+template <class TaskType, class Policy>
 inline
-bool ThreadPool<FunctionType, Args...>::isTerminated() const { return isShutdown_ && activeThreads_ == 0; }
+int BasicThreadPool<TaskType, Policy>::maxThreads() const { return threads_.size() - blockingSlots_; }
 
-template <class FunctionType, class... Args>
-template <class Fn, class... DeducedArgs>
+// 1 if the pool isn't NUMA-aware
+template <class TaskType, class Policy>
 inline
-void ThreadPool<FunctionType, Args...>::execute(Fn&& fn, DeducedArgs&&... args)
-{
-    submit(std::forward<Fn>(fn), std::forward<Args>(args)...);
-}
+int BasicThreadPool<TaskType, Policy>::nodeCount() const { return nodeTasks_.empty() ? 1 : nodeTasks_.size(); }
 
-// DeducedArgs must have the same (decayed) type as Args; its purpose is to force
-// deduction of template arguments, because Args, if used, would be already specified.
-template <class FunctionType, class... Args>
-template <class Fn, class... DeducedArgs>
-std::future<typename std::result_of<Fn(Args...)>::type>
-ThreadPool<FunctionType, Args...>::submit(Fn&& fn, DeducedArgs&&... args)
+// What the queue policy makes of the options (constants, unless it's AnyQueue)
+template <class TaskType, class Policy>
+inline
+bool BasicThreadPool<TaskType, Policy>::usesStealing() const { return Queue::workStealing(workStealing_); }
+
+template <class TaskType, class Policy>
+inline
+bool BasicThreadPool<TaskType, Policy>::usesLifoSlot() const { return Queue::lifoSlot(lifoSlot_); }
+
+template <class TaskType, class Policy>
+inline
+bool BasicThreadPool<TaskType, Policy>::usesBoundedQueue() const { return Queue::bounded(boundedTasks_ != nullptr); }
+
+// The tracer's thread: this pool's thread ID, or 0 outside the pool
+template <class TaskType, class Policy>
+inline
+int BasicThreadPool<TaskType, Policy>::traceThread() const { return currentPool_ == this ? currentId_ : 0; }
+
+// 0 if the queue is unbounded
+template <class TaskType, class Policy>
+inline
+std::size_t BasicThreadPool<TaskType, Policy>::queueCapacity() const
 {
-    using retType = typename std::result_of<Fn(Args...)>::type;
+    return usesBoundedQueue() ? boundedTasks_->capacity() : 0;
+}
 
-    if (isShutdown_)
-        return std::future<retType>();
+template <class TaskType, class Policy>
+inline
+Backpressure BasicThreadPool<TaskType, Policy>::backpressure() const { return backpressure_; }
 
-    Task<FunctionType, Args...> task(std::forward<Fn>(fn), std::forward<Args>(args)...);
-    std::future<retType> fut = std::move(task.getFuture());
+// Both can be polled from any thread, often: neither takes lock_. Once isShutdown()
+// returns true, so does every later call, and what the thread that called shutdown() did
+// before is visible to the caller.
+template <class TaskType, class Policy>
+inline
+bool BasicThreadPool<TaskType, Policy>::isShutdown() const { return isShutdown_.load(std::memory_order_acquire); }
 
-    std::unique_lock<std::mutex> ul(lock_);
-    tasks_.push(std::move(task));
-    ul.unlock();
+template <class TaskType, class Policy>
+inline
+bool BasicThreadPool<TaskType, Policy>::isTerminated() const { return isShutdown() && activeThreads() == 0; }
 
-    taskAvailable_.notify_one();
-    
-    return std::move(fut);
+// How many times this pool has had to allocate memory on the heap for tasks: to grow
+// its slabs, for promise states too big for a slab block, and for callables too big to
+// store inline. Once the slabs have grown to fit the pool's workload, submitting
+// a (small enough) task doesn't increase it.
+template <class TaskType, class Policy>
+inline
+std::size_t BasicThreadPool<TaskType, Policy>::heapAllocations() const
+{
+    return taskSlab_.heapAllocations() + stateSlab_->heapAllocations();
 }
 
-// Signal to threads that they should finish what they're doing. If force == true,
-// all threads in this ThreadPool will be detached (and can be safely destructed).
-// (This does not block the calling thread)
-template <class FunctionType, class... Args>
-void ThreadPool<FunctionType, Args...>::shutdown(bool force)
+// The exceptions tasks let escape so far (each also given to the error handler, if
+// any). A task with a future never does: its exception goes to the future.
+template <class TaskType, class Policy>
+inline
+std::uint64_t BasicThreadPool<TaskType, Policy>::taskErrors() const
 {
-    if (isShutdown_)
-        return;
+    return taskErrors_.load(std::memory_order_relaxed);
+}
 
-    isForced_ = force;
-    isShutdown_ = true;
+// Only collected if THREADPOOL_METRICS is defined (ThreadPoolStats::enabled tells);
+// otherwise, recording metrics costs nothing, and every metric is zero
+template <class TaskType, class Policy>
+ThreadPoolStats BasicThreadPool<TaskType, Policy>::stats() const
+{
+    ThreadPoolStats stats;
+    metrics_.snapshot(stats);
+    return stats;
+}
 
-    taskAvailable_.notify_all();
+// Only traced if THREADPOOL_TRACING is defined (or the policy's tracer is RingTracer);
+// otherwise, these do nothing and the trace is empty. With tracing stopped, each event
+// costs the pool a single branch. Each thread keeps its latest eventsPerThread events (a
+// task takes two or three), which are only allocated by the first call.
+template <class TaskType, class Policy>
+void BasicThreadPool<TaskType, Policy>::startTracing(std::size_t eventsPerThread)
+{
+    tracer_.start(eventsPerThread);
+}
 
-    if (force)
-        for (int i = 0; i != threads_.size(); ++i)
-            threads_[i].detach();
+template <class TaskType, class Policy>
+void BasicThreadPool<TaskType, Policy>::stopTracing()
+{
+    tracer_.stop();
 }
 
-// Wait for all tasks (enqueued and currently running) to complete. This function,
-// as opposed to shutdown(), *does* block the calling thread by polling until the
-// task queue is empty.
-// That is, after wait() returns, activeThreads() == 0.
-template <class FunctionType, class... Args>
-void ThreadPool<FunctionType, Args...>::wait()
+// As Chrome trace JSON (see RingTracer::write), best written once tracing is stopped
+// and the pool idle
+template <class TaskType, class Policy>
+void BasicThreadPool<TaskType, Policy>::writeTrace(std::ostream& out) const
 {
-    const int multiplier = 2;
-    int waitTime = 1;
+    tracer_.write(out);
+}
 
-    while (activeThreads_ != 0 || !tasks_.empty())
+// Hands out a lane of this pool's own to the calling producer: tasks submitted through
+// the token skip the shared queue's lock, so producers with tokens never wait for each
+// other. Reuses the lane of a token destroyed earlier, if any (its remaining tasks
+// still run, in order).
+template <class TaskType, class Policy>
+typename BasicThreadPool<TaskType, Policy>::ProducerToken BasicThreadPool<TaskType, Policy>::producerToken()
+{
+    ProducerLane* head = lanes_;
+    for (ProducerLane* lane = head; lane; lane = lane->next)
     {
-        std::this_thread::sleep_for(std::chrono::milliseconds(waitTime));
-        waitTime = std::min(MAX_WAIT_TIME, multiplier * waitTime);
+        bool inUse = false;
+        if (!lane->inUse && lane->inUse.compare_exchange_strong(inUse, true))
+            return ProducerToken(lane);
     }
+
+    ProducerLane* lane = new ProducerLane();
+    lane->next = head;
+    while (!lanes_.compare_exchange_weak(lane->next, lane))
+        ;
+    return ProducerToken(lane);
 }
 
-template <class FunctionType, class... Args>
-void ThreadPool<FunctionType, Args...>::doWork(int)
+template <class TaskType, class Policy>
+inline
+SlabAllocator<char> BasicThreadPool<TaskType, Policy>::stateAllocator() const
 {
-    // Dequeue tasks until the thread pool is shutdown
-    while (!isShutdown_)
-    {
-        Task<FunctionType, Args...> task;
-        {
-            std::unique_lock<std::mutex> ul(lock_);
+    return SlabAllocator<char>(stateSlab_);
+}
 
-            while (tasks_.empty() && !isShutdown_)
-                taskAvailable_.wait(ul);
-            if (isShutdown_)
+// Constructs a task (with the specified constructor arguments) in a node from taskSlab_
+template <class TaskType, class Policy>
+template <class... CtorArgs>
+typename BasicThreadPool<TaskType, Policy>::TaskNode* BasicThreadPool<TaskType, Policy>::newTask(CtorArgs&&... args)
+{
+    void* block = taskSlab_.allocate();
+    TaskNode* node;
+    try
+    {
+        node = new (block) TaskNode(std::forward<CtorArgs>(args)...);
+    }
+    catch (...)
+    {
+        taskSlab_.deallocate(block);
+        throw;
+    }
+
+    if (!node->task.isInline())
+        taskSlab_.countHeapAllocation();
+    return node;
+}
+
+template <class TaskType, class Policy>
+inline
+void BasicThreadPool<TaskType, Policy>::makeCancellable(TaskNode* node, const CancellationToken& token)
+{
+    node->cancelled = token.cancelled_;
+}
+
+// Rounded up, so that a timer never fires early
+template <class TaskType, class Policy>
+template <class Rep, class Period>
+std::uint64_t BasicThreadPool<TaskType, Policy>::toTicks(const std::chrono::duration<Rep, Period>& d)
+{
+    if (d <= d.zero())
+        return 0;
+    TimerTick ticks = std::chrono::duration_cast<TimerTick>(d);
+    if (ticks < d)
+        ++ticks;
+    return static_cast<std::uint64_t>(ticks.count());
+}
+
+template <class TaskType, class Policy>
+template <class Rep, class Period>
+inline
+std::uint64_t BasicThreadPool<TaskType, Policy>::tickAfter(const std::chrono::duration<Rep, Period>& delay) const
+{
+    return toTicks(std::chrono::steady_clock::now() - timerEpoch_ +
+                   std::chrono::duration_cast<std::chrono::steady_clock::duration>(delay));
+}
+
+// A time of another clock than steady_clock is taken as the time left until then
+template <class TaskType, class Policy>
+template <class Clock, class Duration>
+inline
+std::uint64_t BasicThreadPool<TaskType, Policy>::tickAt(const std::chrono::time_point<Clock, Duration>& time) const
+{
+    return tickAfter(time - Clock::now());
+}
+
+template <class TaskType, class Policy>
+inline
+std::uint64_t BasicThreadPool<TaskType, Policy>::currentTick() const
+{
+    return static_cast<std::uint64_t>(std::chrono::duration_cast<TimerTick>(
+        std::chrono::steady_clock::now() - timerEpoch_).count());
+}
+
+// Enqueues the task once the tick is due. Returns an invalid handle (having destroyed
+// the task) if the pool has been shut down.
+template <class TaskType, class Policy>
+inline
+TimerHandle BasicThreadPool<TaskType, Policy>::addTimer(TaskNode* node, std::uint64_t due)
+{
+    return addTimerActually(node, UniqueFunction<TaskNode*()>(), due, 0);
+}
+
+// Enqueues a task built by makeTask once the tick is due, then every period ticks
+// (which must be positive) until cancelled
+template <class TaskType, class Policy>
+inline
+TimerHandle BasicThreadPool<TaskType, Policy>::addTimer(UniqueFunction<TaskNode*()>&& makeTask, std::uint64_t due,
+                                                        std::uint64_t period)
+{
+    return addTimerActually(nullptr, std::move(makeTask), due, period);
+}
+
+// If the timer is now the first due, the timekeeper has to wake up earlier (and if
+// there's none, an idle thread becomes it)
+template <class TaskType, class Policy>
+TimerHandle BasicThreadPool<TaskType, Policy>::addTimerActually(TaskNode* node, UniqueFunction<TaskNode*()>&& makeTask,
+                                                                std::uint64_t due, std::uint64_t period)
+{
+    TimerHandle handle;
+    bool earlier;
+    {
+        std::lock_guard<std::mutex> lg(timerLock_);
+        if (isShutdown_)
+        {
+            if (node)
+                destroyTask(node);
+            return handle;
+        }
+
+        std::uint32_t index;
+        if (freeTimers_ != 0)
+        {
+            index = freeTimers_ - 1;
+            freeTimers_ = timerSlots_[index].nextFree;
+        }
+        else
+        {
+            index = static_cast<std::uint32_t>(timerSlots_.size());
+            timerSlots_.emplace_back(index);
+        }
+
+        TimerSlot& timer = timerSlots_[index];
+        timer.node = node;
+        timer.makeTask = std::move(makeTask);
+        timer.period = period;
+        timerWheel_.insert(&timer, due);
+        handle.index_ = index + 1;
+        handle.generation_ = timer.generation;
+
+        const std::uint64_t next = timerWheel_.nextExpiry();
+        earlier = next < nextTimer_;
+        nextTimer_ = next;
+    }
+
+    if (earlier)
+    {
+        { std::lock_guard<std::mutex> lg(lock_); }
+        taskAvailable_.notify_all();
+    }
+    return handle;
+}
+
+// Called with timerLock_ held, once the timer is out of the wheel
+template <class TaskType, class Policy>
+void BasicThreadPool<TaskType, Policy>::freeTimer(TimerSlot& timer)
+{
+    timer.node = nullptr;
+    timer.makeTask = UniqueFunction<TaskNode*()>();
+    timer.period = 0;
+    ++timer.generation;
+    timer.nextFree = freeTimers_;
+    freeTimers_ = timer.index + 1;
+}
+
+// Takes the timer out of the wheel in O(1), destroying its task (a one-shot timer's
+// future gets a broken promise). Returns false if the timer already fired (or was
+// cancelled); a periodic timer's run that's already been enqueued still runs.
+template <class TaskType, class Policy>
+bool BasicThreadPool<TaskType, Policy>::cancelTimer(const TimerHandle& handle)
+{
+    if (!handle.valid())
+        return false;
+
+    TaskNode* node;
+    {
+        std::lock_guard<std::mutex> lg(timerLock_);
+        if (handle.index_ > timerSlots_.size())
+            return false;
+        TimerSlot& timer = timerSlots_[handle.index_ - 1];
+        if (timer.generation != handle.generation_)
+            return false;
+
+        timerWheel_.remove(&timer);
+        node = timer.node;
+        freeTimer(timer);
+        nextTimer_ = timerWheel_.nextExpiry();
+    }
+    if (node)
+        destroyTask(node);
+    return true;
+}
+
+// Timers added but neither fired (for the last time) nor cancelled. A timer being fired
+// counts until its task is enqueued, so once this is 0, wait() waits for every task.
+template <class TaskType, class Policy>
+std::size_t BasicThreadPool<TaskType, Policy>::timerCount() const
+{
+    std::lock_guard<std::mutex> lg(timerLock_);
+    return timerWheel_.size() + firingTimers_;
+}
+
+// Advances the wheel to the current tick and enqueues the due timers' tasks (after
+// releasing timerLock_). A periodic timer's next run is a period after the last one
+// was due; runs missed (because no thread was free to fire them) are skipped, not
+// made up. Does nothing if another thread is already at it. Since nothing may wait
+// for them to be taken, tasks that find a bounded queue full are dropped.
+template <class TaskType, class Policy>
+void BasicThreadPool<TaskType, Policy>::fireTimers()
+{
+    const std::uint64_t now = currentTick();
+    if (now < nextTimer_ || isShutdown_)
+        return;
+
+    TaskQueue due;
+    std::size_t fired = 0;
+    {
+        std::unique_lock<std::mutex> ul(timerLock_, std::try_to_lock);
+        if (!ul.owns_lock())
+            return;
+
+        timerWheel_.advance(now, [this, now, &due, &fired](TimerEntry* entry) {
+            TimerSlot& timer = static_cast<TimerSlot&>(*entry);
+            if (timer.period == 0)
+            {
+                ++fired;
+                due.push(timer.node);
+                freeTimer(timer);
+                return;
+            }
+            due.push(timer.makeTask());
+            std::uint64_t next = timer.expiry + timer.period;
+            timerWheel_.insert(&timer, next > now ? next : now + timer.period);
+        });
+        nextTimer_ = timerWheel_.nextExpiry();
+        firingTimers_ += fired;
+    }
+
+    while (!due.empty())
+        enqueue(due.pop(), Backpressure::Reject);
+
+    if (fired != 0)
+    {
+        std::lock_guard<std::mutex> lg(timerLock_);
+        firingTimers_ -= fired;
+    }
+}
+
+// Cancels every timer (for shutdownNow() and the destructor)
+template <class TaskType, class Policy>
+void BasicThreadPool<TaskType, Policy>::clearTimers()
+{
+    TaskQueue dropped;
+    {
+        std::lock_guard<std::mutex> lg(timerLock_);
+        timerWheel_.clear([this, &dropped](TimerEntry* entry) {
+            TimerSlot& timer = static_cast<TimerSlot&>(*entry);
+            if (timer.node)
+                dropped.push(timer.node);
+            freeTimer(timer);
+        });
+        nextTimer_ = TimerWheel::NEVER;
+    }
+
+    while (!dropped.empty())
+        destroyTask(dropped.pop());
+}
+
+template <class TaskType, class Policy>
+inline
+void BasicThreadPool<TaskType, Policy>::destroyTask(TaskNode* node)
+{
+    node->~TaskNode();
+    taskSlab_.deallocate(node);
+}
+
+template <class TaskType, class Policy>
+inline
+bool BasicThreadPool<TaskType, Policy>::enqueue(TaskNode* node)
+{
+    return enqueue(node, backpressure_);
+}
+
+// With work stealing enabled, a Normal task submitted from one of this pool's own
+// threads is pushed onto that thread's deque instead of the shared queue. If the queue
+// is bounded and full, the specified backpressure policy applies (to Normal tasks only:
+// the other bands are never bounded). Returns false (having destroyed the task) if the
+// task was rejected, or if the pool was shut down while waiting. If the pool is
+// NUMA-aware, a task submitted to a node goes to that node's queue (regardless of its
+// priority, and without bound). With a (valid) producer token, the task goes to the
+// token's lane instead, also without bound. An elastic pool may then start another thread.
+template <class TaskType, class Policy>
+bool BasicThreadPool<TaskType, Policy>::enqueue(TaskNode* node, Backpressure backpressure, Priority priority,
+                                                int numaNode, ProducerToken* token)
+{
+    if (!pushTask(node, backpressure, priority, numaNode, token))
+        return false;
+    growIfBusy();
+    return true;
+}
+
+// laneTaskCount_ is incremented under the lane's lock, so that it never drops below zero
+template <class TaskType, class Policy>
+bool BasicThreadPool<TaskType, Policy>::pushTask(TaskNode* node, Backpressure backpressure, Priority priority,
+                                                 int numaNode, ProducerToken* token)
+{
+    ++pendingTasks_;
+    metrics_.stampQueued(*node);
+    tracer_.taskQueued(*node, traceThread());
+    metrics_.queueDepth(pendingTasks_, [this]() { return activeThreads(); });
+
+    if (token && token->lane_)
+    {
+        ProducerLane& lane = *token->lane_;
+        {
+            std::lock_guard<std::mutex> lg(lane.lock);
+            lane.tasks.push(node);
+            ++lane.size;
+            ++laneTaskCount_;
+        }
+        notifyTaskAvailable(1);
+        return true;
+    }
+
+    if (numaNode != ANY_NODE && !nodeTasks_.empty())
+    {
+        std::unique_lock<std::mutex> ul(lock_);
+        nodeTasks_[numaNode % nodeTasks_.size()].push(node);
+        ++nodeTaskCount_;
+        const bool wake = idleThreads_ != 0;
+        ul.unlock();
+
+        if (wake)
+            taskAvailable_.notify_one();
+        return true;
+    }
+
+    if (priority == Priority::Normal && usesStealing() && currentPool_ == this)
+    {
+        if (usesLifoSlot())
+            node = workers_[currentId_ - 1].next.exchange(node);
+        if (node)
+            localTasks_[currentId_ - 1]->push(node);
+        ++localTaskCount_;
+        notifyTaskAvailable(1);
+        return true;
+    }
+
+    if (priority == Priority::Normal && usesBoundedQueue())
+    {
+        if (pushBoundedTask(node, backpressure))
+        {
+            ++boundedTaskCount_;
+            notifyTaskAvailable(1);
+            return true;
+        }
+
+        destroyTask(node);
+        if (--pendingTasks_ == 0)
+        {
+            { std::lock_guard<std::mutex> lg(lock_); }
+            tasksDone_.notify_all();
+        }
+        return false;
+    }
+
+    // The shared FIFO (the default queue) always takes lock_, even uncontended
+    const int band = static_cast<int>(priority);
+    std::unique_lock<std::mutex> ul(lock_);
+    tasks_[band].push(node);
+    ++queuedTasks_[band];
+    const bool wake = idleThreads_ != 0;
+    ul.unlock();
+
+    if (wake)
+        taskAvailable_.notify_one();
+    return true;
+}
+
+// Enqueues every task in the batch (leaving it empty) with Normal priority, taking lock_
+// only once and waking no more threads than there are tasks. If the queue is bounded,
+// tasks rejected by the pool's backpressure policy are destroyed, which breaks their
+// promises.
+template <class TaskType, class Policy>
+void BasicThreadPool<TaskType, Policy>::enqueue(TaskBatch& batch)
+{
+    pushBatch(batch);
+    growIfBusy();
+}
+
+template <class TaskType, class Policy>
+void BasicThreadPool<TaskType, Policy>::pushBatch(TaskBatch& batch)
+{
+    const std::size_t count = batch.size_;
+    if (count == 0)
+        return;
+
+    pendingTasks_ += static_cast<int>(count);
+    batch.size_ = 0;
+    metrics_.queueDepth(pendingTasks_, [this]() { return activeThreads(); });
+
+    if (usesStealing() && currentPool_ == this)
+    {
+        while (!batch.tasks_.empty())
+            localTasks_[currentId_ - 1]->push(batch.tasks_.pop());
+        localTaskCount_ += static_cast<int>(count);
+        notifyTaskAvailable(count);
+        return;
+    }
+
+    if (usesBoundedQueue())
+    {
+        int rejected = 0;
+        while (!batch.tasks_.empty())
+        {
+            TaskNode* node = batch.tasks_.pop();
+            if (pushBoundedTask(node, backpressure_))
+            {
+                ++boundedTaskCount_;
+                notifyTaskAvailable(1);
+            }
+            else
+            {
+                destroyTask(node);
+                ++rejected;
+            }
+        }
+
+        if (rejected != 0 && (pendingTasks_ -= rejected) == 0)
+        {
+            { std::lock_guard<std::mutex> lg(lock_); }
+            tasksDone_.notify_all();
+        }
+        return;
+    }
+
+    std::unique_lock<std::mutex> ul(lock_);
+    tasks_[static_cast<int>(Priority::Normal)].splice(batch.tasks_);
+    queuedTasks_[static_cast<int>(Priority::Normal)] += static_cast<int>(count);
+    const std::size_t idle = idleThreads_;
+    ul.unlock();
+
+    wakeThreads(std::min(count, idle));
+}
+
+// Called after pushing tasks without lock_. Only takes lock_ if some thread might be
+// waiting for them: the counter of pushed tasks is incremented before idleThreads_ is
+// read here, and waitForTask() increments idleThreads_ before reading the counters.
+template <class TaskType, class Policy>
+inline
+void BasicThreadPool<TaskType, Policy>::notifyTaskAvailable(std::size_t count)
+{
+    const std::size_t idle = idleThreads_;
+    if (idle != 0)
+    {
+        { std::lock_guard<std::mutex> lg(lock_); }
+        wakeThreads(std::min(count, idle));
+    }
+}
+
+// Wakes up threads waiting on taskAvailable_ to run the specified amount of new tasks
+template <class TaskType, class Policy>
+inline
+void BasicThreadPool<TaskType, Policy>::wakeThreads(std::size_t count)
+{
+    if (count >= static_cast<std::size_t>(targetThreads_))
+        taskAvailable_.notify_all();
+    else
+        while (count-- != 0)
+            taskAvailable_.notify_one();
+}
+
+// Tries to push onto the bounded queue, waiting for space if backpressure says so
+template <class TaskType, class Policy>
+bool BasicThreadPool<TaskType, Policy>::pushBoundedTask(TaskNode* node, Backpressure backpressure)
+{
+    if (boundedTasks_->tryPush(node))
+        return true;
+    if (backpressure == Backpressure::Reject)
+        return false;
+
+    if (backpressure == Backpressure::SpinThenBlock)
+        for (int i = 0; i != SPIN_COUNT; ++i)
+        {
+            std::this_thread::yield();
+            if (boundedTasks_->tryPush(node))
+                return true;
+        }
+
+    // The fence pairs with the one in popBoundedTask(): either this thread sees the
+    // slot freed by a pop, or the popping thread sees blockedSubmitters_ != 0
+    std::unique_lock<std::mutex> ul(lock_);
+    ++blockedSubmitters_;
+    std::atomic_thread_fence(std::memory_order_seq_cst);
+    bool pushed;
+    while (!(pushed = boundedTasks_->tryPush(node)) && !isShutdown_)
+        spaceAvailable_.wait(ul);
+    --blockedSubmitters_;
+    return pushed;
+}
+
+template <class TaskType, class Policy>
+bool BasicThreadPool<TaskType, Policy>::popBoundedTask(TaskNode*& node)
+{
+    if (!boundedTasks_->tryPop(node))
+        return false;
+
+    setActive(true);
+    --boundedTaskCount_;
+
+    std::atomic_thread_fence(std::memory_order_seq_cst);
+    if (blockedSubmitters_ != 0)
+    {
+        { std::lock_guard<std::mutex> lg(lock_); }
+        spaceAvailable_.notify_one();
+    }
+    return true;
+}
+
+// Signal to threads that they should finish what they're doing. If force == true,
+// all threads in this ThreadPool will be detached (and can be safely destructed).
+// (This does not block the calling thread)
+template <class TaskType, class Policy>
+void BasicThreadPool<TaskType, Policy>::shutdown(bool force)
+{
+    std::unique_lock<std::mutex> ul(lock_);
+    if (isShutdown_)
+        return;
+
+    isShutdown_.store(true, std::memory_order_release);
+    ul.unlock();
+
+    taskAvailable_.notify_all();
+    tasksDone_.notify_all();
+    spaceAvailable_.notify_all();
+
+    if (force)
+    {
+        std::lock_guard<std::mutex> rg(resizeLock_);
+        for (std::size_t i = 0; i != threads_.size(); ++i)
+            if (threads_[i].joinable())
+                threads_[i].detach();
+    }
+}
+
+// Shuts the pool down (as shutdown() does), then takes every queued task off the queues
+// in one pass and destroys it, breaking its promise. Returns the amount of tasks dropped
+// that way; tasks already running still finish. Unlike a plain shutdown, the dropped
+// tasks' resources are released right away, rather than when the pool is destroyed.
+// Timers are cancelled too (without counting them).
+template <class TaskType, class Policy>
+std::size_t BasicThreadPool<TaskType, Policy>::shutdownNow()
+{
+    shutdown(false);
+    clearTimers();
+
+    TaskQueue taken;
+    takeQueuedTasks(taken);
+
+    std::size_t dropped = 0;
+    while (!taken.empty())
+    {
+        destroyTask(taken.pop());
+        ++dropped;
+    }
+
+    if (dropped != 0)
+    {
+        std::lock_guard<std::mutex> lg(lock_);
+        pendingTasks_ -= static_cast<int>(dropped);
+    }
+    tasksDone_.notify_all();
+    return dropped;
+}
+
+// Moves the tasks of every queue to taken (destroying them is left to the caller, since
+// their destructors may call back into the pool). The deques are stolen from, since
+// their owners may still be popping.
+template <class TaskType, class Policy>
+void BasicThreadPool<TaskType, Policy>::takeQueuedTasks(TaskQueue& taken)
+{
+    {
+        std::lock_guard<std::mutex> lg(lock_);
+        for (int i = 0; i != NUM_PRIORITIES; ++i)
+            while (!tasks_[i].empty())
+            {
+                --queuedTasks_[i];
+                taken.push(tasks_[i].pop());
+            }
+        for (std::size_t i = 0; i != nodeTasks_.size(); ++i)
+            while (!nodeTasks_[i].empty())
+            {
+                --nodeTaskCount_;
+                taken.push(nodeTasks_[i].pop());
+            }
+    }
+
+    for (ProducerLane* lane = lanes_; lane; lane = lane->next)
+    {
+        std::lock_guard<std::mutex> lg(lane->lock);
+        while (!lane->tasks.empty())
+        {
+            --lane->size;
+            --laneTaskCount_;
+            taken.push(lane->tasks.pop());
+        }
+    }
+
+    TaskNode* node;
+    for (std::size_t i = 0; i != localTasks_.size(); ++i)
+        while (!localTasks_[i]->empty())
+            if (localTasks_[i]->steal(node))
+            {
+                --localTaskCount_;
+                taken.push(node);
+            }
+    if (usesLifoSlot())
+        for (std::size_t i = 0; i != workers_.size(); ++i)
+            if ((node = workers_[i].next.exchange(nullptr)))
+            {
+                --localTaskCount_;
+                taken.push(node);
+            }
+    if (usesBoundedQueue())
+        while (boundedTasks_->tryPop(node))
+        {
+            --boundedTaskCount_;
+            taken.push(node);
+        }
+}
+
+// Changes the amount of threads to numThreads (clamped to [0, maxThreads()]), and
+// returns right away. New threads start at once; surplus threads first finish the task
+// they're running (and, with work stealing, the tasks in their own deque), so until
+// then, more than threadCount() threads may be running. Can be called at any time,
+// including from a task, and while other threads submit() or wait().
+template <class TaskType, class Policy>
+void BasicThreadPool<TaskType, Policy>::resize(int numThreads)
+{
+    std::lock_guard<std::mutex> rg(resizeLock_);
+    resizeActually(numThreads);
+}
+
+// Must be called with resizeLock_ held. A slot whose thread retired gets a new thread
+// (once the old one is joined); retiring threads notice the new target when woken up.
+template <class TaskType, class Policy>
+void BasicThreadPool<TaskType, Policy>::resizeActually(int numThreads)
+{
+    numThreads = std::max(0, std::min(numThreads, maxThreads()));
+
+    std::vector<int> slots;
+    {
+        std::lock_guard<std::mutex> lg(lock_);
+        if (isShutdown_)
+            return;
+
+        targetThreads_ = numThreads;
+        for (int i = 0; i != numThreads; ++i)
+            if (!threadRunning_[i])
+            {
+                threadRunning_[i] = 1;
+                slots.push_back(i);
+            }
+    }
+
+    for (std::size_t i = 0; i != slots.size(); ++i)
+    {
+        if (threads_[slots[i]].joinable())
+            threads_[slots[i]].join();
+        startThread(slots[i]);
+    }
+    taskAvailable_.notify_all();
+}
+
+// Elastic pools start another thread (if allowed) when none is idle and more tasks are
+// waiting than there are threads. A submitter that finds another thread resizing the
+// pool doesn't wait for it.
+template <class TaskType, class Policy>
+inline
+void BasicThreadPool<TaskType, Policy>::growIfBusy()
+{
+    if (!elastic_ || idleThreads_ != 0 || targetThreads_ >= maxThreads())
+        return;
+    if (pendingTasks_ - activeThreads() <= targetThreads_)
+        return;
+
+    std::unique_lock<std::mutex> rl(resizeLock_, std::try_to_lock);
+    if (rl.owns_lock())
+        resizeActually(targetThreads_ + 1);
+}
+
+// Called by thread id once isRetiring(id). The thread must exit if
+// this returns true, since its slot may get a new thread right away; it doesn't if the
+// pool grew back in the meantime, or if it still has tasks of its own.
+template <class TaskType, class Policy>
+bool BasicThreadPool<TaskType, Policy>::retire(int id)
+{
+    if (usesStealing() && !localTasks_[id - 1]->empty())
+        return false;
+    if (usesLifoSlot() && workers_[id - 1].next.load() != nullptr)
+        return false;
+
+    std::lock_guard<std::mutex> lg(lock_);
+    if (!isRetiring(id))
+        return false;
+    threadRunning_[id - 1] = 0;
+    return true;
+}
+
+// Whether thread id's slot is past targetThreads_, or a compensating thread's past the
+// ones still needed
+template <class TaskType, class Policy>
+inline
+bool BasicThreadPool<TaskType, Policy>::isRetiring(int id) const
+{
+    if (id > maxThreads())
+        return id - maxThreads() > compensating_;
+    return id > targetThreads_;
+}
+
+// A task of this pool entered a BlockingSection: runs the next compensating thread
+// (unless they're all running), in the next slot past maxThreads(). If the slot's thread
+// hasn't retired yet, it just stays. Returns whether a thread compensates.
+template <class TaskType, class Policy>
+bool BasicThreadPool<TaskType, Policy>::blockingStarted()
+{
+    if (blockingSlots_ == 0)
+        return false;
+
+    std::lock_guard<std::mutex> rg(resizeLock_);
+    int slot;
+    {
+        std::lock_guard<std::mutex> lg(lock_);
+        if (isShutdown_ || compensating_ == blockingSlots_)
+            return false;
+
+        slot = maxThreads() + compensating_;
+        ++compensating_;
+        if (threadRunning_[slot])
+            return true;
+        threadRunning_[slot] = 1;
+    }
+
+    try
+    {
+        if (threads_[slot].joinable())
+            threads_[slot].join();
+        startThread(slot);
+    }
+    catch (...)
+    {
+        // No thread to be had (std::system_error): the task just blocks
+        std::lock_guard<std::mutex> lg(lock_);
+        threadRunning_[slot] = 0;
+        --compensating_;
+        return false;
+    }
+    return true;
+}
+
+// The last compensating thread retires, which it notices once woken up
+template <class TaskType, class Policy>
+void BasicThreadPool<TaskType, Policy>::blockingFinished()
+{
+    {
+        std::lock_guard<std::mutex> rg(resizeLock_);
+        std::lock_guard<std::mutex> lg(lock_);
+        --compensating_;
+    }
+    taskAvailable_.notify_all();
+}
+
+// Waits on taskAvailable_ (with lock_ held) for a while. In an elastic pool, the last
+// thread retires after idleTimeout_ without a task, unless that leaves too few threads.
+template <class TaskType, class Policy>
+void BasicThreadPool<TaskType, Policy>::waitIdle(std::unique_lock<std::mutex>& ul, int id)
+{
+    // With timers, one idle thread at a time sleeps only until the next is due; if it's
+    // woken up for a task instead, another idle thread takes over
+    tracer_.parked(id);
+    const std::uint64_t nextTimer = nextTimer_;
+    if (nextTimer != TimerWheel::NEVER && !timekeeper_)
+    {
+        timekeeper_ = true;
+        bool notified = taskAvailable_.wait_until(ul, timerEpoch_ + TimerTick(nextTimer)) == std::cv_status::no_timeout;
+        timekeeper_ = false;
+        tracer_.unparked(id);
+        ul.unlock();
+        fireTimers();
+        if (notified && nextTimer_ != TimerWheel::NEVER)
+            taskAvailable_.notify_one();
+        ul.lock();
+        return;
+    }
+
+    if (!elastic_)
+        taskAvailable_.wait(ul);
+    else if (taskAvailable_.wait_for(ul, idleTimeout_) == std::cv_status::timeout &&
+             id == targetThreads_ && targetThreads_ > minThreads_)
+        --targetThreads_;
+    tracer_.unparked(id);
+}
+
+// Wait for all tasks (enqueued and currently running) to complete. This function,
+// as opposed to shutdown(), *does* block the calling thread, until the last task
+// finishes. If the pool is shut down, only currently running tasks are waited for
+// (since enqueued tasks will never run).
+// That is, after wait() returns, activeThreads() == 0.
+template <class TaskType, class Policy>
+void BasicThreadPool<TaskType, Policy>::wait()
+{
+    std::unique_lock<std::mutex> ul(lock_);
+    while (!isIdle())
+        tasksDone_.wait(ul);
+}
+
+// Same as wait(), but give up after the specified amount of time.
+// Returns true if all tasks completed, false if timed out.
+template <class TaskType, class Policy>
+template <class Rep, class Period>
+bool BasicThreadPool<TaskType, Policy>::waitFor(const std::chrono::duration<Rep, Period>& timeout)
+{
+    return waitUntil(std::chrono::steady_clock::now() + timeout);
+}
+
+// Same as wait(), but give up once the deadline has passed.
+// Returns true if all tasks completed, false if timed out.
+template <class TaskType, class Policy>
+template <class Clock, class Duration>
+bool BasicThreadPool<TaskType, Policy>::waitUntil(const std::chrono::time_point<Clock, Duration>& deadline)
+{
+    std::unique_lock<std::mutex> ul(lock_);
+    while (!isIdle())
+        if (tasksDone_.wait_until(ul, deadline) == std::cv_status::timeout)
+            return isIdle();
+    return true;
+}
+
+// Must be called with lock_ held, so that a task can't finish unnoticed between
+// checking and waiting on tasksDone_
+template <class TaskType, class Policy>
+inline
+bool BasicThreadPool<TaskType, Policy>::isIdle() const
+{
+    return pendingTasks_ == 0 || (isShutdown_ && activeThreads() == 0);
+}
+
+template <class TaskType, class Policy>
+void BasicThreadPool<TaskType, Policy>::doWork(int id)
+{
+    currentPool_ = this;
+    currentId_ = id;
+    stealSeed_ = id;
+    BlockingAware::current() = this;
+
+    // Dequeue tasks until the thread pool is shutdown (or this thread isn't needed anymore)
+    while (!isShutdown_)
+    {
+        if (isRetiring(id) && retire(id))
+            break;
+        if (nextTimer_ != TimerWheel::NEVER)
+            fireTimers();
+
+        TaskNode* node;
+        if (usesStealing() || usesBoundedQueue() || !nodeTasks_.empty() || lanes_ != nullptr)
+        {
+            if (!findTask(id, node))
+            {
+                typename Metrics::Timer idle = metrics_.idleStarted();
+                if (!spinForTask())
+                    waitForTask(id);
+                metrics_.idleFinished(id - 1, idle);
+                continue;
+            }
+        }
+        else
+        {
+            std::unique_lock<std::mutex> ul(lock_);
+
+            if (!hasQueuedTask() && laneTaskCount_ == 0 && !isShutdown_ && !isRetiring(id))
+            {
+                typename Metrics::Timer idle = metrics_.idleStarted();
+                if (idlePolicy_ != IdlePolicy::Block)
+                {
+                    ul.unlock();
+                    spinForTask();
+                    ul.lock();
+                }
+
+                ++idleThreads_;
+                while (!hasQueuedTask() && laneTaskCount_ == 0 && !isShutdown_ && !isRetiring(id))
+                    waitIdle(ul, id);
+                --idleThreads_;
+                metrics_.idleFinished(id - 1, idle);
+            }
+            if (isShutdown_)
                 break;
+            if (!hasQueuedTask())
+                continue;
 
-            ++activeThreads_;
-            task = std::move(tasks_.front());
-            tasks_.pop();
-        }   // So lock_ is unlocked after activeThreads_ increments/a task is *definitely* pulled
+            setActive(true);
+            node = popQueuedTask(Priority::Low);
+        }   // So lock_ is unlocked after the thread is marked active/a task is *definitely* pulled
         
-        task.execute();
-        --activeThreads_;
+        runTask(node);
+    }
+
+    currentPool_ = nullptr;
+    BlockingAware::current() = nullptr;
+}
+
+// Work stealing (or a bounded queue, or NUMA nodes, or producer lanes): look for a High
+// priority task, then this thread's LIFO slot, then a task in its own deque (newest
+// first), then its node's queue, then the bounded queue, then the producer lanes, then
+// the shared queue's Normal and Low bands, then the other nodes' queues, then the other
+// threads' deques (oldest first, starting at a random victim, and from threads of the
+// same node first), then the LIFO slots. Never blocks on an empty pool.
+template <class TaskType, class Policy>
+bool BasicThreadPool<TaskType, Policy>::findTask(int id, TaskNode*& node)
+{
+    if (popSharedTask(Priority::High, node))
+        return true;
+
+    // After a streak of LIFO slot tasks, look at the rest first (once), to be fair to them
+    if (usesLifoSlot())
+    {
+        Worker& worker = workers_[id - 1];
+        if (worker.lifoStreak < MAX_LIFO_STREAK && popNextTask(id - 1, false, node))
+        {
+            ++worker.lifoStreak;
+            return true;
+        }
+        worker.lifoStreak = 0;
+    }
+
+    if (usesStealing() && popLocalTask(*localTasks_[id - 1], false, node))
+        return true;
+
+    int home = ANY_NODE;
+    if (!threadNodes_.empty())
+        home = threadNodes_[id - 1];
+    if (home != ANY_NODE && popNodeTask(home, false, node))
+        return true;
+
+    if (usesBoundedQueue() && popBoundedTask(node))
+        return true;
+
+    if (popLaneTask(id, node))
+        return true;
+
+    if (popSharedTask(Priority::Low, node))
+        return true;
+
+    if (home != ANY_NODE && popNodeTask(home, true, node))
+        return true;
+
+    const int numDeques = localTasks_.size();
+    if (localTaskCount_ == 0)
+        return false;
+
+    // xorshift
+    stealSeed_ ^= stealSeed_ << 13;
+    stealSeed_ ^= stealSeed_ >> 17;
+    stealSeed_ ^= stealSeed_ << 5;
+
+    const int start = stealSeed_ % numDeques;
+    for (int pass = 0; pass != (home == ANY_NODE ? 1 : 2); ++pass)
+        for (int i = 0; i != numDeques; ++i)
+        {
+            int victim = (start + i) % numDeques;
+            if (victim == id - 1 || (home != ANY_NODE && (threadNodes_[victim] == home) != (pass == 0)))
+                continue;
+            if (popLocalTask(*localTasks_[victim], true, node))
+                return true;
+        }
+
+    // Last, the other threads' LIFO slots (including this thread's, skipped after a streak),
+    // so that a task doesn't wait for its submitter to finish when others are idle
+    if (usesLifoSlot())
+        for (int i = 0; i != numDeques; ++i)
+            if (popNextTask((start + i) % numDeques, (start + i) % numDeques != id - 1, node))
+                return true;
+    return false;
+}
+
+// Pops the oldest task of node home's queue or, if remote, of the other nodes' queues
+template <class TaskType, class Policy>
+bool BasicThreadPool<TaskType, Policy>::popNodeTask(int home, bool remote, TaskNode*& node)
+{
+    if (nodeTaskCount_ == 0)
+        return false;
+
+    std::lock_guard<std::mutex> lg(lock_);
+    const int numNodes = nodeTasks_.size();
+    for (int i = remote ? 1 : 0; i < (remote ? numNodes : 1); ++i)
+    {
+        TaskQueue& queue = nodeTasks_[(home + i) % numNodes];
+        if (!queue.empty())
+        {
+            setActive(true);
+            --nodeTaskCount_;
+            node = queue.pop();
+            return true;
+        }
+    }
+    return false;
+}
+
+// Pops the oldest task of the next producer lane that has one, taking turns: a thread
+// starts after the lane it last took a task from (wrapping around to the newest lane),
+// so that no producer's tasks wait behind all of another's
+template <class TaskType, class Policy>
+bool BasicThreadPool<TaskType, Policy>::popLaneTask(int id, TaskNode*& node)
+{
+    if (laneTaskCount_ == 0)
+        return false;
+
+    ProducerLane* head = lanes_;
+    ProducerLane*& last = workers_[id - 1].laneCursor;
+    ProducerLane* start = last && last->next ? last->next : head;
+    ProducerLane* lane = start;
+    do
+    {
+        if (lane->size != 0)
+        {
+            std::lock_guard<std::mutex> lg(lane->lock);
+            if (!lane->tasks.empty())
+            {
+                setActive(true);
+                --lane->size;
+                --laneTaskCount_;
+                node = lane->tasks.pop();
+                last = lane;
+                return true;
+            }
+        }
+        lane = lane->next ? lane->next : head;
+    } while (lane != start);
+    return false;
+}
+
+// Pops the highest priority task in the shared queue, down to the lowest band. Only takes
+// lock_ if the counters say there might be one (if they're stale, waitForTask() will
+// notice under lock_).
+template <class TaskType, class Policy>
+bool BasicThreadPool<TaskType, Policy>::popSharedTask(Priority lowest, TaskNode*& node)
+{
+    bool queued = false;
+    for (int band = 0; band <= static_cast<int>(lowest); ++band)
+        queued = queued || queuedTasks_[band] != 0;
+    if (!queued)
+        return false;
+
+    std::lock_guard<std::mutex> lg(lock_);
+    if (!(node = popQueuedTask(lowest)))
+        return false;
+    setActive(true);
+    return true;
+}
+
+// Must be called with lock_ held
+template <class TaskType, class Policy>
+inline
+bool BasicThreadPool<TaskType, Policy>::hasQueuedTask() const
+{
+    for (int band = 0; band != NUM_PRIORITIES; ++band)
+        if (!tasks_[band].empty())
+            return true;
+    return false;
+}
+
+// Must be called with lock_ held. Returns nullptr if the bands down to lowest are empty.
+template <class TaskType, class Policy>
+typename BasicThreadPool<TaskType, Policy>::TaskNode* BasicThreadPool<TaskType, Policy>::popQueuedTask(Priority lowest)
+{
+    for (int band = 0; band <= static_cast<int>(lowest); ++band)
+        if (!tasks_[band].empty())
+        {
+            --queuedTasks_[band];
+            return tasks_[band].pop();
+        }
+    return nullptr;
+}
+
+// The thread is marked active before localTaskCount_ is decremented, so that no one sees
+// a task in neither
+template <class TaskType, class Policy>
+bool BasicThreadPool<TaskType, Policy>::popLocalTask(WorkStealingDeque<TaskNode*>& deque, bool steal, TaskNode*& node)
+{
+    if (!(steal ? deque.steal(node) : deque.pop(node)))
+        return false;
+
+    setActive(true);
+    --localTaskCount_;
+    if (steal)
+    {
+        metrics_.taskStolen(currentId_ - 1);
+        tracer_.taskStolen(*node, currentId_);
+    }
+    return true;
+}
+
+template <class TaskType, class Policy>
+inline
+bool BasicThreadPool<TaskType, Policy>::popNextTask(int slot, bool steal, TaskNode*& node)
+{
+    std::atomic<TaskNode*>& next = workers_[slot].next;
+    if (next.load(std::memory_order_relaxed) == nullptr || !(node = next.exchange(nullptr)))
+        return false;
+
+    setActive(true);
+    --localTaskCount_;
+    if (steal)
+    {
+        metrics_.taskStolen(currentId_ - 1);
+        tracer_.taskStolen(*node, currentId_);
+    }
+    return true;
+}
+
+// The task's node goes back to the slab before the task counts as finished, so that
+// after wait() returns, every task has been destroyed. A cancelled task is only destroyed.
+// A task that throws is finished like any other, so the thread carries on. (With
+// table-based exception handling, as on every mainstream 64-bit ABI, the try block
+// costs nothing until something throws.)
+template <class TaskType, class Policy>
+inline
+void BasicThreadPool<TaskType, Policy>::runTask(TaskNode* node)
+{
+    if (node->cancelled && node->cancelled->load(std::memory_order_acquire))
+    {
+        destroyTask(node);
+        finishTask();
+        return;
+    }
+
+    typename Metrics::Timer timer = metrics_.taskStarted(*node);
+    tracer_.taskStarted(*node, currentId_);
+    try
+    {
+        node->task.execute();
+    }
+    catch (...)
+    {
+        taskFailed(std::current_exception());
+    }
+    tracer_.taskFinished(*node, currentId_);
+    metrics_.taskFinished(currentId_ - 1, timer);
+    destroyTask(node);
+    finishTask();
+}
+
+// Called on the thread that ran the task. The error handler must not throw: an
+// exception escaping it terminates the program.
+template <class TaskType, class Policy>
+void BasicThreadPool<TaskType, Policy>::taskFailed(std::exception_ptr exception) noexcept
+{
+    taskErrors_.fetch_add(1, std::memory_order_relaxed);
+    if (errorHandler_)
+        errorHandler_(exception);
+}
+
+// Only the calling thread (one of the pool's) writes its flag
+template <class TaskType, class Policy>
+inline
+void BasicThreadPool<TaskType, Policy>::setActive(bool active)
+{
+    workers_[currentId_ - 1].active = active;
+}
+
+// Called after each task completes. Only the last task (or, after shutdown,
+// the last running task) takes lock_ to wake up wait()ing threads.
+template <class TaskType, class Policy>
+void BasicThreadPool<TaskType, Policy>::finishTask()
+{
+    setActive(false);
+    if (--pendingTasks_ == 0 || isShutdown_)
+    {
+        { std::lock_guard<std::mutex> lg(lock_); }
+        tasksDone_.notify_all();
+    }
+}
+
+// Block until a task might be available in either the shared queue or some thread's deque
+// (or this thread should retire)
+template <class TaskType, class Policy>
+void BasicThreadPool<TaskType, Policy>::waitForTask(int id)
+{
+    std::unique_lock<std::mutex> ul(lock_);
+
+    ++idleThreads_;
+    while (!hasQueuedTask() && localTaskCount_ == 0 && boundedTaskCount_ == 0 && nodeTaskCount_ == 0 &&
+           laneTaskCount_ == 0 && !isShutdown_ && !isRetiring(id))
+        waitIdle(ul, id);
+    --idleThreads_;
+}
+
+// Polls the task counters (without taking lock_) as the idle policy says. Returns true
+// as soon as a task might be available, false once the thread should block. Whatever
+// it misses, the thread notices under lock_ before blocking.
+template <class TaskType, class Policy>
+bool BasicThreadPool<TaskType, Policy>::spinForTask() const
+{
+    if (idlePolicy_ == IdlePolicy::Block)
+        return false;
+
+    const unsigned polls = idlePolicy_ == IdlePolicy::SpinThenYield ? 2 * idleSpins_ : idleSpins_;
+    for (unsigned i = 0; i != polls; ++i)
+    {
+        if (mightHaveTask())
+            return true;
+        if (i < idleSpins_)
+            cpuRelax();
+        else
+            std::this_thread::yield();
+    }
+    return false;
+}
+
+template <class TaskType, class Policy>
+inline
+bool BasicThreadPool<TaskType, Policy>::mightHaveTask() const
+{
+    for (int band = 0; band != NUM_PRIORITIES; ++band)
+        if (queuedTasks_[band] != 0)
+            return true;
+    return localTaskCount_ != 0 || boundedTaskCount_ != 0 || nodeTaskCount_ != 0 || laneTaskCount_ != 0;
+}
+
+// Tells the CPU this is a spin-wait loop, which saves power and, with hyper-threading,
+// leaves the core to the other thread
+template <class TaskType, class Policy>
+inline
+void BasicThreadPool<TaskType, Policy>::cpuRelax()
+{
+#if (defined(__GNUC__) || defined(__clang__)) && (defined(__x86_64__) || defined(__i386__))
+    __builtin_ia32_pause();
+#elif (defined(__GNUC__) || defined(__clang__)) && defined(__aarch64__)
+    asm volatile("yield" ::: "memory");
+#else
+    std::atomic_signal_fence(std::memory_order_seq_cst);
+#endif
+}
+
+// Constructs a ThreadPool with the specified amount of threads (must be nonnegative).
+// If waitOnDestroy is true, the ThreadPool will call wait() on destruction; otherwise, it will not.
+template <class Policy, class FunctionType, class... Args>
+PolicyThreadPool<Policy, FunctionType, Args...>::PolicyThreadPool(int numThreads, bool waitOnDestroy)
+    : BasicThreadPool<TaskType, Policy>(numThreads, ThreadPoolOptions(waitOnDestroy))
+{}
+
+template <class Policy, class FunctionType, class... Args>
+PolicyThreadPool<Policy, FunctionType, Args...>::PolicyThreadPool(int numThreads, const ThreadPoolOptions& options)
+    : BasicThreadPool<TaskType, Policy>(numThreads, options)
+{}
+
+// Same as submit(), without returning the future. No promise is created either (so
+// nothing is allocated for its shared state): the return value is discarded, and an
+// exception thrown by fn goes to the pool's error handler (see taskErrors()).
+template <class Policy, class FunctionType, class... Args>
+template <class Fn, class... DeducedArgs>
+inline
+void PolicyThreadPool<Policy, FunctionType, Args...>::execute(Fn&& fn, DeducedArgs&&... args)
+{
+    executeActually(this->backpressure(), nullptr, nullptr, std::forward<Fn>(fn), std::forward<Args>(args)...);
+}
+
+// DeducedArgs must have the same (decayed) type as Args; its purpose is to force
+// deduction of template arguments, because Args, if used, would be already specified.
+// Returns an invalid future if the pool has been shut down (or if the task was rejected
+// by a full bounded queue).
+template <class Policy, class FunctionType, class... Args>
+template <class Fn, class... DeducedArgs>
+inline
+std::future<typename std::result_of<Fn(Args...)>::type>
+PolicyThreadPool<Policy, FunctionType, Args...>::submit(Fn&& fn, DeducedArgs&&... args)
+{
+    return submitActually(this->backpressure(), Priority::Normal, this->ANY_NODE, nullptr, nullptr,
+                          std::forward<Fn>(fn), std::forward<Args>(args)...);
+}
+
+// Same as submit(), but never waits for room in a bounded queue: if the queue is full,
+// returns an invalid future (regardless of the pool's backpressure policy).
+template <class Policy, class FunctionType, class... Args>
+template <class Fn, class... DeducedArgs>
+inline
+std::future<typename std::result_of<Fn(Args...)>::type>
+PolicyThreadPool<Policy, FunctionType, Args...>::trySubmit(Fn&& fn, DeducedArgs&&... args)
+{
+    return submitActually(Backpressure::Reject, Priority::Normal, this->ANY_NODE, nullptr, nullptr,
+                          std::forward<Fn>(fn), std::forward<Args>(args)...);
+}
+
+// Same as submit(), but the task runs before every queued task of lower priority, and
+// after those of higher priority. Only Normal tasks go to a bounded queue (or, when
+// submitted from one of this pool's threads, to a work-stealing deque); the other bands
+// are unbounded and shared by all threads.
+template <class Policy, class FunctionType, class... Args>
+template <class Fn, class... DeducedArgs>
+inline
+std::future<typename std::result_of<Fn(Args...)>::type>
+PolicyThreadPool<Policy, FunctionType, Args...>::submitWithPriority(Priority priority, Fn&& fn, DeducedArgs&&... args)
+{
+    return submitActually(this->backpressure(), priority, this->ANY_NODE, nullptr, nullptr,
+                          std::forward<Fn>(fn), std::forward<Args>(args)...);
+}
+
+// Same as submit(), but if the pool is NUMA-aware (see ThreadPoolOptions::numaNodes),
+// the task is queued on the specified node, whose threads run it before looking for work
+// elsewhere (so it's typically run next to the memory it touches). Threads of other nodes
+// only take it when they run out of work of their own.
+template <class Policy, class FunctionType, class... Args>
+template <class Fn, class... DeducedArgs>
+inline
+std::future<typename std::result_of<Fn(Args...)>::type>
+PolicyThreadPool<Policy, FunctionType, Args...>::submitOnNode(int numaNode, Fn&& fn, DeducedArgs&&... args)
+{
+    return submitActually(this->backpressure(), Priority::Normal, numaNode, nullptr, nullptr,
+                          std::forward<Fn>(fn), std::forward<Args>(args)...);
+}
+
+template <class Policy, class FunctionType, class... Args>
+template <class Fn, class... DeducedArgs>
+std::future<typename std::result_of<Fn(Args...)>::type>
+PolicyThreadPool<Policy, FunctionType, Args...>::submitActually(Backpressure backpressure, Priority priority,
+                                                                int numaNode, ProducerToken* token,
+                                                                const CancellationToken* cancellation,
+                                                                Fn&& fn, DeducedArgs&&... args)
+{
+    using retType = typename std::result_of<Fn(Args...)>::type;
+
+    if (this->isShutdown())
+        return std::future<retType>();
+
+    TaskNode* node = this->newTask(std::allocator_arg, this->stateAllocator(),
+                                   std::forward<Fn>(fn), std::forward<Args>(args)...);
+    std::future<retType> fut = node->task.getFuture();
+    if (cancellation)
+        this->makeCancellable(node, *cancellation);
+    if (!this->enqueue(node, backpressure, priority, numaNode, token))
+        return std::future<retType>();
+    
+    return fut;
+}
+
+template <class Policy, class FunctionType, class... Args>
+template <class Fn, class... DeducedArgs>
+void PolicyThreadPool<Policy, FunctionType, Args...>::executeActually(Backpressure backpressure, ProducerToken* token,
+                                                                      const CancellationToken* cancellation,
+                                                                      Fn&& fn, DeducedArgs&&... args)
+{
+    if (this->isShutdown())
+        return;
+
+    TaskNode* node = this->newTask(DiscardResult(), std::forward<Fn>(fn), std::forward<Args>(args)...);
+    if (cancellation)
+        this->makeCancellable(node, *cancellation);
+    this->enqueue(node, backpressure, Priority::Normal, this->ANY_NODE, token);
+}
+
+// Same as submitAfter(), without returning the future, but returning a handle to cancel
+// the task with (until it's due)
+template <class Policy, class FunctionType, class... Args>
+template <class Rep, class Period, class Fn, class... DeducedArgs>
+inline
+TimerHandle
+PolicyThreadPool<Policy, FunctionType, Args...>::executeAfter(const std::chrono::duration<Rep, Period>& delay,
+                                                              Fn&& fn, DeducedArgs&&... args)
+{
+    return executeAtTick(this->tickAfter(delay), std::forward<Fn>(fn), std::forward<Args>(args)...);
+}
+
+// Same as submitAt(), without returning the future, but returning a handle to cancel
+// the task with (until it's due)
+template <class Policy, class FunctionType, class... Args>
+template <class Clock, class Duration, class Fn, class... DeducedArgs>
+inline
+TimerHandle
+PolicyThreadPool<Policy, FunctionType, Args...>::executeAt(const std::chrono::time_point<Clock, Duration>& time,
+                                                           Fn&& fn, DeducedArgs&&... args)
+{
+    return executeAtTick(this->tickAt(time), std::forward<Fn>(fn), std::forward<Args>(args)...);
+}
+
+// Same as submit(), but the task is only enqueued once the delay has passed (rounded up
+// to a whole millisecond). Until then, it waits in the pool's timer wheel, which costs
+// no thread however many tasks wait, and isn't waited for by wait(). Returns an invalid
+// future if the pool has been shut down; a task still waiting when the pool is destroyed
+// (or shutdownNow() is called) breaks its promise.
+template <class Policy, class FunctionType, class... Args>
+template <class Rep, class Period, class Fn, class... DeducedArgs>
+inline
+std::future<typename std::result_of<Fn(Args...)>::type>
+PolicyThreadPool<Policy, FunctionType, Args...>::submitAfter(const std::chrono::duration<Rep, Period>& delay,
+                                                             Fn&& fn, DeducedArgs&&... args)
+{
+    return submitAtTick(this->tickAfter(delay), std::forward<Fn>(fn), std::forward<Args>(args)...);
+}
+
+// Same as submitAfter(), but the task is enqueued once the specified time has come
+template <class Policy, class FunctionType, class... Args>
+template <class Clock, class Duration, class Fn, class... DeducedArgs>
+inline
+std::future<typename std::result_of<Fn(Args...)>::type>
+PolicyThreadPool<Policy, FunctionType, Args...>::submitAt(const std::chrono::time_point<Clock, Duration>& time,
+                                                          Fn&& fn, DeducedArgs&&... args)
+{
+    return submitAtTick(this->tickAt(time), std::forward<Fn>(fn), std::forward<Args>(args)...);
+}
+
+// Enqueues the task every period (the first time, a period from now) until the timer is
+// cancelled with cancelTimer(), or the pool shut down. Each run gets its own copies of
+// fn and args, and its result is discarded. Runs may overlap if one takes longer than
+// the period. Returns an invalid handle if the pool has been shut down.
+template <class Policy, class FunctionType, class... Args>
+template <class Rep, class Period, class Fn, class... DeducedArgs>
+TimerHandle
+PolicyThreadPool<Policy, FunctionType, Args...>::scheduleEvery(const std::chrono::duration<Rep, Period>& period,
+                                                               Fn&& fn, DeducedArgs&&... args)
+{
+    if (this->isShutdown())
+        return TimerHandle();
+
+    RepeatingTask<typename std::decay<Fn>::type> repeating = {
+        this, std::forward<Fn>(fn), std::tuple<Args...>(std::forward<Args>(args)...)
+    };
+    std::uint64_t ticks = this->toTicks(period);
+    return this->addTimer(UniqueFunction<TaskNode*()>(std::move(repeating)), this->tickAfter(period),
+                          ticks != 0 ? ticks : 1);
+}
+
+template <class Policy, class FunctionType, class... Args>
+template <class Fn, class... DeducedArgs>
+TimerHandle
+PolicyThreadPool<Policy, FunctionType, Args...>::executeAtTick(std::uint64_t due, Fn&& fn, DeducedArgs&&... args)
+{
+    if (this->isShutdown())
+        return TimerHandle();
+
+    return this->addTimer(this->newTask(DiscardResult(), std::forward<Fn>(fn), std::forward<Args>(args)...), due);
+}
+
+template <class Policy, class FunctionType, class... Args>
+template <class Fn, class... DeducedArgs>
+std::future<typename std::result_of<Fn(Args...)>::type>
+PolicyThreadPool<Policy, FunctionType, Args...>::submitAtTick(std::uint64_t due, Fn&& fn, DeducedArgs&&... args)
+{
+    using retType = typename std::result_of<Fn(Args...)>::type;
+
+    if (this->isShutdown())
+        return std::future<retType>();
+
+    TaskNode* node = this->newTask(std::allocator_arg, this->stateAllocator(),
+                                   std::forward<Fn>(fn), std::forward<Args>(args)...);
+    std::future<retType> fut = node->task.getFuture();
+    if (!this->addTimer(node, due).valid())
+        return std::future<retType>();
+
+    return fut;
+}
+
+// Same as submitCancellable(), without returning the future
+template <class Policy, class FunctionType, class... Args>
+template <class Fn, class... DeducedArgs>
+inline
+void PolicyThreadPool<Policy, FunctionType, Args...>::executeCancellable(const CancellationToken& token, Fn&& fn,
+                                                                         DeducedArgs&&... args)
+{
+    executeActually(this->backpressure(), nullptr, &token, std::forward<Fn>(fn), std::forward<Args>(args)...);
+}
+
+// Same as submit(), but if the token is cancelled before a thread takes the task, the
+// task is skipped: it's destroyed without running, and the future's get() throws
+// std::future_error (broken promise). Skipping a task costs no more than popping it.
+template <class Policy, class FunctionType, class... Args>
+template <class Fn, class... DeducedArgs>
+inline
+std::future<typename std::result_of<Fn(Args...)>::type>
+PolicyThreadPool<Policy, FunctionType, Args...>::submitCancellable(const CancellationToken& token, Fn&& fn,
+                                                                   DeducedArgs&&... args)
+{
+    return submitActually(this->backpressure(), Priority::Normal, this->ANY_NODE, nullptr, &token,
+                          std::forward<Fn>(fn), std::forward<Args>(args)...);
+}
+
+// Same as submitFrom(), without returning the future
+template <class Policy, class FunctionType, class... Args>
+template <class Fn, class... DeducedArgs>
+inline
+void PolicyThreadPool<Policy, FunctionType, Args...>::executeFrom(ProducerToken& token, Fn&& fn, DeducedArgs&&... args)
+{
+    executeActually(this->backpressure(), &token, nullptr, std::forward<Fn>(fn), std::forward<Args>(args)...);
+}
+
+// Same as submit(), but the task goes to the token's lane (see producerToken()), which
+// no other producer pushes to. The lanes are drained in turns, after the bounded queue
+// (if any), so the task ranks as Normal priority; lanes aren't bounded.
+template <class Policy, class FunctionType, class... Args>
+template <class Fn, class... DeducedArgs>
+inline
+std::future<typename std::result_of<Fn(Args...)>::type>
+PolicyThreadPool<Policy, FunctionType, Args...>::submitFrom(ProducerToken& token, Fn&& fn, DeducedArgs&&... args)
+{
+    return submitActually(this->backpressure(), Priority::Normal, this->ANY_NODE, &token, nullptr,
+                          std::forward<Fn>(fn), std::forward<Args>(args)...);
+}
+
+// Same as submitBatch(), without promises (results and exceptions are handled as with execute())
+template <class Policy, class FunctionType, class... Args>
+template <class InputIt, class Fn>
+void PolicyThreadPool<Policy, FunctionType, Args...>::executeBatch(InputIt first, InputIt last, Fn fn)
+{
+    if (this->isShutdown())
+        return;
+
+    TaskBatch batch(*this);
+    for (; first != last; ++first)
+    {
+        std::tuple<Args...> args(*first);
+        batch.push(newDiscardingTask(fn, args, typename IndexSequence<sizeof...(Args)>::seq()));
+    }
+    this->enqueue(batch);
+}
+
+// Submits fn once for each element in [first, last), all at once (see enqueue(TaskBatch&)).
+// Each element holds the arguments of one call: the argument itself if the function takes
+// only one, otherwise a std::tuple of them. Returns the futures in the same order, or no
+// futures at all if the pool has been shut down.
+template <class Policy, class FunctionType, class... Args>
+template <class InputIt, class Fn>
+std::vector<std::future<typename std::result_of<Fn(Args...)>::type>>
+PolicyThreadPool<Policy, FunctionType, Args...>::submitBatch(InputIt first, InputIt last, Fn fn)
+{
+    using retType = typename std::result_of<Fn(Args...)>::type;
+
+    std::vector<std::future<retType>> futures;
+    if (this->isShutdown())
+        return futures;
+
+    TaskBatch batch(*this);
+    for (; first != last; ++first)
+    {
+        std::tuple<Args...> args(*first);
+        TaskNode* node = newBatchTask(fn, args, typename IndexSequence<sizeof...(Args)>::seq());
+        batch.push(node);
+        futures.push_back(node->task.getFuture());
     }
+    this->enqueue(batch);
+
+    return futures;
+}
+
+// Not actually using the Sequence - we just want (to expand) the template arguments
+template <class Policy, class FunctionType, class... Args>
+template <class Fn, int... Nums>
+inline
+typename PolicyThreadPool<Policy, FunctionType, Args...>::TaskNode*
+PolicyThreadPool<Policy, FunctionType, Args...>::newBatchTask(Fn& fn, std::tuple<Args...>& args, Sequence<Nums...>)
+{
+    return this->newTask(std::allocator_arg, this->stateAllocator(), fn, std::get<Nums>(args)...);
+}
+
+// Same as newBatchTask(), without a promise
+template <class Policy, class FunctionType, class... Args>
+template <class Fn, int... Nums>
+inline
+typename PolicyThreadPool<Policy, FunctionType, Args...>::TaskNode*
+PolicyThreadPool<Policy, FunctionType, Args...>::newDiscardingTask(Fn& fn, std::tuple<Args...>& args, Sequence<Nums...>)
+{
+    return this->newTask(DiscardResult(), fn, std::get<Nums>(args)...);
 }
 
 #endif /* THREAD_POOL_H */
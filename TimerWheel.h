@@ -0,0 +1,284 @@
+#ifndef TIMER_WHEEL_H_
+#define TIMER_WHEEL_H_
+
+#include <cstddef>
+#include <cstdint>
+
+// What a TimerWheel links into its slots: embedded in whatever it schedules, so that
+// inserting and removing never allocate
+struct TimerEntry
+{
+    TimerEntry* next;
+    TimerEntry** prev;                  // The pointer that points to this entry
+    std::uint64_t expiry;               // In ticks
+    unsigned char level, slot;
+
+    TimerEntry() : next(nullptr), prev(nullptr), expiry(0), level(0), slot(0) {}
+};
+
+// A hierarchical timing wheel: LEVELS wheels of SLOTS slots each, where a slot of level L
+// spans SLOTS^L ticks. An entry goes to the level of the highest SLOT_BITS-bit digit in
+// which its expiry differs from the current tick, so inserting and removing are O(1).
+// As the current tick reaches a slot of a higher level, that slot's entries cascade
+// down to the lower ones. Empty stretches are skipped over (using a bitmap of occupied
+// slots per level), so the owner only needs to call advance() at nextExpiry(), however
+// many entries there are. Not thread-safe.
+class TimerWheel
+{
+private:
+    static const int SLOT_BITS = 6;
+    static const int SLOTS = 1 << SLOT_BITS;
+    static const int LEVELS = (64 + SLOT_BITS - 1) / SLOT_BITS;    // Enough for any 64-bit tick
+    static const std::uint64_t SLOT_MASK = SLOTS - 1;
+
+    TimerEntry* slots_[LEVELS][SLOTS];
+    std::uint64_t occupied_[LEVELS];    // Bit s of level L is set if slots_[L][s] isn't empty
+    std::uint64_t now_;                 // Every entry expiring at or before now_ has been taken out
+    std::size_t size_;
+
+    static int lowestBit(std::uint64_t bits);
+    static int highestBit(std::uint64_t bits);
+    static std::uint64_t slotsAfter(std::uint64_t slot);
+    static std::uint64_t levelStart(std::uint64_t tick, int level);
+
+    void link(TimerEntry* entry);
+    TimerEntry* takeSlot(int level, int slot);
+    bool nextSlot(int& level, int& slot, std::uint64_t& start) const;
+public:
+    static const std::uint64_t NEVER = ~static_cast<std::uint64_t>(0);
+
+    explicit TimerWheel(std::uint64_t now = 0);
+
+    TimerWheel(const TimerWheel& other) = delete;
+    TimerWheel& operator=(const TimerWheel& other) = delete;
+
+    void insert(TimerEntry* entry, std::uint64_t expiry);
+    void remove(TimerEntry* entry);
+
+    template <class Fn>
+    void advance(std::uint64_t now, Fn&& expired);
+
+    template <class Fn>
+    void clear(Fn&& removed);
+
+    std::uint64_t nextExpiry() const;
+    std::uint64_t now() const;
+    std::size_t size() const;
+    bool empty() const;
+};
+
+inline
+TimerWheel::TimerWheel(std::uint64_t now)
+    : now_(now)
+    , size_(0)
+{
+    for (int level = 0; level != LEVELS; ++level)
+    {
+        occupied_[level] = 0;
+        for (int slot = 0; slot != SLOTS; ++slot)
+            slots_[level][slot] = nullptr;
+    }
+}
+
+inline
+int TimerWheel::lowestBit(std::uint64_t bits)
+{
+#if defined(__GNUC__) || defined(__clang__)
+    return __builtin_ctzll(bits);
+#else
+    int bit = 0;
+    while (!(bits & 1))
+    {
+        bits >>= 1;
+        ++bit;
+    }
+    return bit;
+#endif
+}
+
+inline
+int TimerWheel::highestBit(std::uint64_t bits)
+{
+#if defined(__GNUC__) || defined(__clang__)
+    return 63 - __builtin_clzll(bits);
+#else
+    int bit = 0;
+    while (bits >>= 1)
+        ++bit;
+    return bit;
+#endif
+}
+
+// The bits of the slots after slot
+inline
+std::uint64_t TimerWheel::slotsAfter(std::uint64_t slot)
+{
+    return slot == SLOT_MASK ? 0 : ~static_cast<std::uint64_t>(0) << (slot + 1);
+}
+
+// The first tick of the level-L slot span (the slot of level L + 1) that tick is in
+inline
+std::uint64_t TimerWheel::levelStart(std::uint64_t tick, int level)
+{
+    const int bits = (level + 1) * SLOT_BITS;
+    return bits >= 64 ? 0 : tick >> bits << bits;
+}
+
+// An entry that's already due is put in the next tick's slot
+inline
+void TimerWheel::insert(TimerEntry* entry, std::uint64_t expiry)
+{
+    entry->expiry = expiry > now_ ? expiry : now_ + 1;
+    link(entry);
+    ++size_;
+}
+
+inline
+void TimerWheel::link(TimerEntry* entry)
+{
+    const int level = highestBit(entry->expiry ^ now_) / SLOT_BITS;
+    const int slot = static_cast<int>((entry->expiry >> (level * SLOT_BITS)) & SLOT_MASK);
+
+    TimerEntry*& head = slots_[level][slot];
+    entry->next = head;
+    entry->prev = &head;
+    if (head)
+        head->prev = &entry->next;
+    head = entry;
+    entry->level = static_cast<unsigned char>(level);
+    entry->slot = static_cast<unsigned char>(slot);
+    occupied_[level] |= static_cast<std::uint64_t>(1) << slot;
+}
+
+// The entry must be in the wheel
+inline
+void TimerWheel::remove(TimerEntry* entry)
+{
+    *entry->prev = entry->next;
+    if (entry->next)
+        entry->next->prev = entry->prev;
+    if (!slots_[entry->level][entry->slot])
+        occupied_[entry->level] &= ~(static_cast<std::uint64_t>(1) << entry->slot);
+    entry->next = nullptr;
+    entry->prev = nullptr;
+    --size_;
+}
+
+// Unlinks a whole slot at once, returning its first entry
+inline
+TimerEntry* TimerWheel::takeSlot(int level, int slot)
+{
+    TimerEntry* first = slots_[level][slot];
+    slots_[level][slot] = nullptr;
+    occupied_[level] &= ~(static_cast<std::uint64_t>(1) << slot);
+    return first;
+}
+
+// Finds the first occupied slot after the current tick: since every entry of level L
+// shares the current tick's digits above L, it's the lowest level's lowest occupied slot.
+// Its first tick is start.
+inline
+bool TimerWheel::nextSlot(int& level, int& slot, std::uint64_t& start) const
+{
+    for (level = 0; level != LEVELS; ++level)
+    {
+        std::uint64_t current = (now_ >> (level * SLOT_BITS)) & SLOT_MASK;
+        std::uint64_t after = occupied_[level] & slotsAfter(current);
+        if (after)
+        {
+            slot = lowestBit(after);
+            start = levelStart(now_, level) | static_cast<std::uint64_t>(slot) << (level * SLOT_BITS);
+            return true;
+        }
+    }
+    return false;
+}
+
+// Moves the current tick up to now, calling expired(entry) for each entry that becomes
+// due, in order of expiry, after taking it out of the wheel (so expired may insert it
+// again, or insert others). A level-0 slot's entries all expire on the same tick; a
+// higher slot's are redistributed when the current tick reaches its first tick.
+template <class Fn>
+void TimerWheel::advance(std::uint64_t now, Fn&& expired)
+{
+    int level, slot;
+    std::uint64_t start;
+    while (now_ < now)
+    {
+        // Everything before start is empty, so the wheel can jump right to it
+        if (!nextSlot(level, slot, start) || start > now)
+        {
+            now_ = now;
+            return;
+        }
+
+        now_ = start;
+        TimerEntry* entry = takeSlot(level, slot);
+        while (entry)
+        {
+            TimerEntry* next = entry->next;
+            if (entry->expiry == now_)
+            {
+                entry->next = nullptr;
+                entry->prev = nullptr;
+                --size_;
+                expired(entry);
+            }
+            else
+                link(entry);
+            entry = next;
+        }
+    }
+}
+
+// Takes every entry out, calling removed(entry) for each
+template <class Fn>
+void TimerWheel::clear(Fn&& removed)
+{
+    for (int level = 0; level != LEVELS; ++level)
+        while (occupied_[level])
+        {
+            TimerEntry* entry = takeSlot(level, lowestBit(occupied_[level]));
+            while (entry)
+            {
+                TimerEntry* next = entry->next;
+                entry->next = nullptr;
+                entry->prev = nullptr;
+                --size_;
+                removed(entry);
+                entry = next;
+            }
+        }
+}
+
+// The tick at which advance() next has something to do: an entry expires, or a slot
+// cascades. NEVER if the wheel is empty.
+inline
+std::uint64_t TimerWheel::nextExpiry() const
+{
+    int level, slot;
+    std::uint64_t start;
+    if (!nextSlot(level, slot, start))
+        return NEVER;
+    return start;
+}
+
+inline
+std::uint64_t TimerWheel::now() const
+{
+    return now_;
+}
+
+inline
+std::size_t TimerWheel::size() const
+{
+    return size_;
+}
+
+inline
+bool TimerWheel::empty() const
+{
+    return size_ == 0;
+}
+
+#endif /* TIMER_WHEEL_H_ */
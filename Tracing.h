@@ -0,0 +1,262 @@
+#ifndef TRACING_H_
+#define TRACING_H_
+
+#include <atomic>
+#include <memory>
+#include <chrono>
+#include <ostream>
+#include <cstddef>
+#include <cstdint>
+
+#include "CacheAligned.h"
+
+// What a RingTracer records, on the thread it happened on
+enum class TraceEvent
+{
+    Enqueue,                    // A task was queued
+    Start,                      // A task started running
+    End,                        // and finished
+    Steal,                      // A task was taken from another thread's deque or LIFO slot
+    Park,                       // The thread blocked, for lack of tasks
+    Unpark                      // and woke up
+};
+
+// Records what a pool's threads do, by default when THREADPOOL_TRACING is defined (or
+// with PoolPolicy<Queue, Metrics, RingTracer>), between start() and stop(). Each thread
+// writes to a ring of its own (the threads outside the pool share ring 0), which keeps
+// its latest events, so tracing never allocates or blocks. While stopped, each event
+// costs a single branch. Events are numbered by task, so a trace can follow a task from
+// its Enqueue to its Start. start(), stop() and write() mustn't be called concurrently.
+class RingTracer
+{
+public:
+    typedef std::chrono::steady_clock Clock;
+
+    // Every task carries one (see BasicThreadPool::TaskNode)
+    struct TaskStamp
+    {
+        std::uint64_t traceId;                  // 0 if queued while stopped
+
+        TaskStamp() : traceId(0) {}
+    };
+private:
+    // Atomic fields, so that write() can read the rings while they're written to (the
+    // trace is only consistent once the threads are done with the events it reads)
+    struct Event
+    {
+        std::atomic<std::uint64_t> nanos, task, kind;
+    };
+
+    struct Ring
+    {
+        std::unique_ptr<Event[]> events;
+        std::atomic<std::uint64_t> written;     // Events ever recorded (the ring keeps the latest)
+
+        Ring() : written(0) {}
+    };
+
+    CacheAlignedArray<Ring> rings_;
+    std::size_t capacity_;                      // Per ring, a power of two (0 until started)
+    std::atomic<bool> enabled_;
+    std::atomic<std::uint64_t> lastTask_;
+    const Clock::time_point epoch_;
+
+    void record(int thread, TraceEvent event, std::uint64_t task)
+    {
+        Ring& ring = rings_[thread];
+        Event& e = ring.events[ring.written.fetch_add(1, std::memory_order_relaxed) & (capacity_ - 1)];
+        e.nanos.store(std::chrono::duration_cast<std::chrono::nanoseconds>(Clock::now() - epoch_).count(),
+                      std::memory_order_relaxed);
+        e.task.store(task, std::memory_order_relaxed);
+        e.kind.store(static_cast<std::uint64_t>(event), std::memory_order_relaxed);
+    }
+
+    static void writeEvent(std::ostream& out, const char* name, const char* phase, std::uint64_t nanos,
+                           int thread, std::uint64_t task);
+public:
+    // Thread 0 is outside the pool, threads 1 to numThreads its own
+    explicit RingTracer(int numThreads)
+        : rings_(numThreads + 1)
+        , capacity_(0)
+        , enabled_(false)
+        , lastTask_(0)
+        , epoch_(Clock::now())
+    {}
+
+    bool enabled() const { return enabled_.load(std::memory_order_acquire); }
+
+    void start(std::size_t eventsPerThread);
+    void stop() { enabled_.store(false, std::memory_order_release); }
+    void write(std::ostream& out) const;
+
+    void taskQueued(TaskStamp& stamp, int thread)
+    {
+        if (enabled())
+        {
+            stamp.traceId = lastTask_.fetch_add(1, std::memory_order_relaxed) + 1;
+            record(thread, TraceEvent::Enqueue, stamp.traceId);
+        }
+    }
+
+    void taskStarted(const TaskStamp& stamp, int thread)
+    {
+        if (enabled())
+            record(thread, TraceEvent::Start, stamp.traceId);
+    }
+
+    void taskFinished(const TaskStamp& stamp, int thread)
+    {
+        if (enabled())
+            record(thread, TraceEvent::End, stamp.traceId);
+    }
+
+    void taskStolen(const TaskStamp& stamp, int thread)
+    {
+        if (enabled())
+            record(thread, TraceEvent::Steal, stamp.traceId);
+    }
+
+    void parked(int thread)
+    {
+        if (enabled())
+            record(thread, TraceEvent::Park, 0);
+    }
+
+    void unparked(int thread)
+    {
+        if (enabled())
+            record(thread, TraceEvent::Unpark, 0);
+    }
+};
+
+// Clears the rings and starts recording. The rings are allocated by the first call,
+// with room for eventsPerThread (rounded up to a power of two) each; later calls reuse
+// them, since a thread may still be recording into them.
+inline
+void RingTracer::start(std::size_t eventsPerThread)
+{
+    if (capacity_ == 0)
+    {
+        std::size_t capacity = 1;
+        while (capacity < eventsPerThread)
+            capacity *= 2;
+        for (std::size_t i = 0; i != rings_.size(); ++i)
+            rings_[i].events.reset(new Event[capacity]);
+        capacity_ = capacity;
+    }
+
+    for (std::size_t i = 0; i != rings_.size(); ++i)
+        rings_[i].written.store(0, std::memory_order_relaxed);
+    enabled_.store(true, std::memory_order_release);
+}
+
+// Writes the events the rings still hold as Chrome trace JSON, e.g. to load in
+// chrome://tracing or ui.perfetto.dev: a track per thread, where tasks and parked
+// stretches are slices, enqueues and steals are instants, and an arrow joins each task's
+// enqueue to its start. Meant to be called once stopped (and the threads are idle).
+inline
+void RingTracer::write(std::ostream& out) const
+{
+    out << "{\"traceEvents\": [\n"
+        << "{\"name\": \"thread_name\", \"ph\": \"M\", \"pid\": 1, \"tid\": 0, "
+        << "\"args\": {\"name\": \"outside the pool\"}}";
+    for (std::size_t thread = 1; thread != rings_.size(); ++thread)
+        out << ",\n{\"name\": \"thread_name\", \"ph\": \"M\", \"pid\": 1, \"tid\": " << thread
+            << ", \"args\": {\"name\": \"thread " << thread << "\"}}";
+
+    for (std::size_t thread = 0; capacity_ != 0 && thread != rings_.size(); ++thread)
+    {
+        const Ring& ring = rings_[thread];
+        const std::uint64_t written = ring.written.load(std::memory_order_acquire);
+        int open = 0;                           // Slices begun but not ended yet
+        for (std::uint64_t i = written > capacity_ ? written - capacity_ : 0; i != written; ++i)
+        {
+            const Event& e = ring.events[i & (capacity_ - 1)];
+            const std::uint64_t nanos = e.nanos.load(std::memory_order_relaxed);
+            const std::uint64_t task = e.task.load(std::memory_order_relaxed);
+            const int t = static_cast<int>(thread);
+            switch (static_cast<TraceEvent>(e.kind.load(std::memory_order_relaxed)))
+            {
+            case TraceEvent::Enqueue:
+                writeEvent(out, "enqueue", "i", nanos, t, task);
+                writeEvent(out, "queued", "s", nanos, t, task);
+                break;
+            case TraceEvent::Start:
+                writeEvent(out, "task", "B", nanos, t, task);
+                writeEvent(out, "queued", "f", nanos, t, task);
+                ++open;
+                break;
+            case TraceEvent::Park:
+                writeEvent(out, "parked", "B", nanos, t, 0);
+                ++open;
+                break;
+            case TraceEvent::End:
+            case TraceEvent::Unpark:
+                // (Unless the slice began before the ring's oldest event)
+                if (open != 0)
+                {
+                    writeEvent(out, "", "E", nanos, t, 0);
+                    --open;
+                }
+                break;
+            case TraceEvent::Steal:
+                writeEvent(out, "steal", "i", nanos, t, task);
+                break;
+            }
+        }
+    }
+    out << "\n], \"displayTimeUnit\": \"ns\"}\n";
+}
+
+// Flow events ("s" and "f") need a task, the others show it as an argument if they have
+// one. Timestamps are in microseconds.
+inline
+void RingTracer::writeEvent(std::ostream& out, const char* name, const char* phase, std::uint64_t nanos,
+                            int thread, std::uint64_t task)
+{
+    const bool flow = phase[0] == 's' || phase[0] == 'f';
+    if (flow && task == 0)
+        return;
+
+    const char digits[] = { char('0' + nanos / 100 % 10), char('0' + nanos / 10 % 10), char('0' + nanos % 10), 0 };
+    out << ",\n{\"name\": \"" << name << "\", \"ph\": \"" << phase << "\", \"ts\": " << nanos / 1000 << '.'
+        << digits << ", \"pid\": 1, \"tid\": " << thread;
+    if (flow)
+        out << ", \"cat\": \"task\", \"id\": " << task << (phase[0] == 'f' ? ", \"bp\": \"e\"" : "");
+    else if (phase[0] == 'i')
+        out << ", \"s\": \"t\"";
+    if (!flow && task != 0)
+        out << ", \"args\": {\"task\": " << task << "}";
+    out << "}";
+}
+
+// Without THREADPOOL_TRACING (or with PoolPolicy<Queue, Metrics, NoTracer>), nothing is
+// recorded, the calls compile to nothing, and the trace is empty
+class NoTracer
+{
+public:
+    struct TaskStamp {};
+
+    explicit NoTracer(int) {}
+
+    bool enabled() const { return false; }
+    void start(std::size_t) {}
+    void stop() {}
+    void write(std::ostream& out) const { out << "{\"traceEvents\": []}\n"; }
+
+    void taskQueued(TaskStamp&, int) {}
+    void taskStarted(const TaskStamp&, int) {}
+    void taskFinished(const TaskStamp&, int) {}
+    void taskStolen(const TaskStamp&, int) {}
+    void parked(int) {}
+    void unparked(int) {}
+};
+
+// The tracer pools use unless their PoolPolicy says otherwise
+#ifdef THREADPOOL_TRACING
+typedef RingTracer PoolTracer;
+#else
+typedef NoTracer PoolTracer;
+#endif
+
+#endif /* TRACING_H_ */
@@ -0,0 +1,165 @@
+#ifndef WORK_STEALING_DEQUE_H_
+#define WORK_STEALING_DEQUE_H_
+
+#include <atomic>
+#include <vector>
+#include <cstdint>
+#include <type_traits>
+
+// A Chase-Lev work-stealing deque (using the memory orderings from Le et al., "Correct
+// and Efficient Work-Stealing for Weak Memory Models"). The owning thread pushes and
+// pops at the bottom; any other thread may steal from the top. T must be trivially
+// copyable (in practice, a pointer).
+template <class T>
+class WorkStealingDeque
+{
+private:
+    struct Array
+    {
+        std::int64_t mask;
+        std::atomic<T>* slots;
+
+        explicit Array(std::int64_t capacity) : mask(capacity - 1), slots(new std::atomic<T>[capacity]) {}
+        ~Array() { delete[] slots; }
+
+        std::int64_t capacity() const { return mask + 1; }
+        T get(std::int64_t i) const { return slots[i & mask].load(std::memory_order_relaxed); }
+        void put(std::int64_t i, T item) { slots[i & mask].store(item, std::memory_order_relaxed); }
+    };
+
+    std::atomic<std::int64_t> top_;
+    std::atomic<std::int64_t> bottom_;
+    std::atomic<Array*> array_;
+    std::vector<Array*> retired_;           // Arrays replaced by grow(); thieves may still be reading them
+
+    Array* grow(Array* old, std::int64_t bottom, std::int64_t top);
+public:
+    explicit WorkStealingDeque(std::int64_t capacity = 1024);
+    ~WorkStealingDeque();
+
+    WorkStealingDeque(const WorkStealingDeque& other) = delete;
+    WorkStealingDeque& operator=(const WorkStealingDeque& other) = delete;
+
+    void push(T item);
+    bool pop(T& item);
+    bool steal(T& item);
+
+    std::int64_t size() const;
+    bool empty() const;
+};
+
+// Capacity is rounded up to a power of two
+template <class T>
+WorkStealingDeque<T>::WorkStealingDeque(std::int64_t capacity)
+    : top_(0)
+    , bottom_(0)
+{
+    static_assert(std::is_trivially_copyable<T>::value, "WorkStealingDeque elements must be trivially copyable");
+
+    std::int64_t actual = 1;
+    while (actual < capacity)
+        actual *= 2;
+    array_.store(new Array(actual), std::memory_order_relaxed);
+}
+
+template <class T>
+WorkStealingDeque<T>::~WorkStealingDeque()
+{
+    delete array_.load(std::memory_order_relaxed);
+    for (std::size_t i = 0; i != retired_.size(); ++i)
+        delete retired_[i];
+}
+
+// Only the owning thread may call push()
+template <class T>
+void WorkStealingDeque<T>::push(T item)
+{
+    std::int64_t b = bottom_.load(std::memory_order_relaxed);
+    std::int64_t t = top_.load(std::memory_order_acquire);
+    Array* a = array_.load(std::memory_order_relaxed);
+
+    if (b - t > a->capacity() - 1)
+        a = grow(a, b, t);
+
+    a->put(b, item);
+    bottom_.store(b + 1, std::memory_order_release);
+}
+
+// Only the owning thread may call pop(). Returns false if the deque was empty
+// (or a thief took the last item first).
+template <class T>
+bool WorkStealingDeque<T>::pop(T& item)
+{
+    std::int64_t b = bottom_.load(std::memory_order_relaxed) - 1;
+    Array* a = array_.load(std::memory_order_relaxed);
+    bottom_.store(b, std::memory_order_relaxed);
+    std::atomic_thread_fence(std::memory_order_seq_cst);
+    std::int64_t t = top_.load(std::memory_order_relaxed);
+
+    if (t > b)
+    {
+        bottom_.store(b + 1, std::memory_order_relaxed);
+        return false;
+    }
+
+    item = a->get(b);
+    if (t == b)
+    {
+        // Last item - race against thieves for it
+        bool won = top_.compare_exchange_strong(t, t + 1, std::memory_order_seq_cst, std::memory_order_relaxed);
+        bottom_.store(b + 1, std::memory_order_relaxed);
+        return won;
+    }
+    return true;
+}
+
+// May be called from any thread. Returns false if the deque was empty or another
+// thread won the race for the top item.
+template <class T>
+bool WorkStealingDeque<T>::steal(T& item)
+{
+    std::int64_t t = top_.load(std::memory_order_acquire);
+    std::atomic_thread_fence(std::memory_order_seq_cst);
+    std::int64_t b = bottom_.load(std::memory_order_acquire);
+
+    if (t >= b)
+        return false;
+
+    Array* a = array_.load(std::memory_order_acquire);
+    T candidate = a->get(t);
+    if (!top_.compare_exchange_strong(t, t + 1, std::memory_order_seq_cst, std::memory_order_relaxed))
+        return false;
+
+    item = candidate;
+    return true;
+}
+
+// Approximate when called concurrently with push()/pop()/steal()
+template <class T>
+std::int64_t WorkStealingDeque<T>::size() const
+{
+    std::int64_t b = bottom_.load(std::memory_order_relaxed);
+    std::int64_t t = top_.load(std::memory_order_relaxed);
+    return b > t ? b - t : 0;
+}
+
+template <class T>
+bool WorkStealingDeque<T>::empty() const
+{
+    return size() == 0;
+}
+
+template <class T>
+typename WorkStealingDeque<T>::Array*
+WorkStealingDeque<T>::grow(Array* old, std::int64_t bottom, std::int64_t top)
+{
+    Array* a = new Array(old->capacity() * 2);
+    for (std::int64_t i = top; i != bottom; ++i)
+        a->put(i, old->get(i));
+
+    retired_.push_back(old);
+    array_.store(a, std::memory_order_release);
+    return a;
+}
+
+#endif /* WORK_STEALING_DEQUE_H_ */
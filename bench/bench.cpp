@@ -0,0 +1,372 @@
+#include <future>
+#include <thread>
+#include <vector>
+#include <chrono>
+#include <algorithm>
+#include <numeric>
+#include <string>
+#include <atomic>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <cstdint>
+
+#include "../ThreadPool.h"
+#include "../GenericThreadPool.h"
+#include "../Algorithms.h"
+
+using namespace std;
+
+// Scheduler benchmarks. Every scenario runs for each pool mode and thread count of the
+// sweep, and prints one line of CSV (or one JSON object with --json) per run, so that
+// runs before and after a change can be compared. The algorithm scenarios (sort,
+// transform, inclusive_scan, find_if) also run their std:: counterpart first, as mode
+// "std", over the same --elements.
+//
+// usage: bench.out [--json] [--quick] [--max-threads=N] [--scenario=NAME] [--elements=N]
+
+typedef chrono::steady_clock Clock;
+
+struct Result
+{
+    string scenario;
+    string mode;
+    int threads;
+    long ops;
+    double seconds;
+    vector<double> latencies;       // In microseconds, if the scenario measures them
+};
+
+struct Config
+{
+    bool json;
+    bool quick;
+    int maxThreads;
+    string scenario;
+    long elements;                  // For the algorithm scenarios (0: the default)
+};
+
+double micros(Clock::duration d)
+{
+    return chrono::duration<double, micro>(d).count();
+}
+
+double percentile(vector<double>& sorted, double p)
+{
+    if (sorted.empty())
+        return 0;
+    size_t i = static_cast<size_t>(p * (sorted.size() - 1) + 0.5);
+    return sorted[i];
+}
+
+void spinFor(chrono::microseconds d)
+{
+    Clock::time_point end = Clock::now() + d;
+    while (Clock::now() < end)
+        ;
+}
+
+ThreadPoolOptions modeOptions(const string& mode)
+{
+    ThreadPoolOptions options;
+    if (mode == "stealing")
+        options.workStealing = true;
+    else if (mode == "lifo")
+        options.lifoSlot = true;
+    else if (mode == "bounded")
+        options.queueCapacity = 1024;
+    else if (mode == "spin")
+        options.idlePolicy = IdlePolicy::SpinThenYield;
+    return options;
+}
+
+// Empty tasks submitted from one thread, as fast as possible
+void benchThroughput(GenericThreadPool& pool, long n, Result& result)
+{
+    Clock::time_point start = Clock::now();
+    for (long i = 0; i < n; ++i)
+        pool.execute([]() {});
+    pool.wait();
+    result.seconds = chrono::duration<double>(Clock::now() - start).count();
+    result.ops = n;
+}
+
+// One task at a time: from submit() to the task starting (on an idle pool, so this
+// includes waking a thread up)
+void benchSubmitLatency(GenericThreadPool& pool, long n, Result& result)
+{
+    Clock::time_point start = Clock::now();
+    for (long i = 0; i < n; ++i)
+    {
+        Clock::time_point submitted = Clock::now();
+        future<Clock::time_point> started = pool.submit([]() { return Clock::now(); });
+        result.latencies.push_back(micros(started.get() - submitted));
+    }
+    result.seconds = chrono::duration<double>(Clock::now() - start).count();
+    result.ops = n;
+}
+
+// Rounds of a few tiny tasks per thread, each followed by wait()
+void benchForkJoin(GenericThreadPool& pool, long rounds, Result& result)
+{
+    const int tasks = 4 * pool.threadCount();
+    atomic<int> counter(0);
+    Clock::time_point start = Clock::now();
+    for (long r = 0; r < rounds; ++r)
+    {
+        Clock::time_point forked = Clock::now();
+        for (int i = 0; i < tasks; ++i)
+            pool.execute([&counter]() { ++counter; });
+        pool.wait();
+        result.latencies.push_back(micros(Clock::now() - forked));
+    }
+    result.seconds = chrono::duration<double>(Clock::now() - start).count();
+    result.ops = rounds;
+}
+
+// As many producer threads as pool threads, all submitting empty tasks at once (each
+// through a producer token of its own, if tokens)
+void benchContention(GenericThreadPool& pool, long n, bool tokens, Result& result)
+{
+    const int producers = max(2, pool.threadCount());
+    vector<thread> threads;
+    Clock::time_point start = Clock::now();
+    for (int p = 0; p < producers; ++p)
+        threads.emplace_back([&pool, n, producers, tokens]() {
+            if (tokens)
+            {
+                GenericThreadPool::ProducerToken token = pool.producerToken();
+                for (long i = 0; i < n / producers; ++i)
+                    pool.executeFrom(token, []() {});
+            }
+            else
+                for (long i = 0; i < n / producers; ++i)
+                    pool.execute([]() {});
+        });
+    for (int p = 0; p < producers; ++p)
+        threads[p].join();
+    pool.wait();
+    result.seconds = chrono::duration<double>(Clock::now() - start).count();
+    result.ops = n / producers * producers;
+}
+
+// One task per pool thread, each submitting its share of empty tasks from inside the
+// pool: every thread submits, takes and finishes tasks at once, so this is where pool
+// state shared between threads (counters, flags on the same cache line) shows. Not run
+// with a bounded queue, whose Block backpressure would stall every thread in a submit.
+void benchNested(GenericThreadPool& pool, long n, Result& result)
+{
+    const int roots = pool.threadCount();
+    Clock::time_point start = Clock::now();
+    for (int r = 0; r < roots; ++r)
+        pool.execute([&pool, n, roots]() {
+            for (long i = 0; i < n / roots; ++i)
+                pool.execute([]() {});
+        });
+    pool.wait();
+    result.seconds = chrono::duration<double>(Clock::now() - start).count();
+    result.ops = n / roots * roots;
+}
+
+// Short tasks submitted behind a backlog of long (200us) ones: the latency of the short
+// ones, either queued normally or with Priority::High
+void benchMixed(GenericThreadPool& pool, long n, Priority priority, Result& result)
+{
+    Clock::time_point start = Clock::now();
+    for (long i = 0; i < n; ++i)
+    {
+        for (int j = 0; j < pool.threadCount(); ++j)
+            pool.submitWithPriority(Priority::Low, []() { spinFor(chrono::microseconds(200)); });
+
+        Clock::time_point submitted = Clock::now();
+        future<Clock::time_point> started = pool.submitWithPriority(priority, []() { return Clock::now(); });
+        result.latencies.push_back(micros(started.get() - submitted));
+    }
+    pool.wait();
+    result.seconds = chrono::duration<double>(Clock::now() - start).count();
+    result.ops = n;
+}
+
+// The same pseudo-random values for every run
+vector<uint64_t> randomValues(long n)
+{
+    vector<uint64_t> values(n);
+    uint64_t x = 88172645463325252ULL;
+    for (uint64_t& value : values)
+    {
+        x ^= x << 13;
+        x ^= x >> 7;
+        x ^= x << 17;
+        value = x;
+    }
+    return values;
+}
+
+// One of the algorithms over n elements, on pool (or with the std:: algorithm, if pool is
+// null). find_if's match is three quarters of the way in.
+void benchAlgorithm(GenericThreadPool* pool, const string& name, long n, Result& result)
+{
+    vector<uint64_t> values = randomValues(n);
+    vector<uint64_t> out(n);
+    if (name == "find_if")
+        values[n / 4 * 3] = 0;
+
+    Clock::time_point start = Clock::now();
+    if (name == "sort")
+    {
+        if (pool)
+            parallelSort(*pool, values.begin(), values.end());
+        else
+            sort(values.begin(), values.end());
+    }
+    else if (name == "transform")
+    {
+        auto op = [](uint64_t x) { return x * 0x9E3779B97F4A7C15ULL >> 7; };
+        if (pool)
+            parallelTransform(*pool, values.begin(), values.end(), out.begin(), op);
+        else
+            transform(values.begin(), values.end(), out.begin(), op);
+    }
+    else if (name == "inclusive_scan")
+    {
+        if (pool)
+            parallelInclusiveScan(*pool, values.begin(), values.end(), out.begin());
+        else
+            partial_sum(values.begin(), values.end(), out.begin());
+    }
+    else
+    {
+        auto isZero = [](uint64_t x) { return x == 0; };
+        vector<uint64_t>::iterator match = pool ? parallelFindIf(*pool, values.begin(), values.end(), isZero) :
+                                                  find_if(values.begin(), values.end(), isZero);
+        if (match - values.begin() != n / 4 * 3)
+            fprintf(stderr, "find_if: wrong match\n");
+    }
+    result.seconds = chrono::duration<double>(Clock::now() - start).count();
+    result.ops = n;
+}
+
+bool isAlgorithm(const string& scenario)
+{
+    return scenario == "sort" || scenario == "transform" || scenario == "inclusive_scan" || scenario == "find_if";
+}
+
+void printResult(const Config& config, Result& result, bool first)
+{
+    double perSecond = result.seconds > 0 ? result.ops / result.seconds : 0;
+    sort(result.latencies.begin(), result.latencies.end());
+    double mean = result.latencies.empty() ? 0 :
+        accumulate(result.latencies.begin(), result.latencies.end(), 0.0) / result.latencies.size();
+    double p50 = percentile(result.latencies, 0.5);
+    double p99 = percentile(result.latencies, 0.99);
+
+    if (config.json)
+        printf("%s  {\"scenario\": \"%s\", \"mode\": \"%s\", \"threads\": %d, \"ops\": %ld, \"seconds\": %.6f, "
+               "\"ops_per_sec\": %.1f, \"mean_us\": %.3f, \"p50_us\": %.3f, \"p99_us\": %.3f}",
+               first ? "" : ",\n", result.scenario.c_str(), result.mode.c_str(), result.threads,
+               result.ops, result.seconds, perSecond, mean, p50, p99);
+    else
+        printf("%s,%s,%d,%ld,%.6f,%.1f,%.3f,%.3f,%.3f\n", result.scenario.c_str(), result.mode.c_str(),
+               result.threads, result.ops, result.seconds, perSecond, mean, p50, p99);
+    fflush(stdout);
+}
+
+int main(int argc, char** argv)
+{
+    Config config;
+    config.json = false;
+    config.quick = false;
+    config.maxThreads = max(1u, thread::hardware_concurrency());
+    config.elements = 0;
+    for (int i = 1; i < argc; ++i)
+    {
+        if (!strcmp(argv[i], "--json"))
+            config.json = true;
+        else if (!strcmp(argv[i], "--quick"))
+            config.quick = true;
+        else if (!strncmp(argv[i], "--max-threads=", 14))
+            config.maxThreads = max(1, atoi(argv[i] + 14));
+        else if (!strncmp(argv[i], "--scenario=", 11))
+            config.scenario = argv[i] + 11;
+        else if (!strncmp(argv[i], "--elements=", 11))
+            config.elements = max(1L, atol(argv[i] + 11));
+        else
+        {
+            fprintf(stderr, "usage: %s [--json] [--quick] [--max-threads=N] [--scenario=NAME] [--elements=N]\n",
+                    argv[0]);
+            return 1;
+        }
+    }
+
+    // 1, 2, 4, ... and the maximum itself
+    vector<int> threadCounts;
+    for (int t = 1; t < config.maxThreads; t *= 2)
+        threadCounts.push_back(t);
+    threadCounts.push_back(config.maxThreads);
+
+    const long scale = config.quick ? 1 : 10;
+    const long elements = config.elements != 0 ? config.elements : 1000000 * scale;
+    const char* modes[] = { "shared", "stealing", "lifo", "bounded", "spin" };
+    const char* scenarios[] = { "throughput", "submit_latency", "fork_join", "contention", "contention_tokens",
+                                "nested", "mixed", "mixed_high", "sort", "transform", "inclusive_scan", "find_if" };
+
+    if (config.json)
+        printf("[\n");
+    else
+        printf("scenario,mode,threads,ops,seconds,ops_per_sec,mean_us,p50_us,p99_us\n");
+
+    bool first = true;
+    for (const char* scenario : scenarios)
+    {
+        if (!config.scenario.empty() && config.scenario != scenario)
+            continue;
+        if (isAlgorithm(scenario))
+        {
+            Result result;
+            result.scenario = scenario;
+            result.mode = "std";
+            result.threads = 1;
+            benchAlgorithm(nullptr, scenario, elements, result);
+            printResult(config, result, first);
+            first = false;
+        }
+        for (const char* mode : modes)
+            for (int threads : threadCounts)
+            {
+                if (!strcmp(scenario, "nested") && !strcmp(mode, "bounded"))
+                    continue;
+                GenericThreadPool pool(threads, modeOptions(mode));
+                Result result;
+                result.scenario = scenario;
+                result.mode = mode;
+                result.threads = threads;
+
+                string name = scenario;
+                if (name == "throughput")
+                    benchThroughput(pool, 20000 * scale, result);
+                else if (name == "submit_latency")
+                    benchSubmitLatency(pool, 200 * scale, result);
+                else if (name == "fork_join")
+                    benchForkJoin(pool, 200 * scale, result);
+                else if (name == "contention")
+                    benchContention(pool, 20000 * scale, false, result);
+                else if (name == "contention_tokens")
+                    benchContention(pool, 20000 * scale, true, result);
+                else if (name == "nested")
+                    benchNested(pool, 20000 * scale, result);
+                else if (name == "mixed")
+                    benchMixed(pool, 20 * scale, Priority::Normal, result);
+                else if (name == "mixed_high")
+                    benchMixed(pool, 20 * scale, Priority::High, result);
+                else
+                    benchAlgorithm(&pool, name, elements, result);
+
+                printResult(config, result, first);
+                first = false;
+            }
+    }
+
+    if (config.json)
+        printf("\n]\n");
+    return 0;
+}
@@ -2,13 +2,27 @@
 #define THREAD_POOL_H_
 
 #include <vector>
-#include <queue>
 #include <future>
 #include <mutex>
 #include <condition_variable>
 #include <algorithm>
 #include <utility>
 #include <type_traits>
+#include <atomic>
+#include <memory>
+#include <thread>
+#include <chrono>
+#include <deque>
+#include <functional>
+#include <exception>
+#include <cstdint>
+#include <cstddef>
+#include <new>
+#include <tuple>
+#include <string>
+#include <fstream>
+#include <cstdlib>
+#include <ostream>
 
 /**
  * Copyright (c) 2015 by Michael Wang
@@ -33,7 +47,7 @@
  */
 
 // -------------- Sequences -------------
- 
+
 template<int... Nums>
 struct Sequence { };
 
@@ -46,23 +60,472 @@ struct IndexSequence<0, Nums...>
     typedef Sequence<Nums...> seq;
 };
 
+// ----------- UniqueFunction -----------
+
+template <class Signature>
+class UniqueFunction;
+
+// A move-only replacement for std::function. Callables of up to INLINE_SIZE bytes
+// (that can be moved without throwing) are stored inside the object itself, so
+// wrapping a small lambda never allocates; larger ones are stored on the heap.
+template <class R, class... Args>
+class UniqueFunction<R(Args...)>
+{
+public:
+    static const std::size_t INLINE_SIZE = 7 * sizeof(void*);   // So that sizeof(UniqueFunction) == 8 pointers
+private:
+    typedef typename std::aligned_storage<INLINE_SIZE, alignof(void*)>::type Storage;
+
+    struct Operations
+    {
+        R (*invoke)(Storage& storage, Args&&... args);
+        void (*move)(Storage& to, Storage& from);       // Also destroys from
+        void (*destroy)(Storage& storage);
+        bool isInline;
+    };
+
+    template <class Fn>
+    struct InlineOperations
+    {
+        static R invoke(Storage& storage, Args&&... args) { return (*reinterpret_cast<Fn*>(&storage))(std::forward<Args>(args)...); }
+        static void move(Storage& to, Storage& from)
+        {
+            Fn* fn = reinterpret_cast<Fn*>(&from);
+            new (&to) Fn(std::move(*fn));
+            fn->~Fn();
+        }
+        static void destroy(Storage& storage) { reinterpret_cast<Fn*>(&storage)->~Fn(); }
+        static const Operations table;
+    };
+
+    template <class Fn>
+    struct HeapOperations
+    {
+        static Fn*& pointer(Storage& storage) { return *reinterpret_cast<Fn**>(&storage); }
+        static R invoke(Storage& storage, Args&&... args) { return (*pointer(storage))(std::forward<Args>(args)...); }
+        static void move(Storage& to, Storage& from) { new (&to) Fn*(pointer(from)); }
+        static void destroy(Storage& storage) { delete pointer(storage); }
+        static const Operations table;
+    };
+
+    template <class Fn>
+    struct FitsInline
+    {
+        static const bool value = sizeof(Fn) <= INLINE_SIZE
+            && alignof(Storage) % alignof(Fn) == 0
+            && std::is_nothrow_move_constructible<Fn>::value;
+    };
+
+    Storage storage_;
+    const Operations* operations_;
+
+    template <class Fn>
+    void construct(Fn&& fn, std::true_type);
+    template <class Fn>
+    void construct(Fn&& fn, std::false_type);
+public:
+    UniqueFunction();
+
+    template <class Fn, class = typename std::enable_if<
+        !std::is_same<typename std::decay<Fn>::type, UniqueFunction>::value>::type>
+    UniqueFunction(Fn&& fn);
+
+    UniqueFunction(const UniqueFunction& other) = delete;
+    UniqueFunction& operator=(const UniqueFunction& other) = delete;
+
+    UniqueFunction(UniqueFunction&& other);
+    UniqueFunction& operator=(UniqueFunction&& other);
+
+    ~UniqueFunction();
+
+    R operator()(Args... args);
+
+    explicit operator bool() const;
+    bool isInline() const;
+};
+
+template <class R, class... Args>
+template <class Fn>
+const typename UniqueFunction<R(Args...)>::Operations UniqueFunction<R(Args...)>::InlineOperations<Fn>::table = {
+    &InlineOperations<Fn>::invoke, &InlineOperations<Fn>::move, &InlineOperations<Fn>::destroy, true
+};
+
+template <class R, class... Args>
+template <class Fn>
+const typename UniqueFunction<R(Args...)>::Operations UniqueFunction<R(Args...)>::HeapOperations<Fn>::table = {
+    &HeapOperations<Fn>::invoke, &HeapOperations<Fn>::move, &HeapOperations<Fn>::destroy, false
+};
+
+template <class R, class... Args>
+UniqueFunction<R(Args...)>::UniqueFunction()
+    : operations_(nullptr)
+{}
+
+template <class R, class... Args>
+template <class Fn, class>
+UniqueFunction<R(Args...)>::UniqueFunction(Fn&& fn)
+{
+    typedef typename std::decay<Fn>::type Decayed;
+    construct(std::forward<Fn>(fn), std::integral_constant<bool, FitsInline<Decayed>::value>());
+}
+
+template <class R, class... Args>
+UniqueFunction<R(Args...)>::UniqueFunction(UniqueFunction&& other)
+    : operations_(other.operations_)
+{
+    if (operations_)
+        operations_->move(storage_, other.storage_);
+    other.operations_ = nullptr;
+}
+
+template <class R, class... Args>
+UniqueFunction<R(Args...)>& UniqueFunction<R(Args...)>::operator=(UniqueFunction&& other)
+{
+    if (this == &other)
+        return *this;
+
+    if (operations_)
+        operations_->destroy(storage_);
+    operations_ = other.operations_;
+    if (operations_)
+        operations_->move(storage_, other.storage_);
+    other.operations_ = nullptr;
+    return *this;
+}
+
+template <class R, class... Args>
+UniqueFunction<R(Args...)>::~UniqueFunction()
+{
+    if (operations_)
+        operations_->destroy(storage_);
+}
+
+// Calling an empty UniqueFunction is undefined. A plain pointer to a function of exactly
+// this type is called directly, rather than through invoke() (which would take a second
+// indirect call to reach the function).
+template <class R, class... Args>
+inline
+R UniqueFunction<R(Args...)>::operator()(Args... args)
+{
+    typedef R (*Pointer)(Args...);
+    if (operations_ == &InlineOperations<Pointer>::table)
+        return (*reinterpret_cast<Pointer*>(&storage_))(std::forward<Args>(args)...);
+    return operations_->invoke(storage_, std::forward<Args>(args)...);
+}
+
+template <class R, class... Args>
+inline
+UniqueFunction<R(Args...)>::operator bool() const { return operations_ != nullptr; }
+
+// Whether the callable is stored in the object itself (i.e. wasn't heap allocated)
+template <class R, class... Args>
+inline
+bool UniqueFunction<R(Args...)>::isInline() const { return operations_ == nullptr || operations_->isInline; }
+
+template <class R, class... Args>
+template <class Fn>
+void UniqueFunction<R(Args...)>::construct(Fn&& fn, std::true_type)
+{
+    typedef typename std::decay<Fn>::type Decayed;
+    new (&storage_) Decayed(std::forward<Fn>(fn));
+    operations_ = &InlineOperations<Decayed>::table;
+}
+
+template <class R, class... Args>
+template <class Fn>
+void UniqueFunction<R(Args...)>::construct(Fn&& fn, std::false_type)
+{
+    typedef typename std::decay<Fn>::type Decayed;
+    new (&storage_) Decayed*(new Decayed(std::forward<Fn>(fn)));
+    operations_ = &HeapOperations<Decayed>::table;
+}
+
+// ---------------- Slab ----------------
+
+// A thread-safe pool of fixed-size memory blocks. Blocks are carved out of chunks
+// allocated on demand (or up front with reserve()) and are recycled through a
+// lock-free free list, so once the slab has grown to its working size, allocate()
+// and deallocate() never touch the heap. heapAllocations() counts the times it did.
+class Slab
+{
+private:
+    static const std::size_t HEADER_SIZE = 16;          // Keeps blocks aligned for any scalar type
+    static const std::uint32_t MAX_CHUNKS = 4096;
+    static const std::uint32_t NOT_IN_SLAB = 0xffffffff;
+
+    // Precedes each block. next links the free list (as index + 1, so 0 is the end).
+    struct Header
+    {
+        std::uint32_t index;
+        std::atomic<std::uint32_t> next;
+    };
+
+    static const std::size_t CACHE_LINE_SIZE = 64;
+
+    // Every allocation and free CASes freeList_, so it gets a line of its own, away
+    // from the (read-mostly) fields around it
+    const std::size_t blockSize_, stride_, blocksPerChunk_;
+    char pad0_[CACHE_LINE_SIZE];
+    std::atomic<std::uint64_t> freeList_;               // (ABA tag << 32) | (index of first free block + 1)
+    char pad1_[CACHE_LINE_SIZE];
+    std::atomic<char*> chunks_[MAX_CHUNKS];
+    std::atomic<std::uint32_t> numChunks_;
+    std::atomic<std::size_t> heapAllocations_;
+    std::mutex growLock_;
+
+    Header* header(std::uint32_t index) const;
+    bool grow(bool onlyIfEmpty);
+public:
+    explicit Slab(std::size_t blockSize, std::size_t blocksPerChunk = 256);
+    ~Slab();
+
+    Slab(const Slab& other) = delete;
+    Slab& operator=(const Slab& other) = delete;
+
+    void* allocate();
+    void deallocate(void* block);
+    void reserve(std::size_t blocks);
+
+    std::size_t blockSize() const;
+    std::size_t capacity() const;
+    std::size_t heapAllocations() const;
+    void countHeapAllocation();
+};
+
+inline
+Slab::Slab(std::size_t blockSize, std::size_t blocksPerChunk)
+    : blockSize_(blockSize)
+    , stride_(HEADER_SIZE + (blockSize + HEADER_SIZE - 1) / HEADER_SIZE * HEADER_SIZE)
+    , blocksPerChunk_(blocksPerChunk)
+    , freeList_(0)
+    , numChunks_(0)
+    , heapAllocations_(0)
+{
+    for (std::uint32_t i = 0; i != MAX_CHUNKS; ++i)
+        chunks_[i].store(nullptr, std::memory_order_relaxed);
+}
+
+// Every block must have been deallocated already
+inline
+Slab::~Slab()
+{
+    for (std::uint32_t i = 0; i != numChunks_.load(); ++i)
+        ::operator delete(chunks_[i].load());
+}
+
+inline
+Slab::Header* Slab::header(std::uint32_t index) const
+{
+    char* chunk = chunks_[index / blocksPerChunk_].load(std::memory_order_acquire);
+    return reinterpret_cast<Header*>(chunk + (index % blocksPerChunk_) * stride_);
+}
+
+// Falls back to the heap (and counts it) if the slab reached MAX_CHUNKS
+inline
+void* Slab::allocate()
+{
+    for (;;)
+    {
+        std::uint64_t head = freeList_.load(std::memory_order_acquire);
+        while (head & 0xffffffff)
+        {
+            Header* h = header(static_cast<std::uint32_t>(head & 0xffffffff) - 1);
+            std::uint64_t next = ((head >> 32) + 1) << 32 | h->next.load(std::memory_order_relaxed);
+            if (freeList_.compare_exchange_weak(head, next, std::memory_order_acquire, std::memory_order_acquire))
+                return reinterpret_cast<char*>(h) + HEADER_SIZE;
+        }
+
+        if (!grow(true))
+        {
+            countHeapAllocation();
+            Header* h = static_cast<Header*>(::operator new(HEADER_SIZE + blockSize_));
+            h->index = NOT_IN_SLAB;
+            return reinterpret_cast<char*>(h) + HEADER_SIZE;
+        }
+    }
+}
+
+inline
+void Slab::deallocate(void* block)
+{
+    Header* h = reinterpret_cast<Header*>(static_cast<char*>(block) - HEADER_SIZE);
+    if (h->index == NOT_IN_SLAB)
+    {
+        ::operator delete(h);
+        return;
+    }
+
+    std::uint64_t head = freeList_.load(std::memory_order_relaxed);
+    std::uint64_t pushed;
+    do
+    {
+        h->next.store(static_cast<std::uint32_t>(head & 0xffffffff), std::memory_order_relaxed);
+        pushed = ((head >> 32) + 1) << 32 | (h->index + 1);
+    } while (!freeList_.compare_exchange_weak(head, pushed, std::memory_order_release, std::memory_order_relaxed));
+}
+
+// Grows the slab until it holds at least the specified amount of blocks
+inline
+void Slab::reserve(std::size_t blocks)
+{
+    while (capacity() < blocks && grow(false))
+        ;
+}
+
+// Adds one chunk of blocks to the free list. Returns false if there is no room for one.
+// If onlyIfEmpty is set, does nothing when the free list isn't empty (say, because
+// another thread grew the slab while this one waited for growLock_).
+inline
+bool Slab::grow(bool onlyIfEmpty)
+{
+    std::lock_guard<std::mutex> lg(growLock_);
+
+    if (onlyIfEmpty && (freeList_.load(std::memory_order_acquire) & 0xffffffff))
+        return true;
+
+    std::uint32_t chunkIndex = numChunks_.load(std::memory_order_relaxed);
+    if (chunkIndex == MAX_CHUNKS)
+        return false;
+
+    char* chunk = static_cast<char*>(::operator new(stride_ * blocksPerChunk_));
+    countHeapAllocation();
+
+    std::uint32_t first = chunkIndex * blocksPerChunk_;
+    for (std::uint32_t i = 0; i != blocksPerChunk_; ++i)
+    {
+        Header* h = reinterpret_cast<Header*>(chunk + i * stride_);
+        h->index = first + i;
+        h->next.store(i + 1 == blocksPerChunk_ ? 0 : first + i + 2, std::memory_order_relaxed);
+    }
+    chunks_[chunkIndex].store(chunk, std::memory_order_release);
+    numChunks_.store(chunkIndex + 1, std::memory_order_release);
+
+    // Splice the whole chunk onto the front of the free list
+    Header* last = reinterpret_cast<Header*>(chunk + (blocksPerChunk_ - 1) * stride_);
+    std::uint64_t head = freeList_.load(std::memory_order_relaxed);
+    std::uint64_t pushed;
+    do
+    {
+        last->next.store(static_cast<std::uint32_t>(head & 0xffffffff), std::memory_order_relaxed);
+        pushed = ((head >> 32) + 1) << 32 | (first + 1);
+    } while (!freeList_.compare_exchange_weak(head, pushed, std::memory_order_release, std::memory_order_relaxed));
+
+    return true;
+}
+
+inline
+std::size_t Slab::blockSize() const { return blockSize_; }
+
+inline
+std::size_t Slab::capacity() const { return numChunks_.load() * blocksPerChunk_; }
+
+inline
+std::size_t Slab::heapAllocations() const { return heapAllocations_.load(std::memory_order_relaxed); }
+
+inline
+void Slab::countHeapAllocation() { heapAllocations_.fetch_add(1, std::memory_order_relaxed); }
+
+// A standard allocator drawing single objects that fit in a block from a shared Slab,
+// e.g. for std::promise's shared state. The slab is reference counted, so memory can
+// be handed back after the ThreadPool owning it is gone (say, by a surviving future).
+// Bigger requests go to the heap, and are counted as such.
+template <class T>
+class SlabAllocator
+{
+private:
+    template <class U>
+    friend class SlabAllocator;
+
+    std::shared_ptr<Slab> slab_;
+
+    bool fits(std::size_t n) const { return n * sizeof(T) <= slab_->blockSize() && alignof(T) <= 16; }
+public:
+    typedef T value_type;
+
+    explicit SlabAllocator(const std::shared_ptr<Slab>& slab) : slab_(slab) {}
+
+    template <class U>
+    SlabAllocator(const SlabAllocator<U>& other) : slab_(other.slab_) {}
+
+    T* allocate(std::size_t n)
+    {
+        if (fits(n))
+            return static_cast<T*>(slab_->allocate());
+        slab_->countHeapAllocation();
+        return static_cast<T*>(::operator new(n * sizeof(T)));
+    }
+
+    void deallocate(T* p, std::size_t n)
+    {
+        if (fits(n))
+            slab_->deallocate(p);
+        else
+            ::operator delete(p);
+    }
+
+    template <class U>
+    bool operator==(const SlabAllocator<U>& other) const { return slab_ == other.slab_; }
+
+    template <class U>
+    bool operator!=(const SlabAllocator<U>& other) const { return slab_ != other.slab_; }
+};
+
 // ---------------- Task ----------------
 
+// Stores the result of fn(args...) in promise (void results need their own overload)
+template <class R, class Fn, class... CallArgs>
+void fulfillPromise(std::promise<R>& promise, Fn& fn, CallArgs&&... args)
+{
+    promise.set_value(fn(std::forward<CallArgs>(args)...));
+}
+
+template <class Fn, class... CallArgs>
+void fulfillPromise(std::promise<void>& promise, Fn& fn, CallArgs&&... args)
+{
+    fn(std::forward<CallArgs>(args)...);
+    promise.set_value();
+}
+
+// Tag for Task's constructor: the task gets no promise, so creating it allocates no
+// shared state; its result is discarded, and an exception escapes execute()
+struct DiscardResult {};
+
 template <class FunctionType, class... Args>
 class Task
 {
+public:
+    typedef typename std::result_of<typename std::decay<FunctionType>::type(Args...)>::type ResultType;
 private:
-    std::packaged_task<FunctionType> task_;
+    typedef std::promise<ResultType> Promise;
+
+    UniqueFunction<FunctionType> fn_;
+    typename std::aligned_storage<sizeof(Promise), alignof(Promise)>::type promise_;
+    bool hasPromise_;
     std::tuple<Args...> args_;
 
+    Promise& promise() { return *reinterpret_cast<Promise*>(&promise_); }
+
     template<int... Nums>
     void executeActually(Sequence<Nums...>);
 public:
+    // Empty, without a promise: getFuture() must not be called
     Task();
 
-    template <class Fn, class... DeducedArgs>
+    template <class Fn, class... DeducedArgs, class = typename std::enable_if<
+        !std::is_same<typename std::decay<Fn>::type, std::allocator_arg_t>::value &&
+        !std::is_same<typename std::decay<Fn>::type, DiscardResult>::value>::type>
     Task(Fn&& fn, DeducedArgs&&... args);
 
+    // The promise's shared state is allocated with alloc
+    template <class Alloc, class Fn, class... DeducedArgs>
+    Task(std::allocator_arg_t, const Alloc& alloc, Fn&& fn, DeducedArgs&&... args);
+
+    // No promise: getFuture() must not be called
+    template <class Fn, class... DeducedArgs>
+    Task(DiscardResult, Fn&& fn, DeducedArgs&&... args);
+
+    ~Task();
+
     Task(const Task& other) = delete;
     Task& operator=(Task& other) = delete;
 
@@ -70,33 +533,82 @@ public:
     Task& operator=(Task&& other);
 
     void execute();
-    
-    // Need to figure out a way to typedef this
-    std::future<typename std::result_of<typename std::decay<FunctionType>::type(Args...)>::type>
-    getFuture();
+
+    std::future<ResultType> getFuture();
+
+    bool isInline() const;
 };
 
+// Without a promise (as with DiscardResult), so that placeholder tasks never allocate
 template <class FunctionType, class... Args>
 Task<FunctionType, Args...>::Task()
+    : hasPromise_(false)
 {}
 
 template <class FunctionType, class... Args>
-template <class Fn, class... DeducedArgs>
+template <class Fn, class... DeducedArgs, class>
 Task<FunctionType, Args...>::Task(Fn&& fn, DeducedArgs&&... args)
-    : task_(std::forward<Fn>(fn))
+    : fn_(std::forward<Fn>(fn))
+    , hasPromise_(false)
+    , args_(std::forward<Args>(args)...)
+{
+    new (&promise_) Promise();
+    hasPromise_ = true;
+}
+
+template <class FunctionType, class... Args>
+template <class Alloc, class Fn, class... DeducedArgs>
+Task<FunctionType, Args...>::Task(std::allocator_arg_t, const Alloc& alloc, Fn&& fn, DeducedArgs&&... args)
+    : fn_(std::forward<Fn>(fn))
+    , hasPromise_(false)
+    , args_(std::forward<Args>(args)...)
+{
+    new (&promise_) Promise(std::allocator_arg, alloc);
+    hasPromise_ = true;
+}
+
+template <class FunctionType, class... Args>
+template <class Fn, class... DeducedArgs>
+Task<FunctionType, Args...>::Task(DiscardResult, Fn&& fn, DeducedArgs&&... args)
+    : fn_(std::forward<Fn>(fn))
+    , hasPromise_(false)
     , args_(std::forward<Args>(args)...)
 {}
 
+// A promise destroyed before the task ran breaks it
+template <class FunctionType, class... Args>
+Task<FunctionType, Args...>::~Task()
+{
+    if (hasPromise_)
+        promise().~Promise();
+}
+
 template <class FunctionType, class... Args>
 Task<FunctionType, Args...>::Task(Task&& other)
-    : task_(std::move(other.task_))
+    : fn_(std::move(other.fn_))
+    , hasPromise_(other.hasPromise_)
     , args_(std::move(other.args_))
-{}
+{
+    if (hasPromise_)
+        new (&promise_) Promise(std::move(other.promise()));
+}
 
 template <class FunctionType, class... Args>
 Task<FunctionType, Args...>& Task<FunctionType, Args...>::operator=(Task&& other)
 {
-    task_ = std::move(other.task_);
+    fn_ = std::move(other.fn_);
+    if (hasPromise_ && other.hasPromise_)
+        promise() = std::move(other.promise());
+    else if (hasPromise_)
+    {
+        promise().~Promise();
+        hasPromise_ = false;
+    }
+    else if (other.hasPromise_)
+    {
+        new (&promise_) Promise(std::move(other.promise()));
+        hasPromise_ = true;
+    }
     args_ = std::move(other.args_);
     return *this;
 }
@@ -108,10 +620,18 @@ void Task<FunctionType, Args...>::execute()
 }
 
 template <class FunctionType, class... Args>
-std::future<typename std::result_of<typename std::decay<FunctionType>::type(Args...)>::type>
+std::future<typename Task<FunctionType, Args...>::ResultType>
 Task<FunctionType, Args...>::getFuture()
 {
-    return std::move(task_.get_future());
+    return promise().get_future();
+}
+
+// Whether the function was small enough to be stored without a heap allocation
+template <class FunctionType, class... Args>
+inline
+bool Task<FunctionType, Args...>::isInline() const
+{
+    return fn_.isInline();
 }
 
 // Not actually using the Sequence - we just want (to expand) the template arguments
@@ -119,183 +639,3805 @@ template <class FunctionType, class... Args>
 template <int... Nums>
 void Task<FunctionType, Args...>::executeActually(Sequence<Nums...>)
 {
-    task_(std::get<Nums>(args_)...);
+    if (!hasPromise_)
+    {
+        fn_(std::get<Nums>(args_)...);
+        return;
+    }
+
+    try
+    {
+        fulfillPromise(promise(), fn_, std::get<Nums>(args_)...);
+    }
+    catch (...)
+    {
+        promise().set_exception(std::current_exception());
+    }
 }
 
-// -------------- ThreadPool ------------
+// ---------- WorkStealingDeque ---------
 
-template <class FunctionType, class... Args>
-class ThreadPool
+// A Chase-Lev work-stealing deque (using the memory orderings from Le et al., "Correct
+// and Efficient Work-Stealing for Weak Memory Models"). The owning thread pushes and
+// pops at the bottom; any other thread may steal from the top. T must be trivially
+// copyable (in practice, a pointer).
+template <class T>
+class WorkStealingDeque
 {
 private:
-    static const int MAX_WAIT_TIME;         // Maximum time (in milliseconds) to sleep for in wait()
+    struct Array
+    {
+        std::int64_t mask;
+        std::atomic<T>* slots;
 
-    std::vector<std::thread> threads_;
-    std::queue<Task<FunctionType, Args...>> tasks_;
-    std::mutex lock_;
-    std::condition_variable taskAvailable_;
-    int activeThreads_;
-    bool isShutdown_, isForced_, waitOnDestroy_;
-    
-    void doWork(int id);
+        explicit Array(std::int64_t capacity) : mask(capacity - 1), slots(new std::atomic<T>[capacity]) {}
+        ~Array() { delete[] slots; }
+
+        std::int64_t capacity() const { return mask + 1; }
+        T get(std::int64_t i) const { return slots[i & mask].load(std::memory_order_relaxed); }
+        void put(std::int64_t i, T item) { slots[i & mask].store(item, std::memory_order_relaxed); }
+    };
+
+    std::atomic<std::int64_t> top_;
+    std::atomic<std::int64_t> bottom_;
+    std::atomic<Array*> array_;
+    std::vector<Array*> retired_;           // Arrays replaced by grow(); thieves may still be reading them
+
+    Array* grow(Array* old, std::int64_t bottom, std::int64_t top);
 public:
-    ThreadPool(int numThreads, bool waitOnDestroy = true);
-    ~ThreadPool();
-    
-    int activeThreads() const;
-    int threadCount() const;
-    bool isShutdown() const;
-    bool isTerminated() const;
-    
-    void shutdown(bool force = false);
-    void wait();
-    
-    template <class Fn, class... DeducedArgs>
-    void execute(Fn&& fn, DeducedArgs&&... args);
-    
-    template <class Fn, class... DeducedArgs>
-    std::future<typename std::result_of<Fn(Args...)>::type>
-    submit(Fn&& fn, DeducedArgs&&... args);
+    explicit WorkStealingDeque(std::int64_t capacity = 1024);
+    ~WorkStealingDeque();
+
+    WorkStealingDeque(const WorkStealingDeque& other) = delete;
+    WorkStealingDeque& operator=(const WorkStealingDeque& other) = delete;
+
+    void push(T item);
+    bool pop(T& item);
+    bool steal(T& item);
+
+    std::int64_t size() const;
+    bool empty() const;
 };
 
-template <class FunctionType, class... Args>
-const int ThreadPool<FunctionType, Args...>::MAX_WAIT_TIME = 50;
+// Capacity is rounded up to a power of two
+template <class T>
+WorkStealingDeque<T>::WorkStealingDeque(std::int64_t capacity)
+    : top_(0)
+    , bottom_(0)
+{
+    static_assert(std::is_trivially_copyable<T>::value, "WorkStealingDeque elements must be trivially copyable");
 
-// Constructs a ThreadPool with the specified amount of threads (must be nonnegative).
-// If waitOnDestroy is true, the ThreadPool will call wait() on destruction; otherwise, it will not.
-template <class FunctionType, class... Args>
-ThreadPool<FunctionType, Args...>::ThreadPool(int numThreads, bool waitOnDestroy)
-    : threads_(numThreads)
-    , activeThreads_(0)
-    , isShutdown_(false)
-    , isForced_(false)
-    , waitOnDestroy_(waitOnDestroy)
+    std::int64_t actual = 1;
+    while (actual < capacity)
+        actual *= 2;
+    array_.store(new Array(actual), std::memory_order_relaxed);
+}
+
+template <class T>
+WorkStealingDeque<T>::~WorkStealingDeque()
 {
-    for (int i = 0; i != threads_.size(); ++i)
-        threads_[i] = std::move(std::thread(&ThreadPool::doWork, this, i + 1));
+    delete array_.load(std::memory_order_relaxed);
+    for (std::size_t i = 0; i != retired_.size(); ++i)
+        delete retired_[i];
 }
 
-// Join all uncompleted threads if this ThreadPool hasn't been forcefully shut down
-template <class FunctionType, class... Args>
-ThreadPool<FunctionType, Args...>::~ThreadPool()
+// Only the owning thread may call push()
+template <class T>
+void WorkStealingDeque<T>::push(T item)
 {
-    if (waitOnDestroy_)
-        wait();
-    if (!isShutdown_)
-        shutdown(false);
+    std::int64_t b = bottom_.load(std::memory_order_relaxed);
+    std::int64_t t = top_.load(std::memory_order_acquire);
+    Array* a = array_.load(std::memory_order_relaxed);
 
-    if (!isForced_)
-        for (int i = 0; i != threads_.size(); ++i)
-            threads_[i].join();
+    if (b - t > a->capacity() - 1)
+        a = grow(a, b, t);
+
+    a->put(b, item);
+    bottom_.store(b + 1, std::memory_order_release);
 }
 
-template <class FunctionType, class... Args>
-inline
-int ThreadPool<FunctionType, Args...>::activeThreads() const { return activeThreads_; }
+// Only the owning thread may call pop(). Returns false if the deque was empty
+// (or a thief took the last item first).
+template <class T>
+bool WorkStealingDeque<T>::pop(T& item)
+{
+    std::int64_t b = bottom_.load(std::memory_order_relaxed) - 1;
+    Array* a = array_.load(std::memory_order_relaxed);
+    bottom_.store(b, std::memory_order_relaxed);
+    std::atomic_thread_fence(std::memory_order_seq_cst);
+    std::int64_t t = top_.load(std::memory_order_relaxed);
 
-template <class FunctionType, class... Args>
-inline
-int ThreadPool<FunctionType, Args...>::threadCount() const { return threads_.size(); }
+    if (t > b)
+    {
+        bottom_.store(b + 1, std::memory_order_relaxed);
+        return false;
+    }
 
-template <class FunctionType, class... Args>
-inline
-bool ThreadPool<FunctionType, Args...>::isShutdown() const { return isShutdown_; }
+    item = a->get(b);
+    if (t == b)
+    {
+        // Last item - race against thieves for it
+        bool won = top_.compare_exchange_strong(t, t + 1, std::memory_order_seq_cst, std::memory_order_relaxed);
+        bottom_.store(b + 1, std::memory_order_relaxed);
+        return won;
+    }
+    return true;
+}
 
-template <class FunctionType, class... Args>
+// May be called from any thread. Returns false if the deque was empty or another
+// thread won the race for the top item.
+template <class T>
+bool WorkStealingDeque<T>::steal(T& item)
+{
+    std::int64_t t = top_.load(std::memory_order_acquire);
+    std::atomic_thread_fence(std::memory_order_seq_cst);
+    std::int64_t b = bottom_.load(std::memory_order_acquire);
+
+    if (t >= b)
+        return false;
+
+    Array* a = array_.load(std::memory_order_acquire);
+    T candidate = a->get(t);
+    if (!top_.compare_exchange_strong(t, t + 1, std::memory_order_seq_cst, std::memory_order_relaxed))
+        return false;
+
+    item = candidate;
+    return true;
+}
+
+// Approximate when called concurrently with push()/pop()/steal()
+template <class T>
+std::int64_t WorkStealingDeque<T>::size() const
+{
+    std::int64_t b = bottom_.load(std::memory_order_relaxed);
+    std::int64_t t = top_.load(std::memory_order_relaxed);
+    return b > t ? b - t : 0;
+}
+
+template <class T>
+bool WorkStealingDeque<T>::empty() const
+{
+    return size() == 0;
+}
+
+template <class T>
+typename WorkStealingDeque<T>::Array*
+WorkStealingDeque<T>::grow(Array* old, std::int64_t bottom, std::int64_t top)
+{
+    Array* a = new Array(old->capacity() * 2);
+    for (std::int64_t i = top; i != bottom; ++i)
+        a->put(i, old->get(i));
+
+    retired_.push_back(old);
+    array_.store(a, std::memory_order_release);
+    return a;
+}
+
+// -------------- MPMCQueue -------------
+
+// A bounded lock-free multi-producer multi-consumer FIFO (Dmitry Vyukov's design):
+// every slot carries a sequence number that tells producers and consumers whose turn
+// it is to use the slot, so a push or pop is a single CAS on enqueuePos_/dequeuePos_.
+// Slots and both positions are padded to a cache line each, so that producers and
+// consumers don't invalidate each other's lines. T must be trivially copyable (in
+// practice, a pointer).
+template <class T>
+class MPMCQueue
+{
+private:
+    static const std::size_t CACHE_LINE_SIZE = 64;
+
+    struct Cell
+    {
+        std::atomic<std::size_t> sequence;
+        T data;
+        char pad[CACHE_LINE_SIZE - sizeof(std::atomic<std::size_t>) - sizeof(T)];
+    };
+
+    struct Position
+    {
+        std::atomic<std::size_t> value;
+        char pad[CACHE_LINE_SIZE - sizeof(std::atomic<std::size_t>)];
+    };
+
+    char pad0_[CACHE_LINE_SIZE];
+    Cell* const cells_;
+    const std::size_t capacity_;
+    char pad1_[CACHE_LINE_SIZE - sizeof(Cell*) - sizeof(std::size_t)];
+    Position enqueuePos_;
+    Position dequeuePos_;
+public:
+    explicit MPMCQueue(std::size_t capacity);
+    ~MPMCQueue();
+
+    MPMCQueue(const MPMCQueue& other) = delete;
+    MPMCQueue& operator=(const MPMCQueue& other) = delete;
+
+    bool tryPush(T item);
+    bool tryPop(T& item);
+
+    std::size_t capacity() const;
+    std::size_t size() const;
+};
+
+// Capacity must be positive
+template <class T>
+MPMCQueue<T>::MPMCQueue(std::size_t capacity)
+    : cells_(new Cell[capacity])
+    , capacity_(capacity)
+{
+    static_assert(std::is_trivially_copyable<T>::value, "MPMCQueue elements must be trivially copyable");
+
+    for (std::size_t i = 0; i != capacity_; ++i)
+        cells_[i].sequence.store(i, std::memory_order_relaxed);
+    enqueuePos_.value.store(0, std::memory_order_relaxed);
+    dequeuePos_.value.store(0, std::memory_order_relaxed);
+}
+
+template <class T>
+MPMCQueue<T>::~MPMCQueue()
+{
+    delete[] cells_;
+}
+
+// Returns false (without blocking) if the queue is full
+template <class T>
+bool MPMCQueue<T>::tryPush(T item)
+{
+    std::size_t pos = enqueuePos_.value.load(std::memory_order_relaxed);
+    for (;;)
+    {
+        Cell& cell = cells_[pos % capacity_];
+        std::size_t seq = cell.sequence.load(std::memory_order_acquire);
+        std::ptrdiff_t diff = static_cast<std::ptrdiff_t>(seq) - static_cast<std::ptrdiff_t>(pos);
+
+        if (diff == 0)
+        {
+            if (enqueuePos_.value.compare_exchange_weak(pos, pos + 1, std::memory_order_relaxed))
+            {
+                cell.data = item;
+                cell.sequence.store(pos + 1, std::memory_order_release);
+                return true;
+            }
+        }
+        else if (diff < 0)
+            return false;       // The slot still holds the item pushed one lap ago
+        else
+            pos = enqueuePos_.value.load(std::memory_order_relaxed);
+    }
+}
+
+// Returns false (without blocking) if the queue is empty
+template <class T>
+bool MPMCQueue<T>::tryPop(T& item)
+{
+    std::size_t pos = dequeuePos_.value.load(std::memory_order_relaxed);
+    for (;;)
+    {
+        Cell& cell = cells_[pos % capacity_];
+        std::size_t seq = cell.sequence.load(std::memory_order_acquire);
+        std::ptrdiff_t diff = static_cast<std::ptrdiff_t>(seq) - static_cast<std::ptrdiff_t>(pos + 1);
+
+        if (diff == 0)
+        {
+            if (dequeuePos_.value.compare_exchange_weak(pos, pos + 1, std::memory_order_relaxed))
+            {
+                item = cell.data;
+                cell.sequence.store(pos + capacity_, std::memory_order_release);
+                return true;
+            }
+        }
+        else if (diff < 0)
+            return false;       // No item has been pushed into the slot yet
+        else
+            pos = dequeuePos_.value.load(std::memory_order_relaxed);
+    }
+}
+
+template <class T>
+inline
+std::size_t MPMCQueue<T>::capacity() const { return capacity_; }
+
+// Only a snapshot, since other threads may be pushing and popping concurrently
+template <class T>
+std::size_t MPMCQueue<T>::size() const
+{
+    std::size_t enqueued = enqueuePos_.value.load(std::memory_order_relaxed);
+    std::size_t dequeued = dequeuePos_.value.load(std::memory_order_relaxed);
+    return enqueued > dequeued ? enqueued - dequeued : 0;
+}
+
+// ------------- TimerWheel -------------
+
+// What a TimerWheel links into its slots: embedded in whatever it schedules, so that
+// inserting and removing never allocate
+struct TimerEntry
+{
+    TimerEntry* next;
+    TimerEntry** prev;                  // The pointer that points to this entry
+    std::uint64_t expiry;               // In ticks
+    unsigned char level, slot;
+
+    TimerEntry() : next(nullptr), prev(nullptr), expiry(0), level(0), slot(0) {}
+};
+
+// A hierarchical timing wheel: LEVELS wheels of SLOTS slots each, where a slot of level L
+// spans SLOTS^L ticks. An entry goes to the level of the highest SLOT_BITS-bit digit in
+// which its expiry differs from the current tick, so inserting and removing are O(1).
+// As the current tick reaches a slot of a higher level, that slot's entries cascade
+// down to the lower ones. Empty stretches are skipped over (using a bitmap of occupied
+// slots per level), so the owner only needs to call advance() at nextExpiry(), however
+// many entries there are. Not thread-safe.
+class TimerWheel
+{
+private:
+    static const int SLOT_BITS = 6;
+    static const int SLOTS = 1 << SLOT_BITS;
+    static const int LEVELS = (64 + SLOT_BITS - 1) / SLOT_BITS;    // Enough for any 64-bit tick
+    static const std::uint64_t SLOT_MASK = SLOTS - 1;
+
+    TimerEntry* slots_[LEVELS][SLOTS];
+    std::uint64_t occupied_[LEVELS];    // Bit s of level L is set if slots_[L][s] isn't empty
+    std::uint64_t now_;                 // Every entry expiring at or before now_ has been taken out
+    std::size_t size_;
+
+    static int lowestBit(std::uint64_t bits);
+    static int highestBit(std::uint64_t bits);
+    static std::uint64_t slotsAfter(std::uint64_t slot);
+    static std::uint64_t levelStart(std::uint64_t tick, int level);
+
+    void link(TimerEntry* entry);
+    TimerEntry* takeSlot(int level, int slot);
+    bool nextSlot(int& level, int& slot, std::uint64_t& start) const;
+public:
+    static const std::uint64_t NEVER = ~static_cast<std::uint64_t>(0);
+
+    explicit TimerWheel(std::uint64_t now = 0);
+
+    TimerWheel(const TimerWheel& other) = delete;
+    TimerWheel& operator=(const TimerWheel& other) = delete;
+
+    void insert(TimerEntry* entry, std::uint64_t expiry);
+    void remove(TimerEntry* entry);
+
+    template <class Fn>
+    void advance(std::uint64_t now, Fn&& expired);
+
+    template <class Fn>
+    void clear(Fn&& removed);
+
+    std::uint64_t nextExpiry() const;
+    std::uint64_t now() const;
+    std::size_t size() const;
+    bool empty() const;
+};
+
+inline
+TimerWheel::TimerWheel(std::uint64_t now)
+    : now_(now)
+    , size_(0)
+{
+    for (int level = 0; level != LEVELS; ++level)
+    {
+        occupied_[level] = 0;
+        for (int slot = 0; slot != SLOTS; ++slot)
+            slots_[level][slot] = nullptr;
+    }
+}
+
+inline
+int TimerWheel::lowestBit(std::uint64_t bits)
+{
+#if defined(__GNUC__) || defined(__clang__)
+    return __builtin_ctzll(bits);
+#else
+    int bit = 0;
+    while (!(bits & 1))
+    {
+        bits >>= 1;
+        ++bit;
+    }
+    return bit;
+#endif
+}
+
+inline
+int TimerWheel::highestBit(std::uint64_t bits)
+{
+#if defined(__GNUC__) || defined(__clang__)
+    return 63 - __builtin_clzll(bits);
+#else
+    int bit = 0;
+    while (bits >>= 1)
+        ++bit;
+    return bit;
+#endif
+}
+
+// The bits of the slots after slot
+inline
+std::uint64_t TimerWheel::slotsAfter(std::uint64_t slot)
+{
+    return slot == SLOT_MASK ? 0 : ~static_cast<std::uint64_t>(0) << (slot + 1);
+}
+
+// The first tick of the level-L slot span (the slot of level L + 1) that tick is in
+inline
+std::uint64_t TimerWheel::levelStart(std::uint64_t tick, int level)
+{
+    const int bits = (level + 1) * SLOT_BITS;
+    return bits >= 64 ? 0 : tick >> bits << bits;
+}
+
+// An entry that's already due is put in the next tick's slot
+inline
+void TimerWheel::insert(TimerEntry* entry, std::uint64_t expiry)
+{
+    entry->expiry = expiry > now_ ? expiry : now_ + 1;
+    link(entry);
+    ++size_;
+}
+
+inline
+void TimerWheel::link(TimerEntry* entry)
+{
+    const int level = highestBit(entry->expiry ^ now_) / SLOT_BITS;
+    const int slot = static_cast<int>((entry->expiry >> (level * SLOT_BITS)) & SLOT_MASK);
+
+    TimerEntry*& head = slots_[level][slot];
+    entry->next = head;
+    entry->prev = &head;
+    if (head)
+        head->prev = &entry->next;
+    head = entry;
+    entry->level = static_cast<unsigned char>(level);
+    entry->slot = static_cast<unsigned char>(slot);
+    occupied_[level] |= static_cast<std::uint64_t>(1) << slot;
+}
+
+// The entry must be in the wheel
+inline
+void TimerWheel::remove(TimerEntry* entry)
+{
+    *entry->prev = entry->next;
+    if (entry->next)
+        entry->next->prev = entry->prev;
+    if (!slots_[entry->level][entry->slot])
+        occupied_[entry->level] &= ~(static_cast<std::uint64_t>(1) << entry->slot);
+    entry->next = nullptr;
+    entry->prev = nullptr;
+    --size_;
+}
+
+// Unlinks a whole slot at once, returning its first entry
+inline
+TimerEntry* TimerWheel::takeSlot(int level, int slot)
+{
+    TimerEntry* first = slots_[level][slot];
+    slots_[level][slot] = nullptr;
+    occupied_[level] &= ~(static_cast<std::uint64_t>(1) << slot);
+    return first;
+}
+
+// Finds the first occupied slot after the current tick: since every entry of level L
+// shares the current tick's digits above L, it's the lowest level's lowest occupied slot.
+// Its first tick is start.
+inline
+bool TimerWheel::nextSlot(int& level, int& slot, std::uint64_t& start) const
+{
+    for (level = 0; level != LEVELS; ++level)
+    {
+        std::uint64_t current = (now_ >> (level * SLOT_BITS)) & SLOT_MASK;
+        std::uint64_t after = occupied_[level] & slotsAfter(current);
+        if (after)
+        {
+            slot = lowestBit(after);
+            start = levelStart(now_, level) | static_cast<std::uint64_t>(slot) << (level * SLOT_BITS);
+            return true;
+        }
+    }
+    return false;
+}
+
+// Moves the current tick up to now, calling expired(entry) for each entry that becomes
+// due, in order of expiry, after taking it out of the wheel (so expired may insert it
+// again, or insert others). A level-0 slot's entries all expire on the same tick; a
+// higher slot's are redistributed when the current tick reaches its first tick.
+template <class Fn>
+void TimerWheel::advance(std::uint64_t now, Fn&& expired)
+{
+    int level, slot;
+    std::uint64_t start;
+    while (now_ < now)
+    {
+        // Everything before start is empty, so the wheel can jump right to it
+        if (!nextSlot(level, slot, start) || start > now)
+        {
+            now_ = now;
+            return;
+        }
+
+        now_ = start;
+        TimerEntry* entry = takeSlot(level, slot);
+        while (entry)
+        {
+            TimerEntry* next = entry->next;
+            if (entry->expiry == now_)
+            {
+                entry->next = nullptr;
+                entry->prev = nullptr;
+                --size_;
+                expired(entry);
+            }
+            else
+                link(entry);
+            entry = next;
+        }
+    }
+}
+
+// Takes every entry out, calling removed(entry) for each
+template <class Fn>
+void TimerWheel::clear(Fn&& removed)
+{
+    for (int level = 0; level != LEVELS; ++level)
+        while (occupied_[level])
+        {
+            TimerEntry* entry = takeSlot(level, lowestBit(occupied_[level]));
+            while (entry)
+            {
+                TimerEntry* next = entry->next;
+                entry->next = nullptr;
+                entry->prev = nullptr;
+                --size_;
+                removed(entry);
+                entry = next;
+            }
+        }
+}
+
+// The tick at which advance() next has something to do: an entry expires, or a slot
+// cascades. NEVER if the wheel is empty.
+inline
+std::uint64_t TimerWheel::nextExpiry() const
+{
+    int level, slot;
+    std::uint64_t start;
+    if (!nextSlot(level, slot, start))
+        return NEVER;
+    return start;
+}
+
+inline
+std::uint64_t TimerWheel::now() const
+{
+    return now_;
+}
+
+inline
+std::size_t TimerWheel::size() const
+{
+    return size_;
+}
+
+inline
+bool TimerWheel::empty() const
+{
+    return size_ == 0;
+}
+
+// -------------- Affinity --------------
+
+#ifdef __linux__
+#  include <pthread.h>
+#  include <sched.h>
+#endif
+
+// Restricts thread to the specified CPUs. Returns false if that failed (say, because
+// none of them is available to this process) or isn't supported: only Linux is, so far.
+inline bool setThreadAffinity(std::thread& thread, const std::vector<int>& cpus)
+{
+#ifdef __linux__
+    cpu_set_t set;
+    CPU_ZERO(&set);
+    for (std::size_t i = 0; i != cpus.size(); ++i)
+        if (cpus[i] >= 0 && cpus[i] < CPU_SETSIZE)
+            CPU_SET(cpus[i], &set);
+    return pthread_setaffinity_np(thread.native_handle(), sizeof(set), &set) == 0;
+#else
+    (void) thread;
+    (void) cpus;
+    return false;
+#endif
+}
+
+// Parses a list of CPUs in the format Linux uses in sysfs, e.g. "0-3,8,10-11"
+inline std::vector<int> parseCpuList(const std::string& list)
+{
+    std::vector<int> cpus;
+    const char* p = list.c_str();
+    while (*p)
+    {
+        char* end;
+        long first = std::strtol(p, &end, 10);
+        if (end == p)
+            break;
+        long last = first;
+        if (*end == '-')
+        {
+            p = end + 1;
+            last = std::strtol(p, &end, 10);
+            if (end == p)
+                break;
+        }
+        for (long cpu = first; cpu <= last; ++cpu)
+            cpus.push_back(static_cast<int>(cpu));
+
+        p = end;
+        if (*p == ',')
+            ++p;
+    }
+    return cpus;
+}
+
+// The CPUs of each NUMA node (in the format of ThreadPoolOptions::numaNodes), as reported
+// by Linux. Empty if that information isn't available.
+inline std::vector<std::vector<int>> numaTopology()
+{
+    std::vector<std::vector<int>> nodes;
+#ifdef __linux__
+    for (int node = 0; ; ++node)
+    {
+        std::ifstream file("/sys/devices/system/node/node" + std::to_string(node) + "/cpulist");
+        std::string list;
+        if (!std::getline(file, list))
+            break;
+        nodes.push_back(parseCpuList(list));
+    }
+#endif
+    return nodes;
+}
+
+// ------------ CacheAligned ------------
+
+// A fixed-size array of default-constructed Ts, each starting a cache line of its own
+// and padded to whole lines, so that threads writing their own element never write to the
+// same line. (new[] doesn't align to cache lines in C++11, so the storage is aligned by hand.)
+template <class T>
+class CacheAlignedArray
+{
+private:
+    static const std::size_t CACHE_LINE_SIZE = 64;
+    static const std::size_t STRIDE = (sizeof(T) + CACHE_LINE_SIZE - 1) / CACHE_LINE_SIZE * CACHE_LINE_SIZE;
+
+    std::size_t size_;
+    char* storage_;
+    char* first_;
+public:
+    explicit CacheAlignedArray(std::size_t size);
+    ~CacheAlignedArray();
+
+    CacheAlignedArray(const CacheAlignedArray& other) = delete;
+    CacheAlignedArray& operator=(const CacheAlignedArray& other) = delete;
+
+    T& operator[](std::size_t i) { return *reinterpret_cast<T*>(first_ + i * STRIDE); }
+    const T& operator[](std::size_t i) const { return *reinterpret_cast<const T*>(first_ + i * STRIDE); }
+    std::size_t size() const { return size_; }
+};
+
+template <class T>
+CacheAlignedArray<T>::CacheAlignedArray(std::size_t size)
+    : size_(size)
+    , storage_(static_cast<char*>(::operator new(size * STRIDE + CACHE_LINE_SIZE - 1)))
+{
+    std::uintptr_t address = reinterpret_cast<std::uintptr_t>(storage_);
+    first_ = storage_ + (CACHE_LINE_SIZE - address % CACHE_LINE_SIZE) % CACHE_LINE_SIZE;
+
+    std::size_t constructed = 0;
+    try
+    {
+        for (; constructed != size_; ++constructed)
+            new (first_ + constructed * STRIDE) T();
+    }
+    catch (...)
+    {
+        while (constructed != 0)
+            (*this)[--constructed].~T();
+        ::operator delete(storage_);
+        throw;
+    }
+}
+
+template <class T>
+CacheAlignedArray<T>::~CacheAlignedArray()
+{
+    for (std::size_t i = 0; i != size_; ++i)
+        (*this)[i].~T();
+    ::operator delete(storage_);
+}
+
+// --------------- Metrics --------------
+
+// The counts of a LatencyHistogram, taken at some point in time
+struct HistogramSnapshot
+{
+    std::vector<std::uint64_t> counts;      // Per bucket (see LatencyHistogram::bucketOf())
+    std::uint64_t total;
+    std::chrono::nanoseconds sum, max;
+
+    HistogramSnapshot() : total(0), sum(0), max(0) {}
+
+    std::chrono::nanoseconds mean() const;
+    std::chrono::nanoseconds percentile(double p) const;
+};
+
+// Recorded durations, bucketed HDR-style: exactly below 32ns, then 16 buckets per power
+// of two (so within 1/16 of the actual value), up to about a day. Recording is a couple
+// of relaxed atomic operations, so any number of threads can record concurrently.
+class LatencyHistogram
+{
+public:
+    static const int MAX_MSB = 46;          // 2^47ns is about 39 hours
+    static const int NUM_BUCKETS = ((MAX_MSB - 4) << 4) + 32;
+private:
+    std::atomic<std::uint64_t> counts_[NUM_BUCKETS];
+    std::atomic<std::uint64_t> total_, sum_, max_;
+public:
+    LatencyHistogram();
+
+    LatencyHistogram(const LatencyHistogram& other) = delete;
+    LatencyHistogram& operator=(const LatencyHistogram& other) = delete;
+
+    void record(std::chrono::nanoseconds duration);
+    HistogramSnapshot snapshot() const;
+
+    static int bucketOf(std::uint64_t nanos);
+    static std::uint64_t bucketUpperBound(int bucket);
+};
+
+// What one thread of a pool did, in total
+struct WorkerStats
+{
+    std::uint64_t executed;                 // Tasks run
+    std::uint64_t stolen;                   // Of which were stolen from other threads' deques
+    std::chrono::nanoseconds idleTime;      // Spent spinning or blocked, waiting for tasks
+
+    WorkerStats() : executed(0), stolen(0), idleTime(0) {}
+};
+
+// A snapshot of a pool's metrics (see BasicThreadPool::stats()). Only enabled if the pool
+// is compiled with THREADPOOL_METRICS defined; otherwise, every metric stays zero.
+struct ThreadPoolStats
+{
+    bool enabled;
+    HistogramSnapshot queueLatency;         // From submission to the start of the task
+    HistogramSnapshot runTime;
+    std::vector<WorkerStats> workers;       // Per thread slot (see ThreadPoolOptions::maxThreads)
+    std::size_t maxQueueDepth;              // The most tasks waiting at once
+
+    ThreadPoolStats() : enabled(false), maxQueueDepth(0) {}
+};
+
+inline
+std::chrono::nanoseconds HistogramSnapshot::mean() const
+{
+    if (total == 0)
+        return std::chrono::nanoseconds(0);
+    return std::chrono::nanoseconds(sum.count() / static_cast<std::int64_t>(total));
+}
+
+// The smallest duration that at least a fraction p (in [0, 1]) of the recorded ones don't
+// exceed, as precise as its bucket (the maximum, for p = 1)
+inline
+std::chrono::nanoseconds HistogramSnapshot::percentile(double p) const
+{
+    if (total == 0)
+        return std::chrono::nanoseconds(0);
+
+    std::uint64_t rank = static_cast<std::uint64_t>(p * total + 0.5);
+    if (rank == 0)
+        rank = 1;
+    std::uint64_t seen = 0;
+    for (std::size_t i = 0; i != counts.size(); ++i)
+        if ((seen += counts[i]) >= rank)
+        {
+            std::chrono::nanoseconds bound(LatencyHistogram::bucketUpperBound(static_cast<int>(i)));
+            return bound < max ? bound : max;
+        }
+    return max;
+}
+
+inline
+LatencyHistogram::LatencyHistogram()
+    : total_(0)
+    , sum_(0)
+    , max_(0)
+{
+    for (int i = 0; i != NUM_BUCKETS; ++i)
+        counts_[i].store(0, std::memory_order_relaxed);
+}
+
+inline
+void LatencyHistogram::record(std::chrono::nanoseconds duration)
+{
+    std::uint64_t nanos = duration.count() > 0 ? static_cast<std::uint64_t>(duration.count()) : 0;
+    counts_[bucketOf(nanos)].fetch_add(1, std::memory_order_relaxed);
+    total_.fetch_add(1, std::memory_order_relaxed);
+    sum_.fetch_add(nanos, std::memory_order_relaxed);
+
+    std::uint64_t max = max_.load(std::memory_order_relaxed);
+    while (nanos > max && !max_.compare_exchange_weak(max, nanos, std::memory_order_relaxed))
+        ;
+}
+
+// Not atomic as a whole: counts recorded meanwhile may or may not be included
+inline
+HistogramSnapshot LatencyHistogram::snapshot() const
+{
+    HistogramSnapshot snapshot;
+    snapshot.counts.resize(NUM_BUCKETS);
+    for (int i = 0; i != NUM_BUCKETS; ++i)
+    {
+        snapshot.counts[i] = counts_[i].load(std::memory_order_relaxed);
+        snapshot.total += snapshot.counts[i];
+    }
+    snapshot.sum = std::chrono::nanoseconds(sum_.load(std::memory_order_relaxed));
+    snapshot.max = std::chrono::nanoseconds(max_.load(std::memory_order_relaxed));
+    return snapshot;
+}
+
+// The bucket is the value's top 5 bits (whose first is always 1), offset by 16 times the
+// amount of lower bits
+inline
+int LatencyHistogram::bucketOf(std::uint64_t nanos)
+{
+    if (nanos < 32)
+        return static_cast<int>(nanos);
+
+    int msb = 63;
+#if defined(__GNUC__) || defined(__clang__)
+    msb -= __builtin_clzll(nanos);
+#else
+    while (!(nanos >> msb))
+        --msb;
+#endif
+    if (msb > MAX_MSB)
+        return NUM_BUCKETS - 1;
+    const int shift = msb - 4;
+    return (shift << 4) + static_cast<int>(nanos >> shift);
+}
+
+inline
+std::uint64_t LatencyHistogram::bucketUpperBound(int bucket)
+{
+    if (bucket < 32)
+        return bucket;
+    const int shift = (bucket >> 4) - 1;
+    const std::uint64_t mantissa = (bucket & 15) + 16;
+    return ((mantissa + 1) << shift) - 1;
+}
+
+// The metrics a pool records, by default when THREADPOOL_METRICS is defined (or with
+// PoolPolicy<Queue, RecordingMetrics>). Per-thread counters are only written by their
+// own thread, and padded to a cache line each.
+class RecordingMetrics
+{
+public:
+    typedef std::chrono::steady_clock Clock;
+
+    // Every task carries one (see BasicThreadPool::TaskNode)
+    struct TaskStamp
+    {
+        Clock::time_point queuedAt;
+    };
+
+    class Timer
+    {
+    private:
+        Clock::time_point start_;
+    public:
+        Timer() : start_(Clock::now()) {}
+        std::chrono::nanoseconds elapsed() const { return Clock::now() - start_; }
+        Clock::time_point start() const { return start_; }
+    };
+private:
+    struct Worker
+    {
+        std::atomic<std::uint64_t> executed, stolen, idleNanos;
+        Worker() : executed(0), stolen(0), idleNanos(0) {}
+    };
+
+    LatencyHistogram queueLatency_, runTime_;
+    CacheAlignedArray<Worker> workers_;         // Each thread's counters on lines of their own
+    const int numWorkers_;
+    std::atomic<int> maxQueueDepth_;
+public:
+    explicit RecordingMetrics(int numWorkers)
+        : workers_(numWorkers)
+        , numWorkers_(numWorkers)
+        , maxQueueDepth_(0)
+    {}
+
+    void stampQueued(TaskStamp& stamp) { stamp.queuedAt = Clock::now(); }
+
+    // activeThreads() is only called here, since counting the active threads isn't free
+    template <class ActiveThreads>
+    void queueDepth(const std::atomic<int>& pendingTasks, const ActiveThreads& activeThreads)
+    {
+        int depth = pendingTasks.load(std::memory_order_relaxed) - activeThreads();
+        int max = maxQueueDepth_.load(std::memory_order_relaxed);
+        while (depth > max && !maxQueueDepth_.compare_exchange_weak(max, depth, std::memory_order_relaxed))
+            ;
+    }
+
+    Timer taskStarted(const TaskStamp& stamp)
+    {
+        Timer timer;
+        queueLatency_.record(timer.start() - stamp.queuedAt);
+        return timer;
+    }
+
+    void taskFinished(int worker, const Timer& timer)
+    {
+        runTime_.record(timer.elapsed());
+        workers_[worker].executed.fetch_add(1, std::memory_order_relaxed);
+    }
+
+    void taskStolen(int worker) { workers_[worker].stolen.fetch_add(1, std::memory_order_relaxed); }
+
+    Timer idleStarted() { return Timer(); }
+
+    void idleFinished(int worker, const Timer& timer)
+    {
+        workers_[worker].idleNanos.fetch_add(timer.elapsed().count(), std::memory_order_relaxed);
+    }
+
+    void snapshot(ThreadPoolStats& stats) const
+    {
+        stats.enabled = true;
+        stats.queueLatency = queueLatency_.snapshot();
+        stats.runTime = runTime_.snapshot();
+        stats.maxQueueDepth = maxQueueDepth_.load(std::memory_order_relaxed);
+        stats.workers.resize(numWorkers_);
+        for (int i = 0; i != numWorkers_; ++i)
+        {
+            stats.workers[i].executed = workers_[i].executed.load(std::memory_order_relaxed);
+            stats.workers[i].stolen = workers_[i].stolen.load(std::memory_order_relaxed);
+            stats.workers[i].idleTime = std::chrono::nanoseconds(workers_[i].idleNanos.load(std::memory_order_relaxed));
+        }
+    }
+};
+
+// Without THREADPOOL_METRICS (or with PoolPolicy<Queue, NoMetrics>), nothing is recorded,
+// and the calls compile to nothing (TaskStamp is an empty base of each task's node, so it
+// takes no room either)
+class NoMetrics
+{
+public:
+    struct TaskStamp {};
+    struct Timer {};
+
+    explicit NoMetrics(int) {}
+
+    void stampQueued(TaskStamp&) {}
+    template <class ActiveThreads>
+    void queueDepth(const std::atomic<int>&, const ActiveThreads&) {}
+    Timer taskStarted(const TaskStamp&) { return Timer(); }
+    void taskFinished(int, const Timer&) {}
+    void taskStolen(int) {}
+    Timer idleStarted() { return Timer(); }
+    void idleFinished(int, const Timer&) {}
+    void snapshot(ThreadPoolStats&) const {}
+};
+
+// The metrics pools record unless their PoolPolicy says otherwise
+#ifdef THREADPOOL_METRICS
+typedef RecordingMetrics PoolMetrics;
+#else
+typedef NoMetrics PoolMetrics;
+#endif
+
+// --------------- Tracing --------------
+
+// What a RingTracer records, on the thread it happened on
+enum class TraceEvent
+{
+    Enqueue,                    // A task was queued
+    Start,                      // A task started running
+    End,                        // and finished
+    Steal,                      // A task was taken from another thread's deque or LIFO slot
+    Park,                       // The thread blocked, for lack of tasks
+    Unpark                      // and woke up
+};
+
+// Records what a pool's threads do, by default when THREADPOOL_TRACING is defined (or
+// with PoolPolicy<Queue, Metrics, RingTracer>), between start() and stop(). Each thread
+// writes to a ring of its own (the threads outside the pool share ring 0), which keeps
+// its latest events, so tracing never allocates or blocks. While stopped, each event
+// costs a single branch. Events are numbered by task, so a trace can follow a task from
+// its Enqueue to its Start. start(), stop() and write() mustn't be called concurrently.
+class RingTracer
+{
+public:
+    typedef std::chrono::steady_clock Clock;
+
+    // Every task carries one (see BasicThreadPool::TaskNode)
+    struct TaskStamp
+    {
+        std::uint64_t traceId;                  // 0 if queued while stopped
+
+        TaskStamp() : traceId(0) {}
+    };
+private:
+    // Atomic fields, so that write() can read the rings while they're written to (the
+    // trace is only consistent once the threads are done with the events it reads)
+    struct Event
+    {
+        std::atomic<std::uint64_t> nanos, task, kind;
+    };
+
+    struct Ring
+    {
+        std::unique_ptr<Event[]> events;
+        std::atomic<std::uint64_t> written;     // Events ever recorded (the ring keeps the latest)
+
+        Ring() : written(0) {}
+    };
+
+    CacheAlignedArray<Ring> rings_;
+    std::size_t capacity_;                      // Per ring, a power of two (0 until started)
+    std::atomic<bool> enabled_;
+    std::atomic<std::uint64_t> lastTask_;
+    const Clock::time_point epoch_;
+
+    void record(int thread, TraceEvent event, std::uint64_t task)
+    {
+        Ring& ring = rings_[thread];
+        Event& e = ring.events[ring.written.fetch_add(1, std::memory_order_relaxed) & (capacity_ - 1)];
+        e.nanos.store(std::chrono::duration_cast<std::chrono::nanoseconds>(Clock::now() - epoch_).count(),
+                      std::memory_order_relaxed);
+        e.task.store(task, std::memory_order_relaxed);
+        e.kind.store(static_cast<std::uint64_t>(event), std::memory_order_relaxed);
+    }
+
+    static void writeEvent(std::ostream& out, const char* name, const char* phase, std::uint64_t nanos,
+                           int thread, std::uint64_t task);
+public:
+    // Thread 0 is outside the pool, threads 1 to numThreads its own
+    explicit RingTracer(int numThreads)
+        : rings_(numThreads + 1)
+        , capacity_(0)
+        , enabled_(false)
+        , lastTask_(0)
+        , epoch_(Clock::now())
+    {}
+
+    bool enabled() const { return enabled_.load(std::memory_order_acquire); }
+
+    void start(std::size_t eventsPerThread);
+    void stop() { enabled_.store(false, std::memory_order_release); }
+    void write(std::ostream& out) const;
+
+    void taskQueued(TaskStamp& stamp, int thread)
+    {
+        if (enabled())
+        {
+            stamp.traceId = lastTask_.fetch_add(1, std::memory_order_relaxed) + 1;
+            record(thread, TraceEvent::Enqueue, stamp.traceId);
+        }
+    }
+
+    void taskStarted(const TaskStamp& stamp, int thread)
+    {
+        if (enabled())
+            record(thread, TraceEvent::Start, stamp.traceId);
+    }
+
+    void taskFinished(const TaskStamp& stamp, int thread)
+    {
+        if (enabled())
+            record(thread, TraceEvent::End, stamp.traceId);
+    }
+
+    void taskStolen(const TaskStamp& stamp, int thread)
+    {
+        if (enabled())
+            record(thread, TraceEvent::Steal, stamp.traceId);
+    }
+
+    void parked(int thread)
+    {
+        if (enabled())
+            record(thread, TraceEvent::Park, 0);
+    }
+
+    void unparked(int thread)
+    {
+        if (enabled())
+            record(thread, TraceEvent::Unpark, 0);
+    }
+};
+
+// Clears the rings and starts recording. The rings are allocated by the first call,
+// with room for eventsPerThread (rounded up to a power of two) each; later calls reuse
+// them, since a thread may still be recording into them.
+inline
+void RingTracer::start(std::size_t eventsPerThread)
+{
+    if (capacity_ == 0)
+    {
+        std::size_t capacity = 1;
+        while (capacity < eventsPerThread)
+            capacity *= 2;
+        for (std::size_t i = 0; i != rings_.size(); ++i)
+            rings_[i].events.reset(new Event[capacity]);
+        capacity_ = capacity;
+    }
+
+    for (std::size_t i = 0; i != rings_.size(); ++i)
+        rings_[i].written.store(0, std::memory_order_relaxed);
+    enabled_.store(true, std::memory_order_release);
+}
+
+// Writes the events the rings still hold as Chrome trace JSON, e.g. to load in
+// chrome://tracing or ui.perfetto.dev: a track per thread, where tasks and parked
+// stretches are slices, enqueues and steals are instants, and an arrow joins each task's
+// enqueue to its start. Meant to be called once stopped (and the threads are idle).
+inline
+void RingTracer::write(std::ostream& out) const
+{
+    out << "{\"traceEvents\": [\n"
+        << "{\"name\": \"thread_name\", \"ph\": \"M\", \"pid\": 1, \"tid\": 0, "
+        << "\"args\": {\"name\": \"outside the pool\"}}";
+    for (std::size_t thread = 1; thread != rings_.size(); ++thread)
+        out << ",\n{\"name\": \"thread_name\", \"ph\": \"M\", \"pid\": 1, \"tid\": " << thread
+            << ", \"args\": {\"name\": \"thread " << thread << "\"}}";
+
+    for (std::size_t thread = 0; capacity_ != 0 && thread != rings_.size(); ++thread)
+    {
+        const Ring& ring = rings_[thread];
+        const std::uint64_t written = ring.written.load(std::memory_order_acquire);
+        int open = 0;                           // Slices begun but not ended yet
+        for (std::uint64_t i = written > capacity_ ? written - capacity_ : 0; i != written; ++i)
+        {
+            const Event& e = ring.events[i & (capacity_ - 1)];
+            const std::uint64_t nanos = e.nanos.load(std::memory_order_relaxed);
+            const std::uint64_t task = e.task.load(std::memory_order_relaxed);
+            const int t = static_cast<int>(thread);
+            switch (static_cast<TraceEvent>(e.kind.load(std::memory_order_relaxed)))
+            {
+            case TraceEvent::Enqueue:
+                writeEvent(out, "enqueue", "i", nanos, t, task);
+                writeEvent(out, "queued", "s", nanos, t, task);
+                break;
+            case TraceEvent::Start:
+                writeEvent(out, "task", "B", nanos, t, task);
+                writeEvent(out, "queued", "f", nanos, t, task);
+                ++open;
+                break;
+            case TraceEvent::Park:
+                writeEvent(out, "parked", "B", nanos, t, 0);
+                ++open;
+                break;
+            case TraceEvent::End:
+            case TraceEvent::Unpark:
+                // (Unless the slice began before the ring's oldest event)
+                if (open != 0)
+                {
+                    writeEvent(out, "", "E", nanos, t, 0);
+                    --open;
+                }
+                break;
+            case TraceEvent::Steal:
+                writeEvent(out, "steal", "i", nanos, t, task);
+                break;
+            }
+        }
+    }
+    out << "\n], \"displayTimeUnit\": \"ns\"}\n";
+}
+
+// Flow events ("s" and "f") need a task, the others show it as an argument if they have
+// one. Timestamps are in microseconds.
+inline
+void RingTracer::writeEvent(std::ostream& out, const char* name, const char* phase, std::uint64_t nanos,
+                            int thread, std::uint64_t task)
+{
+    const bool flow = phase[0] == 's' || phase[0] == 'f';
+    if (flow && task == 0)
+        return;
+
+    const char digits[] = { char('0' + nanos / 100 % 10), char('0' + nanos / 10 % 10), char('0' + nanos % 10), 0 };
+    out << ",\n{\"name\": \"" << name << "\", \"ph\": \"" << phase << "\", \"ts\": " << nanos / 1000 << '.'
+        << digits << ", \"pid\": 1, \"tid\": " << thread;
+    if (flow)
+        out << ", \"cat\": \"task\", \"id\": " << task << (phase[0] == 'f' ? ", \"bp\": \"e\"" : "");
+    else if (phase[0] == 'i')
+        out << ", \"s\": \"t\"";
+    if (!flow && task != 0)
+        out << ", \"args\": {\"task\": " << task << "}";
+    out << "}";
+}
+
+// Without THREADPOOL_TRACING (or with PoolPolicy<Queue, Metrics, NoTracer>), nothing is
+// recorded, the calls compile to nothing, and the trace is empty
+class NoTracer
+{
+public:
+    struct TaskStamp {};
+
+    explicit NoTracer(int) {}
+
+    bool enabled() const { return false; }
+    void start(std::size_t) {}
+    void stop() {}
+    void write(std::ostream& out) const { out << "{\"traceEvents\": []}\n"; }
+
+    void taskQueued(TaskStamp&, int) {}
+    void taskStarted(const TaskStamp&, int) {}
+    void taskFinished(const TaskStamp&, int) {}
+    void taskStolen(const TaskStamp&, int) {}
+    void parked(int) {}
+    void unparked(int) {}
+};
+
+// The tracer pools use unless their PoolPolicy says otherwise
+#ifdef THREADPOOL_TRACING
+typedef RingTracer PoolTracer;
+#else
+typedef NoTracer PoolTracer;
+#endif
+
+// -------------- Policies --------------
+
+// Queue policies: which queues a pool's threads take tasks from. With a policy other
+// than AnyQueue, the choice is made at compile time, so the queues the pool doesn't use
+// cost it no branch at all (submitting and finding a task never test for them), and the
+// matching ThreadPoolOptions are ignored. Each policy maps what the options ask for to
+// what the pool does.
+
+// Whatever ThreadPoolOptions say (workStealing, lifoSlot and queueCapacity)
+struct AnyQueue
+{
+    static bool workStealing(bool requested) { return requested; }
+    static bool lifoSlot(bool requested) { return requested; }
+    static bool bounded(bool requested) { return requested; }
+};
+
+// The shared queue only, one FIFO per priority under the pool's lock
+struct SharedQueue
+{
+    static bool workStealing(bool) { return false; }
+    static bool lifoSlot(bool) { return false; }
+    static bool bounded(bool) { return false; }
+};
+
+// The lock-free bounded ring (MPMCQueue) for Normal tasks, of queueCapacity tasks
+// (DEFAULT_CAPACITY if that's 0)
+struct BoundedQueue
+{
+    static const std::size_t DEFAULT_CAPACITY = 1024;
+
+    static bool workStealing(bool) { return false; }
+    static bool lifoSlot(bool) { return false; }
+    static bool bounded(bool) { return true; }
+};
+
+// A work-stealing deque per thread (and LIFO slots, if lifoSlot is set)
+struct StealingQueue
+{
+    static bool workStealing(bool) { return true; }
+    static bool lifoSlot(bool requested) { return requested; }
+    static bool bounded(bool) { return false; }
+};
+
+// The compile-time choices of a pool (see PolicyThreadPool and PolicyGenericThreadPool):
+// Queue is one of the queue policies above, Metrics either RecordingMetrics or NoMetrics
+// (by default, PoolMetrics: whichever THREADPOOL_METRICS selects), and Tracer either
+// RingTracer or NoTracer (by default, PoolTracer: whichever THREADPOOL_TRACING selects).
+template <class Queue = AnyQueue, class Metrics = PoolMetrics, class Tracer = PoolTracer>
+struct PoolPolicy
+{
+    typedef Queue QueuePolicy;
+    typedef Metrics MetricsPolicy;
+    typedef Tracer TracerPolicy;
+};
+
+// ------------- ThreadPool -------------
+
+// What submit() does when a bounded queue (see ThreadPoolOptions::queueCapacity) is full
+enum class Backpressure
+{
+    Block,          // Wait until a thread takes a task off the queue
+    SpinThenBlock,  // Retry for a while (yielding in between) before waiting
+    Reject          // Don't enqueue the task; submit() returns an invalid future
+};
+
+// Scheduling bands for submitWithPriority(). A queued task only waits behind the tasks
+// queued before it in its own band and the tasks in higher bands.
+enum class Priority
+{
+    High,           // E.g. latency-critical requests
+    Normal,         // What submit() uses
+    Low             // E.g. background maintenance
+};
+
+// What a thread with nothing to do does before it blocks (until a task is submitted).
+// Spinning saves the submitter a wake-up call, and the thread the time to wake up,
+// at the cost of burning a core: best left to pools on dedicated cores.
+enum class IdlePolicy
+{
+    Block,          // Block right away
+    Spin,           // Poll for tasks idleSpins times (pausing in between) first
+    SpinThenYield   // Same, then poll idleSpins more times, yielding the CPU in between
+};
+
+template <class TaskType, class Policy = PoolPolicy<>>
+class BasicThreadPool;
+
+// Lets queued tasks be skipped (see submitCancellable()): once cancel() is called, the
+// tasks submitted with this token (or a copy of it) that haven't started yet are
+// destroyed instead of run, breaking their promises. Tasks already running aren't
+// interrupted, but can poll isCancelled(). Copies share the same state.
+class CancellationToken
+{
+private:
+    template <class TaskType, class Policy>
+    friend class BasicThreadPool;
+
+    std::shared_ptr<std::atomic<bool>> cancelled_;
+public:
+    CancellationToken() : cancelled_(std::make_shared<std::atomic<bool>>(false)) {}
+
+    void cancel() { cancelled_->store(true, std::memory_order_release); }
+    bool isCancelled() const { return cancelled_->load(std::memory_order_acquire); }
+};
+
+// Identifies a timer (see executeAfter() and scheduleEvery()), to cancel it with
+// cancelTimer(). Default constructed, or once its timer has fired (or been cancelled),
+// it identifies none: slots are reused, but a handle only matches its own timer.
+class TimerHandle
+{
+private:
+    template <class TaskType, class Policy>
+    friend class BasicThreadPool;
+
+    std::uint32_t index_;                   // The timer's slot + 1 (0 if none)
+    std::uint32_t generation_;
+public:
+    TimerHandle() : index_(0), generation_(0) {}
+
+    bool valid() const { return index_ != 0; }
+};
+
+// Construction-time settings for a ThreadPool. The defaults match ThreadPool(numThreads).
+struct ThreadPoolOptions
+{
+    bool waitOnDestroy;             // Call wait() on destruction
+    bool workStealing;              // Give each thread its own deque of tasks (see submit())
+    std::size_t preallocatedTasks;  // Task slots (and promise states) to allocate up front
+    std::size_t queueCapacity;      // If nonzero, use a lock-free queue of (at most) this many tasks
+    Backpressure backpressure;      // What to do when that queue is full
+    std::vector<int> cpuAffinity;   // If not empty, pin thread i to CPU cpuAffinity[i % size]
+    std::vector<std::vector<int>> numaNodes;    // If not empty, the CPUs of each node (see submitOnNode())
+    IdlePolicy idlePolicy;          // What idle threads do before blocking
+    unsigned idleSpins;             // How long they do it, in polls
+    int maxThreads;                 // The most threads resize() can start (0: the initial amount)
+    bool elastic;                   // Add threads under load, and retire idle ones (see resize())
+    int minThreads;                 // The fewest threads an elastic pool retires down to
+    std::chrono::milliseconds idleTimeout;  // How long a thread of an elastic pool idles before retiring
+    bool lifoSlot;                  // Run a task submitted by a task next, on the same thread (implies workStealing)
+    std::function<void(std::exception_ptr)> errorHandler;  // Given each exception a task lets escape (see taskErrors())
+    int blockingThreads;            // Extra threads that stand in for those blocked in a BlockingSection
+
+    explicit ThreadPoolOptions(bool wait = true)
+        : waitOnDestroy(wait)
+        , workStealing(false)
+        , preallocatedTasks(0)
+        , queueCapacity(0)
+        , backpressure(Backpressure::Block)
+        , idlePolicy(IdlePolicy::Block)
+        , idleSpins(2000)
+        , maxThreads(0)
+        , elastic(false)
+        , minThreads(1)
+        , idleTimeout(1000)
+        , lifoSlot(false)
+        , blockingThreads(0)
+    {}
+};
+
+// What a BlockingSection tells the pool whose thread it's on, whatever the pool's type
+class BlockingAware
+{
+private:
+    friend class BlockingSection;
+
+    virtual bool blockingStarted() = 0;
+    virtual void blockingFinished() = 0;
+protected:
+    ~BlockingAware() {}
+
+    // The pool of the current thread (outside a BlockingSection), if any
+    static BlockingAware*& current()
+    {
+        static thread_local BlockingAware* pool = nullptr;
+        return pool;
+    }
+};
+
+// Marks the rest of a task's scope as blocking (on I/O, a lock, another pool's future...):
+// meanwhile, the pool runs a compensating thread in the task's place, so that blocking
+// doesn't leave a core idle while tasks wait. The thread retires once the section ends
+// (after its current task). A pool compensates for up to ThreadPoolOptions::blockingThreads
+// threads at once; past that, or outside a pool's threads, or inside another section, a
+// section does nothing. Meant for waits that last well beyond starting a thread.
+class BlockingSection
+{
+private:
+    BlockingAware* pool_;                   // Null unless the pool compensates
+public:
+    BlockingSection()
+        : pool_(BlockingAware::current())
+    {
+        if (pool_)
+        {
+            BlockingAware::current() = nullptr;
+            if (!pool_->blockingStarted())
+            {
+                BlockingAware::current() = pool_;
+                pool_ = nullptr;
+            }
+        }
+    }
+
+    ~BlockingSection()
+    {
+        if (pool_)
+        {
+            pool_->blockingFinished();
+            BlockingAware::current() = pool_;
+        }
+    }
+
+    BlockingSection(const BlockingSection& other) = delete;
+    BlockingSection& operator=(const BlockingSection& other) = delete;
+};
+
+// The threads, queues and bookkeeping shared by ThreadPool and GenericThreadPool.
+// TaskType must be default constructible, movable, and have an execute() member.
+template <class TaskType, class Policy>
+class BasicThreadPool : private BlockingAware
+{
+protected:
+    typedef typename Policy::QueuePolicy Queue;
+    typedef typename Policy::MetricsPolicy Metrics;
+    typedef typename Policy::TracerPolicy Tracer;
+
+    // Tasks are constructed in place in nodes drawn from taskSlab_ (the stamps are empty
+    // unless THREADPOOL_METRICS and THREADPOOL_TRACING are defined). The task is skipped if
+    // cancelled is set.
+    struct TaskNode : Metrics::TaskStamp, Tracer::TaskStamp
+    {
+        TaskType task;
+        TaskNode* next;
+        std::shared_ptr<std::atomic<bool>> cancelled;
+
+        template <class... CtorArgs>
+        explicit TaskNode(CtorArgs&&... args) : task(std::forward<CtorArgs>(args)...), next(nullptr) {}
+    };
+private:
+    // A FIFO of TaskNodes linked through their next pointers, so that queueing
+    // never allocates
+    class TaskQueue
+    {
+    private:
+        TaskNode* head_;
+        TaskNode* tail_;
+    public:
+        TaskQueue() : head_(nullptr), tail_(nullptr) {}
+
+        bool empty() const { return head_ == nullptr; }
+
+        void push(TaskNode* node)
+        {
+            node->next = nullptr;
+            if (tail_)
+                tail_->next = node;
+            else
+                head_ = node;
+            tail_ = node;
+        }
+
+        TaskNode* pop()
+        {
+            TaskNode* node = head_;
+            head_ = node->next;
+            if (!head_)
+                tail_ = nullptr;
+            return node;
+        }
+
+        // Moves all of other's nodes to the back of this queue
+        void splice(TaskQueue& other)
+        {
+            if (other.empty())
+                return;
+            if (tail_)
+                tail_->next = other.head_;
+            else
+                head_ = other.head_;
+            tail_ = other.tail_;
+            other.head_ = other.tail_ = nullptr;
+        }
+    };
+protected:
+    // Tasks to be enqueued all at once (see enqueue(TaskBatch&)). Tasks that are
+    // still in the batch when it's destroyed are destroyed along with it.
+    class TaskBatch
+    {
+    private:
+        friend class BasicThreadPool;
+
+        BasicThreadPool& pool_;
+        TaskQueue tasks_;
+        std::size_t size_;
+    public:
+        explicit TaskBatch(BasicThreadPool& pool) : pool_(pool), size_(0) {}
+        ~TaskBatch() { while (!tasks_.empty()) pool_.destroyTask(tasks_.pop()); }
+
+        TaskBatch(const TaskBatch& other) = delete;
+        TaskBatch& operator=(const TaskBatch& other) = delete;
+
+        void push(TaskNode* node)
+        {
+            pool_.metrics_.stampQueued(*node);
+            pool_.tracer_.taskQueued(*node, pool_.traceThread());
+            tasks_.push(node);
+            ++size_;
+        }
+        std::size_t size() const { return size_; }
+    };
+private:
+    // The queue of one producer (see ProducerToken). Only the token's owner pushes, so the
+    // lane's lock is contended by the threads draining it at most, never by other producers.
+    // Lanes are only freed along with the pool; a released lane goes to the next token.
+    struct ProducerLane
+    {
+        std::mutex lock;
+        TaskQueue tasks;
+        std::atomic<int> size;          // Readable without lock
+        std::atomic<bool> inUse;        // Owned by a token
+        ProducerLane* next;             // Set before the lane is published, then never changes
+
+        ProducerLane() : size(0), inUse(true), next(nullptr) {}
+    };
+public:
+    // A producer's own lane into the pool (see producerToken()), for submitFrom() and
+    // executeFrom(). Movable, not copyable; must not outlive the pool, and must only be
+    // used by one thread at a time.
+    class ProducerToken
+    {
+    private:
+        friend class BasicThreadPool;
+
+        ProducerLane* lane_;
+
+        explicit ProducerToken(ProducerLane* lane) : lane_(lane) {}
+    public:
+        ProducerToken(ProducerToken&& other) : lane_(other.lane_) { other.lane_ = nullptr; }
+        ~ProducerToken() { if (lane_) lane_->inUse = false; }
+
+        ProducerToken(const ProducerToken& other) = delete;
+        ProducerToken& operator=(const ProducerToken& other) = delete;
+
+        bool valid() const { return lane_ != nullptr; }
+    };
+private:
+
+    static const std::size_t STATE_BLOCK_SIZE = 80;     // Fits std::promise's state and result (for small result types)
+    static const int SPIN_COUNT = 64;                   // Attempts to push before blocking, for Backpressure::SpinThenBlock
+    static const int NUM_PRIORITIES = 3;
+    static const int MAX_LIFO_STREAK = 3;               // Tasks run in a row from a LIFO slot, before looking elsewhere
+    static const std::size_t CACHE_LINE_SIZE = 64;
+
+    static thread_local BasicThreadPool* currentPool_;  // The pool owning the calling thread, if any
+    static thread_local int currentId_;
+    static thread_local unsigned stealSeed_;
+
+    // What each thread (slot) writes often: one cache line each, so that threads don't
+    // invalidate each other's lines. activeThreads() adds up the active flags on demand.
+    struct Worker
+    {
+        std::atomic<bool> active;           // Running a task
+        std::atomic<TaskNode*> next;        // The LIFO slot (see ThreadPoolOptions::lifoSlot)
+        int lifoStreak;                     // Tasks run in a row from it
+        ProducerLane* laneCursor;           // The producer lane it last took a task from
+
+        Worker() : active(false), next(nullptr), lifoStreak(0), laneCursor(nullptr) {}
+    };
+
+    // Timers count time in ticks of TimerTick since timerEpoch_
+    typedef std::chrono::milliseconds TimerTick;
+
+    // A timer (see addTimer()). A one-shot timer holds its task, built when the timer was
+    // added; a periodic one builds each run's task with makeTask.
+    struct TimerSlot : TimerEntry
+    {
+        TaskNode* node;
+        UniqueFunction<TaskNode*()> makeTask;
+        std::uint64_t period;               // In ticks (0 if one-shot)
+        const std::uint32_t index;          // In timerSlots_
+        std::uint32_t generation;           // Bumped whenever the slot is freed
+        std::uint32_t nextFree;             // The next free slot's index + 1, while free
+
+        explicit TimerSlot(std::uint32_t i) : node(nullptr), period(0), index(i), generation(0), nextFree(0) {}
+    };
+
+    // The members are grouped by who writes them, with a cache line of padding in between:
+    // configuration (read-mostly), the lock and what it guards, the counters idle threads
+    // poll, the pending task count (written by every submission and task), the slab, and
+    // the timers.
+
+    std::vector<std::thread> threads_;     // One per slot, up to maxThreads (see resize())
+    std::vector<std::vector<int>> threadCpus_;  // The CPUs each slot's thread is pinned to, if any
+    std::atomic<int> targetThreads_;        // Threads of slots past this one retire
+    const int blockingSlots_;               // The last slots, past maxThreads(), for compensating threads
+    std::atomic<int> compensating_;         // How many of those should run (under resizeLock_ and lock_)
+    const bool elastic_;
+    const int minThreads_;
+    const std::chrono::milliseconds idleTimeout_;
+    std::shared_ptr<Slab> stateSlab_;       // Shared with the future of every submitted task
+    std::atomic<bool> isShutdown_;          // Only set under lock_, but read anywhere
+    bool waitOnDestroy_;
+    const IdlePolicy idlePolicy_;
+    const unsigned idleSpins_;
+    const std::function<void(std::exception_ptr)> errorHandler_;
+    CacheAlignedArray<Worker> workers_;     // workers_[id - 1] belongs to thread id
+
+    // Work stealing: each thread owns localTasks_[id - 1], and tasks_ only receives
+    // tasks submitted from outside the pool (or with a priority other than Normal).
+    // With LIFO slots, the task a thread's task submitted last waits in its slot instead,
+    // and runs next on that thread; a task it displaces goes to the deque. Other threads
+    // only take it when they find nothing else.
+    bool workStealing_;
+    const bool lifoSlot_;
+    std::vector<std::unique_ptr<WorkStealingDeque<TaskNode*>>> localTasks_;
+
+    // Bounded queue: if set, boundedTasks_ replaces tasks_[Normal], and submitters that
+    // find it full wait on spaceAvailable_ (according to backpressure_)
+    std::unique_ptr<MPMCQueue<TaskNode*>> boundedTasks_;
+    Backpressure backpressure_;
+
+    // NUMA nodes: the threads are split into contiguous groups, one per node, each pinned
+    // to its node's CPUs; nodeTasks_[n] holds the tasks submitted to node n (under lock_)
+    std::vector<int> threadNodes_;          // The node of thread id is threadNodes_[id - 1]
+    std::vector<TaskQueue> nodeTasks_;
+
+    char pad0_[CACHE_LINE_SIZE];
+    std::mutex lock_;
+    TaskQueue tasks_[NUM_PRIORITIES];       // One FIFO per Priority, highest first
+    std::vector<char> threadRunning_;       // Whether a slot's thread runs (or will), under lock_
+    std::condition_variable taskAvailable_;
+    std::condition_variable tasksDone_;     // Notified when the pool may have become idle (see wait())
+    std::condition_variable spaceAvailable_;
+    std::mutex resizeLock_;                 // Serializes starting, joining and detaching threads
+
+    char pad1_[CACHE_LINE_SIZE];
+    std::atomic<int> queuedTasks_[NUM_PRIORITIES];  // The sizes of tasks_, readable without lock_
+    std::atomic<int> localTaskCount_;       // Including the tasks in LIFO slots
+    std::atomic<int> boundedTaskCount_;
+    std::atomic<int> nodeTaskCount_;
+    std::atomic<int> blockedSubmitters_;    // Waiting for room in the bounded queue
+
+    // Threads blocked on taskAvailable_ (incremented with lock_ held): if there are none,
+    // submitting a task doesn't notify it. Spinning threads aren't counted.
+    std::atomic<int> idleThreads_;
+
+    // Producer lanes: a list that only grows at its head, drained round-robin, each thread
+    // starting after the lane it last took a task from (its Worker's laneCursor)
+    std::atomic<ProducerLane*> lanes_;
+    std::atomic<int> laneTaskCount_;
+
+    char pad2_[CACHE_LINE_SIZE];
+    std::atomic<int> pendingTasks_;         // Tasks submitted but not yet completed
+
+    char pad3_[CACHE_LINE_SIZE];
+    Slab taskSlab_;
+    Metrics metrics_;
+    Tracer tracer_;
+    std::atomic<std::uint64_t> taskErrors_;
+
+    // Timers: every slot, scheduled or free, is in timerSlots_ (whose elements never
+    // move), and the scheduled ones are in timerWheel_, all under timerLock_. nextTimer_
+    // is when the wheel next needs advancing: idle threads take turns sleeping until then
+    // (one at a time, the timekeeper), and busy ones check it between tasks.
+    char pad4_[CACHE_LINE_SIZE];
+    mutable std::mutex timerLock_;
+    TimerWheel timerWheel_;
+    std::deque<TimerSlot> timerSlots_;
+    std::uint32_t freeTimers_;              // The first free slot's index + 1 (0 if none)
+    std::size_t firingTimers_;              // Taken out of the wheel by fireTimers(), not enqueued yet
+    const std::chrono::steady_clock::time_point timerEpoch_;   // Tick 0
+    std::atomic<std::uint64_t> nextTimer_;  // timerWheel_.nextExpiry(), readable without timerLock_
+    bool timekeeper_;                       // Whether an idle thread sleeps until nextTimer_ (under lock_)
+
+    bool usesStealing() const;
+    bool usesLifoSlot() const;
+    bool usesBoundedQueue() const;
+    int traceThread() const;
+    void doWork(int id);
+    bool pushTask(TaskNode* node, Backpressure backpressure, Priority priority, int numaNode,
+                  ProducerToken* token);
+    void pushBatch(TaskBatch& batch);
+    void startThread(int slot);
+    void resizeActually(int numThreads);
+    void growIfBusy();
+    bool retire(int id);
+    bool isRetiring(int id) const;
+    bool blockingStarted() override;
+    void blockingFinished() override;
+    void waitIdle(std::unique_lock<std::mutex>& ul, int id);
+    bool findTask(int id, TaskNode*& node);
+    bool popSharedTask(Priority lowest, TaskNode*& node);
+    bool popLocalTask(WorkStealingDeque<TaskNode*>& deque, bool steal, TaskNode*& node);
+    bool popNextTask(int slot, bool steal, TaskNode*& node);
+    bool popBoundedTask(TaskNode*& node);
+    bool popNodeTask(int home, bool remote, TaskNode*& node);
+    bool popLaneTask(int id, TaskNode*& node);
+    bool pushBoundedTask(TaskNode* node, Backpressure backpressure);
+    bool hasQueuedTask() const;
+    TaskNode* popQueuedTask(Priority lowest);
+    void notifyTaskAvailable(std::size_t count);
+    void wakeThreads(std::size_t count);
+    void waitForTask(int id);
+    bool spinForTask() const;
+    bool mightHaveTask() const;
+    static void cpuRelax();
+    void runTask(TaskNode* node);
+    void taskFailed(std::exception_ptr exception) noexcept;
+    void destroyTask(TaskNode* node);
+    void finishTask();
+    void setActive(bool active);
+    bool isIdle() const;
+    void takeQueuedTasks(TaskQueue& taken);
+    TimerHandle addTimerActually(TaskNode* node, UniqueFunction<TaskNode*()>&& makeTask,
+                                 std::uint64_t due, std::uint64_t period);
+    void freeTimer(TimerSlot& timer);
+    void fireTimers();
+    void clearTimers();
+    std::uint64_t currentTick() const;
+protected:
+    static const int ANY_NODE = -1;         // For enqueue(): not bound to a NUMA node
+
+    BasicThreadPool(int numThreads, const ThreadPoolOptions& options);
+    ~BasicThreadPool();
+
+    BasicThreadPool(const BasicThreadPool& other) = delete;
+    BasicThreadPool& operator=(const BasicThreadPool& other) = delete;
+
+    template <class... CtorArgs>
+    TaskNode* newTask(CtorArgs&&... args);
+    bool enqueue(TaskNode* node);
+    bool enqueue(TaskNode* node, Backpressure backpressure, Priority priority = Priority::Normal,
+                 int numaNode = ANY_NODE, ProducerToken* token = nullptr);
+    void enqueue(TaskBatch& batch);
+    void makeCancellable(TaskNode* node, const CancellationToken& token);
+
+    template <class Rep, class Period>
+    static std::uint64_t toTicks(const std::chrono::duration<Rep, Period>& d);
+    template <class Rep, class Period>
+    std::uint64_t tickAfter(const std::chrono::duration<Rep, Period>& delay) const;
+    template <class Clock, class Duration>
+    std::uint64_t tickAt(const std::chrono::time_point<Clock, Duration>& time) const;
+    TimerHandle addTimer(TaskNode* node, std::uint64_t due);
+    TimerHandle addTimer(UniqueFunction<TaskNode*()>&& makeTask, std::uint64_t due, std::uint64_t period);
+
+    SlabAllocator<char> stateAllocator() const;
+public:
+    int activeThreads() const;
+    int threadCount() const;
+    int pendingTasks() const;
+    int maxThreads() const;
+    int nodeCount() const;
+    std::size_t queueCapacity() const;
+    Backpressure backpressure() const;
+    bool isShutdown() const;
+    bool isTerminated() const;
+    std::size_t heapAllocations() const;
+    std::uint64_t taskErrors() const;
+    ThreadPoolStats stats() const;
+    void startTracing(std::size_t eventsPerThread = 65536);
+    void stopTracing();
+    void writeTrace(std::ostream& out) const;
+
+    ProducerToken producerToken();
+    bool cancelTimer(const TimerHandle& handle);
+    std::size_t timerCount() const;
+    
+    void resize(int numThreads);
+    void shutdown(bool force = false);
+    std::size_t shutdownNow();
+    void wait();
+
+    template <class Rep, class Period>
+    bool waitFor(const std::chrono::duration<Rep, Period>& timeout);
+
+    template <class Clock, class Duration>
+    bool waitUntil(const std::chrono::time_point<Clock, Duration>& deadline);
+};
+
+// A pool of tasks of one function type, with the compile-time choices of Policy (a
+// PoolPolicy); ThreadPool is the one with the default policies
+template <class Policy, class FunctionType, class... Args>
+class PolicyThreadPool : public BasicThreadPool<Task<FunctionType, Args...>, Policy>
+{
+private:
+    typedef Task<FunctionType, Args...> TaskType;
+    typedef typename BasicThreadPool<TaskType, Policy>::TaskNode TaskNode;
+public:
+    typedef typename BasicThreadPool<TaskType, Policy>::ProducerToken ProducerToken;
+
+    PolicyThreadPool(int numThreads, bool waitOnDestroy = true);
+    PolicyThreadPool(int numThreads, const ThreadPoolOptions& options);
+    
+    template <class Fn, class... DeducedArgs>
+    void execute(Fn&& fn, DeducedArgs&&... args);
+    
+    template <class Fn, class... DeducedArgs>
+    std::future<typename std::result_of<Fn(Args...)>::type>
+    submit(Fn&& fn, DeducedArgs&&... args);
+
+    template <class Fn, class... DeducedArgs>
+    std::future<typename std::result_of<Fn(Args...)>::type>
+    trySubmit(Fn&& fn, DeducedArgs&&... args);
+
+    template <class Fn, class... DeducedArgs>
+    std::future<typename std::result_of<Fn(Args...)>::type>
+    submitWithPriority(Priority priority, Fn&& fn, DeducedArgs&&... args);
+
+    template <class Fn, class... DeducedArgs>
+    std::future<typename std::result_of<Fn(Args...)>::type>
+    submitOnNode(int numaNode, Fn&& fn, DeducedArgs&&... args);
+
+    template <class Fn, class... DeducedArgs>
+    void executeCancellable(const CancellationToken& token, Fn&& fn, DeducedArgs&&... args);
+
+    template <class Fn, class... DeducedArgs>
+    std::future<typename std::result_of<Fn(Args...)>::type>
+    submitCancellable(const CancellationToken& token, Fn&& fn, DeducedArgs&&... args);
+
+    template <class Fn, class... DeducedArgs>
+    void executeFrom(ProducerToken& token, Fn&& fn, DeducedArgs&&... args);
+
+    template <class Fn, class... DeducedArgs>
+    std::future<typename std::result_of<Fn(Args...)>::type>
+    submitFrom(ProducerToken& token, Fn&& fn, DeducedArgs&&... args);
+
+    template <class Rep, class Period, class Fn, class... DeducedArgs>
+    TimerHandle executeAfter(const std::chrono::duration<Rep, Period>& delay, Fn&& fn, DeducedArgs&&... args);
+
+    template <class Clock, class Duration, class Fn, class... DeducedArgs>
+    TimerHandle executeAt(const std::chrono::time_point<Clock, Duration>& time, Fn&& fn, DeducedArgs&&... args);
+
+    template <class Rep, class Period, class Fn, class... DeducedArgs>
+    std::future<typename std::result_of<Fn(Args...)>::type>
+    submitAfter(const std::chrono::duration<Rep, Period>& delay, Fn&& fn, DeducedArgs&&... args);
+
+    template <class Clock, class Duration, class Fn, class... DeducedArgs>
+    std::future<typename std::result_of<Fn(Args...)>::type>
+    submitAt(const std::chrono::time_point<Clock, Duration>& time, Fn&& fn, DeducedArgs&&... args);
+
+    template <class Rep, class Period, class Fn, class... DeducedArgs>
+    TimerHandle scheduleEvery(const std::chrono::duration<Rep, Period>& period, Fn&& fn, DeducedArgs&&... args);
+
+    template <class InputIt, class Fn>
+    void executeBatch(InputIt first, InputIt last, Fn fn);
+
+    template <class InputIt, class Fn>
+    std::vector<std::future<typename std::result_of<Fn(Args...)>::type>>
+    submitBatch(InputIt first, InputIt last, Fn fn);
+private:
+    typedef typename BasicThreadPool<TaskType, Policy>::TaskBatch TaskBatch;
+
+    // Builds each run's task for scheduleEvery(), from its own copies of fn and args
+    template <class Fn>
+    struct RepeatingTask
+    {
+        PolicyThreadPool* pool;
+        Fn fn;
+        std::tuple<Args...> args;
+
+        TaskNode* operator()() { return pool->newDiscardingTask(fn, args, typename IndexSequence<sizeof...(Args)>::seq()); }
+    };
+
+    template <class Fn, class... DeducedArgs>
+    TimerHandle executeAtTick(std::uint64_t due, Fn&& fn, DeducedArgs&&... args);
+
+    template <class Fn, class... DeducedArgs>
+    std::future<typename std::result_of<Fn(Args...)>::type>
+    submitAtTick(std::uint64_t due, Fn&& fn, DeducedArgs&&... args);
+
+    template <class Fn, class... DeducedArgs>
+    void executeActually(Backpressure backpressure, ProducerToken* token, const CancellationToken* cancellation,
+                         Fn&& fn, DeducedArgs&&... args);
+
+    template <class Fn, class... DeducedArgs>
+    std::future<typename std::result_of<Fn(Args...)>::type>
+    submitActually(Backpressure backpressure, Priority priority, int numaNode, ProducerToken* token,
+                   const CancellationToken* cancellation, Fn&& fn, DeducedArgs&&... args);
+
+    template <class Fn, int... Nums>
+    TaskNode* newBatchTask(Fn& fn, std::tuple<Args...>& args, Sequence<Nums...>);
+
+    template <class Fn, int... Nums>
+    TaskNode* newDiscardingTask(Fn& fn, std::tuple<Args...>& args, Sequence<Nums...>);
+};
+
+template <class FunctionType, class... Args>
+class ThreadPool : public PolicyThreadPool<PoolPolicy<>, FunctionType, Args...>
+{
+public:
+    ThreadPool(int numThreads, bool waitOnDestroy = true)
+        : PolicyThreadPool<PoolPolicy<>, FunctionType, Args...>(numThreads, waitOnDestroy)
+    {}
+
+    ThreadPool(int numThreads, const ThreadPoolOptions& options)
+        : PolicyThreadPool<PoolPolicy<>, FunctionType, Args...>(numThreads, options)
+    {}
+};
+
+template <class TaskType, class Policy>
+thread_local BasicThreadPool<TaskType, Policy>* BasicThreadPool<TaskType, Policy>::currentPool_ = nullptr;
+
+template <class TaskType, class Policy>
+thread_local int BasicThreadPool<TaskType, Policy>::currentId_ = 0;
+
+template <class TaskType, class Policy>
+thread_local unsigned BasicThreadPool<TaskType, Policy>::stealSeed_ = 0;
+
+template <class TaskType, class Policy>
+BasicThreadPool<TaskType, Policy>::BasicThreadPool(int numThreads, const ThreadPoolOptions& options)
+    : threads_(std::max(numThreads, options.maxThreads) + options.blockingThreads)
+    , threadCpus_(threads_.size())
+    , targetThreads_(numThreads)
+    , blockingSlots_(options.blockingThreads)
+    , compensating_(0)
+    , elastic_(options.elastic)
+    , minThreads_(options.minThreads)
+    , idleTimeout_(options.idleTimeout)
+    , stateSlab_(new Slab(STATE_BLOCK_SIZE))
+    , isShutdown_(false)
+    , waitOnDestroy_(options.waitOnDestroy)
+    , idlePolicy_(options.idlePolicy)
+    , idleSpins_(options.idleSpins)
+    , errorHandler_(options.errorHandler)
+    , workers_(threads_.size())
+    , workStealing_(Queue::workStealing(options.workStealing || options.lifoSlot))
+    , lifoSlot_(Queue::lifoSlot(options.lifoSlot))
+    , backpressure_(options.backpressure)
+    , threadRunning_(threads_.size(), 0)
+    , localTaskCount_(0)
+    , boundedTaskCount_(0)
+    , nodeTaskCount_(0)
+    , blockedSubmitters_(0)
+    , idleThreads_(0)
+    , lanes_(nullptr)
+    , laneTaskCount_(0)
+    , pendingTasks_(0)
+    , taskSlab_(sizeof(TaskNode))
+    , metrics_(threads_.size())
+    , tracer_(threads_.size())
+    , taskErrors_(0)
+    , freeTimers_(0)
+    , firingTimers_(0)
+    , timerEpoch_(std::chrono::steady_clock::now())
+    , nextTimer_(TimerWheel::NEVER)
+    , timekeeper_(false)
+{
+    // Each task needs one block for its promise's shared state, and one for the result
+    taskSlab_.reserve(options.preallocatedTasks);
+    stateSlab_->reserve(2 * options.preallocatedTasks);
+
+    for (int i = 0; i != NUM_PRIORITIES; ++i)
+        queuedTasks_[i].store(0, std::memory_order_relaxed);
+
+    if (usesStealing())
+        for (std::size_t i = 0; i != threads_.size(); ++i)
+            localTasks_.emplace_back(new WorkStealingDeque<TaskNode*>());
+    if (Queue::bounded(options.queueCapacity != 0))
+    {
+        std::size_t capacity = options.queueCapacity;
+        if (capacity == 0)
+            capacity = BoundedQueue::DEFAULT_CAPACITY;
+        boundedTasks_.reset(new MPMCQueue<TaskNode*>(capacity));
+    }
+    if (!options.numaNodes.empty())
+    {
+        nodeTasks_.resize(options.numaNodes.size());
+        for (std::size_t i = 0; i != threads_.size(); ++i)
+            threadNodes_.push_back(static_cast<int>(i * nodeTasks_.size() / threads_.size()));
+    }
+
+    for (std::size_t i = 0; i != threads_.size(); ++i)
+        if (!threadNodes_.empty())
+            threadCpus_[i] = options.numaNodes[threadNodes_[i]];
+        else if (!options.cpuAffinity.empty())
+            threadCpus_[i].push_back(options.cpuAffinity[i % options.cpuAffinity.size()]);
+
+    for (int i = 0; i != numThreads; ++i)
+    {
+        threadRunning_[i] = 1;
+        startThread(i);
+    }
+}
+
+// Pinning is only a hint: if it fails, the thread runs wherever the OS puts it
+template <class TaskType, class Policy>
+void BasicThreadPool<TaskType, Policy>::startThread(int slot)
+{
+    threads_[slot] = std::thread(&BasicThreadPool::doWork, this, slot + 1);
+    if (!threadCpus_[slot].empty())
+        setThreadAffinity(threads_[slot], threadCpus_[slot]);
+}
+
+// Join all uncompleted threads if this ThreadPool hasn't been forcefully shut down
+template <class TaskType, class Policy>
+BasicThreadPool<TaskType, Policy>::~BasicThreadPool()
+{
+    if (waitOnDestroy_)
+        wait();
+    if (!isShutdown_)
+        shutdown(false);
+
+    // Once a compensating thread that was starting has started, no other will
+    {
+        std::lock_guard<std::mutex> rg(resizeLock_);
+    }
+
+    // (Detached threads aren't joinable)
+    for (std::size_t i = 0; i != threads_.size(); ++i)
+        if (threads_[i].joinable())
+            threads_[i].join();
+
+    clearTimers();
+
+    // Tasks that never ran get destroyed (breaking their promises)
+    for (int i = 0; i != NUM_PRIORITIES; ++i)
+        while (!tasks_[i].empty())
+            destroyTask(tasks_[i].pop());
+    for (std::size_t i = 0; i != nodeTasks_.size(); ++i)
+        while (!nodeTasks_[i].empty())
+            destroyTask(nodeTasks_[i].pop());
+
+    TaskNode* node;
+    for (std::size_t i = 0; i != localTasks_.size(); ++i)
+        while (localTasks_[i]->pop(node))
+            destroyTask(node);
+    if (usesLifoSlot())
+        for (std::size_t i = 0; i != workers_.size(); ++i)
+            if ((node = workers_[i].next.exchange(nullptr)))
+                destroyTask(node);
+    if (usesBoundedQueue())
+        while (boundedTasks_->tryPop(node))
+            destroyTask(node);
+
+    for (ProducerLane* lane = lanes_; lane; )
+    {
+        while (!lane->tasks.empty())
+            destroyTask(lane->tasks.pop());
+        ProducerLane* next = lane->next;
+        delete lane;
+        lane = next;
+    }
+}
+
+template <class TaskType, class Policy>
+inline
+int BasicThreadPool<TaskType, Policy>::activeThreads() const
+{
+    int active = 0;
+    for (std::size_t i = 0; i != workers_.size(); ++i)
+        active += workers_[i].active ? 1 : 0;
+    return active;
+}
+
+template <class TaskType, class Policy>
+inline
+int BasicThreadPool<TaskType, Policy>::threadCount() const { return targetThreads_; }
+
+// Tasks submitted but not finished yet, queued or running (timers only count once due)
+template <class TaskType, class Policy>
+inline
+int BasicThreadPool<TaskType, Policy>::pendingTasks() const { return pendingTasks_; }
+
+template <class TaskType, class Policy>
+inline
+int BasicThreadPool<TaskType, Policy>::maxThreads() const { return threads_.size() - blockingSlots_; }
+
+// 1 if the pool isn't NUMA-aware
+template <class TaskType, class Policy>
+inline
+int BasicThreadPool<TaskType, Policy>::nodeCount() const { return nodeTasks_.empty() ? 1 : nodeTasks_.size(); }
+
+// What the queue policy makes of the options (constants, unless it's AnyQueue)
+template <class TaskType, class Policy>
+inline
+bool BasicThreadPool<TaskType, Policy>::usesStealing() const { return Queue::workStealing(workStealing_); }
+
+template <class TaskType, class Policy>
+inline
+bool BasicThreadPool<TaskType, Policy>::usesLifoSlot() const { return Queue::lifoSlot(lifoSlot_); }
+
+template <class TaskType, class Policy>
+inline
+bool BasicThreadPool<TaskType, Policy>::usesBoundedQueue() const { return Queue::bounded(boundedTasks_ != nullptr); }
+
+// The tracer's thread: this pool's thread ID, or 0 outside the pool
+template <class TaskType, class Policy>
+inline
+int BasicThreadPool<TaskType, Policy>::traceThread() const { return currentPool_ == this ? currentId_ : 0; }
+
+// 0 if the queue is unbounded
+template <class TaskType, class Policy>
+inline
+std::size_t BasicThreadPool<TaskType, Policy>::queueCapacity() const
+{
+    return usesBoundedQueue() ? boundedTasks_->capacity() : 0;
+}
+
+template <class TaskType, class Policy>
+inline
+Backpressure BasicThreadPool<TaskType, Policy>::backpressure() const { return backpressure_; }
+
+// Both can be polled from any thread, often: neither takes lock_. Once isShutdown()
+// returns true, so does every later call, and what the thread that called shutdown() did
+// before is visible to the caller.
+template <class TaskType, class Policy>
+inline
+bool BasicThreadPool<TaskType, Policy>::isShutdown() const { return isShutdown_.load(std::memory_order_acquire); }
+
+template <class TaskType, class Policy>
+inline
+bool BasicThreadPool<TaskType, Policy>::isTerminated() const { return isShutdown() && activeThreads() == 0; }
+
+// How many times this pool has had to allocate memory on the heap for tasks: to grow
+// its slabs, for promise states too big for a slab block, and for callables too big to
+// store inline. Once the slabs have grown to fit the pool's workload, submitting
+// a (small enough) task doesn't increase it.
+template <class TaskType, class Policy>
+inline
+std::size_t BasicThreadPool<TaskType, Policy>::heapAllocations() const
+{
+    return taskSlab_.heapAllocations() + stateSlab_->heapAllocations();
+}
+
+// The exceptions tasks let escape so far (each also given to the error handler, if
+// any). A task with a future never does: its exception goes to the future.
+template <class TaskType, class Policy>
+inline
+std::uint64_t BasicThreadPool<TaskType, Policy>::taskErrors() const
+{
+    return taskErrors_.load(std::memory_order_relaxed);
+}
+
+// Only collected if THREADPOOL_METRICS is defined (ThreadPoolStats::enabled tells);
+// otherwise, recording metrics costs nothing, and every metric is zero
+template <class TaskType, class Policy>
+ThreadPoolStats BasicThreadPool<TaskType, Policy>::stats() const
+{
+    ThreadPoolStats stats;
+    metrics_.snapshot(stats);
+    return stats;
+}
+
+// Only traced if THREADPOOL_TRACING is defined (or the policy's tracer is RingTracer);
+// otherwise, these do nothing and the trace is empty. With tracing stopped, each event
+// costs the pool a single branch. Each thread keeps its latest eventsPerThread events (a
+// task takes two or three), which are only allocated by the first call.
+template <class TaskType, class Policy>
+void BasicThreadPool<TaskType, Policy>::startTracing(std::size_t eventsPerThread)
+{
+    tracer_.start(eventsPerThread);
+}
+
+template <class TaskType, class Policy>
+void BasicThreadPool<TaskType, Policy>::stopTracing()
+{
+    tracer_.stop();
+}
+
+// As Chrome trace JSON (see RingTracer::write), best written once tracing is stopped
+// and the pool idle
+template <class TaskType, class Policy>
+void BasicThreadPool<TaskType, Policy>::writeTrace(std::ostream& out) const
+{
+    tracer_.write(out);
+}
+
+// Hands out a lane of this pool's own to the calling producer: tasks submitted through
+// the token skip the shared queue's lock, so producers with tokens never wait for each
+// other. Reuses the lane of a token destroyed earlier, if any (its remaining tasks
+// still run, in order).
+template <class TaskType, class Policy>
+typename BasicThreadPool<TaskType, Policy>::ProducerToken BasicThreadPool<TaskType, Policy>::producerToken()
+{
+    ProducerLane* head = lanes_;
+    for (ProducerLane* lane = head; lane; lane = lane->next)
+    {
+        bool inUse = false;
+        if (!lane->inUse && lane->inUse.compare_exchange_strong(inUse, true))
+            return ProducerToken(lane);
+    }
+
+    ProducerLane* lane = new ProducerLane();
+    lane->next = head;
+    while (!lanes_.compare_exchange_weak(lane->next, lane))
+        ;
+    return ProducerToken(lane);
+}
+
+template <class TaskType, class Policy>
+inline
+SlabAllocator<char> BasicThreadPool<TaskType, Policy>::stateAllocator() const
+{
+    return SlabAllocator<char>(stateSlab_);
+}
+
+// Constructs a task (with the specified constructor arguments) in a node from taskSlab_
+template <class TaskType, class Policy>
+template <class... CtorArgs>
+typename BasicThreadPool<TaskType, Policy>::TaskNode* BasicThreadPool<TaskType, Policy>::newTask(CtorArgs&&... args)
+{
+    void* block = taskSlab_.allocate();
+    TaskNode* node;
+    try
+    {
+        node = new (block) TaskNode(std::forward<CtorArgs>(args)...);
+    }
+    catch (...)
+    {
+        taskSlab_.deallocate(block);
+        throw;
+    }
+
+    if (!node->task.isInline())
+        taskSlab_.countHeapAllocation();
+    return node;
+}
+
+template <class TaskType, class Policy>
+inline
+void BasicThreadPool<TaskType, Policy>::makeCancellable(TaskNode* node, const CancellationToken& token)
+{
+    node->cancelled = token.cancelled_;
+}
+
+// Rounded up, so that a timer never fires early
+template <class TaskType, class Policy>
+template <class Rep, class Period>
+std::uint64_t BasicThreadPool<TaskType, Policy>::toTicks(const std::chrono::duration<Rep, Period>& d)
+{
+    if (d <= d.zero())
+        return 0;
+    TimerTick ticks = std::chrono::duration_cast<TimerTick>(d);
+    if (ticks < d)
+        ++ticks;
+    return static_cast<std::uint64_t>(ticks.count());
+}
+
+template <class TaskType, class Policy>
+template <class Rep, class Period>
+inline
+std::uint64_t BasicThreadPool<TaskType, Policy>::tickAfter(const std::chrono::duration<Rep, Period>& delay) const
+{
+    return toTicks(std::chrono::steady_clock::now() - timerEpoch_ +
+                   std::chrono::duration_cast<std::chrono::steady_clock::duration>(delay));
+}
+
+// A time of another clock than steady_clock is taken as the time left until then
+template <class TaskType, class Policy>
+template <class Clock, class Duration>
+inline
+std::uint64_t BasicThreadPool<TaskType, Policy>::tickAt(const std::chrono::time_point<Clock, Duration>& time) const
+{
+    return tickAfter(time - Clock::now());
+}
+
+template <class TaskType, class Policy>
+inline
+std::uint64_t BasicThreadPool<TaskType, Policy>::currentTick() const
+{
+    return static_cast<std::uint64_t>(std::chrono::duration_cast<TimerTick>(
+        std::chrono::steady_clock::now() - timerEpoch_).count());
+}
+
+// Enqueues the task once the tick is due. Returns an invalid handle (having destroyed
+// the task) if the pool has been shut down.
+template <class TaskType, class Policy>
+inline
+TimerHandle BasicThreadPool<TaskType, Policy>::addTimer(TaskNode* node, std::uint64_t due)
+{
+    return addTimerActually(node, UniqueFunction<TaskNode*()>(), due, 0);
+}
+
+// Enqueues a task built by makeTask once the tick is due, then every period ticks
+// (which must be positive) until cancelled
+template <class TaskType, class Policy>
+inline
+TimerHandle BasicThreadPool<TaskType, Policy>::addTimer(UniqueFunction<TaskNode*()>&& makeTask, std::uint64_t due,
+                                                        std::uint64_t period)
+{
+    return addTimerActually(nullptr, std::move(makeTask), due, period);
+}
+
+// If the timer is now the first due, the timekeeper has to wake up earlier (and if
+// there's none, an idle thread becomes it)
+template <class TaskType, class Policy>
+TimerHandle BasicThreadPool<TaskType, Policy>::addTimerActually(TaskNode* node, UniqueFunction<TaskNode*()>&& makeTask,
+                                                                std::uint64_t due, std::uint64_t period)
+{
+    TimerHandle handle;
+    bool earlier;
+    {
+        std::lock_guard<std::mutex> lg(timerLock_);
+        if (isShutdown_)
+        {
+            if (node)
+                destroyTask(node);
+            return handle;
+        }
+
+        std::uint32_t index;
+        if (freeTimers_ != 0)
+        {
+            index = freeTimers_ - 1;
+            freeTimers_ = timerSlots_[index].nextFree;
+        }
+        else
+        {
+            index = static_cast<std::uint32_t>(timerSlots_.size());
+            timerSlots_.emplace_back(index);
+        }
+
+        TimerSlot& timer = timerSlots_[index];
+        timer.node = node;
+        timer.makeTask = std::move(makeTask);
+        timer.period = period;
+        timerWheel_.insert(&timer, due);
+        handle.index_ = index + 1;
+        handle.generation_ = timer.generation;
+
+        const std::uint64_t next = timerWheel_.nextExpiry();
+        earlier = next < nextTimer_;
+        nextTimer_ = next;
+    }
+
+    if (earlier)
+    {
+        { std::lock_guard<std::mutex> lg(lock_); }
+        taskAvailable_.notify_all();
+    }
+    return handle;
+}
+
+// Called with timerLock_ held, once the timer is out of the wheel
+template <class TaskType, class Policy>
+void BasicThreadPool<TaskType, Policy>::freeTimer(TimerSlot& timer)
+{
+    timer.node = nullptr;
+    timer.makeTask = UniqueFunction<TaskNode*()>();
+    timer.period = 0;
+    ++timer.generation;
+    timer.nextFree = freeTimers_;
+    freeTimers_ = timer.index + 1;
+}
+
+// Takes the timer out of the wheel in O(1), destroying its task (a one-shot timer's
+// future gets a broken promise). Returns false if the timer already fired (or was
+// cancelled); a periodic timer's run that's already been enqueued still runs.
+template <class TaskType, class Policy>
+bool BasicThreadPool<TaskType, Policy>::cancelTimer(const TimerHandle& handle)
+{
+    if (!handle.valid())
+        return false;
+
+    TaskNode* node;
+    {
+        std::lock_guard<std::mutex> lg(timerLock_);
+        if (handle.index_ > timerSlots_.size())
+            return false;
+        TimerSlot& timer = timerSlots_[handle.index_ - 1];
+        if (timer.generation != handle.generation_)
+            return false;
+
+        timerWheel_.remove(&timer);
+        node = timer.node;
+        freeTimer(timer);
+        nextTimer_ = timerWheel_.nextExpiry();
+    }
+    if (node)
+        destroyTask(node);
+    return true;
+}
+
+// Timers added but neither fired (for the last time) nor cancelled. A timer being fired
+// counts until its task is enqueued, so once this is 0, wait() waits for every task.
+template <class TaskType, class Policy>
+std::size_t BasicThreadPool<TaskType, Policy>::timerCount() const
+{
+    std::lock_guard<std::mutex> lg(timerLock_);
+    return timerWheel_.size() + firingTimers_;
+}
+
+// Advances the wheel to the current tick and enqueues the due timers' tasks (after
+// releasing timerLock_). A periodic timer's next run is a period after the last one
+// was due; runs missed (because no thread was free to fire them) are skipped, not
+// made up. Does nothing if another thread is already at it. Since nothing may wait
+// for them to be taken, tasks that find a bounded queue full are dropped.
+template <class TaskType, class Policy>
+void BasicThreadPool<TaskType, Policy>::fireTimers()
+{
+    const std::uint64_t now = currentTick();
+    if (now < nextTimer_ || isShutdown_)
+        return;
+
+    TaskQueue due;
+    std::size_t fired = 0;
+    {
+        std::unique_lock<std::mutex> ul(timerLock_, std::try_to_lock);
+        if (!ul.owns_lock())
+            return;
+
+        timerWheel_.advance(now, [this, now, &due, &fired](TimerEntry* entry) {
+            TimerSlot& timer = static_cast<TimerSlot&>(*entry);
+            if (timer.period == 0)
+            {
+                ++fired;
+                due.push(timer.node);
+                freeTimer(timer);
+                return;
+            }
+            due.push(timer.makeTask());
+            std::uint64_t next = timer.expiry + timer.period;
+            timerWheel_.insert(&timer, next > now ? next : now + timer.period);
+        });
+        nextTimer_ = timerWheel_.nextExpiry();
+        firingTimers_ += fired;
+    }
+
+    while (!due.empty())
+        enqueue(due.pop(), Backpressure::Reject);
+
+    if (fired != 0)
+    {
+        std::lock_guard<std::mutex> lg(timerLock_);
+        firingTimers_ -= fired;
+    }
+}
+
+// Cancels every timer (for shutdownNow() and the destructor)
+template <class TaskType, class Policy>
+void BasicThreadPool<TaskType, Policy>::clearTimers()
+{
+    TaskQueue dropped;
+    {
+        std::lock_guard<std::mutex> lg(timerLock_);
+        timerWheel_.clear([this, &dropped](TimerEntry* entry) {
+            TimerSlot& timer = static_cast<TimerSlot&>(*entry);
+            if (timer.node)
+                dropped.push(timer.node);
+            freeTimer(timer);
+        });
+        nextTimer_ = TimerWheel::NEVER;
+    }
+
+    while (!dropped.empty())
+        destroyTask(dropped.pop());
+}
+
+template <class TaskType, class Policy>
+inline
+void BasicThreadPool<TaskType, Policy>::destroyTask(TaskNode* node)
+{
+    node->~TaskNode();
+    taskSlab_.deallocate(node);
+}
+
+template <class TaskType, class Policy>
+inline
+bool BasicThreadPool<TaskType, Policy>::enqueue(TaskNode* node)
+{
+    return enqueue(node, backpressure_);
+}
+
+// With work stealing enabled, a Normal task submitted from one of this pool's own
+// threads is pushed onto that thread's deque instead of the shared queue. If the queue
+// is bounded and full, the specified backpressure policy applies (to Normal tasks only:
+// the other bands are never bounded). Returns false (having destroyed the task) if the
+// task was rejected, or if the pool was shut down while waiting. If the pool is
+// NUMA-aware, a task submitted to a node goes to that node's queue (regardless of its
+// priority, and without bound). With a (valid) producer token, the task goes to the
+// token's lane instead, also without bound. An elastic pool may then start another thread.
+template <class TaskType, class Policy>
+bool BasicThreadPool<TaskType, Policy>::enqueue(TaskNode* node, Backpressure backpressure, Priority priority,
+                                                int numaNode, ProducerToken* token)
+{
+    if (!pushTask(node, backpressure, priority, numaNode, token))
+        return false;
+    growIfBusy();
+    return true;
+}
+
+// laneTaskCount_ is incremented under the lane's lock, so that it never drops below zero
+template <class TaskType, class Policy>
+bool BasicThreadPool<TaskType, Policy>::pushTask(TaskNode* node, Backpressure backpressure, Priority priority,
+                                                 int numaNode, ProducerToken* token)
+{
+    ++pendingTasks_;
+    metrics_.stampQueued(*node);
+    tracer_.taskQueued(*node, traceThread());
+    metrics_.queueDepth(pendingTasks_, [this]() { return activeThreads(); });
+
+    if (token && token->lane_)
+    {
+        ProducerLane& lane = *token->lane_;
+        {
+            std::lock_guard<std::mutex> lg(lane.lock);
+            lane.tasks.push(node);
+            ++lane.size;
+            ++laneTaskCount_;
+        }
+        notifyTaskAvailable(1);
+        return true;
+    }
+
+    if (numaNode != ANY_NODE && !nodeTasks_.empty())
+    {
+        std::unique_lock<std::mutex> ul(lock_);
+        nodeTasks_[numaNode % nodeTasks_.size()].push(node);
+        ++nodeTaskCount_;
+        const bool wake = idleThreads_ != 0;
+        ul.unlock();
+
+        if (wake)
+            taskAvailable_.notify_one();
+        return true;
+    }
+
+    if (priority == Priority::Normal && usesStealing() && currentPool_ == this)
+    {
+        if (usesLifoSlot())
+            node = workers_[currentId_ - 1].next.exchange(node);
+        if (node)
+            localTasks_[currentId_ - 1]->push(node);
+        ++localTaskCount_;
+        notifyTaskAvailable(1);
+        return true;
+    }
+
+    if (priority == Priority::Normal && usesBoundedQueue())
+    {
+        if (pushBoundedTask(node, backpressure))
+        {
+            ++boundedTaskCount_;
+            notifyTaskAvailable(1);
+            return true;
+        }
+
+        destroyTask(node);
+        if (--pendingTasks_ == 0)
+        {
+            { std::lock_guard<std::mutex> lg(lock_); }
+            tasksDone_.notify_all();
+        }
+        return false;
+    }
+
+    // The shared FIFO (the default queue) always takes lock_, even uncontended
+    const int band = static_cast<int>(priority);
+    std::unique_lock<std::mutex> ul(lock_);
+    tasks_[band].push(node);
+    ++queuedTasks_[band];
+    const bool wake = idleThreads_ != 0;
+    ul.unlock();
+
+    if (wake)
+        taskAvailable_.notify_one();
+    return true;
+}
+
+// Enqueues every task in the batch (leaving it empty) with Normal priority, taking lock_
+// only once and waking no more threads than there are tasks. If the queue is bounded,
+// tasks rejected by the pool's backpressure policy are destroyed, which breaks their
+// promises.
+template <class TaskType, class Policy>
+void BasicThreadPool<TaskType, Policy>::enqueue(TaskBatch& batch)
+{
+    pushBatch(batch);
+    growIfBusy();
+}
+
+template <class TaskType, class Policy>
+void BasicThreadPool<TaskType, Policy>::pushBatch(TaskBatch& batch)
+{
+    const std::size_t count = batch.size_;
+    if (count == 0)
+        return;
+
+    pendingTasks_ += static_cast<int>(count);
+    batch.size_ = 0;
+    metrics_.queueDepth(pendingTasks_, [this]() { return activeThreads(); });
+
+    if (usesStealing() && currentPool_ == this)
+    {
+        while (!batch.tasks_.empty())
+            localTasks_[currentId_ - 1]->push(batch.tasks_.pop());
+        localTaskCount_ += static_cast<int>(count);
+        notifyTaskAvailable(count);
+        return;
+    }
+
+    if (usesBoundedQueue())
+    {
+        int rejected = 0;
+        while (!batch.tasks_.empty())
+        {
+            TaskNode* node = batch.tasks_.pop();
+            if (pushBoundedTask(node, backpressure_))
+            {
+                ++boundedTaskCount_;
+                notifyTaskAvailable(1);
+            }
+            else
+            {
+                destroyTask(node);
+                ++rejected;
+            }
+        }
+
+        if (rejected != 0 && (pendingTasks_ -= rejected) == 0)
+        {
+            { std::lock_guard<std::mutex> lg(lock_); }
+            tasksDone_.notify_all();
+        }
+        return;
+    }
+
+    std::unique_lock<std::mutex> ul(lock_);
+    tasks_[static_cast<int>(Priority::Normal)].splice(batch.tasks_);
+    queuedTasks_[static_cast<int>(Priority::Normal)] += static_cast<int>(count);
+    const std::size_t idle = idleThreads_;
+    ul.unlock();
+
+    wakeThreads(std::min(count, idle));
+}
+
+// Called after pushing tasks without lock_. Only takes lock_ if some thread might be
+// waiting for them: the counter of pushed tasks is incremented before idleThreads_ is
+// read here, and waitForTask() increments idleThreads_ before reading the counters.
+template <class TaskType, class Policy>
+inline
+void BasicThreadPool<TaskType, Policy>::notifyTaskAvailable(std::size_t count)
+{
+    const std::size_t idle = idleThreads_;
+    if (idle != 0)
+    {
+        { std::lock_guard<std::mutex> lg(lock_); }
+        wakeThreads(std::min(count, idle));
+    }
+}
+
+// Wakes up threads waiting on taskAvailable_ to run the specified amount of new tasks
+template <class TaskType, class Policy>
+inline
+void BasicThreadPool<TaskType, Policy>::wakeThreads(std::size_t count)
+{
+    if (count >= static_cast<std::size_t>(targetThreads_))
+        taskAvailable_.notify_all();
+    else
+        while (count-- != 0)
+            taskAvailable_.notify_one();
+}
+
+// Tries to push onto the bounded queue, waiting for space if backpressure says so
+template <class TaskType, class Policy>
+bool BasicThreadPool<TaskType, Policy>::pushBoundedTask(TaskNode* node, Backpressure backpressure)
+{
+    if (boundedTasks_->tryPush(node))
+        return true;
+    if (backpressure == Backpressure::Reject)
+        return false;
+
+    if (backpressure == Backpressure::SpinThenBlock)
+        for (int i = 0; i != SPIN_COUNT; ++i)
+        {
+            std::this_thread::yield();
+            if (boundedTasks_->tryPush(node))
+                return true;
+        }
+
+    // The fence pairs with the one in popBoundedTask(): either this thread sees the
+    // slot freed by a pop, or the popping thread sees blockedSubmitters_ != 0
+    std::unique_lock<std::mutex> ul(lock_);
+    ++blockedSubmitters_;
+    std::atomic_thread_fence(std::memory_order_seq_cst);
+    bool pushed;
+    while (!(pushed = boundedTasks_->tryPush(node)) && !isShutdown_)
+        spaceAvailable_.wait(ul);
+    --blockedSubmitters_;
+    return pushed;
+}
+
+template <class TaskType, class Policy>
+bool BasicThreadPool<TaskType, Policy>::popBoundedTask(TaskNode*& node)
+{
+    if (!boundedTasks_->tryPop(node))
+        return false;
+
+    setActive(true);
+    --boundedTaskCount_;
+
+    std::atomic_thread_fence(std::memory_order_seq_cst);
+    if (blockedSubmitters_ != 0)
+    {
+        { std::lock_guard<std::mutex> lg(lock_); }
+        spaceAvailable_.notify_one();
+    }
+    return true;
+}
+
+// Signal to threads that they should finish what they're doing. If force == true,
+// all threads in this ThreadPool will be detached (and can be safely destructed).
+// (This does not block the calling thread)
+template <class TaskType, class Policy>
+void BasicThreadPool<TaskType, Policy>::shutdown(bool force)
+{
+    std::unique_lock<std::mutex> ul(lock_);
+    if (isShutdown_)
+        return;
+
+    isShutdown_.store(true, std::memory_order_release);
+    ul.unlock();
+
+    taskAvailable_.notify_all();
+    tasksDone_.notify_all();
+    spaceAvailable_.notify_all();
+
+    if (force)
+    {
+        std::lock_guard<std::mutex> rg(resizeLock_);
+        for (std::size_t i = 0; i != threads_.size(); ++i)
+            if (threads_[i].joinable())
+                threads_[i].detach();
+    }
+}
+
+// Shuts the pool down (as shutdown() does), then takes every queued task off the queues
+// in one pass and destroys it, breaking its promise. Returns the amount of tasks dropped
+// that way; tasks already running still finish. Unlike a plain shutdown, the dropped
+// tasks' resources are released right away, rather than when the pool is destroyed.
+// Timers are cancelled too (without counting them).
+template <class TaskType, class Policy>
+std::size_t BasicThreadPool<TaskType, Policy>::shutdownNow()
+{
+    shutdown(false);
+    clearTimers();
+
+    TaskQueue taken;
+    takeQueuedTasks(taken);
+
+    std::size_t dropped = 0;
+    while (!taken.empty())
+    {
+        destroyTask(taken.pop());
+        ++dropped;
+    }
+
+    if (dropped != 0)
+    {
+        std::lock_guard<std::mutex> lg(lock_);
+        pendingTasks_ -= static_cast<int>(dropped);
+    }
+    tasksDone_.notify_all();
+    return dropped;
+}
+
+// Moves the tasks of every queue to taken (destroying them is left to the caller, since
+// their destructors may call back into the pool). The deques are stolen from, since
+// their owners may still be popping.
+template <class TaskType, class Policy>
+void BasicThreadPool<TaskType, Policy>::takeQueuedTasks(TaskQueue& taken)
+{
+    {
+        std::lock_guard<std::mutex> lg(lock_);
+        for (int i = 0; i != NUM_PRIORITIES; ++i)
+            while (!tasks_[i].empty())
+            {
+                --queuedTasks_[i];
+                taken.push(tasks_[i].pop());
+            }
+        for (std::size_t i = 0; i != nodeTasks_.size(); ++i)
+            while (!nodeTasks_[i].empty())
+            {
+                --nodeTaskCount_;
+                taken.push(nodeTasks_[i].pop());
+            }
+    }
+
+    for (ProducerLane* lane = lanes_; lane; lane = lane->next)
+    {
+        std::lock_guard<std::mutex> lg(lane->lock);
+        while (!lane->tasks.empty())
+        {
+            --lane->size;
+            --laneTaskCount_;
+            taken.push(lane->tasks.pop());
+        }
+    }
+
+    TaskNode* node;
+    for (std::size_t i = 0; i != localTasks_.size(); ++i)
+        while (!localTasks_[i]->empty())
+            if (localTasks_[i]->steal(node))
+            {
+                --localTaskCount_;
+                taken.push(node);
+            }
+    if (usesLifoSlot())
+        for (std::size_t i = 0; i != workers_.size(); ++i)
+            if ((node = workers_[i].next.exchange(nullptr)))
+            {
+                --localTaskCount_;
+                taken.push(node);
+            }
+    if (usesBoundedQueue())
+        while (boundedTasks_->tryPop(node))
+        {
+            --boundedTaskCount_;
+            taken.push(node);
+        }
+}
+
+// Changes the amount of threads to numThreads (clamped to [0, maxThreads()]), and
+// returns right away. New threads start at once; surplus threads first finish the task
+// they're running (and, with work stealing, the tasks in their own deque), so until
+// then, more than threadCount() threads may be running. Can be called at any time,
+// including from a task, and while other threads submit() or wait().
+template <class TaskType, class Policy>
+void BasicThreadPool<TaskType, Policy>::resize(int numThreads)
+{
+    std::lock_guard<std::mutex> rg(resizeLock_);
+    resizeActually(numThreads);
+}
+
+// Must be called with resizeLock_ held. A slot whose thread retired gets a new thread
+// (once the old one is joined); retiring threads notice the new target when woken up.
+template <class TaskType, class Policy>
+void BasicThreadPool<TaskType, Policy>::resizeActually(int numThreads)
+{
+    numThreads = std::max(0, std::min(numThreads, maxThreads()));
+
+    std::vector<int> slots;
+    {
+        std::lock_guard<std::mutex> lg(lock_);
+        if (isShutdown_)
+            return;
+
+        targetThreads_ = numThreads;
+        for (int i = 0; i != numThreads; ++i)
+            if (!threadRunning_[i])
+            {
+                threadRunning_[i] = 1;
+                slots.push_back(i);
+            }
+    }
+
+    for (std::size_t i = 0; i != slots.size(); ++i)
+    {
+        if (threads_[slots[i]].joinable())
+            threads_[slots[i]].join();
+        startThread(slots[i]);
+    }
+    taskAvailable_.notify_all();
+}
+
+// Elastic pools start another thread (if allowed) when none is idle and more tasks are
+// waiting than there are threads. A submitter that finds another thread resizing the
+// pool doesn't wait for it.
+template <class TaskType, class Policy>
+inline
+void BasicThreadPool<TaskType, Policy>::growIfBusy()
+{
+    if (!elastic_ || idleThreads_ != 0 || targetThreads_ >= maxThreads())
+        return;
+    if (pendingTasks_ - activeThreads() <= targetThreads_)
+        return;
+
+    std::unique_lock<std::mutex> rl(resizeLock_, std::try_to_lock);
+    if (rl.owns_lock())
+        resizeActually(targetThreads_ + 1);
+}
+
+// Called by thread id once isRetiring(id). The thread must exit if
+// this returns true, since its slot may get a new thread right away; it doesn't if the
+// pool grew back in the meantime, or if it still has tasks of its own.
+template <class TaskType, class Policy>
+bool BasicThreadPool<TaskType, Policy>::retire(int id)
+{
+    if (usesStealing() && !localTasks_[id - 1]->empty())
+        return false;
+    if (usesLifoSlot() && workers_[id - 1].next.load() != nullptr)
+        return false;
+
+    std::lock_guard<std::mutex> lg(lock_);
+    if (!isRetiring(id))
+        return false;
+    threadRunning_[id - 1] = 0;
+    return true;
+}
+
+// Whether thread id's slot is past targetThreads_, or a compensating thread's past the
+// ones still needed
+template <class TaskType, class Policy>
+inline
+bool BasicThreadPool<TaskType, Policy>::isRetiring(int id) const
+{
+    if (id > maxThreads())
+        return id - maxThreads() > compensating_;
+    return id > targetThreads_;
+}
+
+// A task of this pool entered a BlockingSection: runs the next compensating thread
+// (unless they're all running), in the next slot past maxThreads(). If the slot's thread
+// hasn't retired yet, it just stays. Returns whether a thread compensates.
+template <class TaskType, class Policy>
+bool BasicThreadPool<TaskType, Policy>::blockingStarted()
+{
+    if (blockingSlots_ == 0)
+        return false;
+
+    std::lock_guard<std::mutex> rg(resizeLock_);
+    int slot;
+    {
+        std::lock_guard<std::mutex> lg(lock_);
+        if (isShutdown_ || compensating_ == blockingSlots_)
+            return false;
+
+        slot = maxThreads() + compensating_;
+        ++compensating_;
+        if (threadRunning_[slot])
+            return true;
+        threadRunning_[slot] = 1;
+    }
+
+    try
+    {
+        if (threads_[slot].joinable())
+            threads_[slot].join();
+        startThread(slot);
+    }
+    catch (...)
+    {
+        // No thread to be had (std::system_error): the task just blocks
+        std::lock_guard<std::mutex> lg(lock_);
+        threadRunning_[slot] = 0;
+        --compensating_;
+        return false;
+    }
+    return true;
+}
+
+// The last compensating thread retires, which it notices once woken up
+template <class TaskType, class Policy>
+void BasicThreadPool<TaskType, Policy>::blockingFinished()
+{
+    {
+        std::lock_guard<std::mutex> rg(resizeLock_);
+        std::lock_guard<std::mutex> lg(lock_);
+        --compensating_;
+    }
+    taskAvailable_.notify_all();
+}
+
+// Waits on taskAvailable_ (with lock_ held) for a while. In an elastic pool, the last
+// thread retires after idleTimeout_ without a task, unless that leaves too few threads.
+template <class TaskType, class Policy>
+void BasicThreadPool<TaskType, Policy>::waitIdle(std::unique_lock<std::mutex>& ul, int id)
+{
+    // With timers, one idle thread at a time sleeps only until the next is due; if it's
+    // woken up for a task instead, another idle thread takes over
+    tracer_.parked(id);
+    const std::uint64_t nextTimer = nextTimer_;
+    if (nextTimer != TimerWheel::NEVER && !timekeeper_)
+    {
+        timekeeper_ = true;
+        bool notified = taskAvailable_.wait_until(ul, timerEpoch_ + TimerTick(nextTimer)) == std::cv_status::no_timeout;
+        timekeeper_ = false;
+        tracer_.unparked(id);
+        ul.unlock();
+        fireTimers();
+        if (notified && nextTimer_ != TimerWheel::NEVER)
+            taskAvailable_.notify_one();
+        ul.lock();
+        return;
+    }
+
+    if (!elastic_)
+        taskAvailable_.wait(ul);
+    else if (taskAvailable_.wait_for(ul, idleTimeout_) == std::cv_status::timeout &&
+             id == targetThreads_ && targetThreads_ > minThreads_)
+        --targetThreads_;
+    tracer_.unparked(id);
+}
+
+// Wait for all tasks (enqueued and currently running) to complete. This function,
+// as opposed to shutdown(), *does* block the calling thread, until the last task
+// finishes. If the pool is shut down, only currently running tasks are waited for
+// (since enqueued tasks will never run).
+// That is, after wait() returns, activeThreads() == 0.
+template <class TaskType, class Policy>
+void BasicThreadPool<TaskType, Policy>::wait()
+{
+    std::unique_lock<std::mutex> ul(lock_);
+    while (!isIdle())
+        tasksDone_.wait(ul);
+}
+
+// Same as wait(), but give up after the specified amount of time.
+// Returns true if all tasks completed, false if timed out.
+template <class TaskType, class Policy>
+template <class Rep, class Period>
+bool BasicThreadPool<TaskType, Policy>::waitFor(const std::chrono::duration<Rep, Period>& timeout)
+{
+    return waitUntil(std::chrono::steady_clock::now() + timeout);
+}
+
+// Same as wait(), but give up once the deadline has passed.
+// Returns true if all tasks completed, false if timed out.
+template <class TaskType, class Policy>
+template <class Clock, class Duration>
+bool BasicThreadPool<TaskType, Policy>::waitUntil(const std::chrono::time_point<Clock, Duration>& deadline)
+{
+    std::unique_lock<std::mutex> ul(lock_);
+    while (!isIdle())
+        if (tasksDone_.wait_until(ul, deadline) == std::cv_status::timeout)
+            return isIdle();
+    return true;
+}
+
+// Must be called with lock_ held, so that a task can't finish unnoticed between
+// checking and waiting on tasksDone_
+template <class TaskType, class Policy>
 inline
-bool ThreadPool<FunctionType, Args...>::isTerminated() const { return isShutdown_ && activeThreads_ == 0; }
+bool BasicThreadPool<TaskType, Policy>::isIdle() const
+{
+    return pendingTasks_ == 0 || (isShutdown_ && activeThreads() == 0);
+}
 
-template <class FunctionType, class... Args>
+template <class TaskType, class Policy>
+void BasicThreadPool<TaskType, Policy>::doWork(int id)
+{
+    currentPool_ = this;
+    currentId_ = id;
+    stealSeed_ = id;
+    BlockingAware::current() = this;
+
+    // Dequeue tasks until the thread pool is shutdown (or this thread isn't needed anymore)
+    while (!isShutdown_)
+    {
+        if (isRetiring(id) && retire(id))
+            break;
+        if (nextTimer_ != TimerWheel::NEVER)
+            fireTimers();
+
+        TaskNode* node;
+        if (usesStealing() || usesBoundedQueue() || !nodeTasks_.empty() || lanes_ != nullptr)
+        {
+            if (!findTask(id, node))
+            {
+                typename Metrics::Timer idle = metrics_.idleStarted();
+                if (!spinForTask())
+                    waitForTask(id);
+                metrics_.idleFinished(id - 1, idle);
+                continue;
+            }
+        }
+        else
+        {
+            std::unique_lock<std::mutex> ul(lock_);
+
+            if (!hasQueuedTask() && laneTaskCount_ == 0 && !isShutdown_ && !isRetiring(id))
+            {
+                typename Metrics::Timer idle = metrics_.idleStarted();
+                if (idlePolicy_ != IdlePolicy::Block)
+                {
+                    ul.unlock();
+                    spinForTask();
+                    ul.lock();
+                }
+
+                ++idleThreads_;
+                while (!hasQueuedTask() && laneTaskCount_ == 0 && !isShutdown_ && !isRetiring(id))
+                    waitIdle(ul, id);
+                --idleThreads_;
+                metrics_.idleFinished(id - 1, idle);
+            }
+            if (isShutdown_)
+                break;
+            if (!hasQueuedTask())
+                continue;
+
+            setActive(true);
+            node = popQueuedTask(Priority::Low);
+        }   // So lock_ is unlocked after the thread is marked active/a task is *definitely* pulled
+        
+        runTask(node);
+    }
+
+    currentPool_ = nullptr;
+    BlockingAware::current() = nullptr;
+}
+
+// Work stealing (or a bounded queue, or NUMA nodes, or producer lanes): look for a High
+// priority task, then this thread's LIFO slot, then a task in its own deque (newest
+// first), then its node's queue, then the bounded queue, then the producer lanes, then
+// the shared queue's Normal and Low bands, then the other nodes' queues, then the other
+// threads' deques (oldest first, starting at a random victim, and from threads of the
+// same node first), then the LIFO slots. Never blocks on an empty pool.
+template <class TaskType, class Policy>
+bool BasicThreadPool<TaskType, Policy>::findTask(int id, TaskNode*& node)
+{
+    if (popSharedTask(Priority::High, node))
+        return true;
+
+    // After a streak of LIFO slot tasks, look at the rest first (once), to be fair to them
+    if (usesLifoSlot())
+    {
+        Worker& worker = workers_[id - 1];
+        if (worker.lifoStreak < MAX_LIFO_STREAK && popNextTask(id - 1, false, node))
+        {
+            ++worker.lifoStreak;
+            return true;
+        }
+        worker.lifoStreak = 0;
+    }
+
+    if (usesStealing() && popLocalTask(*localTasks_[id - 1], false, node))
+        return true;
+
+    int home = ANY_NODE;
+    if (!threadNodes_.empty())
+        home = threadNodes_[id - 1];
+    if (home != ANY_NODE && popNodeTask(home, false, node))
+        return true;
+
+    if (usesBoundedQueue() && popBoundedTask(node))
+        return true;
+
+    if (popLaneTask(id, node))
+        return true;
+
+    if (popSharedTask(Priority::Low, node))
+        return true;
+
+    if (home != ANY_NODE && popNodeTask(home, true, node))
+        return true;
+
+    const int numDeques = localTasks_.size();
+    if (localTaskCount_ == 0)
+        return false;
+
+    // xorshift
+    stealSeed_ ^= stealSeed_ << 13;
+    stealSeed_ ^= stealSeed_ >> 17;
+    stealSeed_ ^= stealSeed_ << 5;
+
+    const int start = stealSeed_ % numDeques;
+    for (int pass = 0; pass != (home == ANY_NODE ? 1 : 2); ++pass)
+        for (int i = 0; i != numDeques; ++i)
+        {
+            int victim = (start + i) % numDeques;
+            if (victim == id - 1 || (home != ANY_NODE && (threadNodes_[victim] == home) != (pass == 0)))
+                continue;
+            if (popLocalTask(*localTasks_[victim], true, node))
+                return true;
+        }
+
+    // Last, the other threads' LIFO slots (including this thread's, skipped after a streak),
+    // so that a task doesn't wait for its submitter to finish when others are idle
+    if (usesLifoSlot())
+        for (int i = 0; i != numDeques; ++i)
+            if (popNextTask((start + i) % numDeques, (start + i) % numDeques != id - 1, node))
+                return true;
+    return false;
+}
+
+// Pops the oldest task of node home's queue or, if remote, of the other nodes' queues
+template <class TaskType, class Policy>
+bool BasicThreadPool<TaskType, Policy>::popNodeTask(int home, bool remote, TaskNode*& node)
+{
+    if (nodeTaskCount_ == 0)
+        return false;
+
+    std::lock_guard<std::mutex> lg(lock_);
+    const int numNodes = nodeTasks_.size();
+    for (int i = remote ? 1 : 0; i < (remote ? numNodes : 1); ++i)
+    {
+        TaskQueue& queue = nodeTasks_[(home + i) % numNodes];
+        if (!queue.empty())
+        {
+            setActive(true);
+            --nodeTaskCount_;
+            node = queue.pop();
+            return true;
+        }
+    }
+    return false;
+}
+
+// Pops the oldest task of the next producer lane that has one, taking turns: a thread
+// starts after the lane it last took a task from (wrapping around to the newest lane),
+// so that no producer's tasks wait behind all of another's
+template <class TaskType, class Policy>
+bool BasicThreadPool<TaskType, Policy>::popLaneTask(int id, TaskNode*& node)
+{
+    if (laneTaskCount_ == 0)
+        return false;
+
+    ProducerLane* head = lanes_;
+    ProducerLane*& last = workers_[id - 1].laneCursor;
+    ProducerLane* start = last && last->next ? last->next : head;
+    ProducerLane* lane = start;
+    do
+    {
+        if (lane->size != 0)
+        {
+            std::lock_guard<std::mutex> lg(lane->lock);
+            if (!lane->tasks.empty())
+            {
+                setActive(true);
+                --lane->size;
+                --laneTaskCount_;
+                node = lane->tasks.pop();
+                last = lane;
+                return true;
+            }
+        }
+        lane = lane->next ? lane->next : head;
+    } while (lane != start);
+    return false;
+}
+
+// Pops the highest priority task in the shared queue, down to the lowest band. Only takes
+// lock_ if the counters say there might be one (if they're stale, waitForTask() will
+// notice under lock_).
+template <class TaskType, class Policy>
+bool BasicThreadPool<TaskType, Policy>::popSharedTask(Priority lowest, TaskNode*& node)
+{
+    bool queued = false;
+    for (int band = 0; band <= static_cast<int>(lowest); ++band)
+        queued = queued || queuedTasks_[band] != 0;
+    if (!queued)
+        return false;
+
+    std::lock_guard<std::mutex> lg(lock_);
+    if (!(node = popQueuedTask(lowest)))
+        return false;
+    setActive(true);
+    return true;
+}
+
+// Must be called with lock_ held
+template <class TaskType, class Policy>
+inline
+bool BasicThreadPool<TaskType, Policy>::hasQueuedTask() const
+{
+    for (int band = 0; band != NUM_PRIORITIES; ++band)
+        if (!tasks_[band].empty())
+            return true;
+    return false;
+}
+
+// Must be called with lock_ held. Returns nullptr if the bands down to lowest are empty.
+template <class TaskType, class Policy>
+typename BasicThreadPool<TaskType, Policy>::TaskNode* BasicThreadPool<TaskType, Policy>::popQueuedTask(Priority lowest)
+{
+    for (int band = 0; band <= static_cast<int>(lowest); ++band)
+        if (!tasks_[band].empty())
+        {
+            --queuedTasks_[band];
+            return tasks_[band].pop();
+        }
+    return nullptr;
+}
+
+// The thread is marked active before localTaskCount_ is decremented, so that no one sees
+// a task in neither
+template <class TaskType, class Policy>
+bool BasicThreadPool<TaskType, Policy>::popLocalTask(WorkStealingDeque<TaskNode*>& deque, bool steal, TaskNode*& node)
+{
+    if (!(steal ? deque.steal(node) : deque.pop(node)))
+        return false;
+
+    setActive(true);
+    --localTaskCount_;
+    if (steal)
+    {
+        metrics_.taskStolen(currentId_ - 1);
+        tracer_.taskStolen(*node, currentId_);
+    }
+    return true;
+}
+
+template <class TaskType, class Policy>
+inline
+bool BasicThreadPool<TaskType, Policy>::popNextTask(int slot, bool steal, TaskNode*& node)
+{
+    std::atomic<TaskNode*>& next = workers_[slot].next;
+    if (next.load(std::memory_order_relaxed) == nullptr || !(node = next.exchange(nullptr)))
+        return false;
+
+    setActive(true);
+    --localTaskCount_;
+    if (steal)
+    {
+        metrics_.taskStolen(currentId_ - 1);
+        tracer_.taskStolen(*node, currentId_);
+    }
+    return true;
+}
+
+// The task's node goes back to the slab before the task counts as finished, so that
+// after wait() returns, every task has been destroyed. A cancelled task is only destroyed.
+// A task that throws is finished like any other, so the thread carries on. (With
+// table-based exception handling, as on every mainstream 64-bit ABI, the try block
+// costs nothing until something throws.)
+template <class TaskType, class Policy>
+inline
+void BasicThreadPool<TaskType, Policy>::runTask(TaskNode* node)
+{
+    if (node->cancelled && node->cancelled->load(std::memory_order_acquire))
+    {
+        destroyTask(node);
+        finishTask();
+        return;
+    }
+
+    typename Metrics::Timer timer = metrics_.taskStarted(*node);
+    tracer_.taskStarted(*node, currentId_);
+    try
+    {
+        node->task.execute();
+    }
+    catch (...)
+    {
+        taskFailed(std::current_exception());
+    }
+    tracer_.taskFinished(*node, currentId_);
+    metrics_.taskFinished(currentId_ - 1, timer);
+    destroyTask(node);
+    finishTask();
+}
+
+// Called on the thread that ran the task. The error handler must not throw: an
+// exception escaping it terminates the program.
+template <class TaskType, class Policy>
+void BasicThreadPool<TaskType, Policy>::taskFailed(std::exception_ptr exception) noexcept
+{
+    taskErrors_.fetch_add(1, std::memory_order_relaxed);
+    if (errorHandler_)
+        errorHandler_(exception);
+}
+
+// Only the calling thread (one of the pool's) writes its flag
+template <class TaskType, class Policy>
+inline
+void BasicThreadPool<TaskType, Policy>::setActive(bool active)
+{
+    workers_[currentId_ - 1].active = active;
+}
+
+// Called after each task completes. Only the last task (or, after shutdown,
+// the last running task) takes lock_ to wake up wait()ing threads.
+template <class TaskType, class Policy>
+void BasicThreadPool<TaskType, Policy>::finishTask()
+{
+    setActive(false);
+    if (--pendingTasks_ == 0 || isShutdown_)
+    {
+        { std::lock_guard<std::mutex> lg(lock_); }
+        tasksDone_.notify_all();
+    }
+}
+
+// Block until a task might be available in either the shared queue or some thread's deque
+// (or this thread should retire)
+template <class TaskType, class Policy>
+void BasicThreadPool<TaskType, Policy>::waitForTask(int id)
+{
+    std::unique_lock<std::mutex> ul(lock_);
+
+    ++idleThreads_;
+    while (!hasQueuedTask() && localTaskCount_ == 0 && boundedTaskCount_ == 0 && nodeTaskCount_ == 0 &&
+           laneTaskCount_ == 0 && !isShutdown_ && !isRetiring(id))
+        waitIdle(ul, id);
+    --idleThreads_;
+}
+
+// Polls the task counters (without taking lock_) as the idle policy says. Returns true
+// as soon as a task might be available, false once the thread should block. Whatever
+// it misses, the thread notices under lock_ before blocking.
+template <class TaskType, class Policy>
+bool BasicThreadPool<TaskType, Policy>::spinForTask() const
+{
+    if (idlePolicy_ == IdlePolicy::Block)
+        return false;
+
+    const unsigned polls = idlePolicy_ == IdlePolicy::SpinThenYield ? 2 * idleSpins_ : idleSpins_;
+    for (unsigned i = 0; i != polls; ++i)
+    {
+        if (mightHaveTask())
+            return true;
+        if (i < idleSpins_)
+            cpuRelax();
+        else
+            std::this_thread::yield();
+    }
+    return false;
+}
+
+template <class TaskType, class Policy>
+inline
+bool BasicThreadPool<TaskType, Policy>::mightHaveTask() const
+{
+    for (int band = 0; band != NUM_PRIORITIES; ++band)
+        if (queuedTasks_[band] != 0)
+            return true;
+    return localTaskCount_ != 0 || boundedTaskCount_ != 0 || nodeTaskCount_ != 0 || laneTaskCount_ != 0;
+}
+
+// Tells the CPU this is a spin-wait loop, which saves power and, with hyper-threading,
+// leaves the core to the other thread
+template <class TaskType, class Policy>
+inline
+void BasicThreadPool<TaskType, Policy>::cpuRelax()
+{
+#if (defined(__GNUC__) || defined(__clang__)) && (defined(__x86_64__) || defined(__i386__))
+    __builtin_ia32_pause();
+#elif (defined(__GNUC__) || defined(__clang__)) && defined(__aarch64__)
+    asm volatile("yield" ::: "memory");
+#else
+    std::atomic_signal_fence(std::memory_order_seq_cst);
+#endif
+}
+
+// Constructs a ThreadPool with the specified amount of threads (must be nonnegative).
+// If waitOnDestroy is true, the ThreadPool will call wait() on destruction; otherwise, it will not.
+template <class Policy, class FunctionType, class... Args>
+PolicyThreadPool<Policy, FunctionType, Args...>::PolicyThreadPool(int numThreads, bool waitOnDestroy)
+    : BasicThreadPool<TaskType, Policy>(numThreads, ThreadPoolOptions(waitOnDestroy))
+{}
+
+template <class Policy, class FunctionType, class... Args>
+PolicyThreadPool<Policy, FunctionType, Args...>::PolicyThreadPool(int numThreads, const ThreadPoolOptions& options)
+    : BasicThreadPool<TaskType, Policy>(numThreads, options)
+{}
+
+// Same as submit(), without returning the future. No promise is created either (so
+// nothing is allocated for its shared state): the return value is discarded, and an
+// exception thrown by fn goes to the pool's error handler (see taskErrors()).
+template <class Policy, class FunctionType, class... Args>
 template <class Fn, class... DeducedArgs>
 inline
-void ThreadPool<FunctionType, Args...>::execute(Fn&& fn, DeducedArgs&&... args)
+void PolicyThreadPool<Policy, FunctionType, Args...>::execute(Fn&& fn, DeducedArgs&&... args)
 {
-    submit(std::forward<Fn>(fn), std::forward<Args>(args)...);
+    executeActually(this->backpressure(), nullptr, nullptr, std::forward<Fn>(fn), std::forward<Args>(args)...);
 }
 
 // DeducedArgs must have the same (decayed) type as Args; its purpose is to force
 // deduction of template arguments, because Args, if used, would be already specified.
-template <class FunctionType, class... Args>
+// Returns an invalid future if the pool has been shut down (or if the task was rejected
+// by a full bounded queue).
+template <class Policy, class FunctionType, class... Args>
 template <class Fn, class... DeducedArgs>
+inline
 std::future<typename std::result_of<Fn(Args...)>::type>
-ThreadPool<FunctionType, Args...>::submit(Fn&& fn, DeducedArgs&&... args)
+PolicyThreadPool<Policy, FunctionType, Args...>::submit(Fn&& fn, DeducedArgs&&... args)
 {
-    using retType = typename std::result_of<Fn(Args...)>::type;
+    return submitActually(this->backpressure(), Priority::Normal, this->ANY_NODE, nullptr, nullptr,
+                          std::forward<Fn>(fn), std::forward<Args>(args)...);
+}
 
-    if (isShutdown_)
-        return std::future<retType>();
+// Same as submit(), but never waits for room in a bounded queue: if the queue is full,
+// returns an invalid future (regardless of the pool's backpressure policy).
+template <class Policy, class FunctionType, class... Args>
+template <class Fn, class... DeducedArgs>
+inline
+std::future<typename std::result_of<Fn(Args...)>::type>
+PolicyThreadPool<Policy, FunctionType, Args...>::trySubmit(Fn&& fn, DeducedArgs&&... args)
+{
+    return submitActually(Backpressure::Reject, Priority::Normal, this->ANY_NODE, nullptr, nullptr,
+                          std::forward<Fn>(fn), std::forward<Args>(args)...);
+}
 
-    Task<FunctionType, Args...> task(std::forward<Fn>(fn), std::forward<Args>(args)...);
-    std::future<retType> fut = std::move(task.getFuture());
+// Same as submit(), but the task runs before every queued task of lower priority, and
+// after those of higher priority. Only Normal tasks go to a bounded queue (or, when
+// submitted from one of this pool's threads, to a work-stealing deque); the other bands
+// are unbounded and shared by all threads.
+template <class Policy, class FunctionType, class... Args>
+template <class Fn, class... DeducedArgs>
+inline
+std::future<typename std::result_of<Fn(Args...)>::type>
+PolicyThreadPool<Policy, FunctionType, Args...>::submitWithPriority(Priority priority, Fn&& fn, DeducedArgs&&... args)
+{
+    return submitActually(this->backpressure(), priority, this->ANY_NODE, nullptr, nullptr,
+                          std::forward<Fn>(fn), std::forward<Args>(args)...);
+}
 
-    std::unique_lock<std::mutex> ul(lock_);
-    tasks_.push(std::move(task));
-    ul.unlock();
+// Same as submit(), but if the pool is NUMA-aware (see ThreadPoolOptions::numaNodes),
+// the task is queued on the specified node, whose threads run it before looking for work
+// elsewhere (so it's typically run next to the memory it touches). Threads of other nodes
+// only take it when they run out of work of their own.
+template <class Policy, class FunctionType, class... Args>
+template <class Fn, class... DeducedArgs>
+inline
+std::future<typename std::result_of<Fn(Args...)>::type>
+PolicyThreadPool<Policy, FunctionType, Args...>::submitOnNode(int numaNode, Fn&& fn, DeducedArgs&&... args)
+{
+    return submitActually(this->backpressure(), Priority::Normal, numaNode, nullptr, nullptr,
+                          std::forward<Fn>(fn), std::forward<Args>(args)...);
+}
+
+template <class Policy, class FunctionType, class... Args>
+template <class Fn, class... DeducedArgs>
+std::future<typename std::result_of<Fn(Args...)>::type>
+PolicyThreadPool<Policy, FunctionType, Args...>::submitActually(Backpressure backpressure, Priority priority,
+                                                                int numaNode, ProducerToken* token,
+                                                                const CancellationToken* cancellation,
+                                                                Fn&& fn, DeducedArgs&&... args)
+{
+    using retType = typename std::result_of<Fn(Args...)>::type;
+
+    if (this->isShutdown())
+        return std::future<retType>();
 
-    taskAvailable_.notify_one();
+    TaskNode* node = this->newTask(std::allocator_arg, this->stateAllocator(),
+                                   std::forward<Fn>(fn), std::forward<Args>(args)...);
+    std::future<retType> fut = node->task.getFuture();
+    if (cancellation)
+        this->makeCancellable(node, *cancellation);
+    if (!this->enqueue(node, backpressure, priority, numaNode, token))
+        return std::future<retType>();
     
-    return std::move(fut);
+    return fut;
 }
 
-// Signal to threads that they should finish what they're doing. If force == true,
-// all threads in this ThreadPool will be detached (and can be safely destructed).
-// (This does not block the calling thread)
-template <class FunctionType, class... Args>
-void ThreadPool<FunctionType, Args...>::shutdown(bool force)
+template <class Policy, class FunctionType, class... Args>
+template <class Fn, class... DeducedArgs>
+void PolicyThreadPool<Policy, FunctionType, Args...>::executeActually(Backpressure backpressure, ProducerToken* token,
+                                                                      const CancellationToken* cancellation,
+                                                                      Fn&& fn, DeducedArgs&&... args)
 {
-    if (isShutdown_)
+    if (this->isShutdown())
         return;
 
-    isForced_ = force;
-    isShutdown_ = true;
+    TaskNode* node = this->newTask(DiscardResult(), std::forward<Fn>(fn), std::forward<Args>(args)...);
+    if (cancellation)
+        this->makeCancellable(node, *cancellation);
+    this->enqueue(node, backpressure, Priority::Normal, this->ANY_NODE, token);
+}
 
-    taskAvailable_.notify_all();
+// Same as submitAfter(), without returning the future, but returning a handle to cancel
+// the task with (until it's due)
+template <class Policy, class FunctionType, class... Args>
+template <class Rep, class Period, class Fn, class... DeducedArgs>
+inline
+TimerHandle
+PolicyThreadPool<Policy, FunctionType, Args...>::executeAfter(const std::chrono::duration<Rep, Period>& delay,
+                                                              Fn&& fn, DeducedArgs&&... args)
+{
+    return executeAtTick(this->tickAfter(delay), std::forward<Fn>(fn), std::forward<Args>(args)...);
+}
 
-    if (force)
-        for (int i = 0; i != threads_.size(); ++i)
-            threads_[i].detach();
+// Same as submitAt(), without returning the future, but returning a handle to cancel
+// the task with (until it's due)
+template <class Policy, class FunctionType, class... Args>
+template <class Clock, class Duration, class Fn, class... DeducedArgs>
+inline
+TimerHandle
+PolicyThreadPool<Policy, FunctionType, Args...>::executeAt(const std::chrono::time_point<Clock, Duration>& time,
+                                                           Fn&& fn, DeducedArgs&&... args)
+{
+    return executeAtTick(this->tickAt(time), std::forward<Fn>(fn), std::forward<Args>(args)...);
 }
 
-// Wait for all tasks (enqueued and currently running) to complete. This function,
-// as opposed to shutdown(), *does* block the calling thread by polling until the
-// task queue is empty.
-// That is, after wait() returns, activeThreads() == 0.
-template <class FunctionType, class... Args>
-void ThreadPool<FunctionType, Args...>::wait()
+// Same as submit(), but the task is only enqueued once the delay has passed (rounded up
+// to a whole millisecond). Until then, it waits in the pool's timer wheel, which costs
+// no thread however many tasks wait, and isn't waited for by wait(). Returns an invalid
+// future if the pool has been shut down; a task still waiting when the pool is destroyed
+// (or shutdownNow() is called) breaks its promise.
+template <class Policy, class FunctionType, class... Args>
+template <class Rep, class Period, class Fn, class... DeducedArgs>
+inline
+std::future<typename std::result_of<Fn(Args...)>::type>
+PolicyThreadPool<Policy, FunctionType, Args...>::submitAfter(const std::chrono::duration<Rep, Period>& delay,
+                                                             Fn&& fn, DeducedArgs&&... args)
+{
+    return submitAtTick(this->tickAfter(delay), std::forward<Fn>(fn), std::forward<Args>(args)...);
+}
+
+// Same as submitAfter(), but the task is enqueued once the specified time has come
+template <class Policy, class FunctionType, class... Args>
+template <class Clock, class Duration, class Fn, class... DeducedArgs>
+inline
+std::future<typename std::result_of<Fn(Args...)>::type>
+PolicyThreadPool<Policy, FunctionType, Args...>::submitAt(const std::chrono::time_point<Clock, Duration>& time,
+                                                          Fn&& fn, DeducedArgs&&... args)
+{
+    return submitAtTick(this->tickAt(time), std::forward<Fn>(fn), std::forward<Args>(args)...);
+}
+
+// Enqueues the task every period (the first time, a period from now) until the timer is
+// cancelled with cancelTimer(), or the pool shut down. Each run gets its own copies of
+// fn and args, and its result is discarded. Runs may overlap if one takes longer than
+// the period. Returns an invalid handle if the pool has been shut down.
+template <class Policy, class FunctionType, class... Args>
+template <class Rep, class Period, class Fn, class... DeducedArgs>
+TimerHandle
+PolicyThreadPool<Policy, FunctionType, Args...>::scheduleEvery(const std::chrono::duration<Rep, Period>& period,
+                                                               Fn&& fn, DeducedArgs&&... args)
+{
+    if (this->isShutdown())
+        return TimerHandle();
+
+    RepeatingTask<typename std::decay<Fn>::type> repeating = {
+        this, std::forward<Fn>(fn), std::tuple<Args...>(std::forward<Args>(args)...)
+    };
+    std::uint64_t ticks = this->toTicks(period);
+    return this->addTimer(UniqueFunction<TaskNode*()>(std::move(repeating)), this->tickAfter(period),
+                          ticks != 0 ? ticks : 1);
+}
+
+template <class Policy, class FunctionType, class... Args>
+template <class Fn, class... DeducedArgs>
+TimerHandle
+PolicyThreadPool<Policy, FunctionType, Args...>::executeAtTick(std::uint64_t due, Fn&& fn, DeducedArgs&&... args)
+{
+    if (this->isShutdown())
+        return TimerHandle();
+
+    return this->addTimer(this->newTask(DiscardResult(), std::forward<Fn>(fn), std::forward<Args>(args)...), due);
+}
+
+template <class Policy, class FunctionType, class... Args>
+template <class Fn, class... DeducedArgs>
+std::future<typename std::result_of<Fn(Args...)>::type>
+PolicyThreadPool<Policy, FunctionType, Args...>::submitAtTick(std::uint64_t due, Fn&& fn, DeducedArgs&&... args)
+{
+    using retType = typename std::result_of<Fn(Args...)>::type;
+
+    if (this->isShutdown())
+        return std::future<retType>();
+
+    TaskNode* node = this->newTask(std::allocator_arg, this->stateAllocator(),
+                                   std::forward<Fn>(fn), std::forward<Args>(args)...);
+    std::future<retType> fut = node->task.getFuture();
+    if (!this->addTimer(node, due).valid())
+        return std::future<retType>();
+
+    return fut;
+}
+
+// Same as submitCancellable(), without returning the future
+template <class Policy, class FunctionType, class... Args>
+template <class Fn, class... DeducedArgs>
+inline
+void PolicyThreadPool<Policy, FunctionType, Args...>::executeCancellable(const CancellationToken& token, Fn&& fn,
+                                                                         DeducedArgs&&... args)
+{
+    executeActually(this->backpressure(), nullptr, &token, std::forward<Fn>(fn), std::forward<Args>(args)...);
+}
+
+// Same as submit(), but if the token is cancelled before a thread takes the task, the
+// task is skipped: it's destroyed without running, and the future's get() throws
+// std::future_error (broken promise). Skipping a task costs no more than popping it.
+template <class Policy, class FunctionType, class... Args>
+template <class Fn, class... DeducedArgs>
+inline
+std::future<typename std::result_of<Fn(Args...)>::type>
+PolicyThreadPool<Policy, FunctionType, Args...>::submitCancellable(const CancellationToken& token, Fn&& fn,
+                                                                   DeducedArgs&&... args)
+{
+    return submitActually(this->backpressure(), Priority::Normal, this->ANY_NODE, nullptr, &token,
+                          std::forward<Fn>(fn), std::forward<Args>(args)...);
+}
+
+// Same as submitFrom(), without returning the future
+template <class Policy, class FunctionType, class... Args>
+template <class Fn, class... DeducedArgs>
+inline
+void PolicyThreadPool<Policy, FunctionType, Args...>::executeFrom(ProducerToken& token, Fn&& fn, DeducedArgs&&... args)
+{
+    executeActually(this->backpressure(), &token, nullptr, std::forward<Fn>(fn), std::forward<Args>(args)...);
+}
+
+// Same as submit(), but the task goes to the token's lane (see producerToken()), which
+// no other producer pushes to. The lanes are drained in turns, after the bounded queue
+// (if any), so the task ranks as Normal priority; lanes aren't bounded.
+template <class Policy, class FunctionType, class... Args>
+template <class Fn, class... DeducedArgs>
+inline
+std::future<typename std::result_of<Fn(Args...)>::type>
+PolicyThreadPool<Policy, FunctionType, Args...>::submitFrom(ProducerToken& token, Fn&& fn, DeducedArgs&&... args)
 {
-    const int multiplier = 2;
-    int waitTime = 1;
+    return submitActually(this->backpressure(), Priority::Normal, this->ANY_NODE, &token, nullptr,
+                          std::forward<Fn>(fn), std::forward<Args>(args)...);
+}
+
+// Same as submitBatch(), without promises (results and exceptions are handled as with execute())
+template <class Policy, class FunctionType, class... Args>
+template <class InputIt, class Fn>
+void PolicyThreadPool<Policy, FunctionType, Args...>::executeBatch(InputIt first, InputIt last, Fn fn)
+{
+    if (this->isShutdown())
+        return;
 
-    while (activeThreads_ != 0 || !tasks_.empty())
+    TaskBatch batch(*this);
+    for (; first != last; ++first)
     {
-        std::this_thread::sleep_for(std::chrono::milliseconds(waitTime));
-        waitTime = std::min(MAX_WAIT_TIME, multiplier * waitTime);
+        std::tuple<Args...> args(*first);
+        batch.push(newDiscardingTask(fn, args, typename IndexSequence<sizeof...(Args)>::seq()));
     }
+    this->enqueue(batch);
 }
 
-template <class FunctionType, class... Args>
-void ThreadPool<FunctionType, Args...>::doWork(int)
+// Submits fn once for each element in [first, last), all at once (see enqueue(TaskBatch&)).
+// Each element holds the arguments of one call: the argument itself if the function takes
+// only one, otherwise a std::tuple of them. Returns the futures in the same order, or no
+// futures at all if the pool has been shut down.
+template <class Policy, class FunctionType, class... Args>
+template <class InputIt, class Fn>
+std::vector<std::future<typename std::result_of<Fn(Args...)>::type>>
+PolicyThreadPool<Policy, FunctionType, Args...>::submitBatch(InputIt first, InputIt last, Fn fn)
 {
-    // Dequeue tasks until the thread pool is shutdown
-    while (!isShutdown_)
-    {
-        Task<FunctionType, Args...> task;
-        {
-            std::unique_lock<std::mutex> ul(lock_);
+    using retType = typename std::result_of<Fn(Args...)>::type;
 
-            while (tasks_.empty() && !isShutdown_)
-                taskAvailable_.wait(ul);
-            if (isShutdown_)
-                break;
+    std::vector<std::future<retType>> futures;
+    if (this->isShutdown())
+        return futures;
 
-            ++activeThreads_;
-            task = std::move(tasks_.front());
-            tasks_.pop();
-        }   // So lock_ is unlocked after activeThreads_ increments/a task is *definitely* pulled
-        
-        task.execute();
-        --activeThreads_;
+    TaskBatch batch(*this);
+    for (; first != last; ++first)
+    {
+        std::tuple<Args...> args(*first);
+        TaskNode* node = newBatchTask(fn, args, typename IndexSequence<sizeof...(Args)>::seq());
+        batch.push(node);
+        futures.push_back(node->task.getFuture());
     }
+    this->enqueue(batch);
+
+    return futures;
+}
+
+// Not actually using the Sequence - we just want (to expand) the template arguments
+template <class Policy, class FunctionType, class... Args>
+template <class Fn, int... Nums>
+inline
+typename PolicyThreadPool<Policy, FunctionType, Args...>::TaskNode*
+PolicyThreadPool<Policy, FunctionType, Args...>::newBatchTask(Fn& fn, std::tuple<Args...>& args, Sequence<Nums...>)
+{
+    return this->newTask(std::allocator_arg, this->stateAllocator(), fn, std::get<Nums>(args)...);
+}
+
+// Same as newBatchTask(), without a promise
+template <class Policy, class FunctionType, class... Args>
+template <class Fn, int... Nums>
+inline
+typename PolicyThreadPool<Policy, FunctionType, Args...>::TaskNode*
+PolicyThreadPool<Policy, FunctionType, Args...>::newDiscardingTask(Fn& fn, std::tuple<Args...>& args, Sequence<Nums...>)
+{
+    return this->newTask(DiscardResult(), fn, std::get<Nums>(args)...);
 }
 
-#endif /* THREAD_POOL_H */
+#endif /* THREAD_POOL_H_ */
@@ -0,0 +1,67 @@
+#!/bin/sh
+# Merges headers into a single one, on standard output (see the Makefile):
+#
+#     amalgamate.sh SRCDIR File.h:Title ...
+#
+# The headers are concatenated in the order given, each under a banner with its title,
+# without their include guards, their #includes and their license. The standard
+# #includes of every header are gathered at the top (the last header's first), followed
+# by the last header's license, which should be ThreadPool.h.
+
+src=$1
+shift
+for spec in "$@"; do
+    last=${spec%%:*}
+done
+
+# A header's code alone, without leading or trailing blank lines
+strip() {
+    awk '
+        NR <= 2 && /^#(ifndef|define) [A-Z_]*_H_$/ { next }
+        /^#endif \/\* [A-Z_]* \*\/$/ { next }
+        /^#include [<"]/ { next }
+        /^\/\*\*$/ { comment = $0; next }
+        comment != "" && /Copyright/ { comment = ""; license = 1; next }
+        comment != "" { print comment; comment = "" }
+        license { if (/^ \*\/$/) license = 0; next }
+        { lines[n++] = $0 }
+        END {
+            first = 0
+            while (first < n && lines[first] == "") first++
+            last = n - 1
+            while (last >= first && lines[last] == "") last--
+            for (i = first; i <= last; i++) print lines[i]
+        }
+    ' "$1"
+}
+
+# "// ------- Title -------", 40 characters wide
+banner() {
+    awk -v title="$1" 'BEGIN {
+        dashes = 36 - length(title)
+        left = ""; right = ""
+        for (i = 0; i < dashes - int(dashes / 2); i++) left = left "-"
+        for (i = 0; i < int(dashes / 2); i++) right = right "-"
+        print "// " left " " title " " right
+    }'
+}
+
+echo "#ifndef THREAD_POOL_H_"
+echo "#define THREAD_POOL_H_"
+echo
+{
+    grep -h '^#include <' "$src/$last"
+    for spec in "$@"; do
+        grep -h '^#include <' "$src/${spec%%:*}"
+    done
+} | awk '!seen[$0]++'
+echo
+awk '/^\/\*\*$/ { p = 1 } p { print } p && /^ \*\/$/ { exit }' "$src/$last"
+for spec in "$@"; do
+    echo
+    banner "${spec#*:}"
+    echo
+    strip "$src/${spec%%:*}"
+done
+echo
+echo "#endif /* THREAD_POOL_H_ */"
@@ -7,8 +7,26 @@
 #include <cstdio>
 #include <cassert>
 #include <string>
+#include <atomic>
+#include <mutex>
+#include <tuple>
+#include <new>
+#include <cstdlib>
+#include <functional>
+#include <algorithm>
+#include <cstdint>
+#include <sstream>
+#include <random>
+#include <numeric>
 
 #include "../ThreadPool.h"
+#include "../GenericThreadPool.h"
+#include "../ParallelFor.h"
+#include "../Algorithms.h"
+#include "../TaskGraph.h"
+#include "../TaskGroup.h"
+#include "../ExecutorGroup.h"
+#include "../Coroutine.h"
 
 using namespace std;
 
@@ -61,7 +79,7 @@ int expensiveTask(int x)
     return 0;
 }
 
-void testPerformance(int n)
+void testExecute(int n)
 {
     using namespace std::chrono;
     future<int> fut[1000];
@@ -73,15 +91,13 @@ void testPerformance(int n)
     ThreadPool<int(int), int> pool(4);
 
     for (int i = 0; i < n; ++i)
-        fut[i] = pool.submit(expensiveComputation, i);
-    for (int i = 0; i < n; ++i)
-        printf("Case #%d: %d\n", i + 1, fut[i].get());
+        pool.execute(expensiveTask, i);
 
-    // pool.wait();
+    pool.wait();
     t = clock() - t;
     auto t2 = chrono::high_resolution_clock::now();
     dur = duration_cast<duration<double>>(t2 - t1);
-    printf("testPerformance() with ThreadPool took %ld cycles (%f seconds)\n", t, dur.count());
+    printf("testExecute() with ThreadPool took %ld cycles (%f seconds)\n", t, dur.count());
 
     pool.shutdown();
     assert(pool.isShutdown() && pool.isTerminated());
@@ -91,69 +107,1154 @@ void testPerformance(int n)
     t1 = chrono::high_resolution_clock::now();
 
     for (int i = 0; i < n; ++i)
-        fut[i] = async(launch::async, expensiveComputation, i);
+        fut[i] = async(launch::async, expensiveTask, i);
     for (int i = 0; i < n; ++i)
-        printf("Case #%d: %d\n", i + 1, fut[i].get());
+        fut[i].get();
 
     t = clock() - t;
     t2 = chrono::high_resolution_clock::now();
     dur = duration_cast<duration<double>>(t2 - t1);
-    printf("testPerformance() with async() took %ld cycles (%f seconds)\n", t, dur.count());
+    printf("testExecute() with async() took %ld cycles (%f seconds)\n", t, dur.count());
+}
 
-    // Regular
-    /*
-    t = clock();
-    t1 = chrono::high_resolution_clock::now();
+ThreadPool<void(int), int>* treePool;
+atomic<int> treeNodes;
 
-    for (int i = 0; i < n; ++i)
+void spawnTree(int depth)
+{
+    ++treeNodes;
+    if (depth == 0)
+        return;
+    treePool->execute(spawnTree, depth - 1);
+    treePool->execute(spawnTree, depth - 1);
+}
+
+void testWorkStealing()
+{
+    ThreadPoolOptions options;
+    options.workStealing = true;
+    ThreadPool<void(int), int> pool(4, options);
+
+    treePool = &pool;
+    treeNodes = 0;
+    pool.execute(spawnTree, 12);
+    pool.wait();
+    assert(treeNodes == (1 << 13) - 1);
+    assert(pool.activeThreads() == 0);
+
+    // Tasks submitted from outside the pool still run
+    future<void> fut = pool.submit(spawnTree, 0);
+    fut.get();
+    assert(treeNodes == (1 << 13));
+}
+
+void testWaitFor()
+{
+    ThreadPool<void(int), int> pool(2);
+
+    // Nothing to wait for
+    assert(pool.waitFor(chrono::milliseconds(0)));
+
+    pool.execute([](int ms) { this_thread::sleep_for(chrono::milliseconds(ms)); }, 300);
+    assert(!pool.waitFor(chrono::milliseconds(10)));
+    assert(pool.waitUntil(chrono::steady_clock::now() + chrono::seconds(10)));
+    assert(pool.activeThreads() == 0);
+
+    // wait() returns as soon as the last task finishes, rather than after polling
+    for (int i = 0; i < 100; ++i)
     {
-        int res = expensiveComputation(i);
-        printf("Case #%d: %d\n", i + 1, res);
+        auto start = chrono::steady_clock::now();
+        pool.execute([](int) {}, 0);
+        pool.wait();
+        assert(chrono::steady_clock::now() - start < chrono::milliseconds(500));
     }
 
-    t = clock() - t;
-    t2 = chrono::high_resolution_clock::now();
-    dur = duration_cast<duration<double>>(t2 - t1);
-    printf("testPerformance() with a single thread took %ld cycles (%f seconds)\n", t, dur.count());
-    */
+    // After shutdown, wait() only waits for running tasks
+    pool.execute([](int ms) { this_thread::sleep_for(chrono::milliseconds(ms)); }, 100);
+    pool.execute([](int ms) { this_thread::sleep_for(chrono::milliseconds(ms)); }, 100);
+    pool.execute([](int ms) { this_thread::sleep_for(chrono::milliseconds(ms)); }, 100);
+    this_thread::sleep_for(chrono::milliseconds(20));
+    pool.shutdown();
+    pool.wait();
+    assert(pool.isTerminated());
 }
 
-void testExecute(int n)
+struct Request { int id; };
+
+void testGenericPool()
 {
-    using namespace std::chrono;
-    future<int> fut[1000];
+    GenericThreadPool pool(2);
 
-    clock_t t = clock();
-    auto t1 = chrono::high_resolution_clock::now();
-    duration<double> dur;
+    // Different signatures share the same threads
+    future<int> square = pool.submit([](int x) { return x * x; }, 7);
+    future<string> greeting = pool.submit([](const string& s) { return "hello " + s; }, string("bob"));
+    future<int> computed = pool.submit(expensiveComputation, 3u);
+    Request request = { 42 };
+    future<int> requestId = pool.submit([](Request* r) { return r->id; }, &request);
+    atomic<int> counter(0);
+    future<void> done = pool.submit([&counter]() { ++counter; });
+
+    assert(square.get() == 49);
+    assert(greeting.get() == "hello bob");
+    assert(computed.get() == expensiveComputation(3));
+    assert(requestId.get() == 42);
+    done.get();
+    assert(counter == 1);
 
+    // Exceptions end up in the future
+    future<int> thrown = pool.submit([]() -> int { throw runtime_error("oops"); });
+    try
+    {
+        thrown.get();
+        assert(false);
+    }
+    catch (const runtime_error& e)
+    {
+        assert(string(e.what()) == "oops");
+    }
+
+    // Move-only arguments, and execute() without a future
+    unique_ptr<int> owned(new int(5));
+    future<int> moved = pool.submit([](unique_ptr<int> p) { return *p; }, move(owned));
+    assert(moved.get() == 5);
+    for (int i = 0; i < 100; ++i)
+        pool.execute([&counter](int x) { counter += x; }, 2);
+    pool.wait();
+    assert(counter == 201);
+
+    // Small lambdas are stored inline
+    int a = 1, b = 2;
+    UniqueFunction<int()> small([a, b]() { return a + b; });
+    assert(small.isInline() && small() == 3);
+    char big[128] = { 9 };
+    UniqueFunction<int()> large([big]() { return big[0]; });
+    assert(!large.isInline() && large() == 9);
+    UniqueFunction<int()> movedTo(move(large));
+    assert(!large && movedTo() == 9);
+
+    // Plain function pointers are called directly, and so are function references
+    UniqueFunction<int(unsigned)> pointer(&expensiveComputation);
+    UniqueFunction<int(unsigned)> reference(expensiveComputation);
+    assert(pointer.isInline() && pointer(3) == expensiveComputation(3));
+    UniqueFunction<int(unsigned)> movedPointer(move(pointer));
+    assert(!pointer && movedPointer(4) == reference(4));
+    ThreadPool<int(unsigned), unsigned> typed(1);
+    assert(typed.submit(expensiveComputation, 5u).get() == expensiveComputation(5));
+}
+
+// Counts every heap allocation made by the test. The replacements are never inlined:
+// otherwise GCC sees free() called on what operator new returned, and warns.
+atomic<size_t> heapAllocs(0);
+
+#if defined(__GNUC__) || defined(__clang__)
+#define TEST_NOINLINE __attribute__((noinline))
+#else
+#define TEST_NOINLINE
+#endif
+
+TEST_NOINLINE void* operator new(size_t size)
+{
+    ++heapAllocs;
+    if (void* p = malloc(size))
+        return p;
+    throw bad_alloc();
+}
+
+TEST_NOINLINE void operator delete(void* p) noexcept
+{
+    free(p);
+}
+
+TEST_NOINLINE void operator delete(void* p, size_t) noexcept
+{
+    free(p);
+}
+
+#ifdef __cpp_aligned_new
+// (aligned_alloc() wants a multiple of the alignment)
+TEST_NOINLINE void* operator new(size_t size, align_val_t alignment)
+{
+    ++heapAllocs;
+    const size_t align = static_cast<size_t>(alignment);
+    if (void* p = aligned_alloc(align, (size + align - 1) / align * align))
+        return p;
+    throw bad_alloc();
+}
+
+TEST_NOINLINE void operator delete(void* p, align_val_t) noexcept
+{
+    free(p);
+}
+
+TEST_NOINLINE void operator delete(void* p, size_t, align_val_t) noexcept
+{
+    free(p);
+}
+#endif
+
+void testAllocationFree()
+{
+    ThreadPoolOptions options;
+    options.preallocatedTasks = 256;
+    ThreadPool<int(int), int> pool(2, options);
+    GenericThreadPool genericPool(2, options);
+    future<int> fut[200];
+
+    size_t poolAllocs = pool.heapAllocations();
+    size_t genericAllocs = genericPool.heapAllocations();
+    size_t before = heapAllocs;
+
+    for (int round = 0; round < 10; ++round)
+    {
+        for (int i = 0; i < 100; ++i)
+            fut[i] = pool.submit([](int x) { return x + 1; }, i);
+        for (int i = 100; i < 200; ++i)
+            fut[i] = genericPool.submit([](int x, int y) { return x + y; }, i, 1);
+        for (int i = 0; i < 200; ++i)
+            assert(fut[i].get() == i + 1);
+        for (int i = 0; i < 200; ++i)
+            fut[i] = future<int>();
+    }
+    pool.wait();
+    genericPool.wait();
+
+    assert(heapAllocs == before);
+    assert(pool.heapAllocations() == poolAllocs);
+    assert(genericPool.heapAllocations() == genericAllocs);
+
+    // Callables too big to store inline are counted
+    char big[128] = { 1 };
+    genericPool.execute([big]() { assert(big[0] == 1); });
+    genericPool.wait();
+    assert(genericPool.heapAllocations() == genericAllocs + 1);
+
+    // Placeholder tasks (and the tasks moved into them) have no promise to allocate
+    const size_t beforePlaceholders = heapAllocs;
+    {
+        Task<int(int), int> placeholder, other;
+        placeholder = move(other);
+    }
+    assert(heapAllocs == beforePlaceholders);
+}
+
+void testBoundedQueue()
+{
+    // A full queue rejects tasks without blocking
+    ThreadPoolOptions options;
+    options.queueCapacity = 4;
+    options.backpressure = Backpressure::Reject;
+    GenericThreadPool pool(1, options);
+    assert(pool.queueCapacity() == 4);
+
+    promise<void> gate;
+    shared_future<void> opened = gate.get_future().share();
+    atomic<bool> started(false);
+    atomic<int> counter(0);
+    pool.execute([opened, &started]() { started = true; opened.wait(); });
+    while (!started)
+        this_thread::yield();
+
+    future<void> queued[4];
+    for (int i = 0; i < 4; ++i)
+    {
+        queued[i] = pool.trySubmit([&counter]() { ++counter; });
+        assert(queued[i].valid());
+    }
+    assert(!pool.trySubmit([&counter]() { ++counter; }).valid());
+    assert(!pool.submit([&counter]() { ++counter; }).valid());
+
+    gate.set_value();
+    pool.wait();
+    assert(counter == 4);
+
+    // Blocking submitters wait for room instead, so no task is lost
+    Backpressure policies[] = { Backpressure::Block, Backpressure::SpinThenBlock };
+    for (int p = 0; p < 2; ++p)
+    {
+        ThreadPoolOptions blockingOptions;
+        blockingOptions.queueCapacity = 2;
+        blockingOptions.backpressure = policies[p];
+        ThreadPool<void(int), int> blockingPool(2, blockingOptions);
+
+        atomic<int> sum(0);
+        vector<thread> submitters;
+        for (int t = 0; t < 4; ++t)
+            submitters.emplace_back([&blockingPool, &sum]() {
+                for (int i = 0; i < 500; ++i)
+                    blockingPool.execute([&sum](int x) { sum += x; }, 1);
+            });
+        for (int t = 0; t < 4; ++t)
+            submitters[t].join();
+        blockingPool.wait();
+        assert(sum == 2000);
+    }
+}
+
+void testBatch()
+{
     ThreadPool<int(int), int> pool(4);
+    vector<int> xs(1000);
+    for (int i = 0; i < 1000; ++i)
+        xs[i] = i;
 
-    for (int i = 0; i < n; ++i)
-        pool.execute(expensiveTask, i);
+    vector<future<int>> doubled = pool.submitBatch(xs.begin(), xs.end(), [](int x) { return 2 * x; });
+    assert(doubled.size() == 1000);
+    for (int i = 0; i < 1000; ++i)
+        assert(doubled[i].get() == 2 * i);
+
+    // Several arguments are passed as tuples
+    ThreadPool<int(int, int), int, int> pairPool(2);
+    vector<tuple<int, int>> pairs;
+    for (int i = 0; i < 100; ++i)
+        pairs.push_back(make_tuple(i, i + 1));
+    vector<future<int>> sums = pairPool.submitBatch(pairs.begin(), pairs.end(), [](int x, int y) { return x + y; });
+    for (int i = 0; i < 100; ++i)
+        assert(sums[i].get() == 2 * i + 1);
 
+    atomic<int> counter(0);
+    pool.executeBatch(xs.begin(), xs.end(), [&counter](int x) { counter += x; return 0; });
     pool.wait();
-    t = clock() - t;
-    auto t2 = chrono::high_resolution_clock::now();
-    dur = duration_cast<duration<double>>(t2 - t1);
-    printf("testExecute() with ThreadPool took %ld cycles (%f seconds)\n", t, dur.count());
+    assert(counter == 999 * 1000 / 2);
+    assert(pool.submitBatch(xs.begin(), xs.begin(), [](int x) { return x; }).empty());
+
+    GenericThreadPool genericPool(2);
+    vector<string> names = { "alice", "bob", "carol" };
+    vector<future<size_t>> lengths = genericPool.submitBatch(names.begin(), names.end(),
+                                                             [](const string& s) { return s.size(); });
+    assert(lengths[0].get() == 5 && lengths[1].get() == 3 && lengths[2].get() == 5);
+
+    // A batch larger than a bounded queue still gets through
+    ThreadPoolOptions options;
+    options.queueCapacity = 8;
+    GenericThreadPool boundedPool(2, options);
+    counter = 0;
+    boundedPool.executeBatch(xs.begin(), xs.end(), [&counter](int) { ++counter; });
+    boundedPool.wait();
+    assert(counter == 1000);
+}
+
+void testParallelFor()
+{
+    GenericThreadPool pool(4);
+    vector<int> v(10000);
+    parallelFor(pool, 0, 10000, [&v](int i) { v[i] = 2 * i; });
+    for (int i = 0; i < 10000; ++i)
+        assert(v[i] == 2 * i);
+
+    long long sum = parallelReduce(pool, 0, 100000, 0LL,
+                                   [](int i) { return (long long) i; },
+                                   [](long long x, long long y) { return x + y; });
+    assert(sum == 99999LL * 100000 / 2);
+    assert(parallelReduce(pool, 5, 5, 7, [](int i) { return i; }, [](int x, int y) { return x + y; }) == 7);
+
+    // Chunks never get smaller than the grain
+    atomic<int> chunks(0);
+    parallelForChunks(pool, 0, 1000, [&chunks](int first, int last) {
+        assert(last - first >= 100 || last == 1000);
+        ++chunks;
+    }, 100);
+    assert(chunks <= 10);
+
+    // The first exception is rethrown, and the remaining indices are skipped
+    try
+    {
+        parallelFor(pool, 0, 1000000, [](int i) {
+            if (i == 10)
+                throw runtime_error("parallel");
+        });
+        assert(false);
+    }
+    catch (const runtime_error& e)
+    {
+        assert(string(e.what()) == "parallel");
+    }
+
+    // Calling from inside a task doesn't deadlock, even if no thread is free to help
+    ThreadPool<void()> single(1);
+    atomic<int> inner(0);
+    single.submit([&single, &inner]() {
+        parallelFor(single, 0, 100, [&inner](int) { ++inner; });
+    }).get();
+    assert(inner == 100);
+}
+
+void testPoolFuture()
+{
+    GenericThreadPool pool(2);
+
+    // Continuations run on the pool, with the previous result
+    PoolFuture<size_t> length = pool.async([](int x) { return 2 * x; }, 21)
+        .then([](int x) { return to_string(x); })
+        .then([](const string& s) { return s.size(); });
+    assert(length.get() == 2);
+    assert(!length.valid());
+
+    atomic<int> counter(0);
+    PoolFuture<int> afterVoid = pool.async([&counter]() { ++counter; }).then([&counter]() { return counter + 1; });
+    assert(afterVoid.get() == 2);
+
+    // Exceptions skip the continuations
+    PoolFuture<int> failed = pool.async([]() -> int { throw runtime_error("async"); })
+        .then([&counter](int x) { ++counter; return x; });
+    try
+    {
+        failed.get();
+        assert(false);
+    }
+    catch (const runtime_error& e)
+    {
+        assert(string(e.what()) == "async");
+    }
+    assert(counter == 1);
+
+    // A long chain on a single thread, which never blocks waiting for a stage
+    GenericThreadPool single(1);
+    PoolFuture<int> chain = single.async([]() { return 0; });
+    for (int i = 0; i < 100; ++i)
+        chain = chain.then([](int x) { return x + 1; });
+    assert(chain.get() == 100);
+
+    vector<PoolFuture<int>> squares;
+    for (int i = 0; i < 10; ++i)
+        squares.push_back(pool.async([](int x) { return x * x; }, i));
+    vector<int> all = whenAll(move(squares)).get();
+    assert(all.size() == 10);
+    for (int i = 0; i < 10; ++i)
+        assert(all[i] == i * i);
+    assert(whenAll(vector<PoolFuture<int>>()).get().empty());
+
+    vector<PoolFuture<void>> voids;
+    for (int i = 0; i < 10; ++i)
+        voids.push_back(pool.async([&counter]() { ++counter; }));
+    whenAll(move(voids)).then([&counter]() { assert(counter == 11); }).get();
+
+    // The first task can't finish before whenAny() has returned
+    promise<void> slowGate;
+    shared_future<void> slowOpened = slowGate.get_future().share();
+    vector<PoolFuture<int>> racing;
+    racing.push_back(pool.async([slowOpened]() { slowOpened.wait(); return 1; }));
+    racing.push_back(pool.async([]() { return 2; }));
+    WhenAnyResult<int> first = whenAny(move(racing)).get();
+    slowGate.set_value();
+    assert(first.index == 1 && first.futures[1].get() == 2);
+    assert(first.futures[0].get() == 1);
+
+    // Continuations that can't be scheduled anymore break their promise
+    GenericThreadPool closing(1);
+    promise<void> gate;
+    shared_future<void> opened = gate.get_future().share();
+    PoolFuture<int> orphan = closing.async([opened]() { opened.wait(); return 1; }).then([](int x) { return x; });
+    this_thread::sleep_for(chrono::milliseconds(20));
+    closing.shutdown();
+    gate.set_value();
+    try
+    {
+        orphan.get();
+        assert(false);
+    }
+    catch (const future_error& e)
+    {
+        assert(e.code() == future_errc::broken_promise);
+    }
+}
+
+void testTaskGraph()
+{
+    GenericThreadPool pool(4);
+
+    // A diamond: a before b and c, both before d
+    TaskGraph graph;
+    vector<int> order;
+    mutex orderLock;
+    auto record = [&order, &orderLock](int id) {
+        lock_guard<mutex> lg(orderLock);
+        order.push_back(id);
+    };
+    TaskGraph::Node a = graph.add([&record]() { record(0); });
+    TaskGraph::Node b = graph.add([&record]() { record(1); });
+    TaskGraph::Node c = graph.add([&record]() { record(2); });
+    TaskGraph::Node d = graph.add([&record]() { record(3); });
+    graph.precede(a, b);
+    graph.precede(a, c);
+    graph.precede(b, d);
+    graph.precede(c, d);
+
+    // The same graph runs again without being rebuilt
+    for (int run = 0; run < 100; ++run)
+    {
+        order.clear();
+        graph.run(pool);
+        assert(order.size() == 4 && order[0] == 0 && order[3] == 3);
+    }
+
+    // Twenty layers of tasks, each depending on two tasks of the previous layer
+    TaskGraph layers;
+    atomic<int> counter(0);
+    vector<TaskGraph::Node> previous, current;
+    for (int layer = 0; layer < 20; ++layer)
+    {
+        current.clear();
+        for (int i = 0; i < 50; ++i)
+        {
+            current.push_back(layers.add([&counter]() { ++counter; }));
+            if (!previous.empty())
+            {
+                layers.precede(previous[i], current[i]);
+                layers.precede(previous[(i + 1) % 50], current[i]);
+            }
+        }
+        previous = current;
+    }
+    layers.run(pool);
+    assert(counter == 1000);
+
+    // Nodes after a failing one are skipped
+    TaskGraph failing;
+    TaskGraph::Node thrower = failing.add([]() { throw runtime_error("graph"); });
+    failing.precede(thrower, failing.add([&counter]() { ++counter; }));
+    try
+    {
+        failing.run(pool);
+        assert(false);
+    }
+    catch (const runtime_error& e)
+    {
+        assert(string(e.what()) == "graph");
+    }
+    assert(counter == 1000);
+
+    // A node whose task the pool rejects fails the run: it and the nodes after it are
+    // skipped (here, every node, the calling thread's root starting after the rejection)
+    {
+        ThreadPoolOptions options;
+        options.queueCapacity = 4;
+        options.backpressure = Backpressure::Reject;
+        GenericThreadPool bounded(1, options);
+
+        promise<void> gate;
+        shared_future<void> opened = gate.get_future().share();
+        atomic<bool> started(false);
+        bounded.execute([opened, &started]() { started = true; opened.wait(); });
+        while (!started)
+            this_thread::yield();
+        for (int i = 0; i < 4; ++i)
+            bounded.execute([]() {});
+
+        TaskGraph rejected;
+        atomic<int> ran(0);
+        rejected.add([&ran]() { ++ran; });
+        TaskGraph::Node dropped = rejected.add([&ran]() { ++ran; });
+        rejected.precede(dropped, rejected.add([&ran]() { ++ran; }));
+        try
+        {
+            rejected.run(bounded);
+            assert(false);
+        }
+        catch (const future_error& e)
+        {
+            assert(e.code() == future_errc::broken_promise);
+        }
+        assert(ran == 0);
+
+        gate.set_value();
+        bounded.wait();
+    }
+
+    TaskGraph cyclic;
+    TaskGraph::Node x = cyclic.add([]() {});
+    TaskGraph::Node y = cyclic.add([]() {});
+    cyclic.precede(x, y);
+    cyclic.precede(y, x);
+    try
+    {
+        cyclic.run(pool);
+        assert(false);
+    }
+    catch (const logic_error&)
+    {
+    }
+}
+
+void testPriority()
+{
+    // A single blocked thread, then each band's tasks get queued in reverse order of
+    // priority: they run highest band first, and in submission order within a band
+    ThreadPoolOptions plain, bounded, stealing;
+    bounded.queueCapacity = 16;
+    stealing.workStealing = true;
+    ThreadPoolOptions* options[] = { &plain, &bounded, &stealing };
+    for (int o = 0; o < 3; ++o)
+    {
+        GenericThreadPool pool(1, *options[o]);
+
+        promise<void> gate;
+        shared_future<void> opened = gate.get_future().share();
+        atomic<bool> started(false);
+        pool.execute([opened, &started]() { started = true; opened.wait(); });
+        while (!started)
+            this_thread::yield();
+
+        vector<int> order;
+        Priority priorities[] = { Priority::Low, Priority::Normal, Priority::High };
+        for (int p = 0; p < 3; ++p)
+            for (int i = 0; i < 3; ++i)
+                pool.submitWithPriority(priorities[p], [&order](int id) { order.push_back(id); }, 10 * p + i);
+
+        gate.set_value();
+        pool.wait();
+        int expected[] = { 20, 21, 22, 10, 11, 12, 0, 1, 2 };
+        assert(order == vector<int>(expected, expected + 9));
+    }
+
+    ThreadPool<int(int), int> typedPool(2);
+    assert(typedPool.submitWithPriority(Priority::High, [](int x) { return x + 1; }, 41).get() == 42);
+}
+
+void testNumaNodes()
+{
+    assert(parseCpuList("0-3,8,10-11\n") == vector<int>({ 0, 1, 2, 3, 8, 10, 11 }));
+    assert(parseCpuList("").empty());
+
+    // Whatever the topology, tasks submitted to any node all run (pinning is only a hint,
+    // so the same CPU can back several nodes)
+    vector<vector<int>> nodes = numaTopology();
+    if (nodes.empty())
+        nodes.push_back(vector<int>(1, 0));
+    nodes.push_back(nodes[0]);
+
+    ThreadPoolOptions options;
+    options.numaNodes = nodes;
+    options.workStealing = true;
+    GenericThreadPool pool(4, options);
+    assert(pool.nodeCount() == (int) nodes.size());
+
+    vector<future<int>> results;
+    for (int i = 0; i < 100; ++i)
+        results.push_back(pool.submitOnNode(i % pool.nodeCount(), [](int x) { return x * x; }, i));
+    for (int i = 0; i < 100; ++i)
+        assert(results[i].get() == i * i);
+
+    // With fewer threads than nodes, the threads take over the tasks of nodes without any
+    ThreadPool<int(int), int> sparsePool(1, options);
+    assert(sparsePool.submitOnNode(1, [](int x) { return x + 1; }, 1).get() == 2);
+
+    ThreadPoolOptions pinned;
+    pinned.cpuAffinity = nodes[0];
+    GenericThreadPool pinnedPool(2, pinned);
+    assert(pinnedPool.nodeCount() == 1);
+    assert(pinnedPool.submitOnNode(3, []() { return 7; }).get() == 7);
+}
+
+void testIdlePolicy()
+{
+    // Bursts separated by pauses, so threads go idle (and spin, yield or block) in between
+    IdlePolicy policies[] = { IdlePolicy::Block, IdlePolicy::Spin, IdlePolicy::SpinThenYield };
+    for (int p = 0; p < 3; ++p)
+        for (int stealing = 0; stealing < 2; ++stealing)
+        {
+            ThreadPoolOptions options;
+            options.idlePolicy = policies[p];
+            options.idleSpins = 100;
+            options.workStealing = stealing != 0;
+            ThreadPool<void(int), int> pool(2, options);
+
+            atomic<int> sum(0);
+            for (int burst = 0; burst < 20; ++burst)
+            {
+                for (int i = 0; i < 10; ++i)
+                    pool.execute([&sum](int x) { sum += x; }, 1);
+                if (burst % 5 == 0)
+                    this_thread::sleep_for(chrono::milliseconds(1));
+            }
+            pool.wait();
+            assert(sum == 200);
+
+            vector<int> xs(50, 2);
+            pool.executeBatch(xs.begin(), xs.end(), [&sum](int x) { sum += x; });
+            pool.wait();
+            assert(sum == 300);
+        }
+}
+
+void testResize()
+{
+    bool stealing[] = { false, true };
+    for (int s = 0; s < 2; ++s)
+    {
+        ThreadPoolOptions options;
+        options.maxThreads = 8;
+        options.workStealing = stealing[s];
+        ThreadPool<void(int), int> pool(2, options);
+        assert(pool.threadCount() == 2 && pool.maxThreads() == 8);
+
+        // Resizing back and forth while other threads keep submitting and waiting
+        atomic<int> sum(0);
+        atomic<bool> done(false);
+        thread submitter([&pool, &sum, &done]() {
+            for (int i = 0; i < 2000; ++i)
+                pool.execute([&sum](int x) { sum += x; }, 1);
+            done = true;
+        });
+        int sizes[] = { 8, 1, 0, 4, 20, 3 };
+        for (int i = 0; !done || i < 6; ++i)
+        {
+            pool.resize(sizes[i % 6]);
+            this_thread::yield();
+        }
+        submitter.join();
+
+        pool.resize(3);
+        assert(pool.threadCount() == 3);
+        pool.wait();
+        assert(sum == 2000);
+    }
+
+    // Without maxThreads, a pool can shrink and grow back to its initial size only
+    GenericThreadPool fixed(2);
+    fixed.resize(5);
+    assert(fixed.threadCount() == 2);
+
+    // An elastic pool grows under load, and shrinks back once idle
+    ThreadPoolOptions elastic;
+    elastic.elastic = true;
+    elastic.maxThreads = 4;
+    elastic.minThreads = 1;
+    elastic.idleTimeout = chrono::milliseconds(10);
+    GenericThreadPool pool(1, elastic);
+
+    promise<void> gate;
+    shared_future<void> opened = gate.get_future().share();
+    atomic<bool> started(false);
+    pool.execute([opened, &started]() { started = true; opened.wait(); });
+    while (!started)
+        this_thread::yield();
+    for (int i = 0; i < 8; ++i)
+        pool.execute([opened]() { opened.wait(); });
+    assert(pool.threadCount() == 4);
+    gate.set_value();
+    pool.wait();
+
+    for (int i = 0; i < 200 && pool.threadCount() != 1; ++i)
+        this_thread::sleep_for(chrono::milliseconds(5));
+    assert(pool.threadCount() == 1);
+    assert(pool.submit([]() { return 5; }).get() == 5);
+}
+
+void testMetrics()
+{
+    // Buckets are exact below 32ns, and within 1/16 above
+    assert(LatencyHistogram::bucketOf(31) == 31 && LatencyHistogram::bucketUpperBound(31) == 31);
+    assert(LatencyHistogram::bucketOf(32) == LatencyHistogram::bucketOf(33));
+    assert(LatencyHistogram::bucketOf(1000) != LatencyHistogram::bucketOf(1100));
+    for (uint64_t v = 1; v < (uint64_t(1) << 40); v = v * 3 + 1)
+    {
+        int bucket = LatencyHistogram::bucketOf(v);
+        assert(LatencyHistogram::bucketUpperBound(bucket) >= v);
+        assert(LatencyHistogram::bucketUpperBound(bucket) <= v + v / 16);
+    }
+
+    LatencyHistogram histogram;
+    for (int i = 1; i <= 1000; ++i)
+        histogram.record(chrono::microseconds(i));
+    HistogramSnapshot snapshot = histogram.snapshot();
+    assert(snapshot.total == 1000 && snapshot.max == chrono::microseconds(1000));
+    assert(snapshot.mean() == chrono::nanoseconds(500500));
+    assert(snapshot.percentile(0.5) >= chrono::microseconds(500) && snapshot.percentile(0.5) <= chrono::microseconds(532));
+    assert(snapshot.percentile(1) == chrono::microseconds(1000));
+
+    ThreadPoolOptions options;
+    options.workStealing = true;
+    GenericThreadPool pool(2, options);
+    for (int i = 0; i < 100; ++i)
+        pool.execute([&pool]() { pool.execute([]() { this_thread::sleep_for(chrono::microseconds(10)); }); });
+    pool.wait();
+
+    ThreadPoolStats stats = pool.stats();
+#ifdef THREADPOOL_METRICS
+    assert(stats.enabled && stats.workers.size() == 2);
+    assert(stats.queueLatency.total == 200 && stats.runTime.total == 200);
+    assert(stats.workers[0].executed + stats.workers[1].executed == 200);
+    assert(stats.runTime.percentile(0.99) >= chrono::microseconds(10));
+    assert(stats.maxQueueDepth >= 1);
+#else
+    assert(!stats.enabled && stats.workers.empty() && stats.runTime.total == 0);
+#endif
+}
+
+void testProducerTokens()
+{
+    // Idle threads blocked before the first token existed still wake up for its tasks
+    GenericThreadPool pool(2);
+    this_thread::sleep_for(chrono::milliseconds(10));
+    GenericThreadPool::ProducerToken token = pool.producerToken();
+    assert(token.valid());
+    assert(pool.submitFrom(token, [](int x) { return x * 2; }, 21).get() == 42);
+
+    // Each producer's tasks run in the order it submitted them (with one thread)
+    GenericThreadPool single(1);
+    const int producers = 4, perProducer = 1000;
+    vector<vector<int>> seen(producers);
+    vector<thread> threads;
+    for (int p = 0; p < producers; ++p)
+        threads.emplace_back([&single, &seen, p]() {
+            GenericThreadPool::ProducerToken own = single.producerToken();
+            for (int i = 0; i < perProducer; ++i)
+                single.executeFrom(own, [&seen, p, i]() { seen[p].push_back(i); });
+        });
+    for (int p = 0; p < producers; ++p)
+        threads[p].join();
+    single.wait();
+    for (int p = 0; p < producers; ++p)
+    {
+        assert(seen[p].size() == perProducer);
+        for (int i = 0; i < perProducer; ++i)
+            assert(seen[p][i] == i);
+    }
+
+    // A moved-from token falls back to the shared queue
+    GenericThreadPool::ProducerToken moved(std::move(token));
+    assert(!token.valid() && moved.valid());
+    assert(pool.submitFrom(token, []() { return 1; }).get() == 1);
+
+    // Many producers at once, on a typed pool with work stealing
+    ThreadPoolOptions options;
+    options.workStealing = true;
+    ThreadPool<int(int), int> typed(3, options);
+    atomic<int> sum(0);
+    threads.clear();
+    for (int p = 0; p < 8; ++p)
+        threads.emplace_back([&typed, &sum]() {
+            ThreadPool<int(int), int>::ProducerToken own = typed.producerToken();
+            for (int i = 0; i < 500; ++i)
+                typed.executeFrom(own, [&sum](int x) { sum += x; return x; }, 1);
+            future<int> last = typed.submitFrom(own, [](int x) { return x; }, 7);
+            assert(last.get() == 7);
+        });
+    for (int p = 0; p < 8; ++p)
+        threads[p].join();
+    typed.wait();
+    assert(sum == 8 * 500);
+}
+
+void testCancellation()
+{
+    // Cancelled tasks that are still queued are skipped, breaking their promises
+    GenericThreadPool pool(1);
+    promise<void> gate;
+    shared_future<void> opened = gate.get_future().share();
+    pool.execute([opened]() { opened.wait(); });
+
+    CancellationToken token;
+    atomic<int> ran(0);
+    vector<future<int>> cancelled;
+    for (int i = 0; i < 10; ++i)
+        cancelled.push_back(pool.submitCancellable(token, [&ran]() { return ++ran; }));
+    pool.executeCancellable(token, [&ran]() { ++ran; });
+    future<int> kept = pool.submit([]() { return 3; });
+    CancellationToken copy = token;
+    copy.cancel();
+    assert(token.isCancelled());
+
+    gate.set_value();
+    pool.wait();
+    assert(ran == 0 && kept.get() == 3);
+    for (int i = 0; i < 10; ++i)
+    {
+        bool broken = false;
+        try { cancelled[i].get(); }
+        catch (const future_error& e) { broken = e.code() == future_errc::broken_promise; }
+        assert(broken);
+    }
+
+    ThreadPool<int(int), int> typed(2);
+    CancellationToken live;
+    assert(typed.submitCancellable(live, [](int x) { return x + 1; }, 1).get() == 2);
+
+    // shutdownNow() drops every queued task at once, including those in the deques
+    ThreadPoolOptions options;
+    options.workStealing = true;
+    GenericThreadPool stealing(1, options);
+    promise<void> gate2;
+    shared_future<void> opened2 = gate2.get_future().share();
+    promise<void> spawned;
+    stealing.execute([&stealing, &ran, &spawned, opened2]() {
+        for (int i = 0; i < 50; ++i)
+            stealing.execute([&ran]() { ++ran; });
+        spawned.set_value();
+        opened2.wait();
+    });
+    spawned.get_future().wait();
+    vector<future<void>> dropped;
+    for (int i = 0; i < 20; ++i)
+        dropped.push_back(stealing.submitWithPriority(Priority::Low, [&ran]() { ++ran; }));
+
+    assert(stealing.shutdownNow() == 70);
+    assert(stealing.isShutdown() && stealing.shutdownNow() == 0);
+    assert(!stealing.submit([]() {}).valid());
+    gate2.set_value();
+    stealing.wait();
+    assert(ran == 0);
+    bool broken = false;
+    try { dropped[0].get(); }
+    catch (const future_error& e) { broken = e.code() == future_errc::broken_promise; }
+    assert(broken);
+}
+
+// Only built with C++20 (make STD=c++20)
+#if __cplusplus >= 202002L && defined(__cpp_impl_coroutine)
+CoTask<int> coSquare(GenericThreadPool& pool, int x)
+{
+    co_await schedule(pool);
+    co_return x * x;
+}
+
+CoTask<int> coSumOfSquares(GenericThreadPool& pool, int n)
+{
+    int sum = 0;
+    for (int i = 1; i <= n; ++i)
+        sum += co_await coSquare(pool, i);
+    co_return sum;
+}
+
+CoTask<void> coFail(GenericThreadPool& pool)
+{
+    co_await schedule(pool);
+    throw runtime_error("failed");
+}
+
+CoTask<void> coCount(GenericThreadPool& pool, atomic<int>& count)
+{
+    co_await schedule(pool);
+    int squared = co_await coSquare(pool, 3);
+    count += squared;
+}
+
+void testCoroutines()
+{
+    GenericThreadPool pool(2);
+    assert(syncWait(coSumOfSquares(pool, 10)) == 385);
+
+    bool thrown = false;
+    try { syncWait(coFail(pool)); }
+    catch (const runtime_error&) { thrown = true; }
+    assert(thrown);
+
+    // Many coroutines in flight on two threads, none of them blocking one
+    atomic<int> count(0);
+    for (int i = 0; i < 10000; ++i)
+        spawn(pool, coCount(pool, count));
+    pool.wait();
+    assert(count == 9 * 10000);
 
     pool.shutdown();
-    assert(pool.isShutdown() && pool.isTerminated());
+    thrown = false;
+    try { syncWait(coSquare(pool, 2)); }
+    catch (const future_error&) { thrown = true; }
+    assert(thrown);
+    spawn(pool, coCount(pool, count));
+    assert(count == 9 * 10000);
+}
+#else
+void testCoroutines() {}
+#endif
 
-    // Async
-    t = clock();
-    t1 = chrono::high_resolution_clock::now();
+void testLifoSlot()
+{
+    ThreadPoolOptions options;
+    options.lifoSlot = true;
 
-    for (int i = 0; i < n; ++i)
-        fut[i] = async(launch::async, expensiveTask, i);
-    for (int i = 0; i < n; ++i)
-        fut[i].get();
+    // A chain of tasks runs back to back on one thread, but only for a few links before
+    // the task queued behind them gets its turn
+    GenericThreadPool single(1, options);
+    vector<int> order;
+    function<void(int)> link = [&](int i) {
+        order.push_back(i);
+        if (i < 10)
+            single.execute(link, i + 1);
+    };
+    promise<void> gate;
+    shared_future<void> opened = gate.get_future().share();
+    single.execute([opened]() { opened.wait(); });
+    single.execute(link, 1);
+    single.execute([&order]() { order.push_back(0); });
+    gate.set_value();
+    single.wait();
+    assert(order.size() == 11);
+    int behind = find(order.begin(), order.end(), 0) - order.begin();
+    assert(behind > 1 && behind < 10);
+    for (int i = 0, expected = 1; i < 11; ++i)
+        if (order[i] != 0)
+            assert(order[i] == expected++);
 
-    t = clock() - t;
-    t2 = chrono::high_resolution_clock::now();
-    dur = duration_cast<duration<double>>(t2 - t1);
-    printf("testExecute() with async() took %ld cycles (%f seconds)\n", t, dur.count());
+    // A task waiting for the task in its slot doesn't deadlock: another thread takes it
+    GenericThreadPool pool(2, options);
+    future<int> outer = pool.submit([&pool]() {
+        future<int> inner = pool.submit([]() { return 5; });
+        return inner.get() + 1;
+    });
+    assert(outer.get() == 6);
+
+    // Slots count as queued for shutdownNow()
+    promise<void> gate2;
+    shared_future<void> opened2 = gate2.get_future().share();
+    promise<void> spawned;
+    GenericThreadPool dropping(1, options);
+    dropping.execute([&dropping, &spawned, opened2]() {
+        dropping.execute([]() { assert(false); });
+        dropping.execute([]() { assert(false); });
+        spawned.set_value();
+        opened2.wait();
+    });
+    spawned.get_future().wait();
+    assert(dropping.shutdownNow() == 2);
+    gate2.set_value();
+}
+
+void testCacheAligned()
+{
+    // Each element starts a line of its own
+    CacheAlignedArray<int> ints(5);
+    for (size_t i = 0; i != ints.size(); ++i)
+    {
+        assert(reinterpret_cast<uintptr_t>(&ints[i]) % 64 == 0);
+        assert(ints[i] == 0);
+    }
+    assert(reinterpret_cast<char*>(&ints[1]) - reinterpret_cast<char*>(&ints[0]) == 64);
+
+    struct Wide { char bytes[100]; };
+    CacheAlignedArray<Wide> wides(3);
+    assert(reinterpret_cast<char*>(&wides[1]) - reinterpret_cast<char*>(&wides[0]) == 128);
+
+    // activeThreads() is summed from the threads' own flags
+    GenericThreadPool pool(3);
+    promise<void> gate;
+    shared_future<void> opened = gate.get_future().share();
+    atomic<int> started(0);
+    for (int i = 0; i < 2; ++i)
+        pool.execute([&started, opened]() { ++started; opened.wait(); });
+    while (started != 2)
+        this_thread::yield();
+    assert(pool.activeThreads() == 2);
+    gate.set_value();
+    pool.wait();
+    assert(pool.activeThreads() == 0);
+}
+
+void testTimers()
+{
+    // The wheel itself, advanced by hand: every entry comes out once, on its own tick,
+    // however far apart the ticks are and however far the wheel jumps
+    TimerWheel wheel;
+    vector<TimerEntry> entries(2000);
+    unsigned seed = 12345;
+    for (size_t i = 0; i != entries.size(); ++i)
+    {
+        seed = seed * 1103515245 + 12345;
+        wheel.insert(&entries[i], 1 + (seed >> 8) % (i % 2 ? 100 : 10000000));
+    }
+    wheel.remove(&entries[0]);
+    assert(wheel.size() == entries.size() - 1);
+
+    size_t expired = 0;
+    uint64_t last = 0;
+    while (!wheel.empty())
+    {
+        uint64_t next = wheel.nextExpiry();
+        assert(next != TimerWheel::NEVER && next > wheel.now());
+        wheel.advance(next + next % 3, [&](TimerEntry* entry) {
+            assert(entry->expiry >= last && entry->expiry <= wheel.now());
+            last = entry->expiry;
+            ++expired;
+        });
+    }
+    assert(expired == entries.size() - 1 && wheel.nextExpiry() == TimerWheel::NEVER);
+
+    GenericThreadPool pool(2);
+
+    // Delayed tasks run in order of their due times, no earlier
+    chrono::steady_clock::time_point start = chrono::steady_clock::now();
+    future<chrono::steady_clock::time_point> late = pool.submitAfter(chrono::milliseconds(50), []() {
+        return chrono::steady_clock::now();
+    });
+    future<int> atTime = pool.submitAt(chrono::system_clock::now() + chrono::milliseconds(20), []() { return 3; });
+    mutex orderLock;
+    vector<int> order;
+    for (int delay : { 30, 10, 20 })
+        pool.executeAfter(chrono::milliseconds(delay), [&orderLock, &order, delay]() {
+            lock_guard<mutex> lg(orderLock);
+            order.push_back(delay);
+        });
+    assert(late.get() - start >= chrono::milliseconds(50));
+    assert(atTime.get() == 3);
+    assert(order.size() == 3 && order[0] == 10 && order[1] == 20 && order[2] == 30);
+
+    // Cancelling, once only. (A fired timer is counted until the thread that fired it has
+    // enqueued its task, which may already have run.)
+    while (pool.timerCount() != 0)
+        this_thread::yield();
+    TimerHandle never = pool.executeAfter(chrono::hours(1), []() { assert(false); });
+    assert(never.valid() && pool.timerCount() == 1);
+    assert(pool.cancelTimer(never));
+    assert(!pool.cancelTimer(never) && !pool.cancelTimer(TimerHandle()));
+    assert(pool.timerCount() == 0);
+
+    // Periodic tasks run until cancelled
+    atomic<int> ticks(0);
+    TimerHandle periodic = pool.scheduleEvery(chrono::milliseconds(2), [&ticks]() { ++ticks; });
+    while (ticks < 5)
+        this_thread::sleep_for(chrono::milliseconds(1));
+    assert(pool.cancelTimer(periodic));
+    pool.wait();
+    int stopped = ticks;
+    this_thread::sleep_for(chrono::milliseconds(20));
+    assert(ticks == stopped);
+
+    // Many timers cost no more than their slots; they all fire, even while the threads
+    // are busy (a busy thread fires them between tasks)
+    atomic<int> fired(0);
+    for (int i = 0; i < 10000; ++i)
+        pool.executeAfter(chrono::milliseconds(i % 40), [&fired]() { ++fired; });
+    pool.execute([]() { this_thread::sleep_for(chrono::milliseconds(30)); });
+    pool.execute([]() { this_thread::sleep_for(chrono::milliseconds(30)); });
+    while (pool.timerCount() != 0)
+        this_thread::sleep_for(chrono::milliseconds(1));
+    pool.wait();
+    assert(fired == 10000);
+
+    // On a ThreadPool, and arguments
+    ThreadPool<int(int), int> typed(1);
+    future<int> doubled = typed.submitAfter(chrono::milliseconds(5), [](int x) { return 2 * x; }, 21);
+    atomic<int> sum(0);
+    TimerHandle adding = typed.scheduleEvery(chrono::milliseconds(1), [&sum](int x) { sum += x; return 0; }, 2);
+    assert(doubled.get() == 42);
+    while (sum < 6)
+        this_thread::sleep_for(chrono::milliseconds(1));
+    assert(typed.cancelTimer(adding));
+
+    // Timers pending when the pool goes away break their promises, and a pool that's
+    // been shut down takes no more
+    future<int> dropped;
+    {
+        GenericThreadPool shortLived(1);
+        for (int i = 0; i < 1000; ++i)
+            shortLived.executeAfter(chrono::hours(1 + i), []() { assert(false); });
+        dropped = shortLived.submitAfter(chrono::hours(1), []() { return 1; });
+        shortLived.scheduleEvery(chrono::hours(1), []() { assert(false); });
+        assert(shortLived.timerCount() == 1002);
+        shortLived.shutdown();
+        assert(!shortLived.submitAfter(chrono::milliseconds(1), []() { return 1; }).valid());
+        assert(!shortLived.executeAfter(chrono::milliseconds(1), []() {}).valid());
+    }
+    bool broken = false;
+    try
+    {
+        dropped.get();
+    }
+    catch (const future_error&)
+    {
+        broken = true;
+    }
+    assert(broken);
 }
 
 void thisDoesntCompileOnWindows()
@@ -170,12 +1271,537 @@ void thisDoesntCompileOnWindows()
 #endif
 }
 
+void testTaskGroup()
+{
+    // No promise for a discarded result: a Task without one allocates nothing
+    size_t before = heapAllocs;
+    {
+        Task<int(int), int> task(DiscardResult(), [](int x) { return x; }, 1);
+        task.execute();
+    }
+    assert(heapAllocs == before);
+
+    // Exceptions thrown by executed tasks go to the pool
+    ThreadPool<int(int), int> typed(2);
+    typed.execute([](int x) -> int { throw x; }, 1);
+    vector<int> ones(10, 1);
+    typed.executeBatch(ones.begin(), ones.end(), [](int x) -> int { throw x; });
+    typed.wait();
+    assert(typed.taskErrors() == 11);
+
+    GenericThreadPool pool(4);
+    atomic<long> sum(0);
+    TaskGroup group;
+    for (int i = 0; i < 100000; ++i)
+        group.run(pool, [&sum, i]() { sum += i; });
+    group.wait();
+    assert(sum == 100000L * 99999 / 2);
+
+    // The first exception is rethrown, and the group can be reused
+    for (int i = 0; i < 1000; ++i)
+        group.run(pool, [i]() { if (i == 10) throw runtime_error("group"); });
+    try
+    {
+        group.wait();
+        assert(false);
+    }
+    catch (const runtime_error& e)
+    {
+        assert(string(e.what()) == "group");
+    }
+    assert(!group.hasFailed());
+
+    // Tasks can add tasks to their own group
+    atomic<int> counter(0);
+    for (int i = 0; i < 10; ++i)
+        group.run(pool, [&group, &pool, &counter]() {
+            for (int j = 0; j < 10; ++j)
+                group.run(pool, [&counter]() { ++counter; });
+        });
+    group.wait();
+    assert(counter == 100);
+
+    // On a ThreadPool<void()>
+    ThreadPool<void()> voidPool(2);
+    for (int i = 0; i < 1000; ++i)
+        group.run(voidPool, [&counter]() { ++counter; });
+    group.wait();
+    assert(counter == 1100);
+
+    // Tasks dropped by a pool that's been shut down break their promise
+    voidPool.shutdown();
+    group.run(voidPool, [&counter]() { ++counter; });
+    bool broken = false;
+    try
+    {
+        group.wait();
+    }
+    catch (const future_error&)
+    {
+        broken = true;
+    }
+    assert(broken && counter == 1100);
+}
+
+void testErrorHandler()
+{
+    mutex errorsLock;
+    vector<string> errors;
+    ThreadPoolOptions options;
+    options.errorHandler = [&errorsLock, &errors](exception_ptr exception) {
+        try
+        {
+            rethrow_exception(exception);
+        }
+        catch (const runtime_error& e)
+        {
+            lock_guard<mutex> lg(errorsLock);
+            errors.push_back(e.what());
+        }
+    };
+
+    // Throwing tasks don't take their threads down, and wait() still returns
+    for (int mode = 0; mode < 2; ++mode)
+    {
+        options.workStealing = mode == 1;
+        GenericThreadPool pool(2, options);
+        atomic<int> counter(0);
+        for (int i = 0; i < 100; ++i)
+            pool.execute([&counter, i]() {
+                ++counter;
+                if (i % 2)
+                    throw runtime_error("task");
+            });
+        pool.wait();
+        assert(counter == 100 && pool.taskErrors() == 50);
+        assert(pool.activeThreads() == 0);
+
+        // Exceptions with a future to go to don't count
+        future<int> thrown = pool.submit([]() -> int { throw runtime_error("future"); });
+        assert(pool.submit([]() { return 1; }).get() == 1);
+        try
+        {
+            thrown.get();
+            assert(false);
+        }
+        catch (const runtime_error&)
+        {
+        }
+        pool.executeAfter(chrono::milliseconds(1), []() { throw runtime_error("timer"); });
+        while (pool.taskErrors() != 51)
+            this_thread::sleep_for(chrono::milliseconds(1));
+        pool.wait();
+    }
+    assert(errors.size() == 102);
+    assert(count(errors.begin(), errors.end(), string("task")) == 100);
+    assert(count(errors.begin(), errors.end(), string("timer")) == 2);
+
+    // Without a handler, they're only counted
+    ThreadPool<void()> counted(1);
+    for (int i = 0; i < 10; ++i)
+        counted.execute([]() { throw 1; });
+    counted.wait();
+    assert(counted.taskErrors() == 10);
+}
+
+void testExecutorGroup()
+{
+    // Balanced by hand, and idle classes lend their threads right away
+    ExecutorGroupOptions options;
+    options.interval = chrono::milliseconds(0);
+    options.lendAfter = chrono::milliseconds(0);
+    ExecutorGroup group(4, options);
+    GenericThreadPool& cpu = group.addClass("cpu", 2, 4);
+    GenericThreadPool& io = group.addClass("io", 1, 4);
+    GenericThreadPool& latency = group.addClass("latency", 1, 1, false);
+    assert(&group.pool("io") == &io);
+    assert(cpu.threadCount() == 0 && io.threadCount() == 0 && latency.threadCount() == 1);
+
+    bool thrown = false;
+    try
+    {
+        group.addClass("more", 3, 4);
+    }
+    catch (const invalid_argument&)
+    {
+        thrown = true;
+    }
+    assert(thrown);
+
+    promise<void> gate;
+    shared_future<void> opened = gate.get_future().share();
+    auto blocked = [opened]() { opened.wait(); };
+
+    // A busy class borrows the idle ones' threads...
+    for (int i = 0; i < 10; ++i)
+        cpu.execute(blocked);
+    group.rebalance();
+    assert(cpu.threadCount() == 3 && latency.threadCount() == 1);
+
+    // ...until they need them back
+    for (int i = 0; i < 5; ++i)
+        io.execute(blocked);
+    group.rebalance();
+    assert(cpu.threadCount() == 2 && io.threadCount() == 1 && latency.threadCount() == 1);
+
+    vector<ExecutorClassStats> stats = group.stats();
+    assert(stats.size() == 3 && stats[0].name == "cpu" && stats[0].pendingTasks == 10);
+    assert(stats[1].threads == 1 && stats[1].reservedThreads == 1 && stats[2].maxThreads == 1);
+
+    gate.set_value();
+    cpu.wait();
+    io.wait();
+    group.rebalance();
+    assert(cpu.threadCount() == 0 && io.threadCount() == 0 && latency.threadCount() == 1);
+
+    // Borrowers that won't give threads back until their work runs out
+    options.reclaim = ReclaimPolicy::Wait;
+    ExecutorGroup waiting(2, options);
+    GenericThreadPool& batch = waiting.addClass("batch", 1, 2);
+    GenericThreadPool& interactive = waiting.addClass("interactive", 1, 2);
+    promise<void> batchGate;
+    shared_future<void> batchOpened = batchGate.get_future().share();
+    for (int i = 0; i < 4; ++i)
+        batch.execute([batchOpened]() { batchOpened.wait(); });
+    waiting.rebalance();
+    assert(batch.threadCount() == 2);
+    atomic<bool> ran(false);
+    interactive.execute([&ran]() { ran = true; });
+    waiting.rebalance();
+    assert(batch.threadCount() == 2 && interactive.threadCount() == 0);
+    batchGate.set_value();
+    batch.wait();
+    waiting.rebalance();
+    assert(interactive.threadCount() >= 1);
+    interactive.wait();
+    assert(ran);
+
+    // Balanced by the group's own thread
+    ExecutorGroup automatic(2);
+    GenericThreadPool& work = automatic.addClass("work", 1, 2);
+    atomic<int> counter(0);
+    for (int i = 0; i < 100; ++i)
+        work.execute([&counter]() { ++counter; });
+    work.wait();
+    assert(counter == 100);
+}
+
+void testBlockingSection()
+{
+    // A task waiting in a section for a task submitted after it: the pool's only thread
+    // blocks, so a compensating thread runs the other task
+    for (int mode = 0; mode < 2; ++mode)
+    {
+        ThreadPoolOptions options;
+        options.workStealing = mode == 1;
+        options.blockingThreads = 1;
+        GenericThreadPool pool(1, options);
+        assert(pool.maxThreads() == 1 && pool.threadCount() == 1);
+
+        for (int round = 0; round < 20; ++round)
+        {
+            promise<int> answer;
+            future<int> blocked = pool.submit([&answer]() {
+                BlockingSection blocking;
+                BlockingSection nested;     // Doesn't ask for a second thread
+                return answer.get_future().get();
+            });
+            pool.execute([&answer]() { answer.set_value(42); });
+            assert(blocked.get() == 42);
+        }
+        pool.wait();
+        assert(pool.threadCount() == 1 && pool.activeThreads() == 0);
+    }
+
+    // Any pool's tasks can use one, whatever its type
+    ThreadPoolOptions options;
+    options.blockingThreads = 2;
+    ThreadPool<int()> typed(1, options);
+    promise<void> go;
+    shared_future<void> ready = go.get_future().share();
+    future<int> first = typed.submit([ready]() { BlockingSection b; ready.wait(); return 1; });
+    future<int> second = typed.submit([ready]() { BlockingSection b; ready.wait(); return 2; });
+    future<int> third = typed.submit([]() { return 3; });
+    assert(third.get() == 3);
+    go.set_value();
+    assert(first.get() + second.get() == 3);
+
+    // Without blockingThreads (or outside a pool), a section does nothing
+    GenericThreadPool plain(1);
+    promise<void> never;
+    future<void> waited = never.get_future();
+    future<bool> timedOut = plain.submit([&waited]() {
+        BlockingSection blocking;
+        return waited.wait_for(chrono::milliseconds(20)) == future_status::timeout;
+    });
+    assert(timedOut.get());
+    BlockingSection outside;
+}
+
+// Each task submits ten more, from inside the pool
+template <class Pool>
+void runNestedTasks(Pool& pool)
+{
+    atomic<int> counter(0);
+    for (int i = 0; i < 10; ++i)
+        pool.execute([&pool, &counter]() {
+            ++counter;
+            for (int j = 0; j < 10; ++j)
+                pool.execute([&counter]() { ++counter; });
+        });
+    pool.wait();
+    assert(counter == 110);
+    pool.submit([&counter]() { ++counter; }).get();
+    assert(counter == 111);
+}
+
+void testPolicies()
+{
+    // A fixed queue policy overrides the options
+    ThreadPoolOptions options;
+    options.workStealing = true;
+    options.queueCapacity = 16;
+    PolicyGenericThreadPool<PoolPolicy<SharedQueue>> shared(2, options);
+    assert(shared.queueCapacity() == 0);
+    runNestedTasks(shared);
+
+    PolicyGenericThreadPool<PoolPolicy<BoundedQueue>> bounded(2);
+    assert(bounded.queueCapacity() == BoundedQueue::DEFAULT_CAPACITY);
+    runNestedTasks(bounded);
+
+    options.lifoSlot = true;
+    PolicyGenericThreadPool<PoolPolicy<StealingQueue>> stealing(2, options);
+    assert(stealing.queueCapacity() == 0);
+    runNestedTasks(stealing);
+
+    PolicyThreadPool<PoolPolicy<StealingQueue>, void()> typed(2);
+    runNestedTasks(typed);
+    PolicyThreadPool<PoolPolicy<BoundedQueue>, int(unsigned), unsigned> computations(2);
+    assert(computations.submit(expensiveComputation, 10u).get() == expensiveComputation(10));
+
+    // Metrics can be recorded by one pool only, whatever THREADPOOL_METRICS says
+    PolicyGenericThreadPool<PoolPolicy<AnyQueue, RecordingMetrics>> recorded(2);
+    PolicyGenericThreadPool<PoolPolicy<AnyQueue, NoMetrics>> unrecorded(2);
+    for (int i = 0; i < 100; ++i)
+    {
+        recorded.execute([]() {});
+        unrecorded.execute([]() {});
+    }
+    recorded.wait();
+    unrecorded.wait();
+
+    ThreadPoolStats stats = recorded.stats();
+    assert(stats.enabled && stats.workers.size() == 2);
+    assert(stats.workers[0].executed + stats.workers[1].executed == 100);
+    assert(!unrecorded.stats().enabled);
+}
+
+// How many times pattern appears in text
+size_t countOf(const string& text, const string& pattern)
+{
+    size_t count = 0;
+    for (size_t at = text.find(pattern); at != string::npos; at = text.find(pattern, at + 1))
+        ++count;
+    return count;
+}
+
+void testTracing()
+{
+    ThreadPoolOptions options;
+    options.workStealing = true;
+    PolicyGenericThreadPool<PoolPolicy<AnyQueue, PoolMetrics, RingTracer>> traced(2, options);
+    runNestedTasks(traced);             // Not traced yet
+    traced.startTracing();
+    runNestedTasks(traced);
+    traced.stopTracing();
+    traced.execute([]() {});            // Not traced anymore
+    traced.wait();
+
+    ostringstream out;
+    traced.writeTrace(out);
+    string trace = out.str();
+    assert(trace.find("{\"traceEvents\": [") == 0);
+    assert(countOf(trace, "\"name\": \"thread_name\"") == 3);
+    assert(countOf(trace, "\"name\": \"task\", \"ph\": \"B\"") == 111);
+    assert(countOf(trace, "\"name\": \"enqueue\"") == 111);
+    assert(countOf(trace, "\"ph\": \"f\"") == 111);
+    assert(countOf(trace, "\"args\": {\"task\": 111}") == 2);
+    // (Threads still parked when tracing stopped don't end their slice)
+    assert(countOf(trace, "\"ph\": \"E\"") >= 111);
+    assert(countOf(trace, "\"ph\": \"E\"") <= countOf(trace, "\"ph\": \"B\""));
+
+    // A small ring keeps the latest events only, and never ends a slice it didn't begin
+    PolicyGenericThreadPool<PoolPolicy<AnyQueue, PoolMetrics, RingTracer>> small(2, options);
+    small.startTracing(4);
+    runNestedTasks(small);
+    small.stopTracing();
+    out.str("");
+    small.writeTrace(out);
+    trace = out.str();
+    assert(countOf(trace, "\"name\": \"task\", \"ph\": \"B\"") < 111);
+    assert(countOf(trace, "\"ph\": \"E\"") <= countOf(trace, "\"ph\": \"B\""));
+
+    PolicyGenericThreadPool<PoolPolicy<AnyQueue, PoolMetrics, NoTracer>> untraced(2);
+    untraced.startTracing();
+    runNestedTasks(untraced);
+    untraced.stopTracing();
+    out.str("");
+    untraced.writeTrace(out);
+    assert(out.str() == "{\"traceEvents\": []}\n");
+}
+
+void testAlgorithms()
+{
+    GenericThreadPool pool(4);
+    mt19937 random(42);
+
+    // Many runs (merged over several rounds), a few, and too few to split
+    for (int n : { 300000, 20000, 1000, 1, 0 })
+    {
+        vector<int> v(n);
+        for (int& x : v)
+            x = random() % 1000;
+        vector<int> expected = v;
+        sort(expected.begin(), expected.end());
+        parallelSort(pool, v.begin(), v.end());
+        assert(v == expected);
+    }
+
+    // Elements that are really moved, by a comparison of their own
+    vector<string> words(100000);
+    for (string& w : words)
+        w = to_string(random() % 100000);
+    vector<string> expectedWords = words;
+    sort(expectedWords.begin(), expectedWords.end(), greater<string>());
+    parallelSort(pool, words.begin(), words.end(), greater<string>());
+    assert(words == expectedWords);
+
+    vector<long long> numbers(100003);
+    iota(numbers.begin(), numbers.end(), -50000);
+    vector<long long> squares(numbers.size());
+    assert(parallelTransform(pool, numbers.begin(), numbers.end(), squares.begin(),
+                             [](long long x) { return x * x; }) == squares.end());
+    for (size_t i = 0; i < numbers.size(); ++i)
+        assert(squares[i] == numbers[i] * numbers[i]);
+
+    vector<long long> sums(numbers.size()), expectedSums(numbers.size());
+    partial_sum(numbers.begin(), numbers.end(), expectedSums.begin());
+    assert(parallelInclusiveScan(pool, numbers.begin(), numbers.end(), sums.begin()) == sums.end());
+    assert(sums == expectedSums);
+    parallelInclusiveScan(pool, squares.begin(), squares.end(), squares.begin(),
+                          [](long long x, long long y) { return max(x, y); });
+    assert(squares[100000] == 50000LL * 50000 && squares.back() == 50002LL * 50002);
+    assert(parallelInclusiveScan(pool, sums.begin(), sums.begin(), sums.begin()) == sums.begin());
+
+    // The first match is found, and the blocks past it are skipped
+    vector<int> haystack(4000000, 0);
+    haystack[1000] = haystack[3000000] = 1;
+    atomic<int> calls(0);
+    vector<int>::iterator match = parallelFindIf(pool, haystack.begin(), haystack.end(), [&calls](int x) {
+        ++calls;
+        return x == 1;
+    });
+    assert(match == haystack.begin() + 1000);
+    assert(calls < 2000000);
+    haystack[1000] = haystack[3000000] = 0;
+    assert(parallelFindIf(pool, haystack.begin(), haystack.end(), [](int x) { return x == 1; }) == haystack.end());
+
+    try
+    {
+        parallelFindIf(pool, haystack.begin(), haystack.end(), [](int) -> bool { throw runtime_error("find"); });
+        assert(false);
+    }
+    catch (const runtime_error& e)
+    {
+        assert(string(e.what()) == "find");
+    }
+
+    // From inside a task, with no thread free to help
+    ThreadPool<void()> single(1);
+    vector<int> inner(50000);
+    for (int& x : inner)
+        x = random();
+    single.submit([&single, &inner]() { parallelSort(single, inner.begin(), inner.end()); }).get();
+    assert(is_sorted(inner.begin(), inner.end()));
+}
+
+// Producers submitting and monitors polling while the pool shuts down (run it under
+// ThreadSanitizer with make tsan)
+void testConcurrentShutdown()
+{
+    for (int round = 0; round < 20; ++round)
+    {
+        ThreadPoolOptions options;
+        options.workStealing = round % 2 == 1;
+        GenericThreadPool pool(2, options);
+        atomic<bool> stop(false);
+        atomic<int> ran(0);
+
+        vector<thread> threads;
+        for (int i = 0; i < 2; ++i)
+            threads.emplace_back([&pool, &stop, &ran]() {
+                while (!stop)
+                    pool.execute([&ran]() { ++ran; });
+            });
+        threads.emplace_back([&pool, &stop]() {
+            bool shutdown = false;
+            while (!stop)
+            {
+                assert(pool.activeThreads() <= 2 && pool.pendingTasks() >= 0);
+                if (pool.isTerminated())
+                    assert(pool.isShutdown());
+                bool now = pool.isShutdown();
+                assert(now || !shutdown);       // Once shut down, always shut down
+                shutdown = now;
+            }
+        });
+
+        while (ran < 100)
+            this_thread::yield();
+        pool.shutdown();
+        assert(pool.isShutdown());
+        assert(!pool.submit([]() { return 0; }).valid());
+        for (int i = 0; i < 1000 && !pool.isTerminated(); ++i)
+            this_thread::sleep_for(chrono::milliseconds(1));
+        assert(pool.isTerminated() && pool.activeThreads() == 0);
+        stop = true;
+        for (thread& t : threads)
+            t.join();
+    }
+}
+
 int main()
 {
     // testWorkerPull();
-    testPerformance(100);
-    // testPerformance(500);
     testExecute(100);
+    testWorkStealing();
+    testWaitFor();
+    testGenericPool();
+    testAllocationFree();
+    testBoundedQueue();
+    testBatch();
+    testParallelFor();
+    testPoolFuture();
+    testTaskGraph();
+    testPriority();
+    testNumaNodes();
+    testIdlePolicy();
+    testResize();
+    testMetrics();
+    testProducerTokens();
+    testCancellation();
+    testCoroutines();
+    testLifoSlot();
+    testCacheAligned();
+    testTimers();
+    testTaskGroup();
+    testErrorHandler();
+    testExecutorGroup();
+    testBlockingSection();
+    testPolicies();
+    testTracing();
+    testAlgorithms();
+    testConcurrentShutdown();
     thisDoesntCompileOnWindows();
 
     cout << "----- All tests finished" << endl;